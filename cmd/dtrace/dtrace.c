@@ -168,7 +168,8 @@ usage(FILE *fp)
 	    "\t-s  enable or list probes according to the specified D script\n"
 	    "\t-S  print D compiler intermediate code\n"
 	    "\t-U  undefine symbol when invoking preprocessor\n"
-	    "\t-v  set verbose mode (report stability attributes, arguments)\n"
+	    "\t-v  set verbose mode (report stability attributes, arguments,\n"
+	    "\t    dynamic variable use, sampled and rate-limited firings)\n"
 	    "\t-V  report DTrace API version\n"
 	    "\t-w  permit destructive actions\n"
 	    "\t-x  enable or modify compiler and tracing options\n"
@@ -1976,6 +1977,21 @@ main(int argc, char *argv[])
 			dfatal("failed to print aggregations");
 	}
 
+#if defined(linux)
+	/*
+	 * In verbose mode, report on the dynamic variable space as a guide to
+	 * sizing dynvarsize.  The per-enabling report shows firings passed
+	 * over by sample() and ratelimit() and, with "-x overhead", what each
+	 * enabled probe cost.
+	 */
+	if (g_verbose)
+		(void) dtrace_dynstat_print(g_dtp, stderr);
+
+	if (g_verbose || (dtrace_getopt(g_dtp, "overhead", &opt) == 0 &&
+	    opt != DTRACEOPT_UNSET))
+		(void) dtrace_ecbstat_print(g_dtp, stderr);
+#endif
+
 	dtrace_close(g_dtp);
 	return (g_status);
 }
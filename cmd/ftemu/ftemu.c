@@ -0,0 +1,674 @@
+/**********************************************************************/
+/*   ftemu  -  offline  check  of  the  pid provider's instruction  */
+/*   emulation (driver/fasttrap_emu.c).				      */
+/*   								      */
+/*   For  each  function  in  libc and ld.so (or the shared objects  */
+/*   named  on  the  command line), we walk the instructions with the  */
+/*   driver's  disassembler  (dis_tables.c),  and  classify each one  */
+/*   the  way  fasttrap_tracepoint_init()  would:  already emulated  */
+/*   (branches,  ret,  nop,  push  %rbp),  emulated by fasttrap_emu.c,  */
+/*   or left to be single stepped in the scratch page.		      */
+/*   								      */
+/*   Every  site  fasttrap_emu.c  claims  is then run both ways: we  */
+/*   single  step the real instruction, in place, in a ptrace()d child  */
+/*   with  random  register  contents,  and  compare  the  registers,  */
+/*   flags  and  pushed  value  with  what dtrace_emu_exec() makes of  */
+/*   the same starting state.					      */
+/*   								      */
+/*   Usage: ftemu [-c] [-v] [-n trials] [-s seed] [file.so ...]	      */
+/*   								      */
+/*   Exits non-zero if any emulated instruction disagrees with the  */
+/*   CPU.							      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <elf.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+
+#include "fasttrap_emu.h"
+
+# define	DATAMODEL_LP64	2
+
+int dtrace_instr_size_isa(unsigned char *instr, int model, int *rmindex);
+
+/**********************************************************************/
+/*   Site classes.						      */
+/**********************************************************************/
+# define	C_BRANCH	0	/* Emulated by fasttrap_isa.c. */
+# define	C_EMU		1	/* Emulated by fasttrap_emu.c. */
+# define	C_STEP		2	/* Single stepped. */
+# define	C_NOPROBE	3	/* int3/int - refused. */
+
+typedef struct counts {
+	unsigned long	c_class[4];
+	unsigned long	c_op[DTRACE_EMU_NOPS];
+} counts_t;
+
+# define	FL_ARITH	0x8d5
+# define	FL_TF		0x100
+
+static int	cflag;
+static int	vflag;
+static int	trials = 1;
+static pid_t	child;
+static struct user_regs_struct base_regs;
+static unsigned long	n_verified;
+static unsigned long	n_bad;
+
+/**********************************************************************/
+/*   Objects we are going to look at.				      */
+/**********************************************************************/
+typedef struct obj {
+	char		o_path[PATH_MAX];
+	uintptr_t	o_base;
+	const ElfW(Phdr) *o_phdr;
+	int		o_phnum;
+} obj_t;
+static obj_t	*objs;
+static int	nobjs;
+static char	**want;
+static int	nwant;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ftemu [-c] [-v] [-n trials] [-s seed] [file.so ...]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -c        Count only - dont verify against the CPU.\n");
+	fprintf(stderr, "  -v        Print every emulated site.\n");
+	fprintf(stderr, "  -n trials Random register sets per site (default 1).\n");
+	fprintf(stderr, "  -s seed   Random seed (default 1).\n");
+	exit(1);
+}
+
+static uint64_t
+rnd64(void)
+{
+	return ((uint64_t) random() << 62) ^ ((uint64_t) random() << 31) ^
+		(uint64_t) random();
+}
+
+/**********************************************************************/
+/*   Mirror  of  the  opcode  switch  in fasttrap_tracepoint_init().  */
+/*   Keep the two in step.					      */
+/**********************************************************************/
+static int
+classify(uint8_t *instr, int len, dtrace_emu_t *em)
+{	int	start = 0;
+	uint8_t	rex = 0;
+	uint8_t	op;
+
+	for (;;) {
+		switch (instr[start]) {
+		  case 0x26: case 0x2e: case 0x36: case 0x3e:
+		  case 0x64: case 0x65: case 0x66: case 0x67:
+		  case 0xf0: case 0xf2: case 0xf3:
+		  	start++;
+			continue;
+		  }
+		break;
+	}
+	if ((instr[start] & 0xf0) == 0x40)
+		rex = instr[start++];
+
+	op = instr[start];
+	if (op == 0x0f) {
+		if (instr[start + 1] >= 0x80 && instr[start + 1] <= 0x8f)
+			return C_BRANCH;
+	} else if (op == 0xff) {
+		int reg = (instr[start + 1] >> 3) & 7;
+		if (reg == 2 || reg == 4)
+			return C_BRANCH;
+	} else if (op >= 0x70 && op <= 0x7f) {
+		return C_BRANCH;
+	} else {
+		switch (op) {
+		  case 0xc2: case 0xc3:
+		  case 0xe0: case 0xe1: case 0xe2: case 0xe3:
+		  case 0xe8: case 0xe9: case 0xeb:
+		  	return C_BRANCH;
+		  case 0x55:
+		  	if (start == 0)
+				return C_BRANCH;
+			break;
+		  case 0x90:
+		  	if ((rex & 1) == 0)
+				return C_BRANCH;
+			break;
+		  case 0xcc:
+		  case 0xcd:
+		  	return C_NOPROBE;
+		  }
+	}
+
+	if (dtrace_emu_decode(instr, len, em) == 0)
+		return C_EMU;
+	return C_STEP;
+}
+
+/**********************************************************************/
+/*   The child just sits there, stopped, while we step it around our  */
+/*   (shared) text.						      */
+/**********************************************************************/
+static void
+child_start(void)
+{	int	status;
+
+	if ((child = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (child == 0) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		for (;;)
+			pause();
+	}
+	if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+		fprintf(stderr, "ftemu: child did not stop\n");
+		exit(1);
+	}
+	if (ptrace(PTRACE_GETREGS, child, NULL, &base_regs) < 0) {
+		perror("PTRACE_GETREGS");
+		exit(1);
+	}
+}
+
+static void
+child_stop(void)
+{
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+	}
+}
+
+/**********************************************************************/
+/*   user_regs_struct <-> instruction encoding order.		      */
+/**********************************************************************/
+static void
+regs_get(const struct user_regs_struct *r, dtrace_emu_regs_t *er)
+{
+	er->er_gpr[0] = r->rax;
+	er->er_gpr[1] = r->rcx;
+	er->er_gpr[2] = r->rdx;
+	er->er_gpr[3] = r->rbx;
+	er->er_gpr[4] = r->rsp;
+	er->er_gpr[5] = r->rbp;
+	er->er_gpr[6] = r->rsi;
+	er->er_gpr[7] = r->rdi;
+	er->er_gpr[8] = r->r8;
+	er->er_gpr[9] = r->r9;
+	er->er_gpr[10] = r->r10;
+	er->er_gpr[11] = r->r11;
+	er->er_gpr[12] = r->r12;
+	er->er_gpr[13] = r->r13;
+	er->er_gpr[14] = r->r14;
+	er->er_gpr[15] = r->r15;
+	er->er_rip = r->rip;
+	er->er_rflags = r->eflags;
+}
+static void
+regs_put(const dtrace_emu_regs_t *er, struct user_regs_struct *r)
+{
+	r->rax = er->er_gpr[0];
+	r->rcx = er->er_gpr[1];
+	r->rdx = er->er_gpr[2];
+	r->rbx = er->er_gpr[3];
+	r->rsp = er->er_gpr[4];
+	r->rbp = er->er_gpr[5];
+	r->rsi = er->er_gpr[6];
+	r->rdi = er->er_gpr[7];
+	r->r8 = er->er_gpr[8];
+	r->r9 = er->er_gpr[9];
+	r->r10 = er->er_gpr[10];
+	r->r11 = er->er_gpr[11];
+	r->r12 = er->er_gpr[12];
+	r->r13 = er->er_gpr[13];
+	r->r14 = er->er_gpr[14];
+	r->r15 = er->er_gpr[15];
+	r->rip = er->er_rip;
+	r->eflags = er->er_rflags;
+}
+
+/**********************************************************************/
+/*   Memory  callbacks for dtrace_emu_exec(): loads come from the  */
+/*   child; stores are only recorded, since the CPU has already done  */
+/*   the real one and we want to compare against it.		      */
+/**********************************************************************/
+typedef struct store {
+	int		s_done;
+	uint64_t	s_addr;
+	uint64_t	s_val;
+} store_t;
+
+static int
+child_read(uint64_t addr, void *buf, int size)
+{	struct iovec local, remote;
+
+	local.iov_base = buf;
+	local.iov_len = size;
+	remote.iov_base = (void *) (uintptr_t) addr;
+	remote.iov_len = size;
+	return process_vm_readv(child, &local, 1, &remote, 1, 0) == size ? 0 : -1;
+}
+static int
+emu_load(void *arg, uint64_t addr, uint64_t *val, int size)
+{
+	(void) arg;
+	*val = 0;
+	return child_read(addr, val, size);
+}
+static int
+emu_store(void *arg, uint64_t addr, uint64_t val, int size)
+{	store_t	*sp = arg;
+
+	(void) size;
+	sp->s_done = 1;
+	sp->s_addr = addr;
+	sp->s_val = val;
+	return 0;
+}
+
+static const char *gpr_names[16] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+	};
+
+static void
+print_site(const char *how, const char *sym, uintptr_t off, uint8_t *instr,
+	int len, const dtrace_emu_t *em)
+{	int	i;
+
+	printf("%s %s+0x%lx:", how, sym, (unsigned long) off);
+	for (i = 0; i < len; i++)
+		printf(" %02x", instr[i]);
+	printf("  %s\n", dtrace_emu_names[em->em_op]);
+}
+
+/**********************************************************************/
+/*   Run one site once on the CPU and once in the emulator.	      */
+/**********************************************************************/
+static int
+verify(uintptr_t addr, const dtrace_emu_t *em, char *why, int whylen)
+{	struct user_regs_struct in, out;
+	dtrace_emu_regs_t er, hw;
+	dtrace_emu_mem_t mem;
+	store_t	st;
+	siginfo_t si;
+	uint64_t v;
+	int	status, hw_fault, rc, i;
+
+	in = base_regs;
+	regs_get(&in, &er);
+	for (i = 0; i < 16; i++)
+		er.er_gpr[i] = rnd64();
+	er.er_gpr[DTRACE_EMU_RSP] = (base_regs.rsp - 4096) & ~15UL;
+	er.er_rflags = (base_regs.eflags & ~(uint64_t) (FL_ARITH | FL_TF)) |
+		(rnd64() & FL_ARITH);
+	er.er_rip = addr;
+	regs_put(&er, &in);
+	in.orig_rax = -1;
+
+	if (ptrace(PTRACE_SETREGS, child, NULL, &in) < 0 ||
+	    ptrace(PTRACE_SINGLESTEP, child, NULL, NULL) < 0 ||
+	    waitpid(child, &status, 0) < 0) {
+		perror("ptrace");
+		exit(1);
+	}
+	if (!WIFSTOPPED(status)) {
+		fprintf(stderr, "ftemu: child died stepping %p\n", (void *) addr);
+		exit(1);
+	}
+	hw_fault = WSTOPSIG(status) != SIGTRAP;
+	if (hw_fault) {
+		memset(&si, 0, sizeof si);
+		ptrace(PTRACE_GETSIGINFO, child, NULL, &si);
+	}
+	if (ptrace(PTRACE_GETREGS, child, NULL, &out) < 0) {
+		perror("PTRACE_GETREGS");
+		exit(1);
+	}
+	regs_get(&out, &hw);
+
+	memset(&st, 0, sizeof st);
+	mem.em_load = emu_load;
+	mem.em_store = emu_store;
+	mem.em_arg = &st;
+	rc = dtrace_emu_exec(em, &er, &mem);
+
+	n_verified++;
+	if (hw_fault || rc != 0) {
+		if (hw_fault && rc != 0)
+			return 0;
+		snprintf(why, whylen, "cpu %s (sig %d, addr %p), emulation %s",
+			hw_fault ? "faulted" : "did not fault",
+			hw_fault ? WSTOPSIG(status) : 0,
+			hw_fault ? si.si_addr : NULL,
+			rc ? "faulted" : "did not fault");
+		return -1;
+	}
+
+	for (i = 0; i < 16; i++) {
+		if (er.er_gpr[i] != hw.er_gpr[i]) {
+			snprintf(why, whylen, "%%%s: cpu %016llx emu %016llx",
+				gpr_names[i],
+				(unsigned long long) hw.er_gpr[i],
+				(unsigned long long) er.er_gpr[i]);
+			return -1;
+		}
+	}
+	if (er.er_rip != hw.er_rip) {
+		snprintf(why, whylen, "%%rip: cpu %llx emu %llx",
+			(unsigned long long) hw.er_rip,
+			(unsigned long long) er.er_rip);
+		return -1;
+	}
+	if ((er.er_rflags & FL_ARITH) != (hw.er_rflags & FL_ARITH)) {
+		snprintf(why, whylen, "flags: cpu %03llx emu %03llx",
+			(unsigned long long) (hw.er_rflags & FL_ARITH),
+			(unsigned long long) (er.er_rflags & FL_ARITH));
+		return -1;
+	}
+	if (em->em_op == DTRACE_EMU_PUSH) {
+		if (!st.s_done || st.s_addr != hw.er_gpr[DTRACE_EMU_RSP] ||
+		    child_read(st.s_addr, &v, sizeof v) != 0 || v != st.s_val) {
+			snprintf(why, whylen, "pushed value differs");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**********************************************************************/
+/*   Walk one function.						      */
+/**********************************************************************/
+static void
+do_func(const char *sym, uintptr_t addr, size_t size, counts_t *all,
+	counts_t *entry)
+{	uint8_t	buf[32];
+	uintptr_t off;
+	dtrace_emu_t em;
+	char	why[256];
+	int	len, rmindex, c, t;
+	size_t	n;
+
+	for (off = 0; off < size; off += len) {
+		n = size - off < 15 ? size - off : 15;
+		memset(buf, 0, sizeof buf);
+		memcpy(buf, (void *) (addr + off), n);
+		len = dtrace_instr_size_isa(buf, DATAMODEL_LP64, &rmindex);
+		if (len <= 0 || off + len > size)
+			break;
+
+		c = classify(buf, len, &em);
+		all->c_class[c]++;
+		if (off == 0)
+			entry->c_class[c]++;
+		if (c != C_EMU)
+			continue;
+		all->c_op[em.em_op]++;
+		if (off == 0)
+			entry->c_op[em.em_op]++;
+
+		if (vflag)
+			print_site("emu ", sym, off, buf, len, &em);
+		if (cflag)
+			continue;
+		for (t = 0; t < trials; t++) {
+			if (verify(addr + off, &em, why, sizeof why) == 0)
+				continue;
+			print_site("FAIL", sym, off, buf, len, &em);
+			printf("     %s\n", why);
+			n_bad++;
+			break;
+		}
+	}
+}
+
+/**********************************************************************/
+/*   Is [addr, addr+size) inside an executable segment of o?	      */
+/**********************************************************************/
+static int
+in_text(obj_t *o, ElfW(Addr) addr, size_t size)
+{	int	i;
+
+	for (i = 0; i < o->o_phnum; i++) {
+		const ElfW(Phdr) *ph = &o->o_phdr[i];
+		if (ph->p_type != PT_LOAD || (ph->p_flags & PF_X) == 0)
+			continue;
+		if (addr >= ph->p_vaddr && addr + size <= ph->p_vaddr + ph->p_memsz)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+addr_cmp(const void *a, const void *b)
+{	const ElfW(Sym) *s1 = *(const ElfW(Sym) **) a;
+	const ElfW(Sym) *s2 = *(const ElfW(Sym) **) b;
+
+	if (s1->st_value != s2->st_value)
+		return s1->st_value < s2->st_value ? -1 : 1;
+	return 0;
+}
+
+static void
+print_counts(const char *label, counts_t *c)
+{	unsigned long total = 0, probeable;
+	int	i;
+
+	for (i = 0; i < 4; i++)
+		total += c->c_class[i];
+	probeable = total - c->c_class[C_NOPROBE];
+	if (probeable == 0)
+		probeable = 1;
+
+	printf("  %s: %lu sites\n", label, total);
+	printf("    %-12s %8lu\n", "branch", c->c_class[C_BRANCH]);
+	for (i = 1; i < DTRACE_EMU_NOPS; i++)
+		printf("    %-12s %8lu\n", dtrace_emu_names[i], c->c_op[i]);
+	printf("    %-12s %8lu\n", "unprobeable", c->c_class[C_NOPROBE]);
+	printf("    stepped      %8lu  %5.1f%% (was %5.1f%%)\n",
+		c->c_class[C_STEP],
+		100.0 * c->c_class[C_STEP] / probeable,
+		100.0 * (c->c_class[C_STEP] + c->c_class[C_EMU]) / probeable);
+}
+
+/**********************************************************************/
+/*   Walk every function symbol in one object.			      */
+/**********************************************************************/
+static void
+do_obj(obj_t *o)
+{	struct stat sbuf;
+	ElfW(Ehdr) *eh;
+	ElfW(Shdr) *sh, *symsh = NULL;
+	ElfW(Sym) *syms, **funcs;
+	const char *strtab;
+	char	*base;
+	counts_t all, entry;
+	size_t	nsyms, nfuncs = 0, i;
+	int	fd;
+
+	if ((fd = open(o->o_path, O_RDONLY)) < 0 || fstat(fd, &sbuf) < 0) {
+		perror(o->o_path);
+		return;
+	}
+	base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror(o->o_path);
+		return;
+	}
+	eh = (ElfW(Ehdr) *) base;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64) {
+		fprintf(stderr, "%s: not an x86-64 ELF file\n", o->o_path);
+		munmap(base, sbuf.st_size);
+		return;
+	}
+
+	/***********************************************/
+	/*   Prefer  .symtab  (if not stripped), else  */
+	/*   make do with .dynsym.		       */
+	/***********************************************/
+	sh = (ElfW(Shdr) *) (base + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB)
+			symsh = &sh[i];
+		else if (sh[i].sh_type == SHT_DYNSYM && symsh == NULL)
+			symsh = &sh[i];
+	}
+	if (symsh == NULL) {
+		fprintf(stderr, "%s: no symbols\n", o->o_path);
+		munmap(base, sbuf.st_size);
+		return;
+	}
+	syms = (ElfW(Sym) *) (base + symsh->sh_offset);
+	nsyms = symsh->sh_size / sizeof (ElfW(Sym));
+	strtab = base + sh[symsh->sh_link].sh_offset;
+
+	/***********************************************/
+	/*   Aliases  share an address - only do each  */
+	/*   function once.			       */
+	/***********************************************/
+	funcs = calloc(nsyms, sizeof *funcs);
+	for (i = 0; i < nsyms; i++) {
+		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+		    syms[i].st_shndx == SHN_UNDEF || syms[i].st_size == 0 ||
+		    !in_text(o, syms[i].st_value, syms[i].st_size))
+			continue;
+		funcs[nfuncs++] = &syms[i];
+	}
+	qsort(funcs, nfuncs, sizeof *funcs, addr_cmp);
+
+	memset(&all, 0, sizeof all);
+	memset(&entry, 0, sizeof entry);
+	for (i = 0; i < nfuncs; i++) {
+		if (i && funcs[i]->st_value == funcs[i - 1]->st_value)
+			continue;
+		do_func(strtab + funcs[i]->st_name,
+			o->o_base + funcs[i]->st_value, funcs[i]->st_size,
+			&all, &entry);
+	}
+
+	printf("%s:\n", o->o_path);
+	print_counts("all instructions", &all);
+	print_counts("function entry", &entry);
+
+	free(funcs);
+	munmap(base, sbuf.st_size);
+}
+
+/**********************************************************************/
+/*   Pick the objects to look at out of what we have mapped.	      */
+/**********************************************************************/
+static int
+wanted(const char *path)
+{	const char *bn = strrchr(path, '/');
+	char	rp[PATH_MAX], rp2[PATH_MAX];
+	int	i;
+
+	bn = bn ? bn + 1 : path;
+	if (nwant == 0)
+		return strncmp(bn, "libc.so", 7) == 0 ||
+			strncmp(bn, "ld-linux", 8) == 0;
+
+	if (realpath(path, rp) == NULL)
+		return 0;
+	for (i = 0; i < nwant; i++) {
+		if (realpath(want[i], rp2) && strcmp(rp, rp2) == 0)
+			return 1;
+	}
+	return 0;
+}
+static int
+phdr_callback(struct dl_phdr_info *info, size_t size, void *data)
+{	obj_t	*o;
+
+	(void) size;
+	(void) data;
+	if (info->dlpi_name == NULL || *info->dlpi_name == '\0' ||
+	    !wanted(info->dlpi_name))
+		return 0;
+	objs = realloc(objs, (nobjs + 1) * sizeof *objs);
+	o = &objs[nobjs++];
+	snprintf(o->o_path, sizeof o->o_path, "%s", info->dlpi_name);
+	o->o_base = info->dlpi_addr;
+	o->o_phdr = info->dlpi_phdr;
+	o->o_phnum = info->dlpi_phnum;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{	int	c, i;
+	unsigned int seed = 1;
+
+	while ((c = getopt(argc, argv, "cvn:s:")) != -1) {
+		switch (c) {
+		  case 'c':
+		  	cflag = 1;
+			break;
+		  case 'v':
+		  	vflag = 1;
+			break;
+		  case 'n':
+		  	trials = atoi(optarg);
+			break;
+		  case 's':
+		  	seed = strtoul(optarg, NULL, 0);
+			break;
+		  default:
+		  	usage();
+		  }
+	}
+	want = &argv[optind];
+	nwant = argc - optind;
+	srandom(seed);
+
+	/***********************************************/
+	/*   Map  anything  we were asked about, so we  */
+	/*   (and  the child) have it at a known place  */
+	/*   to step through.			       */
+	/***********************************************/
+	for (i = 0; i < nwant; i++) {
+		if (dlopen(want[i], RTLD_NOW | RTLD_LOCAL) == NULL) {
+			fprintf(stderr, "ftemu: %s\n", dlerror());
+			exit(1);
+		}
+	}
+	dl_iterate_phdr(phdr_callback, NULL);
+	if (nobjs == 0) {
+		fprintf(stderr, "ftemu: nothing to look at\n");
+		exit(1);
+	}
+
+	if (!cflag)
+		child_start();
+	for (i = 0; i < nobjs; i++)
+		do_obj(&objs[i]);
+	child_stop();
+
+	if (!cflag)
+		printf("verified %lu emulations against the cpu: %lu failed\n",
+			n_verified, n_bad);
+	return n_bad ? 1 : 0;
+}
@@ -328,7 +328,14 @@ tp->ct_tinfo.t_opcode,
 	}
 
 	tp->ct_instr_buf[0] = tp->ct_tinfo.t_opcode;
+	/***********************************************/
+	/*   A   jump-optimized  FBT  probe  may  have  */
+	/*   overwritten  the  rest  of  the  original  */
+	/*   instruction,  so the provider hands us a  */
+	/*   copy of it.			       */
+	/***********************************************/
 	dtrace_memcpy(&tp->ct_instr_buf[1], 
+		tp->ct_tinfo.t_instr ? (void *) (tp->ct_tinfo.t_instr + 1) :
 		(void *) regs->r_pc, 
 		tp->ct_tinfo.t_inslen - 1);
 	/***********************************************/
@@ -42,6 +42,7 @@ unsigned long long cnt_timer2;
 unsigned long long cnt_timer3;
 unsigned long long cnt_timer_add;
 unsigned long long cnt_timer_remove;
+unsigned long long cnt_timer_omni;
 
 
 # if MODE == CYCLIC_SUN
@@ -98,6 +99,9 @@ init_cyclic()
 
 # if MODE == CYCLIC_LINUX
 #include <linux/interrupt.h>
+#include <linux/cpu.h>
+#include <asm/irq_regs.h>
+#include <sys/privregs.h>
 
 /**********************************************************************/
 /*   Prototypes.						      */
@@ -112,6 +116,25 @@ static int (*fn_hrtimer_cancel)(struct hrtimer *);
 static int (*fn_hrtimer_start)(struct hrtimer *timer, ktime_t tim,
                          const enum hrtimer_mode mode);
 static u64 (*fn_hrtimer_forward)(struct hrtimer *timer, ktime_t now, ktime_t interval);
+static int (*fn_register_cpu_notifier)(struct notifier_block *);
+static void (*fn_unregister_cpu_notifier)(struct notifier_block *);
+static int cyclic_cpu_notify(struct notifier_block *, unsigned long, void *);
+static struct notifier_block n_cpu_notify = {
+	.notifier_call = cyclic_cpu_notify,
+	};
+
+/**********************************************************************/
+/*   On  kernels  which  support  it,  pin  the  per-cpu  timers so  */
+/*   hrtimer doesnt migrate them to a different cpu.		      */
+/**********************************************************************/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+# define	CYCLIC_MODE_PINNED	HRTIMER_MODE_REL_PINNED
+#else
+# define	CYCLIC_MODE_PINNED	HRTIMER_MODE_REL
+#endif
+#if !defined(CPU_TASKS_FROZEN)
+# define	CPU_TASKS_FROZEN	0
+#endif
 
 #define	TMR_ALIVE       1
 #define	TMR_RUNNING     2
@@ -129,6 +152,37 @@ struct c_timer {
 spinlock_t lock_timers;
 struct c_timer *hd_timers;
 
+/**********************************************************************/
+/*   Omni-present  cyclics  (profile-N). Each cpu has its own hrtimer  */
+/*   and  we call the handler direct from the hrtimer interrupt - no  */
+/*   lock_timers or tasklet hop.				      */
+/**********************************************************************/
+struct c_omni_cpu {
+	struct hrtimer	co_htp;	/* Must be first item in structure */
+	cyc_handler_t	co_hdlr;
+	cyc_time_t	co_time;
+	ktime_t		co_interval;
+	void		*co_arg;	/* From cyo_online, for cyo_offline */
+	int		co_cpu;
+	volatile int	co_dying;
+	};
+struct c_omni {
+	cyc_omni_handler_t co_hdlr;
+	struct c_omni_cpu **co_cpus;	/* nr_cpus entries */
+	struct c_omni	*co_next;
+	};
+static struct c_omni *hd_omni;	/* Protected by cpu_lock */
+
+/**********************************************************************/
+/*   Solaris  style  cpu  setup callbacks (register_cpu_setup_func),  */
+/*   driven from the kernel hotplug notifier.			      */
+/**********************************************************************/
+# define	MAX_CPU_SETUP	4
+static struct cpu_setup_item {
+	cpu_setup_func_t *cs_func;
+	void		*cs_arg;
+	} cpu_setup_list[MAX_CPU_SETUP];
+
 int
 init_cyclic()
 {
@@ -147,13 +201,30 @@ init_cyclic()
 	fn_hrtimer_start  = get_proc_addr("hrtimer_start");
 	fn_hrtimer_forward = get_proc_addr("hrtimer_forward");
 
+	fn_register_cpu_notifier = get_proc_addr("register_cpu_notifier");
+	fn_unregister_cpu_notifier = get_proc_addr("unregister_cpu_notifier");
+
 	if (fn_hrtimer_start == NULL) {
 		printk(KERN_WARNING "dtracedrv: Cannot locate hrtimer in this kernel\n");
 		return FALSE;
 	}
 	spin_lock_init(&lock_timers);
+
+	/***********************************************/
+	/*   Without  this,  a  cpu  coming online or  */
+	/*   going offline wont get or lose its omni  */
+	/*   cyclics.				       */
+	/***********************************************/
+	if (fn_register_cpu_notifier)
+		fn_register_cpu_notifier(&n_cpu_notify);
 	return TRUE;
 }
+void
+fini_cyclic()
+{
+	if (fn_unregister_cpu_notifier && fn_register_cpu_notifier)
+		fn_unregister_cpu_notifier(&n_cpu_notify);
+}
 
 extern int dtrace_shutdown;
 static void cyclic_tasklet_func(unsigned long arg)
@@ -335,11 +406,214 @@ cyclic_add(cyc_handler_t *hdrl, cyc_time_t *t)
 
 	return (cyclic_id_t) cp;
 }
+/**********************************************************************/
+/*   Per-cpu  omni  timer  expiry. We are in hard interrupt context,  */
+/*   so we can tell the profile provider where we interrupted.	      */
+/**********************************************************************/
+static enum hrtimer_restart
+be_omni_callback(struct hrtimer *ptr)
+{	struct c_omni_cpu *ocp = (struct c_omni_cpu *) ptr;
+	struct pt_regs *regs;
+	cpu_t	*cpu;
+
+	if (ocp->co_dying)
+		return HRTIMER_NORESTART;
+
+	cnt_timer_omni++;
+	cpu = CPU;
+	if ((regs = get_irq_regs()) != NULL) {
+		if (user_mode(regs)) {
+			cpu->cpu_profile_pc = 0;
+			cpu->cpu_profile_upc = regs->r_pc;
+		} else {
+			cpu->cpu_profile_pc = regs->r_pc;
+			cpu->cpu_profile_upc = 0;
+		}
+	}
+	ocp->co_hdlr.cyh_func(ocp->co_hdlr.cyh_arg);
+	cpu->cpu_profile_pc = 0;
+	cpu->cpu_profile_upc = 0;
+
+	fn_hrtimer_forward(ptr, ptr->base->get_time(), ocp->co_interval);
+	return HRTIMER_RESTART;
+}
+/**********************************************************************/
+/*   Called  on the target cpu, so that the hrtimer lands on (and is  */
+/*   pinned to) that cpu's clock base.				      */
+/**********************************************************************/
+static void
+omni_start_cpu(void *arg)
+{	struct c_omni_cpu *ocp = arg;
+
+	fn_hrtimer_init(&ocp->co_htp, CLOCK_MONOTONIC, CYCLIC_MODE_PINNED);
+	ocp->co_htp.function = be_omni_callback;
+	fn_hrtimer_start(&ocp->co_htp, ocp->co_interval, CYCLIC_MODE_PINNED);
+}
+static void
+omni_online(struct c_omni *op, int cpu)
+{	struct c_omni_cpu *ocp;
+
+	if (cpu >= nr_cpus || op->co_cpus[cpu])
+		return;
+
+	if ((ocp = kzalloc(sizeof *ocp, GFP_KERNEL)) == NULL) {
+		printk("dtracedrv:cyclic_add_omni: Cannot alloc memory\n");
+		return;
+	}
+	ocp->co_cpu = cpu;
+	op->co_hdlr.cyo_online(op->co_hdlr.cyo_arg, &cpu_table[cpu],
+		&ocp->co_hdlr, &ocp->co_time);
+	ocp->co_arg = ocp->co_hdlr.cyh_arg;
+	ocp->co_interval = ktime_set(ocp->co_time.cyt_interval / (1000 * 1000 * 1000),
+		ocp->co_time.cyt_interval % (1000 * 1000 * 1000));
+	op->co_cpus[cpu] = ocp;
+
+	SMP_CALL_FUNCTION_SINGLE(cpu, omni_start_cpu, ocp, TRUE);
+}
+static void
+omni_offline(struct c_omni *op, int cpu)
+{	struct c_omni_cpu *ocp;
+
+	if (cpu >= nr_cpus || (ocp = op->co_cpus[cpu]) == NULL)
+		return;
+
+	/***********************************************/
+	/*   hrtimer_cancel  waits  for  a  running  */
+	/*   callback to finish.		       */
+	/***********************************************/
+	ocp->co_dying = TRUE;
+	fn_hrtimer_cancel(&ocp->co_htp);
+	op->co_cpus[cpu] = NULL;
+
+	op->co_hdlr.cyo_offline(op->co_hdlr.cyo_arg, &cpu_table[cpu], ocp->co_arg);
+	kfree(ocp);
+}
+/**********************************************************************/
+/*   Add  an  omni cyclic. Caller holds cpu_lock, which also protects  */
+/*   hd_omni against the hotplug notifier.			      */
+/**********************************************************************/
 cyclic_id_t
 cyclic_add_omni(cyc_omni_handler_t *omni)
-{
-	TODO();
-	return 0;
+{	struct c_omni *op;
+	int	cpu;
+
+	if (fn_hrtimer_init == NULL) {
+		printk("cyclic_add_omni: cannot locate hrtimer_init\n");
+		return 0;
+	}
+	if ((op = kzalloc(sizeof *op, GFP_KERNEL)) == NULL ||
+	    (op->co_cpus = kzalloc(sizeof *op->co_cpus * nr_cpus, GFP_KERNEL)) == NULL) {
+		printk("dtracedrv:cyclic_add_omni: Cannot alloc memory\n");
+		kfree(op);
+		return 0;
+	}
+
+	cnt_timer_add++;
+	op->co_hdlr = *omni;
+	for_each_online_cpu(cpu)
+		omni_online(op, cpu);
+
+	op->co_next = hd_omni;
+	hd_omni = op;
+
+	return (cyclic_id_t) op;
+}
+/**********************************************************************/
+/*   Remove an omni cyclic, if this is one. Caller holds cpu_lock.    */
+/**********************************************************************/
+static int
+cyclic_remove_omni(cyclic_id_t id)
+{	struct c_omni **opp;
+	struct c_omni *op;
+	int	cpu;
+
+	for (opp = &hd_omni; *opp; opp = &(*opp)->co_next) {
+		if (*opp == (struct c_omni *) id)
+			break;
+	}
+	if ((op = *opp) == NULL)
+		return FALSE;
+
+	*opp = op->co_next;
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		omni_offline(op, cpu);
+	kfree(op->co_cpus);
+	kfree(op);
+	return TRUE;
+}
+/**********************************************************************/
+/*   Emulate the Solaris cpu setup callback registration. Caller holds  */
+/*   cpu_lock.							      */
+/**********************************************************************/
+void
+register_cpu_setup_func(cpu_setup_func_t *func, void *arg)
+{	int	i;
+
+	for (i = 0; i < MAX_CPU_SETUP; i++) {
+		if (cpu_setup_list[i].cs_func == NULL) {
+			cpu_setup_list[i].cs_arg = arg;
+			cpu_setup_list[i].cs_func = func;
+			return;
+		}
+	}
+	printk("dtracedrv: register_cpu_setup_func: table full\n");
+}
+void
+unregister_cpu_setup_func(cpu_setup_func_t *func, void *arg)
+{	int	i;
+
+	for (i = 0; i < MAX_CPU_SETUP; i++) {
+		if (cpu_setup_list[i].cs_func == func &&
+		    cpu_setup_list[i].cs_arg == arg) {
+			cpu_setup_list[i].cs_func = NULL;
+			return;
+		}
+	}
+}
+static void
+cpu_setup_call(cpu_setup_t what, int cpu)
+{	int	i;
+
+	for (i = 0; i < MAX_CPU_SETUP; i++) {
+		if (cpu_setup_list[i].cs_func)
+			cpu_setup_list[i].cs_func(what, cpu, cpu_setup_list[i].cs_arg);
+	}
+}
+/**********************************************************************/
+/*   Kernel  cpu  hotplug notifier. Give a new cpu its buffers (via  */
+/*   dtrace_cpu_setup) and omni timers, and tear them down when it    */
+/*   goes away. We cannot cope with cpus beyond the nr_cpus we sized  */
+/*   our tables for at load time.				      */
+/**********************************************************************/
+static int
+cyclic_cpu_notify(struct notifier_block *n, unsigned long action, void *hcpu)
+{	int	cpu = (int) (long) hcpu;
+	struct c_omni *op;
+
+	if (cpu >= nr_cpus)
+		return NOTIFY_OK;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	  case CPU_ONLINE:
+	  case CPU_DOWN_FAILED:
+		mutex_enter(&cpu_lock);
+		cpu_setup_call(CPU_CONFIG, cpu);
+		cpu_setup_call(CPU_ON, cpu);
+		for (op = hd_omni; op; op = op->co_next)
+			omni_online(op, cpu);
+		mutex_exit(&cpu_lock);
+		break;
+
+	  case CPU_DOWN_PREPARE:
+		mutex_enter(&cpu_lock);
+		for (op = hd_omni; op; op = op->co_next)
+			omni_offline(op, cpu);
+		cpu_setup_call(CPU_OFF, cpu);
+		cpu_setup_call(CPU_UNCONFIG, cpu);
+		mutex_exit(&cpu_lock);
+		break;
+	  }
+	return NOTIFY_OK;
 }
 void 
 cyclic_remove(cyclic_id_t id)
@@ -349,6 +623,11 @@ cyclic_remove(cyclic_id_t id)
 	if (id == 0)
 		return;
 
+	if (cyclic_remove_omni(id)) {
+		cnt_timer_remove++;
+		return;
+	}
+
 	cnt_timer_remove++;
 	ctp->c_dying = TRUE;
 	fn_hrtimer_cancel(&ctp->c_htp);
@@ -402,6 +681,10 @@ init_cyclic()
 {
 	return TRUE;
 }
+void
+fini_cyclic()
+{
+}
 static void
 be_callback(struct timer_list *ptr)
 {	struct c_timer *cp = (struct c_timer *) ptr;
@@ -0,0 +1,1050 @@
+/**********************************************************************/
+/*   Translate  DIF  objects  to  native  x86-64 code ("difjit" D     */
+/*   option).							      */
+/*   								      */
+/*   This  is  a simple template compiler: each DIF instruction is    */
+/*   expanded  in  turn,  with  the  DIF  registers  living  in  a    */
+/*   dtrace_difjit_t  on  the  stack  of  dtrace_difjit_exec(). It    */
+/*   removes  the  fetch/decode/dispatch  of  the  interpreter, and   */
+/*   nothing  more  clever  than  that.  DIF is already validated by  */
+/*   dtrace_difo_validate()  (and  only  has forward branches, so is  */
+/*   loop  free),  so  we  rely  on  that here just as the            */
+/*   interpreter does.						      */
+/*   								      */
+/*   Anything  which  needs  access checks or can fault is done by    */
+/*   calling  back  into  dtrace.c  (dtrace_difjit_*())  or  the      */
+/*   dtrace_load*() and dtrace_fuword*() functions. Before each such  */
+/*   call  we  record  the  DIF  pc  in djt_opc, and after it we      */
+/*   check  the  CPU  fault  flags  and  bail  out, so faults are     */
+/*   reported exactly as the interpreter would report them.	      */
+/*   								      */
+/*   DIF  objects  using  any  other instruction (strings, dynamic    */
+/*   variables,  subroutines, stores, ...) are left to the            */
+/*   interpreter.						      */
+/*   								      */
+/*   The  code  is  written into ordinary (non-executable) vmalloc    */
+/*   memory,  which  is  then made read-only and executable. It is    */
+/*   never writable and executable at the same time.		      */
+/*   								      */
+/*   /proc/dtrace/difjit  runs  a  self-test which puts each          */
+/*   supported  instruction  through  the  interpreter, the threaded  */
+/*   interpreter  and  the  JIT,  with  a  spread of operand values,  */
+/*   and compares the results.					      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#include "dtrace_linux.h"
+#include <sys/dtrace_impl.h>
+#include "dtrace_proto.h"
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+
+unsigned long long cnt_difjit_compiled;
+unsigned long long cnt_difjit_unsupported;
+
+# if defined(__amd64)
+
+/**********************************************************************/
+/*   x86-64 register numbers.					      */
+/**********************************************************************/
+# define	R_AX	0
+# define	R_CX	1
+# define	R_DX	2
+# define	R_BX	3
+# define	R_SI	6
+# define	R_DI	7
+# define	R_R12	12
+
+/**********************************************************************/
+/*   Condition codes for Jcc (second byte of the 0x0f 0x8x form).     */
+/**********************************************************************/
+# define	CC_E	0x84
+# define	CC_NE	0x85
+# define	CC_L	0x8c
+# define	CC_GE	0x8d
+# define	CC_LE	0x8e
+# define	CC_G	0x8f
+
+/**********************************************************************/
+/*   The  generated  code  is produced in two passes. The first has   */
+/*   j_buf  set  to  NULL,  and  just  works  out the offset of each  */
+/*   instruction  and  the  total  size.  Every  instruction has a    */
+/*   fixed  size encoding, so the second pass lays out code exactly   */
+/*   the  same,  and  can  resolve  forward  branches  from  the      */
+/*   offsets of the first.					      */
+/**********************************************************************/
+typedef struct jit_state {
+	uchar_t	*j_buf;		/* output, or NULL when sizing */
+	size_t	j_pos;		/* current output offset */
+	size_t	*j_offs;	/* offset of each DIF instruction */
+	size_t	j_exit;		/* offset of the epilogue */
+	size_t	j_divzero;	/* offset of divide-by-zero stub */
+} jit_state_t;
+
+static int	(*fn_set_memory_ro)(unsigned long, int);
+static int	(*fn_set_memory_rw)(unsigned long, int);
+static int	(*fn_set_memory_x)(unsigned long, int);
+static int	(*fn_set_memory_nx)(unsigned long, int);
+
+static void
+jb(jit_state_t *j, int b)
+{
+	if (j->j_buf)
+		j->j_buf[j->j_pos] = (uchar_t) b;
+	j->j_pos++;
+}
+static void
+j32(jit_state_t *j, uint32_t v)
+{
+	jb(j, v);
+	jb(j, v >> 8);
+	jb(j, v >> 16);
+	jb(j, v >> 24);
+}
+static void
+j64(jit_state_t *j, uint64_t v)
+{
+	j32(j, (uint32_t) v);
+	j32(j, (uint32_t) (v >> 32));
+}
+static void
+jbytes(jit_state_t *j, const char *s, int n)
+{
+	while (n-- > 0)
+		jb(j, *s++ & 0xff);
+}
+# define	JB(j, s)	jbytes(j, s, sizeof s - 1)
+
+/**********************************************************************/
+/*   mov reg, [rbx+disp32] and mov [rbx+disp32], reg.		      */
+/**********************************************************************/
+static void
+jit_ldq(jit_state_t *j, int reg, uint32_t disp)
+{
+	jb(j, 0x48 | (reg >= 8 ? 4 : 0));
+	jb(j, 0x8b);
+	jb(j, 0x80 | ((reg & 7) << 3) | R_BX);
+	j32(j, disp);
+}
+static void
+jit_stq(jit_state_t *j, int reg, uint32_t disp)
+{
+	jb(j, 0x48 | (reg >= 8 ? 4 : 0));
+	jb(j, 0x89);
+	jb(j, 0x80 | ((reg & 7) << 3) | R_BX);
+	j32(j, disp);
+}
+# define	REGOFF(r)	((uint32_t) ((r) * sizeof (uint64_t)))
+# define	jit_ld(j, reg, r)	jit_ldq(j, reg, REGOFF(r))
+# define	jit_st(j, reg, r)	jit_stq(j, reg, REGOFF(r))
+
+/**********************************************************************/
+/*   mov qword [rbx+djt_opc], pc				      */
+/**********************************************************************/
+static void
+jit_opc(jit_state_t *j, uint_t pc)
+{
+	JB(j, "\x48\xc7\x83");
+	j32(j, offsetof(dtrace_difjit_t, djt_opc));
+	j32(j, pc);
+}
+/**********************************************************************/
+/*   mov rax, imm64; call rax					      */
+/**********************************************************************/
+static void
+jit_call(jit_state_t *j, void *fn)
+{
+	JB(j, "\x48\xb8");
+	j64(j, (uint64_t) fn);
+	JB(j, "\xff\xd0");
+}
+static void
+jit_jcc(jit_state_t *j, int cc, size_t target)
+{
+	jb(j, 0x0f);
+	jb(j, cc);
+	j32(j, (uint32_t) (target - (j->j_pos + 4)));
+}
+static void
+jit_jmp(jit_state_t *j, size_t target)
+{
+	jb(j, 0xe9);
+	j32(j, (uint32_t) (target - (j->j_pos + 4)));
+}
+/**********************************************************************/
+/*   test word [r12], CPU_DTRACE_FAULT; jne exit		      */
+/**********************************************************************/
+static void
+jit_faultchk(jit_state_t *j)
+{
+	JB(j, "\x66\x41\xf7\x04\x24");
+	jb(j, CPU_DTRACE_FAULT & 0xff);
+	jb(j, (CPU_DTRACE_FAULT >> 8) & 0xff);
+	jit_jcc(j, CC_NE, j->j_exit);
+}
+
+/**********************************************************************/
+/*   Can we translate every instruction in this DIF object?	      */
+/**********************************************************************/
+static int
+jit_supported(dtrace_difo_t *dp)
+{	uint_t	pc;
+
+	for (pc = 0; pc < dp->dtdo_len; pc++) {
+		switch (DIF_INSTR_OP(dp->dtdo_buf[pc])) {
+		  case DIF_OP_OR: case DIF_OP_XOR: case DIF_OP_AND:
+		  case DIF_OP_SLL: case DIF_OP_SRL: case DIF_OP_SRA:
+		  case DIF_OP_SUB: case DIF_OP_ADD: case DIF_OP_MUL:
+		  case DIF_OP_SDIV: case DIF_OP_UDIV:
+		  case DIF_OP_SREM: case DIF_OP_UREM:
+		  case DIF_OP_NOT: case DIF_OP_MOV:
+		  case DIF_OP_CMP: case DIF_OP_TST:
+		  case DIF_OP_BA: case DIF_OP_BE: case DIF_OP_BNE:
+		  case DIF_OP_BG: case DIF_OP_BGU: case DIF_OP_BGE:
+		  case DIF_OP_BGEU: case DIF_OP_BL: case DIF_OP_BLU:
+		  case DIF_OP_BLE: case DIF_OP_BLEU:
+		  case DIF_OP_LDSB: case DIF_OP_LDSH: case DIF_OP_LDSW:
+		  case DIF_OP_LDUB: case DIF_OP_LDUH: case DIF_OP_LDUW:
+		  case DIF_OP_LDX:
+		  case DIF_OP_RLDSB: case DIF_OP_RLDSH: case DIF_OP_RLDSW:
+		  case DIF_OP_RLDUB: case DIF_OP_RLDUH: case DIF_OP_RLDUW:
+		  case DIF_OP_RLDX:
+		  case DIF_OP_ULDSB: case DIF_OP_ULDSH: case DIF_OP_ULDSW:
+		  case DIF_OP_ULDUB: case DIF_OP_ULDUH: case DIF_OP_ULDUW:
+		  case DIF_OP_ULDX:
+		  case DIF_OP_RET: case DIF_OP_NOP:
+		  case DIF_OP_SETX: case DIF_OP_SETS:
+		  case DIF_OP_LDGA: case DIF_OP_LDGS:
+		  	break;
+		  default:
+		  	return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**********************************************************************/
+/*   Sign/zero  extend  the  result  of  a  load  in  %rax,  as  the  */
+/*   interpreter's casts do.					      */
+/**********************************************************************/
+static void
+jit_extend(jit_state_t *j, uint_t op)
+{
+	switch (op) {
+	  case DIF_OP_LDSB:
+	  case DIF_OP_ULDSB:
+	  	JB(j, "\x48\x0f\xbe\xc0");	/* movsx rax, al */
+		break;
+	  case DIF_OP_LDSH:
+	  case DIF_OP_ULDSH:
+	  	JB(j, "\x48\x0f\xbf\xc0");	/* movsx rax, ax */
+		break;
+	  case DIF_OP_LDSW:
+	  case DIF_OP_ULDSW:
+	  	JB(j, "\x48\x63\xc0");		/* movsxd rax, eax */
+		break;
+	  case DIF_OP_LDUB:
+	  case DIF_OP_ULDUB:
+	  	JB(j, "\x0f\xb6\xc0");		/* movzx eax, al */
+		break;
+	  case DIF_OP_LDUH:
+	  case DIF_OP_ULDUH:
+	  	JB(j, "\x0f\xb7\xc0");		/* movzx eax, ax */
+		break;
+	  case DIF_OP_LDUW:
+	  case DIF_OP_ULDUW:
+	  	JB(j, "\x89\xc0");		/* mov eax, eax */
+		break;
+	}
+}
+
+static void *
+jit_loadfn(uint_t op)
+{
+	switch (op) {
+	  case DIF_OP_LDSB: case DIF_OP_LDUB:
+	  	return (void *) dtrace_load8;
+	  case DIF_OP_LDSH: case DIF_OP_LDUH:
+	  	return (void *) dtrace_load16;
+	  case DIF_OP_LDSW: case DIF_OP_LDUW:
+	  	return (void *) dtrace_load32;
+	  case DIF_OP_LDX:
+	  	return (void *) dtrace_load64;
+	  case DIF_OP_ULDSB: case DIF_OP_ULDUB:
+	  	return (void *) dtrace_fuword8;
+	  case DIF_OP_ULDSH: case DIF_OP_ULDUH:
+	  	return (void *) dtrace_fuword16;
+	  case DIF_OP_ULDSW: case DIF_OP_ULDUW:
+	  	return (void *) dtrace_fuword32;
+	  default:
+	  	return (void *) dtrace_fuword64;
+	}
+}
+
+/**********************************************************************/
+/*   Division.  r1 / r2 with r2 == 0 flags CPU_DTRACE_DIVZERO. We     */
+/*   also  avoid  the  #DE which idiv raises for INT64_MIN / -1: the  */
+/*   quotient wraps and the remainder is zero.			      */
+/**********************************************************************/
+static void
+jit_div(jit_state_t *j, uint_t op, uint_t pc, uint_t r1, uint_t r2, uint_t rd)
+{	int	sgn = op == DIF_OP_SDIV || op == DIF_OP_SREM;
+	int	rem = op == DIF_OP_SREM || op == DIF_OP_UREM;
+
+	jit_opc(j, pc);
+	jit_ld(j, R_CX, r2);
+	JB(j, "\x48\x85\xc9");			/* test rcx, rcx */
+	jit_jcc(j, CC_E, j->j_divzero);
+	jit_ld(j, R_AX, r1);
+	if (sgn) {
+		JB(j, "\x48\x83\xf9\xff");	/* cmp rcx, -1 */
+		JB(j, "\x75\x05");		/* jne 1f */
+		if (rem)
+			JB(j, "\x31\xd2\x90");	/* xor edx, edx; nop */
+		else
+			JB(j, "\x48\xf7\xd8");	/* neg rax */
+		JB(j, "\xeb\x05");		/* jmp 2f */
+		JB(j, "\x48\x99");		/* 1: cqo */
+		JB(j, "\x48\xf7\xf9");		/* idiv rcx */
+	} else {
+		JB(j, "\x31\xd2");		/* xor edx, edx */
+		JB(j, "\x48\xf7\xf1");		/* div rcx */
+	}
+	if (rem)
+		JB(j, "\x48\x89\xd0");		/* mov rax, rdx */
+	jit_st(j, R_AX, rd);			/* 2: */
+}
+
+/**********************************************************************/
+/*   Generate the code for a DIF object (one pass).		      */
+/**********************************************************************/
+static void
+jit_gen(jit_state_t *j, dtrace_difo_t *dp)
+{	uint_t	pc;
+
+	/***********************************************/
+	/*   Prologue.  %rbx  =  the dtrace_difjit_t,  */
+	/*   %r12  =  &cpuc_dtrace_flags, %r13/%r14 =  */
+	/*   condition  codes: %r13 is the result of  */
+	/*   the  last compare (giving n and z), %r14  */
+	/*   the  carry. Five pushes leave the stack  */
+	/*   16-byte aligned for calls.		       */
+	/***********************************************/
+	JB(j, "\x53\x41\x54\x41\x55\x41\x56\x41\x57");
+	JB(j, "\x48\x89\xfb");			/* mov rbx, rdi */
+	jit_ldq(j, R_R12, offsetof(dtrace_difjit_t, djt_flags));
+	JB(j, "\x41\xbd\x01\x00\x00\x00");	/* mov r13d, 1 (!n, !z) */
+	JB(j, "\x45\x31\xf6");			/* xor r14d, r14d */
+
+	for (pc = 0; pc < dp->dtdo_len; pc++) {
+		dif_instr_t instr = dp->dtdo_buf[pc];
+		uint_t op = DIF_INSTR_OP(instr);
+		uint_t r1 = DIF_INSTR_R1(instr);
+		uint_t r2 = DIF_INSTR_R2(instr);
+		uint_t rd = DIF_INSTR_RD(instr);
+		size_t target = 0;
+
+		j->j_offs[pc] = j->j_pos;
+
+		switch (op) {
+		  case DIF_OP_BA: case DIF_OP_BE: case DIF_OP_BNE:
+		  case DIF_OP_BG: case DIF_OP_BGU: case DIF_OP_BGE:
+		  case DIF_OP_BGEU: case DIF_OP_BL: case DIF_OP_BLU:
+		  case DIF_OP_BLE: case DIF_OP_BLEU:
+			target = j->j_offs[DIF_INSTR_LABEL(instr)];
+			break;
+		}
+
+		switch (op) {
+		  case DIF_OP_OR:
+		  case DIF_OP_XOR:
+		  case DIF_OP_AND:
+		  case DIF_OP_SUB:
+		  case DIF_OP_ADD:
+		  case DIF_OP_MUL:
+		  case DIF_OP_SLL:
+		  case DIF_OP_SRL:
+		  case DIF_OP_SRA:
+			jit_ld(j, R_AX, r1);
+			jit_ld(j, R_CX, r2);
+			switch (op) {
+			  case DIF_OP_OR:  JB(j, "\x48\x09\xc8"); break;
+			  case DIF_OP_XOR: JB(j, "\x48\x31\xc8"); break;
+			  case DIF_OP_AND: JB(j, "\x48\x21\xc8"); break;
+			  case DIF_OP_SUB: JB(j, "\x48\x29\xc8"); break;
+			  case DIF_OP_ADD: JB(j, "\x48\x01\xc8"); break;
+			  case DIF_OP_MUL: JB(j, "\x48\x0f\xaf\xc1"); break;
+			  case DIF_OP_SLL: JB(j, "\x48\xd3\xe0"); break;
+			  case DIF_OP_SRL: JB(j, "\x48\xd3\xe8"); break;
+			  case DIF_OP_SRA: JB(j, "\x48\xd3\xf8"); break;
+			}
+			jit_st(j, R_AX, rd);
+			break;
+
+		  case DIF_OP_SDIV:
+		  case DIF_OP_UDIV:
+		  case DIF_OP_SREM:
+		  case DIF_OP_UREM:
+			jit_div(j, op, pc, r1, r2, rd);
+			break;
+
+		  case DIF_OP_NOT:
+			jit_ld(j, R_AX, r1);
+			JB(j, "\x48\xf7\xd0");		/* not rax */
+			jit_st(j, R_AX, rd);
+			break;
+
+		  case DIF_OP_MOV:
+			jit_ld(j, R_AX, r1);
+			jit_st(j, R_AX, rd);
+			break;
+
+		  case DIF_OP_CMP:
+			/***********************************************/
+			/*   n  and  z  come  from  the  (wrapping)  */
+			/*   difference,  c  from  the  unsigned  */
+			/*   compare; v is always zero.		       */
+			/***********************************************/
+			jit_ld(j, R_AX, r1);
+			jit_ld(j, R_CX, r2);
+			JB(j, "\x49\x89\xc5");		/* mov r13, rax */
+			JB(j, "\x49\x29\xcd");		/* sub r13, rcx */
+			JB(j, "\x45\x31\xf6");		/* xor r14d, r14d */
+			JB(j, "\x48\x39\xc8");		/* cmp rax, rcx */
+			JB(j, "\x41\x0f\x92\xc6");	/* setb r14b */
+			break;
+
+		  case DIF_OP_TST:
+			jit_ld(j, R_AX, r1);
+			JB(j, "\x45\x31\xf6");		/* xor r14d, r14d */
+			JB(j, "\x45\x31\xed");		/* xor r13d, r13d */
+			JB(j, "\x48\x85\xc0");		/* test rax, rax */
+			JB(j, "\x41\x0f\x95\xc5");	/* setne r13b */
+			break;
+
+		  /***********************************************/
+		  /*   Branches  test  %r13  against  zero, so  */
+		  /*   OF  is  clear and the signed Jcc's give  */
+		  /*   the interpreter's n/z combinations.     */
+		  /***********************************************/
+		  case DIF_OP_BA:
+			jit_jmp(j, target);
+			break;
+		  case DIF_OP_BE:
+		  case DIF_OP_BNE:
+		  case DIF_OP_BG:
+		  case DIF_OP_BGE:
+		  case DIF_OP_BL:
+		  case DIF_OP_BLE:
+			JB(j, "\x4d\x85\xed");		/* test r13, r13 */
+			jit_jcc(j, op == DIF_OP_BE ? CC_E :
+			    op == DIF_OP_BNE ? CC_NE :
+			    op == DIF_OP_BG ? CC_G :
+			    op == DIF_OP_BGE ? CC_GE :
+			    op == DIF_OP_BL ? CC_L : CC_LE, target);
+			break;
+		  case DIF_OP_BGEU:
+		  case DIF_OP_BLU:
+			JB(j, "\x4d\x85\xf6");		/* test r14, r14 */
+			jit_jcc(j, op == DIF_OP_BGEU ? CC_E : CC_NE, target);
+			break;
+		  case DIF_OP_BGU:
+			JB(j, "\x4d\x85\xf6");		/* test r14, r14 */
+			JB(j, "\x75\x09");		/* jne 1f */
+			JB(j, "\x4d\x85\xed");		/* test r13, r13 */
+			jit_jcc(j, CC_NE, target);
+			break;				/* 1: */
+		  case DIF_OP_BLEU:
+			JB(j, "\x4d\x85\xf6");		/* test r14, r14 */
+			jit_jcc(j, CC_NE, target);
+			JB(j, "\x4d\x85\xed");		/* test r13, r13 */
+			jit_jcc(j, CC_E, target);
+			break;
+
+		  case DIF_OP_LDSB: case DIF_OP_LDSH: case DIF_OP_LDSW:
+		  case DIF_OP_LDUB: case DIF_OP_LDUH: case DIF_OP_LDUW:
+		  case DIF_OP_LDX:
+		  case DIF_OP_ULDSB: case DIF_OP_ULDSH: case DIF_OP_ULDSW:
+		  case DIF_OP_ULDUB: case DIF_OP_ULDUH: case DIF_OP_ULDUW:
+		  case DIF_OP_ULDX:
+			jit_opc(j, pc);
+			jit_ld(j, R_DI, r1);
+			jit_call(j, jit_loadfn(op));
+			jit_extend(j, op);
+			jit_st(j, R_AX, rd);
+			jit_faultchk(j);
+			break;
+
+		  case DIF_OP_RLDSB: case DIF_OP_RLDSH: case DIF_OP_RLDSW:
+		  case DIF_OP_RLDUB: case DIF_OP_RLDUH: case DIF_OP_RLDUW:
+		  case DIF_OP_RLDX:
+			jit_opc(j, pc);
+			JB(j, "\x48\x89\xdf");		/* mov rdi, rbx */
+			jb(j, 0xbe);			/* mov esi, op */
+			j32(j, op);
+			jit_ld(j, R_DX, r1);
+			jit_call(j, (void *) dtrace_difjit_rload);
+			jit_st(j, R_AX, rd);
+			jit_faultchk(j);
+			break;
+
+		  case DIF_OP_LDGA:
+			jit_opc(j, pc);
+			JB(j, "\x48\x89\xdf");		/* mov rdi, rbx */
+			jb(j, 0xbe);			/* mov esi, var */
+			j32(j, r1);
+			jit_ld(j, R_DX, r2);
+			jit_call(j, (void *) dtrace_difjit_ldga);
+			jit_st(j, R_AX, rd);
+			jit_faultchk(j);
+			break;
+
+		  case DIF_OP_LDGS:
+			jit_opc(j, pc);
+			JB(j, "\x48\x89\xdf");		/* mov rdi, rbx */
+			jb(j, 0xbe);			/* mov esi, id */
+			j32(j, DIF_INSTR_VAR(instr));
+			jit_call(j, (void *) dtrace_difjit_ldgs);
+			jit_st(j, R_AX, rd);
+			jit_faultchk(j);
+			break;
+
+		  case DIF_OP_SETX:
+			JB(j, "\x48\xb8");		/* mov rax, imm64 */
+			j64(j, dp->dtdo_inttab[DIF_INSTR_INTEGER(instr)]);
+			jit_st(j, R_AX, rd);
+			break;
+
+		  case DIF_OP_SETS:
+			JB(j, "\x48\xb8");		/* mov rax, imm64 */
+			j64(j, (uint64_t) (uintptr_t) (dp->dtdo_strtab +
+			    DIF_INSTR_STRING(instr)));
+			jit_st(j, R_AX, rd);
+			break;
+
+		  case DIF_OP_RET:
+			jit_ld(j, R_AX, rd);
+			jit_jmp(j, j->j_exit);
+			break;
+
+		  case DIF_OP_NOP:
+			break;
+		}
+	}
+
+	/***********************************************/
+	/*   Falling off the end returns zero.	       */
+	/***********************************************/
+	j->j_offs[pc] = j->j_pos;
+	JB(j, "\x31\xc0");			/* xor eax, eax */
+
+	j->j_exit = j->j_pos;
+	JB(j, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3");
+
+	j->j_divzero = j->j_pos;
+	JB(j, "\x66\x41\x81\x0c\x24");		/* or word [r12], DIVZERO */
+	jb(j, CPU_DTRACE_DIVZERO & 0xff);
+	jb(j, (CPU_DTRACE_DIVZERO >> 8) & 0xff);
+	jit_jmp(j, j->j_exit);
+}
+
+/**********************************************************************/
+/*   Allocate  a  writable,  non-executable  buffer  for  the  code.  */
+/*   Without  set_memory_x()  and friends we cannot make it ROX once  */
+/*   written, so we refuse, and leave it to the interpreter.	      */
+/**********************************************************************/
+static void *
+jit_alloc(size_t size)
+{
+static int first_time = TRUE;
+
+	if (first_time) {
+		fn_set_memory_ro = get_proc_addr("set_memory_ro");
+		fn_set_memory_rw = get_proc_addr("set_memory_rw");
+		fn_set_memory_x = get_proc_addr("set_memory_x");
+		fn_set_memory_nx = get_proc_addr("set_memory_nx");
+		first_time = FALSE;
+	}
+	if (fn_set_memory_ro == NULL || fn_set_memory_rw == NULL ||
+	    fn_set_memory_x == NULL || fn_set_memory_nx == NULL)
+		return NULL;
+
+	return vmalloc(PAGE_ALIGN(size));
+}
+/**********************************************************************/
+/*   The  code  is written: make it read-only, and only then let it  */
+/*   execute.							      */
+/**********************************************************************/
+static int
+jit_protect(uchar_t *code, size_t size)
+{	int	npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	if (fn_set_memory_ro((unsigned long) code, npages) != 0)
+		return FALSE;
+	if (fn_set_memory_x((unsigned long) code, npages) != 0)
+		return FALSE;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Give  the  pages  back  the  protections vmalloc() handed them  */
+/*   out with before freeing them.				      */
+/**********************************************************************/
+static void
+jit_release(uchar_t *code, size_t size)
+{	int	npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	fn_set_memory_nx((unsigned long) code, npages);
+	fn_set_memory_rw((unsigned long) code, npages);
+	vfree(code);
+}
+
+/**********************************************************************/
+/*   Compile  a DIF object, if we can. Called with dtrace_lock held,  */
+/*   possibly while the DIF object is being run by the interpreter    */
+/*   on another CPU, so the code is only published once complete.     */
+/**********************************************************************/
+int
+dtrace_difjit_compile(dtrace_difo_t *dp)
+{	jit_state_t	j;
+	size_t	size;
+	uchar_t	*code;
+
+	if (dp->dtdo_jit != NULL)
+		return 0;
+
+	if (!jit_supported(dp)) {
+		cnt_difjit_unsupported++;
+		return -1;
+	}
+
+	memset(&j, 0, sizeof j);
+	j.j_offs = kmem_zalloc((dp->dtdo_len + 1) * sizeof (size_t), KM_SLEEP);
+
+	jit_gen(&j, dp);
+	size = j.j_pos;
+
+	if ((code = jit_alloc(size)) == NULL) {
+		kmem_free(j.j_offs, (dp->dtdo_len + 1) * sizeof (size_t));
+		return -1;
+	}
+
+	j.j_buf = code;
+	j.j_pos = 0;
+	jit_gen(&j, dp);
+	ASSERT(j.j_pos == size);
+
+	kmem_free(j.j_offs, (dp->dtdo_len + 1) * sizeof (size_t));
+
+	if (!jit_protect(code, size)) {
+		jit_release(code, size);
+		return -1;
+	}
+
+	dp->dtdo_jitlen = size;
+	dtrace_membar_producer();
+	dp->dtdo_jit = code;
+	cnt_difjit_compiled++;
+	return 0;
+}
+
+/**********************************************************************/
+/*   Called  from  dtrace_difo_destroy(),  when  no  probe  can  be   */
+/*   running the code.						      */
+/**********************************************************************/
+void
+dtrace_difjit_free(dtrace_difo_t *dp)
+{
+	if (dp->dtdo_jit == NULL)
+		return;
+
+	jit_release(dp->dtdo_jit, dp->dtdo_jitlen);
+	dp->dtdo_jit = NULL;
+	dp->dtdo_jitlen = 0;
+}
+
+/**********************************************************************/
+/*   Differential self-test.					      */
+/**********************************************************************/
+static const uint64_t jt_vals[] = {
+	0, 1, 2, 7, 63, 64, 65,
+	-1ULL, -7ULL,
+	0x7fffffffffffffffULL,
+	0x8000000000000000ULL,
+	0x123456789abcdef0ULL,
+	};
+# define	JT_NVALS	(sizeof jt_vals / sizeof jt_vals[0])
+
+typedef struct jit_test {
+	dtrace_difo_t	jt_difo;
+	dif_instr_t	jt_text[16];
+	uint64_t	jt_int[4];
+	char		jt_str[8];
+	uint64_t	jt_mem[4];	/* load target and scratch */
+	dtrace_mstate_t	jt_mstate;
+	dtrace_vstate_t	jt_vstate;
+	dtrace_state_t	*jt_state;
+	int		jt_ntests;
+	int		jt_nfail;
+	int		jt_nskip;
+	struct seq_file	*jt_seq;
+} jit_test_t;
+
+static void
+jt_setup(jit_test_t *jt, int len, uint64_t a, uint64_t b)
+{	dtrace_difo_t	*dp = &jt->jt_difo;
+	dtrace_mstate_t	*ms = &jt->jt_mstate;
+	int	i;
+
+	memset(dp, 0, sizeof *dp);
+	dp->dtdo_buf = jt->jt_text;
+	dp->dtdo_len = len;
+	dp->dtdo_inttab = jt->jt_int;
+	dp->dtdo_intlen = 4;
+	dp->dtdo_strtab = jt->jt_str;
+	dp->dtdo_strlen = sizeof jt->jt_str;
+	dp->dtdo_refcnt = 1;
+
+	jt->jt_int[0] = a;
+	jt->jt_int[1] = b;
+	jt->jt_int[2] = 0x1111;
+	jt->jt_int[3] = 0x2222;
+
+	memset(ms, 0, sizeof *ms);
+	ms->dtms_present = DTRACE_MSTATE_ARGS;
+	ms->dtms_access = DTRACE_ACCESS_ARGS | DTRACE_ACCESS_KERNEL;
+	for (i = 0; i < 5; i++)
+		ms->dtms_arg[i] = jt_vals[(a + i) % JT_NVALS] ^ b;
+	ms->dtms_scratch_base = (uintptr_t) jt->jt_mem;
+	ms->dtms_scratch_size = 2 * sizeof (uint64_t);
+	ms->dtms_scratch_ptr = ms->dtms_scratch_base;
+}
+
+/**********************************************************************/
+/*   Run  the  DIF  object  set  up  by  jt_setup()  through  the    */
+/*   switch  interpreter,  the  threaded  interpreter  and  the JIT,  */
+/*   and  compare  the  return  value,  the  fault  flags  and  the   */
+/*   fault offset.						      */
+/**********************************************************************/
+static char *jt_how[] = {"interp", "threaded", "jit"};
+
+static void
+jt_run(jit_test_t *jt, const char *name, uint64_t a, uint64_t b)
+{	dtrace_difo_t	*dp = &jt->jt_difo;
+	dtrace_mstate_t	ms[3];
+	uint64_t	rval[3];
+	uint16_t	flt[3];
+	dtrace_difpre_t	*pre;
+	void	*code;
+	int	i;
+
+	jt->jt_ntests++;
+	dtrace_difo_predecode(dp);
+	if (dtrace_difjit_compile(dp) != 0 || dp->dtdo_pre == NULL) {
+		jt->jt_nskip++;
+		seq_printf(jt->jt_seq, "%-8s not compiled\n", name);
+		dtrace_difjit_free(dp);
+		dtrace_difo_predecode_free(dp);
+		return;
+	}
+	code = dp->dtdo_jit;
+	pre = dp->dtdo_pre;
+
+	for (i = 0; i < 3; i++) {
+		dtrace_icookie_t cookie;
+		volatile uint16_t *flags;
+
+		dp->dtdo_pre = i >= 1 ? pre : NULL;
+		dp->dtdo_jit = i >= 2 ? code : NULL;
+		ms[i] = jt->jt_mstate;
+		jt->jt_mem[0] = 0x8081828384858687ULL;
+		jt->jt_mem[1] = 0;
+
+		cookie = dtrace_interrupt_disable();
+		flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
+		*flags &= ~CPU_DTRACE_FAULT;
+		rval[i] = dtrace_dif_run(dp, &ms[i], &jt->jt_vstate,
+		    jt->jt_state);
+		flt[i] = *flags & CPU_DTRACE_FAULT;
+		*flags &= ~CPU_DTRACE_FAULT;
+		cpu_core[cpu_get_id()].cpuc_dtrace_illval = 0;
+		dtrace_interrupt_enable(cookie);
+	}
+
+	dp->dtdo_jit = code;
+	dp->dtdo_pre = pre;
+	dtrace_difjit_free(dp);
+	dtrace_difo_predecode_free(dp);
+
+	for (i = 1; i < 3; i++) {
+		if (rval[0] == rval[i] && flt[0] == flt[i] &&
+		    (flt[0] == 0 || ms[0].dtms_fltoffs == ms[i].dtms_fltoffs))
+			continue;
+
+		jt->jt_nfail++;
+		seq_printf(jt->jt_seq, "%-8s a=%llx b=%llx: interp=%llx/%x/%u %s=%llx/%x/%u FAIL\n",
+			name, (unsigned long long) a, (unsigned long long) b,
+			(unsigned long long) rval[0], flt[0], ms[0].dtms_fltoffs,
+			jt_how[i],
+			(unsigned long long) rval[i], flt[i], ms[i].dtms_fltoffs);
+	}
+}
+
+static const struct {
+	uint_t	op;
+	char	*name;
+	} jt_alu[] = {
+	{DIF_OP_OR, "or"}, {DIF_OP_XOR, "xor"}, {DIF_OP_AND, "and"},
+	{DIF_OP_SLL, "sll"}, {DIF_OP_SRL, "srl"}, {DIF_OP_SRA, "sra"},
+	{DIF_OP_SUB, "sub"}, {DIF_OP_ADD, "add"}, {DIF_OP_MUL, "mul"},
+	{DIF_OP_SDIV, "sdiv"}, {DIF_OP_UDIV, "udiv"},
+	{DIF_OP_SREM, "srem"}, {DIF_OP_UREM, "urem"},
+	{DIF_OP_NOT, "not"}, {DIF_OP_MOV, "mov"},
+	{0}
+	}, jt_br[] = {
+	{DIF_OP_BA, "ba"}, {DIF_OP_BE, "be"}, {DIF_OP_BNE, "bne"},
+	{DIF_OP_BG, "bg"}, {DIF_OP_BGU, "bgu"}, {DIF_OP_BGE, "bge"},
+	{DIF_OP_BGEU, "bgeu"}, {DIF_OP_BL, "bl"}, {DIF_OP_BLU, "blu"},
+	{DIF_OP_BLE, "ble"}, {DIF_OP_BLEU, "bleu"},
+	{0}
+	}, jt_ld[] = {
+	{DIF_OP_LDSB, "ldsb"}, {DIF_OP_LDSH, "ldsh"}, {DIF_OP_LDSW, "ldsw"},
+	{DIF_OP_LDUB, "ldub"}, {DIF_OP_LDUH, "lduh"}, {DIF_OP_LDUW, "lduw"},
+	{DIF_OP_LDX, "ldx"},
+	{DIF_OP_RLDSB, "rldsb"}, {DIF_OP_RLDSH, "rldsh"}, {DIF_OP_RLDSW, "rldsw"},
+	{DIF_OP_RLDUB, "rldub"}, {DIF_OP_RLDUH, "rlduh"}, {DIF_OP_RLDUW, "rlduw"},
+	{DIF_OP_RLDX, "rldx"},
+	{0}
+	}, jt_uld[] = {
+	{DIF_OP_ULDSB, "uldsb"}, {DIF_OP_ULDSH, "uldsh"}, {DIF_OP_ULDSW, "uldsw"},
+	{DIF_OP_ULDUB, "uldub"}, {DIF_OP_ULDUH, "ulduh"}, {DIF_OP_ULDUW, "ulduw"},
+	{DIF_OP_ULDX, "uldx"},
+	{0}
+	};
+
+void
+dtrace_difjit_selftest(struct seq_file *seq)
+{	jit_test_t *jt;
+	int	i, k, n;
+	uint64_t a, b;
+	unsigned long uaddr;
+
+	jt = kmem_zalloc(sizeof *jt, KM_SLEEP);
+	jt->jt_state = kmem_zalloc(sizeof (dtrace_state_t), KM_SLEEP);
+	jt->jt_vstate.dtvs_state = jt->jt_state;
+	jt->jt_seq = seq;
+	strcpy(jt->jt_str, "difjit");
+
+	/***********************************************/
+	/*   A  user  page  for  the  user loads, in  */
+	/*   the  address  space  of whoever is reading  */
+	/*   us.  Fill  it in now, so it is present by  */
+	/*   the time we get to it from probe context.  */
+	/***********************************************/
+	uaddr = vm_mmap(NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	if (IS_ERR_VALUE(uaddr))
+		uaddr = 0;
+	else {
+		jt->jt_mem[0] = 0x8081828384858687ULL;
+		jt->jt_mem[1] = 0xf0e1d2c3b4a59687ULL;
+		if (copy_to_user((void *) uaddr, jt->jt_mem,
+		    2 * sizeof (uint64_t)) != 0) {
+			vm_munmap(uaddr, PAGE_SIZE);
+			uaddr = 0;
+		}
+	}
+
+	mutex_enter(&dtrace_lock);
+
+	/***********************************************/
+	/*   Arithmetic:  setx  a, b; op; ret. Signed  */
+	/*   INT64_MIN  /  -1  is  skipped:  the  C  */
+	/*   interpreter itself takes a #DE on it.     */
+	/***********************************************/
+	for (k = 0; jt_alu[k].name; k++) {
+		for (i = 0; i < JT_NVALS * JT_NVALS; i++) {
+			a = jt_vals[i / JT_NVALS];
+			b = jt_vals[i % JT_NVALS];
+			if ((jt_alu[k].op == DIF_OP_SDIV ||
+			    jt_alu[k].op == DIF_OP_SREM) &&
+			    a == 0x8000000000000000ULL && b == -1ULL)
+				continue;
+			jt_setup(jt, 4, a, b);
+			jt->jt_text[0] = DIF_INSTR_SETX(0, 1);
+			jt->jt_text[1] = DIF_INSTR_SETX(1, 2);
+			jt->jt_text[2] = DIF_INSTR_FMT(jt_alu[k].op, 1,
+			    jt_alu[k].op == DIF_OP_NOT ||
+			    jt_alu[k].op == DIF_OP_MOV ? 0 : 2, 3);
+			jt->jt_text[3] = DIF_INSTR_RET(3);
+			jt_run(jt, jt_alu[k].name, a, b);
+		}
+	}
+
+	/***********************************************/
+	/*   Compares  and  branches:  the result says  */
+	/*   whether the branch was taken.	       */
+	/***********************************************/
+	for (k = 0; jt_br[k].name; k++) {
+		for (n = 0; n < 2; n++) {
+			for (i = 0; i < JT_NVALS * JT_NVALS; i++) {
+				a = jt_vals[i / JT_NVALS];
+				b = jt_vals[i % JT_NVALS];
+				jt_setup(jt, 8, a, b);
+				jt->jt_text[0] = DIF_INSTR_SETX(0, 1);
+				jt->jt_text[1] = DIF_INSTR_SETX(1, 2);
+				jt->jt_text[2] = n ? DIF_INSTR_TST(1) :
+				    DIF_INSTR_CMP(DIF_OP_CMP, 1, 2);
+				jt->jt_text[3] = DIF_INSTR_BRANCH(jt_br[k].op, 6);
+				jt->jt_text[4] = DIF_INSTR_SETX(2, 3);
+				jt->jt_text[5] = DIF_INSTR_RET(3);
+				jt->jt_text[6] = DIF_INSTR_SETX(3, 3);
+				jt->jt_text[7] = DIF_INSTR_RET(3);
+				jt_run(jt, jt_br[k].name, a, b);
+			}
+		}
+	}
+
+	/***********************************************/
+	/*   The  same  against an argument, which the  */
+	/*   threaded   interpreter  fuses  into  one  */
+	/*   superinstruction.			       */
+	/***********************************************/
+	for (k = 0; jt_br[k].name; k++) {
+		for (i = 0; i < JT_NVALS * JT_NVALS; i++) {
+			a = i / JT_NVALS;
+			b = jt_vals[i % JT_NVALS];
+			jt_setup(jt, 8, a, b);
+			jt->jt_text[0] = DIF_INSTR_LDV(DIF_OP_LDGS, DIF_VAR_ARG0, 1);
+			jt->jt_text[1] = DIF_INSTR_SETX(1, 2);
+			jt->jt_text[2] = DIF_INSTR_CMP(DIF_OP_CMP, 1, 2);
+			jt->jt_text[3] = DIF_INSTR_BRANCH(jt_br[k].op, 6);
+			jt->jt_text[4] = DIF_INSTR_SETX(2, 3);
+			jt->jt_text[5] = DIF_INSTR_RET(3);
+			jt->jt_text[6] = DIF_INSTR_SETX(3, 3);
+			jt->jt_text[7] = DIF_INSTR_RET(3);
+			jt_run(jt, jt_br[k].name, a, b);
+		}
+	}
+
+	/***********************************************/
+	/*   Loads,  at each byte offset in the first  */
+	/*   word.  The  restricted  loads  are  only  */
+	/*   allowed  in  scratch  (jt_mem[0..1]), so  */
+	/*   offsets past that fault with KPRIV.       */
+	/***********************************************/
+	for (k = 0; jt_ld[k].name; k++) {
+		for (i = 0; i < 24; i++) {
+			a = (uint64_t) (uintptr_t) jt->jt_mem + i;
+			jt_setup(jt, 4, a, 0);
+			jt->jt_text[0] = DIF_INSTR_NOP;
+			jt->jt_text[1] = DIF_INSTR_SETX(0, 1);
+			jt->jt_text[2] = DIF_INSTR_LOAD(jt_ld[k].op, 1, 2);
+			jt->jt_text[3] = DIF_INSTR_RET(2);
+			jt_run(jt, jt_ld[k].name, a, 0);
+		}
+	}
+
+	/***********************************************/
+	/*   User  loads, at each byte offset in the  */
+	/*   page  we  mapped above, and from the page  */
+	/*   at zero, which is never mapped, so they  */
+	/*   fault.  Both  sides  go  through the same  */
+	/*   dtrace_fuword*(),  so this checks the JIT  */
+	/*   extends  the  result  and  reports  the  */
+	/*   fault just as the interpreter does.       */
+	/***********************************************/
+	for (k = 0; jt_uld[k].name; k++) {
+		for (i = 0; i < 16; i++) {
+			if (i < 8) {
+				if (uaddr == 0)
+					continue;
+				a = uaddr + i;
+			} else {
+				a = (i - 8) * sizeof (uint64_t);
+			}
+			jt_setup(jt, 4, a, 0);
+			jt->jt_text[0] = DIF_INSTR_NOP;
+			jt->jt_text[1] = DIF_INSTR_SETX(0, 1);
+			jt->jt_text[2] = DIF_INSTR_LOAD(jt_uld[k].op, 1, 2);
+			jt->jt_text[3] = DIF_INSTR_RET(2);
+			jt_run(jt, jt_uld[k].name, a, 0);
+		}
+	}
+
+	/***********************************************/
+	/*   Arguments, via ldga and ldgs.	       */
+	/***********************************************/
+	for (i = 0; i < 5; i++) {
+		jt_setup(jt, 3, i, 0);
+		jt->jt_text[0] = DIF_INSTR_SETX(0, 1);
+		jt->jt_text[1] = DIF_INSTR_LDA(DIF_OP_LDGA, DIF_VAR_ARGS, 1, 2);
+		jt->jt_text[2] = DIF_INSTR_RET(2);
+		jt_run(jt, "ldga", i, 0);
+
+		jt_setup(jt, 2, i, 0);
+		jt->jt_text[0] = DIF_INSTR_LDV(DIF_OP_LDGS, DIF_VAR_ARG0 + i, 1);
+		jt->jt_text[1] = DIF_INSTR_RET(1);
+		jt_run(jt, "ldgs", i, 0);
+	}
+
+	/***********************************************/
+	/*   sets, nop, and falling off the end.       */
+	/***********************************************/
+	jt_setup(jt, 3, 0, 0);
+	jt->jt_text[0] = DIF_INSTR_SETS(2, 1);
+	jt->jt_text[1] = DIF_INSTR_NOP;
+	jt->jt_text[2] = DIF_INSTR_RET(1);
+	jt_run(jt, "sets", 2, 0);
+
+	jt_setup(jt, 2, 5, 0);
+	jt->jt_text[0] = DIF_INSTR_SETX(0, 1);
+	jt->jt_text[1] = DIF_INSTR_NOP;
+	jt_run(jt, "nop", 5, 0);
+
+	/***********************************************/
+	/*   Something  the  JIT  doesnt handle must  */
+	/*   be refused.			       */
+	/***********************************************/
+	jt_setup(jt, 2, 0, 0);
+	jt->jt_text[0] = DIF_INSTR_CALL(DIF_SUBR_RAND, 1);
+	jt->jt_text[1] = DIF_INSTR_RET(1);
+	if (dtrace_difjit_compile(&jt->jt_difo) == 0) {
+		dtrace_difjit_free(&jt->jt_difo);
+		jt->jt_nfail++;
+		seq_printf(seq, "call     compiled FAIL\n");
+	}
+
+	mutex_exit(&dtrace_lock);
+
+	if (uaddr)
+		vm_munmap(uaddr, PAGE_SIZE);
+
+	seq_printf(seq, "difjit: %d tests, %d failed, %d not compiled\n",
+		jt->jt_ntests, jt->jt_nfail, jt->jt_nskip);
+
+	kmem_free(jt->jt_state, sizeof (dtrace_state_t));
+	kmem_free(jt, sizeof *jt);
+}
+
+# else /* !defined(__amd64) */
+
+int
+dtrace_difjit_compile(dtrace_difo_t *dp)
+{
+	cnt_difjit_unsupported++;
+	return -1;
+}
+void
+dtrace_difjit_free(dtrace_difo_t *dp)
+{
+}
+void
+dtrace_difjit_selftest(struct seq_file *seq)
+{
+	seq_printf(seq, "difjit: not supported on this architecture\n");
+}
+
+# endif /* defined(__amd64) */
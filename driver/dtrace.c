@@ -194,12 +194,21 @@ hrtime_t	dtrace_deadman_interval = NANOSEC;
 hrtime_t	dtrace_deadman_timeout = (hrtime_t)10 * NANOSEC;
 hrtime_t	dtrace_deadman_user = (hrtime_t)30 * NANOSEC;
 hrtime_t	dtrace_unregister_defunct_reap = (hrtime_t)60 * NANOSEC;
+#if linux
+uint_t		dtrace_dynhash_maxchain = 4;		/* mean lookup walk */
+uint_t		dtrace_dynhash_maxcollide = 64;		/* 1 in n allocs */
+uint_t		dtrace_dynhash_minlookups = 1024;	/* per clean */
+size_t		dtrace_dynhash_maxsize = (256 * 1024);	/* buckets */
+uint_t		dtrace_dynhash_spin = 100000;		/* resize wait */
+hrtime_t	dtrace_dynhash_quiesce = NANOSEC / MILLISEC;	/* 1 ms */
+#endif
 
 # if linux
 static void dtrace_action_chill(dtrace_mstate_t *mstate, hrtime_t val);
 
 static int dtrace_module_loaded(struct notifier_block *nb, unsigned long val, void *data);
 static void dtrace_module_unloaded(struct modctl *modctl);
+extern int nr_cpus;
 
 static struct notifier_block n_module_load = {
 	.notifier_call = dtrace_module_loaded,
@@ -249,6 +258,16 @@ static int		dtrace_toxranges;	/* number of toxic ranges */
 static int		dtrace_toxranges_max;	/* size of toxic range array */
 static dtrace_anon_t	dtrace_anon;		/* anonymous enabling */
 static kmem_cache_t	*dtrace_state_cache;	/* cache for dynamic state */
+# if linux
+static dtrace_kmc_t	*dtrace_probe_kmc;	/* cache for dtrace_probe_t */
+static dtrace_kmc_t	*dtrace_ecb_kmc;	/* cache for dtrace_ecb_t */
+static dtrace_kmc_t	*dtrace_action_kmc;	/* cache for dtrace_action_t */
+#	define	dtrace_obj_zalloc(kc, size)	dtrace_kmc_zalloc(kc, size, KM_SLEEP)
+#	define	dtrace_obj_free(kc, ptr, size)	dtrace_kmc_free(kc, ptr, size)
+# else
+#	define	dtrace_obj_zalloc(kc, size)	kmem_zalloc(size, KM_SLEEP)
+#	define	dtrace_obj_free(kc, ptr, size)	kmem_free(ptr, size)
+# endif
 static uint64_t		dtrace_vtime_references; /* number of vtimestamp refs */
 static kthread_t	*dtrace_panicked;	/* panicking thread */
 static dtrace_ecb_t	*dtrace_ecb_create_cache; /* cached created ECB */
@@ -298,9 +317,9 @@ static int		dtrace_dynvar_failclean; /* dynvars failed to clean */
  * mod_lock is similar with respect to dtrace_provider_lock in that it must be
  * acquired _between_ dtrace_provider_lock and dtrace_lock.
  */
-MUTEX_DEFINE(dtrace_lock);			/* probe state lock */
-MUTEX_DEFINE(dtrace_provider_lock);		/* provider state lock */
-MUTEX_DEFINE(dtrace_meta_lock);			/* meta-provider state lock */
+MUTEX_DEFINE_QUEUED(dtrace_lock);		/* probe state lock */
+MUTEX_DEFINE_QUEUED(dtrace_provider_lock);	/* provider state lock */
+MUTEX_DEFINE_QUEUED(dtrace_meta_lock);		/* meta-provider state lock */
 
 /*
  * DTrace Provider Variables
@@ -581,6 +600,10 @@ static uint64_t dtrace_helper(int, dtrace_mstate_t *,
     dtrace_state_t *, uint64_t, uint64_t);
 static dtrace_helpers_t *dtrace_helpers_create(proc_t *);
 static void dtrace_buffer_drop(dtrace_buffer_t *);
+#if linux
+static void dtrace_buffer_wakeup(dtrace_buffer_t *, dtrace_state_t *);
+static void dtrace_buffer_publish(dtrace_buffer_t *);
+#endif
 static intptr_t dtrace_buffer_reserve(dtrace_buffer_t *, size_t, size_t,
     dtrace_state_t *, dtrace_mstate_t *);
 static int dtrace_state_option(dtrace_state_t *, dtrace_optid_t,
@@ -1581,10 +1604,17 @@ dtrace_dynvar_clean(dtrace_dstate_t *dstate)
  * variable can be allocated.  If NULL is returned, the appropriate counter
  * will be incremented.
  */
+#if linux
+static dtrace_dynvar_t *
+dtrace_dynvar_hash(dtrace_dstate_t *dstate, uint_t nkeys,
+    dtrace_key_t *key, size_t dsize, dtrace_dynvar_op_t op,
+    dtrace_mstate_t *mstate, dtrace_vstate_t *vstate)
+#else
 dtrace_dynvar_t *
 dtrace_dynvar(dtrace_dstate_t *dstate, uint_t nkeys,
     dtrace_key_t *key, size_t dsize, dtrace_dynvar_op_t op,
     dtrace_mstate_t *mstate, dtrace_vstate_t *vstate)
+#endif
 {
 	uint64_t hashval = DTRACE_DYNHASH_VALID;
 	dtrace_dynhash_t *hash = dstate->dtds_hash;
@@ -1709,6 +1739,9 @@ HERE();
 		dtrace_tuple_t *dtuple = &dvar->dtdv_tuple;
 		dtrace_key_t *dkey = &dtuple->dtt_key[0];
 
+#if linux
+		dcpu->dtdsc_steps++;
+#endif
 HERE();
 		if (dvar->dtdv_hashval != hashval) {
 			if (dvar->dtdv_hashval == DTRACE_DYNHASH_SINK) {
@@ -2032,8 +2065,16 @@ retry:
 	dvar->dtdv_hashval = hashval;
 	dvar->dtdv_next = start;
 
-	if (dtrace_casptr(&hash[bucket].dtdh_chain, start, dvar) == start)
+	if (dtrace_casptr(&hash[bucket].dtdh_chain, start, dvar) == start) {
+#if linux
+		dstate->dtds_percpu[me].dtdsc_allocs++;
+#endif
 		return (dvar);
+	}
+
+#if linux
+	dstate->dtds_percpu[me].dtdsc_collisions++;
+#endif
 
 	/*
 	 * The cas has failed.  Either another CPU is adding an element to
@@ -2053,8 +2094,401 @@ retry:
 		dvar->dtdv_next = free;
 	} while (dtrace_casptr(&dcpu->dtdsc_dirty, free, dvar) != free);
 
+#if linux
+	return (dtrace_dynvar_hash(dstate, nkeys, key, dsize, op,
+	    mstate, vstate));
+#else
 	return (dtrace_dynvar(dstate, nkeys, key, dsize, op, mstate, vstate));
+#endif
+}
+
+#if linux
+unsigned long long cnt_dynhash_resize;
+unsigned long long cnt_dynhash_resize_abort;
+
+/*
+ * Map a dynamic variable's key onto its slot in dtds_vardrops:  globals
+ * first, then thread-locals.  A thread-local key ends with the thread key,
+ * which can never be a variable identifier (see DTRACE_TLS_THRKEY); an
+ * associative array's key ends with its identifier.  Returns -1 if the key
+ * makes no sense, as it may if it has been read from a chunk that is being
+ * reused.
+ */
+static int
+dtrace_dynvar_varndx(dtrace_dstate_t *dstate, uint_t nkeys,
+    dtrace_key_t *key)
+{
+	uint64_t id;
+
+	if (nkeys == 0 || nkeys > DIF_DTR_NREGS + 2)
+		return (-1);
+
+	if ((id = key[nkeys - 1].dttk_value) < DIF_VARIABLE_MAX)
+		return (id < dstate->dtds_nglobals ? (int)id : -1);
+
+	if (nkeys < 2 ||
+	    (id = key[nkeys - 2].dttk_value) >= dstate->dtds_ntlocals)
+		return (-1);
+
+	return (dstate->dtds_nglobals + (int)id);
+}
+
+/*
+ * A CPU's busy count is only ever written by that CPU, and an interrupting
+ * probe always puts it back as it found it, so it needs no atomics:  just a
+ * full barrier after counting ourselves in, so that the store is visible
+ * before we look at dtds_gen (dtrace_dynvar_resize() changes dtds_gen and
+ * then looks at the counts), and a release before counting ourselves out,
+ * so that we are done with the hash chains when the resizer sees zero.
+ */
+static void
+dtrace_dynvar_enter(dtrace_dstate_percpu_t *dcpu)
+{
+	dcpu->dtdsc_busy++;
+	smp_mb();
+}
+
+static void
+dtrace_dynvar_exit(dtrace_dstate_percpu_t *dcpu)
+{
+#if defined(smp_store_release)
+	smp_store_release(&dcpu->dtdsc_busy, dcpu->dtdsc_busy - 1);
+#else
+	smp_mb();
+	dcpu->dtdsc_busy--;
+#endif
+}
+
+/*
+ * Charge a drop to the variable it befell.  The counts are kept per CPU,
+ * nr_cpus rows of dtds_nglobals + dtds_ntlocals, so that variables which
+ * are dropping on several CPUs at once don't also fight over a cache line.
+ */
+static void
+dtrace_dynvar_vardrop(dtrace_dstate_t *dstate, uint_t nkeys,
+    dtrace_key_t *key)
+{
+	int ndx;
+
+	if (dstate->dtds_vardrops == NULL ||
+	    (ndx = dtrace_dynvar_varndx(dstate, nkeys, key)) < 0)
+		return;
+
+	dstate->dtds_vardrops[cpu_get_id() *
+	    (dstate->dtds_nglobals + dstate->dtds_ntlocals) + ndx]++;
+}
+
+/*
+ * Each CPU counts itself in for the duration of the hash operation, so that
+ * dtrace_dynvar_resize() can tell when nothing is left on the old hash
+ * chains.  If a resize is under way we wait for it -- but only for so long,
+ * as we may be an NMI which has interrupted the resizing CPU.  Giving up is
+ * a drop, so that the ECB's data is discarded rather than being recorded
+ * with a variable wrongly read as zero.  Drops are also charged to the
+ * variable concerned, for DTRACEIOC_DYNSTAT.
+ */
+dtrace_dynvar_t *
+dtrace_dynvar(dtrace_dstate_t *dstate, uint_t nkeys,
+    dtrace_key_t *key, size_t dsize, dtrace_dynvar_op_t op,
+    dtrace_mstate_t *mstate, dtrace_vstate_t *vstate)
+{
+	dtrace_dstate_percpu_t *dcpu = &dstate->dtds_percpu[cpu_get_id()];
+	dtrace_dynvar_t *dvar;
+	uint64_t drops;
+	uint_t spin = 0;
+
+	for (;;) {
+		dtrace_dynvar_enter(dcpu);
+
+		if ((dstate->dtds_gen & 1) == 0)
+			break;
+
+		dtrace_dynvar_exit(dcpu);
+
+		while (dstate->dtds_gen & 1) {
+			if (++spin < dtrace_dynhash_spin)
+				continue;
+
+			dcpu->dtdsc_drops++;
+			DTRACE_CPUFLAG_SET(CPU_DTRACE_DROP);
+			dtrace_dynvar_vardrop(dstate, nkeys, key);
+
+			return (NULL);
+		}
+	}
+
+	drops = dcpu->dtdsc_drops + dcpu->dtdsc_dirty_drops +
+	    dcpu->dtdsc_rinsing_drops;
+
+	dvar = dtrace_dynvar_hash(dstate, nkeys, key, dsize, op,
+	    mstate, vstate);
+
+	dcpu->dtdsc_lookups++;
+
+	if (dvar == NULL && drops != dcpu->dtdsc_drops +
+	    dcpu->dtdsc_dirty_drops + dcpu->dtdsc_rinsing_drops)
+		dtrace_dynvar_vardrop(dstate, nkeys, key);
+
+	dtrace_dynvar_exit(dcpu);
+
+	return (dvar);
+}
+
+/*
+ * Called by the cleaner:  if, since we last looked, lookups have been walking
+ * long hash chains or too many allocations have lost the race for a chain
+ * head, ask for the hash to be doubled.  dtrace_dynvar_resize() does the
+ * work, as we cannot allocate memory from here.
+ */
+static void
+dtrace_dynvar_adapt(dtrace_dstate_t *dstate)
+{
+	uint64_t lookups = 0, steps = 0, allocs = 0, collisions = 0;
+	size_t nchunks;
+	int i;
+
+	if (dstate->dtds_base == NULL || dstate->dtds_resize != 0)
+		return;
+
+	for (i = 0; i < NCPU; i++) {
+		dtrace_dstate_percpu_t *dcpu = &dstate->dtds_percpu[i];
+
+		lookups += dcpu->dtdsc_lookups;
+		steps += dcpu->dtdsc_steps;
+		allocs += dcpu->dtdsc_allocs;
+		collisions += dcpu->dtdsc_collisions;
+	}
+
+	if (lookups - dstate->dtds_lastlookups < dtrace_dynhash_minlookups)
+		return;
+
+	nchunks = dstate->dtds_size / dstate->dtds_chunksize;
+
+	if ((steps - dstate->dtds_laststeps >
+	    (lookups - dstate->dtds_lastlookups) * dtrace_dynhash_maxchain ||
+	    (collisions - dstate->dtds_lastcollisions) *
+	    dtrace_dynhash_maxcollide > allocs - dstate->dtds_lastallocs) &&
+	    dstate->dtds_hashsize * 2 <= dtrace_dynhash_maxsize &&
+	    dstate->dtds_hashsize * 2 <= nchunks * 4)
+		dstate->dtds_resize = dstate->dtds_hashsize * 2;
+
+	dstate->dtds_lastlookups = lookups;
+	dstate->dtds_laststeps = steps;
+	dstate->dtds_lastallocs = allocs;
+	dstate->dtds_lastcollisions = collisions;
+}
+
+/*
+ * Grow the hash to the size asked for by dtrace_dynvar_adapt().  Making
+ * dtds_gen odd keeps CPUs out of dtrace_dynvar(); once those already in it
+ * have left, nothing else can be looking at the hash chains and we relink
+ * their chunks into the new buckets.  We keep the CPU throughout, so that
+ * the other CPUs aren't left waiting on a resizer that has been preempted,
+ * but leave interrupts enabled:  we may be waiting for up to
+ * dtrace_dynhash_quiesce, and a probe that interrupts us only waits its
+ * bounded time and drops, as it would on any other CPU.  As we are holding
+ * dtrace_lock, if the other CPUs haven't left by then, we give up and keep
+ * the old hash, and the cleaner will ask again if it is still needed.
+ */
+static void
+dtrace_dynvar_resize(dtrace_dstate_t *dstate)
+{
+	size_t i, bucket, osize = dstate->dtds_hashsize;
+	size_t hashsize = dstate->dtds_resize;
+	dtrace_dynhash_t *hash, *ohash = dstate->dtds_hash;
+	dtrace_dynhash_t *oalloc = dstate->dtds_hashalloc;
+	dtrace_dynvar_t *dvar, *next;
+	hrtime_t deadline;
+	uint32_t gen;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	dstate->dtds_resize = 0;
+
+	if (dstate->dtds_base == NULL || hashsize <= osize)
+		return;
+
+	if ((hash = kmem_zalloc(hashsize * sizeof (dtrace_dynhash_t),
+	    KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+		return;
+
+	for (i = 0; i < hashsize; i++)
+		hash[i].dtdh_chain = &dtrace_dynhash_sink;
+
+	preempt_disable();
+
+	gen = dstate->dtds_gen;
+	(void) dtrace_cas32((uint32_t *)&dstate->dtds_gen, gen, gen + 1);
+
+	deadline = dtrace_gethrtime() + dtrace_dynhash_quiesce;
+
+	for (i = 0; i < NCPU; i++) {
+		while (dstate->dtds_percpu[i].dtdsc_busy != 0) {
+			if (dtrace_gethrtime() < deadline)
+				continue;
+
+			(void) dtrace_cas32((uint32_t *)&dstate->dtds_gen,
+			    gen + 1, gen + 2);
+			preempt_enable();
+			cnt_dynhash_resize_abort++;
+			kmem_free(hash, hashsize * sizeof (dtrace_dynhash_t));
+			return;
+		}
+	}
+
+	dtrace_membar_consumer();
+
+	for (i = 0; i < osize; i++) {
+		for (dvar = ohash[i].dtdh_chain;
+		    dvar != &dtrace_dynhash_sink; dvar = next) {
+			ASSERT(dvar->dtdv_hashval != DTRACE_DYNHASH_FREE);
+			next = dvar->dtdv_next;
+			bucket = dvar->dtdv_hashval % hashsize;
+			dvar->dtdv_next = hash[bucket].dtdh_chain;
+			hash[bucket].dtdh_chain = dvar;
+		}
+	}
+
+	dstate->dtds_hash = hash;
+	dstate->dtds_hashsize = hashsize;
+	dstate->dtds_hashalloc = hash;
+	dstate->dtds_resizes++;
+	cnt_dynhash_resize++;
+
+	dtrace_membar_producer();
+	(void) dtrace_cas32((uint32_t *)&dstate->dtds_gen, gen + 1, gen + 2);
+
+	preempt_enable();
+
+	if (oalloc != NULL)
+		kmem_free(oalloc, osize * sizeof (dtrace_dynhash_t));
+}
+
+/*
+ * Fill in a DTRACEIOC_DYNSTAT description of the dynamic variable space.
+ * Probes are still firing, so a chain may change under us; anything which
+ * doesn't look like a live chunk ends our walk of that chain.  The hash
+ * itself cannot change, as resizing also requires dtrace_lock.
+ */
+static void
+dtrace_dynvar_stat(dtrace_dstate_t *dstate, dtrace_dynstat_t *ds,
+    uint32_t nvars)
+{
+	uintptr_t base = (uintptr_t)dstate->dtds_base;
+	uintptr_t limit = base + dstate->dtds_size;
+	size_t chunksize = dstate->dtds_chunksize;
+	dtrace_dynstat_var_t *vars = NULL, *v;
+	dtrace_dynvar_t *dvar;
+	uint_t nids, n;
+	uint64_t len, j;
+	size_t i;
+	int ndx;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (dstate->dtds_base == NULL)
+		return;
+
+	ds->dtdy_size = dstate->dtds_size;
+	ds->dtdy_chunksize = chunksize;
+	ds->dtdy_nchunks = dstate->dtds_size / chunksize;
+	ds->dtdy_hashsize = dstate->dtds_hashsize;
+	ds->dtdy_resizes = dstate->dtds_resizes;
+
+	for (i = 0; i < NCPU; i++) {
+		dtrace_dstate_percpu_t *dcpu = &dstate->dtds_percpu[i];
+
+		ds->dtdy_lookups += dcpu->dtdsc_lookups;
+		ds->dtdy_steps += dcpu->dtdsc_steps;
+		ds->dtdy_allocs += dcpu->dtdsc_allocs;
+		ds->dtdy_collisions += dcpu->dtdsc_collisions;
+		ds->dtdy_drops += dcpu->dtdsc_drops;
+		ds->dtdy_dirty_drops += dcpu->dtdsc_dirty_drops;
+		ds->dtdy_rinsing_drops += dcpu->dtdsc_rinsing_drops;
+	}
+
+	nids = dstate->dtds_nglobals + dstate->dtds_ntlocals;
+
+	if (nids != 0)
+		vars = kmem_zalloc(nids * sizeof (dtrace_dynstat_var_t),
+		    KM_SLEEP);
+
+	for (i = 0; i < dstate->dtds_hashsize; i++) {
+		dvar = dstate->dtds_hash[i].dtdh_chain;
+
+		for (len = 0; dvar != &dtrace_dynhash_sink &&
+		    len < ds->dtdy_nchunks; dvar = dvar->dtdv_next, len++) {
+			if ((uintptr_t)dvar < base ||
+			    (uintptr_t)dvar + chunksize > limit ||
+			    dvar->dtdv_hashval == DTRACE_DYNHASH_FREE)
+				break;
+		}
+
+		if (len == 0)
+			continue;
+
+		ds->dtdy_buckets++;
+		ds->dtdy_inuse += len;
+
+		if (len > ds->dtdy_maxchain)
+			ds->dtdy_maxchain = len;
+
+		if (vars == NULL)
+			continue;
+
+		dvar = dstate->dtds_hash[i].dtdh_chain;
+
+		for (j = 0; j < len && dvar != &dtrace_dynhash_sink &&
+		    (uintptr_t)dvar >= base &&
+		    (uintptr_t)dvar + chunksize <= limit;
+		    j++, dvar = dvar->dtdv_next) {
+			n = dvar->dtdv_tuple.dtt_nkeys;
+
+			if (n == 0 || sizeof (dtrace_dynvar_t) +
+			    (n - 1) * sizeof (dtrace_key_t) > chunksize)
+				continue;
+
+			if ((ndx = dtrace_dynvar_varndx(dstate, n,
+			    dvar->dtdv_tuple.dtt_key)) < 0)
+				continue;
+
+			vars[ndx].dtdyv_count++;
+
+			if (len > vars[ndx].dtdyv_maxchain)
+				vars[ndx].dtdyv_maxchain = len;
+		}
+	}
+
+	for (i = 0, n = 0; i < nids; i++) {
+		v = &vars[i];
+
+		for (j = 0; dstate->dtds_vardrops != NULL && j < nr_cpus; j++)
+			v->dtdyv_drops += dstate->dtds_vardrops[j * nids + i];
+
+		if (v->dtdyv_count == 0 && v->dtdyv_drops == 0)
+			continue;
+
+		if (i < dstate->dtds_nglobals) {
+			v->dtdyv_id = i + DIF_VAR_OTHER_UBASE;
+			v->dtdyv_scope = DIFV_SCOPE_GLOBAL;
+		} else {
+			v->dtdyv_id = i - dstate->dtds_nglobals +
+			    DIF_VAR_OTHER_UBASE;
+			v->dtdyv_scope = DIFV_SCOPE_THREAD;
+		}
+
+		if (n < nvars)
+			ds->dtdy_vars[n] = *v;
+
+		n++;
+	}
+
+	ds->dtdy_nvars = n;
+
+	if (vars != NULL)
+		kmem_free(vars, nids * sizeof (dtrace_dynstat_var_t));
 }
+#endif
 
 /*ARGSUSED*/
 static void
@@ -2669,6 +3103,9 @@ dtrace_speculation_commit(dtrace_state_t *state, processorid_t cpu,
 	 * Finally, commit the reserved space in the destination buffer.
 	 */
 	dest->dtb_offset = offs + src->dtb_offset;
+#if linux
+	dtrace_buffer_publish(dest);
+#endif
 
 out:
 	/*
@@ -5035,73 +5472,872 @@ dump_dtrace_regs(char *msg, uint64_t *regs)
 # endif
 
 /*
- * Emulate the execution of DTrace IR instructions specified by the given
- * DIF object.  This function is deliberately void of assertions as all of
- * the necessary checks are handled by a call to dtrace_difo_validate().
+ * Load a scalar global (or built-in) variable for DIF_OP_LDGS.
  */
 static uint64_t
-dtrace_dif_emulate(dtrace_difo_t *difo, dtrace_mstate_t *mstate,
-    dtrace_vstate_t *vstate, dtrace_state_t *state)
+dtrace_dif_ldgs(uint_t id, dtrace_mstate_t *mstate, dtrace_vstate_t *vstate,
+    dtrace_state_t *state)
 {
-	const dif_instr_t *text = difo->dtdo_buf;
-	const uint_t textlen = difo->dtdo_len;
-	const char *strtab = difo->dtdo_strtab;
-	const uint64_t *inttab = difo->dtdo_inttab;
-
-	uint64_t rval = 0;
 	dtrace_statvar_t *svar;
-	dtrace_dstate_t *dstate = &vstate->dtvs_dynvars;
-	dtrace_difv_t *v;
-	volatile uint16_t *flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
-	volatile uintptr_t *illval = &cpu_core[cpu_get_id()].cpuc_dtrace_illval;
+	uintptr_t a;
 
-	dtrace_key_t tupregs[DIF_DTR_NREGS + 2]; /* +2 for thread and id */
-	uint64_t regs[DIF_DIR_NREGS];
-	uint64_t *tmp;
+	if (id < DIF_VAR_OTHER_UBASE)
+		return (dtrace_dif_variable(mstate, state, id, 0));
 
-	uint8_t cc_n = 0, cc_z = 0, cc_v = 0, cc_c = 0;
-	int64_t cc_r;
-	uint_t pc = 0, id, opc = 0;
-	uint8_t ttop = 0;
-	dif_instr_t instr;
-	uint_t r1, r2, rd;
+	id -= DIF_VAR_OTHER_UBASE;
+	svar = vstate->dtvs_globals[id];
+	ASSERT(svar != NULL);
+
+	if (!(svar->dtsv_var.dtdv_type.dtdt_flags & DIF_TF_BYREF))
+		return (svar->dtsv_data);
+
+	a = (uintptr_t)svar->dtsv_data;
 
-HERE();
 	/*
-	 * We stash the current DIF object into the machine state: we need it
-	 * for subsequent access checking.
+	 * If the 0th byte is set to UINT8_MAX then this is to be treated as
+	 * a reference to a NULL variable.
 	 */
-	mstate->dtms_difo = difo;
+	if (*(uint8_t *)a == UINT8_MAX)
+		return (0);
 
-	regs[DIF_REG_R0] = 0; 		/* %r0 is fixed at zero */
+	return (a + sizeof (uint64_t));
+}
 
-	while (pc < textlen && !(*flags & CPU_DTRACE_FAULT)) {
-		opc = pc;
+#if linux
+/*
+ * Linux:  thread-local variable slots (see dtrace_tls_t).  Both return -1 if
+ * the variable has no slot or we cannot find the current thread's row, in
+ * which case the caller uses the dynamic variable space.  They return -2 if
+ * the thread has no shadow proc of its own and its variables cannot go to the
+ * dynamic variable space either (see par_tls_index()); loads then read as
+ * zero and stores are dropped.
+ */
+unsigned long long cnt_tls_slot;
+unsigned long long cnt_tls_dynvar;
 
-		instr = text[pc++];
-/*if (instr == 0x49010001) instr = 0x1e010001;*/
-		r1 = DIF_INSTR_R1(instr);
-		r2 = DIF_INSTR_R2(instr);
-		rd = DIF_INSTR_RD(instr);
+static int
+dtrace_tls_row(dtrace_tls_t *tls, uint_t id, int *slot, uint64_t *tag,
+    uint64_t **rowp)
+{
+	uint32_t gen;
+	int ndx;
 
-		switch (DIF_INSTR_OP(instr)) {
-		case DIF_OP_OR:
-PRINT_CASE(DIF_OP_OR);
-			regs[rd] = regs[r1] | regs[r2];
-			break;
-		case DIF_OP_XOR:
-PRINT_CASE(DIF_OP_XOR);
-			regs[rd] = regs[r1] ^ regs[r2];
-			break;
-		case DIF_OP_AND:
-PRINT_CASE(DIF_OP_AND);
-			regs[rd] = regs[r1] & regs[r2];
-			break;
-		case DIF_OP_SLL:
-PRINT_CASE(DIF_OP_SLL);
-			regs[rd] = regs[r1] << regs[r2];
-			break;
-		case DIF_OP_SRL:
+	if (tls->dtt_rows == NULL || id >= tls->dtt_nids ||
+	    (*slot = tls->dtt_slot[id]) < 0)
+		return (-1);
+
+	if ((ndx = par_tls_index(&gen)) < 0)
+		return (ndx == -2 ? -2 : -1);
+
+	*tag = (uint64_t)gen + 1;
+	*rowp = &tls->dtt_rows[ndx * (tls->dtt_nslots + 1)];
+	return (0);
+}
+
+static int
+dtrace_tls_load(dtrace_tls_t *tls, uint_t id, uint64_t *valp)
+{
+	uint64_t *row, tag;
+	int slot, rv;
+
+	if ((rv = dtrace_tls_row(tls, id, &slot, &tag, &row)) != 0)
+		return (rv);
+
+	cnt_tls_slot++;
+	*valp = row[0] == tag ? row[slot + 1] : 0;
+	return (0);
+}
+
+static int
+dtrace_tls_store(dtrace_tls_t *tls, uint_t id, uint64_t val)
+{
+	uint64_t *row, tag;
+	int slot, rv;
+
+	if ((rv = dtrace_tls_row(tls, id, &slot, &tag, &row)) != 0)
+		return (rv);
+
+	cnt_tls_slot++;
+	if (row[0] != tag) {
+		bzero(&row[1], tls->dtt_nslots * sizeof (uint64_t));
+		row[0] = tag;
+	}
+	row[slot + 1] = val;
+	return (0);
+}
+
+/*
+ * Assign slots to the scalar thread-local variables of a consumer which is
+ * about to go.  Failing to allocate the table just leaves every thread-local
+ * in the dynamic variable space.
+ */
+static void
+dtrace_tls_init(dtrace_vstate_t *vstate)
+{
+	dtrace_tls_t *tls = &vstate->dtvs_tls;
+	uint_t i, nids = vstate->dtvs_ntlocals, nslots = 0;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+	ASSERT(tls->dtt_rows == NULL);
+
+	if (nids == 0)
+		return;
+
+	tls->dtt_slot = kmem_alloc(nids * sizeof (int8_t), KM_SLEEP);
+
+	for (i = 0; i < nids; i++) {
+		dtrace_difv_t *v = &vstate->dtvs_tlocals[i];
+
+		tls->dtt_slot[i] = -1;
+
+		if (v->dtdv_id < DIF_VAR_OTHER_UBASE ||
+		    v->dtdv_kind != DIFV_KIND_SCALAR ||
+		    (v->dtdv_type.dtdt_flags & DIF_TF_BYREF) ||
+		    nslots == DTRACE_TLS_MAXSLOTS)
+			continue;
+
+		tls->dtt_slot[i] = nslots++;
+	}
+
+	if (nslots != 0) {
+		tls->dtt_size = PID_MAX_DEFAULT * (nslots + 1) *
+		    sizeof (uint64_t);
+		tls->dtt_rows = kmem_zalloc(tls->dtt_size, KM_NOSLEEP);
+	}
+
+	if (tls->dtt_rows == NULL) {
+		kmem_free(tls->dtt_slot, nids * sizeof (int8_t));
+		tls->dtt_slot = NULL;
+		tls->dtt_size = 0;
+		return;
+	}
+
+	tls->dtt_nslots = nslots;
+	dtrace_membar_producer();
+	tls->dtt_nids = nids;
+}
+
+static void
+dtrace_tls_fini(dtrace_vstate_t *vstate)
+{
+	dtrace_tls_t *tls = &vstate->dtvs_tls;
+
+	if (tls->dtt_rows == NULL)
+		return;
+
+	kmem_free(tls->dtt_rows, tls->dtt_size);
+	kmem_free(tls->dtt_slot, tls->dtt_nids * sizeof (int8_t));
+	bzero(tls, sizeof (dtrace_tls_t));
+}
+#endif
+
+/*
+ * Load a thread-local variable for DIF_OP_LDTS; returns 0 if it has not been
+ * assigned.
+ */
+static uint64_t
+dtrace_dif_ldts(uint_t id, dtrace_mstate_t *mstate, dtrace_vstate_t *vstate)
+{
+	dtrace_dynvar_t *dvar;
+	dtrace_key_t key[2];
+	dtrace_difv_t *v;
+#if linux
+	uint64_t val;
+#endif
+
+	ASSERT(id >= DIF_VAR_OTHER_UBASE);
+	id -= DIF_VAR_OTHER_UBASE;
+	v = &vstate->dtvs_tlocals[id];
+
+#if linux
+	switch (dtrace_tls_load(&vstate->dtvs_tls, id, &val)) {
+	case 0:
+		return (val);
+	case -2:
+		return (0);
+	}
+	cnt_tls_dynvar++;
+#endif
+
+	key[0].dttk_value = (uint64_t)id;
+	key[0].dttk_size = 0;
+	DTRACE_TLS_THRKEY(key[1].dttk_value);
+	key[1].dttk_size = 0;
+
+	dvar = dtrace_dynvar(&vstate->dtvs_dynvars, 2, key,
+	    sizeof (uint64_t), DTRACE_DYNVAR_NOALLOC, mstate, vstate);
+
+	if (dvar == NULL)
+		return (0);
+
+	if (v->dtdv_type.dtdt_flags & DIF_TF_BYREF)
+		return ((uint64_t)(uintptr_t)dvar->dtdv_data);
+
+	return (*((uint64_t *)dvar->dtdv_data));
+}
+
+/*
+ * Store to a thread-local variable for DIF_OP_STTS; storing zero frees it.
+ */
+static void
+dtrace_dif_stts(uint_t id, uint64_t val, dtrace_mstate_t *mstate,
+    dtrace_vstate_t *vstate)
+{
+	dtrace_dstate_t *dstate = &vstate->dtvs_dynvars;
+	dtrace_dynvar_t *dvar;
+	dtrace_key_t key[2];
+	dtrace_difv_t *v;
+#if linux
+	dtrace_dstate_percpu_t *dcpu;
+	uint64_t drops[3];
+	int rv;
+#endif
+
+	ASSERT(id >= DIF_VAR_OTHER_UBASE);
+	id -= DIF_VAR_OTHER_UBASE;
+	v = &vstate->dtvs_tlocals[id];
+
+	/*
+	 * Given that we're storing to thread-local data, we need to flush our
+	 * predicate cache.
+	 */
+	curthread->t_predcache = NULL;
+
+#if linux
+	if ((rv = dtrace_tls_store(&vstate->dtvs_tls, id, val)) == 0)
+		return;
+
+	if (rv == -2) {
+		if (val != 0)
+			dstate->dtds_percpu[CPU->cpu_id].dtdsc_tlsdrops++;
+		return;
+	}
+	cnt_tls_dynvar++;
+
+	/*
+	 * dtrace_dynvar() charges a failed allocation to this CPU's dynamic
+	 * variable drop counters; we want thread-local drops reported on
+	 * their own.
+	 */
+	dcpu = &dstate->dtds_percpu[CPU->cpu_id];
+	drops[0] = dcpu->dtdsc_drops;
+	drops[1] = dcpu->dtdsc_dirty_drops;
+	drops[2] = dcpu->dtdsc_rinsing_drops;
+#endif
+
+	key[0].dttk_value = (uint64_t)id;
+	key[0].dttk_size = 0;
+	DTRACE_TLS_THRKEY(key[1].dttk_value);
+	key[1].dttk_size = 0;
+
+	dvar = dtrace_dynvar(dstate, 2, key,
+	    v->dtdv_type.dtdt_size > sizeof (uint64_t) ?
+	    v->dtdv_type.dtdt_size : sizeof (uint64_t),
+	    val ? DTRACE_DYNVAR_ALLOC : DTRACE_DYNVAR_DEALLOC,
+	    mstate, vstate);
+
+	if (dvar == NULL) {
+#if linux
+		if (drops[0] != dcpu->dtdsc_drops ||
+		    drops[1] != dcpu->dtdsc_dirty_drops ||
+		    drops[2] != dcpu->dtdsc_rinsing_drops) {
+			dcpu->dtdsc_drops = drops[0];
+			dcpu->dtdsc_dirty_drops = drops[1];
+			dcpu->dtdsc_rinsing_drops = drops[2];
+			dcpu->dtdsc_tlsdrops++;
+		}
+#endif
+		return;
+	}
+
+	if (v->dtdv_type.dtdt_flags & DIF_TF_BYREF) {
+		if (!dtrace_vcanload((void *)(uintptr_t)val,
+		    &v->dtdv_type, mstate, vstate))
+			return;
+
+		dtrace_vcopy((void *)(uintptr_t)val,
+		    dvar->dtdv_data, &v->dtdv_type);
+	} else {
+		*((uint64_t *)dvar->dtdv_data) = val;
+	}
+}
+
+#if linux
+/*
+ * Linux:  the following are called from code generated by dif_jit.c, for
+ * the DIF instructions that need the framework's access checks.  Each has
+ * the same semantics as the corresponding case in dtrace_dif_emulate().
+ */
+uint64_t
+dtrace_difjit_ldga(dtrace_difjit_t *jit, uint_t var, uint64_t ndx)
+{
+	return (dtrace_dif_variable(jit->djt_mstate, jit->djt_state, var, ndx));
+}
+
+uint64_t
+dtrace_difjit_ldgs(dtrace_difjit_t *jit, uint_t id)
+{
+	return (dtrace_dif_ldgs(id, jit->djt_mstate, jit->djt_vstate,
+	    jit->djt_state));
+}
+
+uint64_t
+dtrace_difjit_rload(dtrace_difjit_t *jit, uint_t op, uint64_t addr)
+{
+	static const uint8_t size[] = { 1, 2, 4, 1, 2, 4, 8 };
+
+	ASSERT(op >= DIF_OP_RLDSB && op <= DIF_OP_RLDX);
+
+	if (!dtrace_canstore(addr, size[op - DIF_OP_RLDSB],
+	    jit->djt_mstate, jit->djt_vstate)) {
+		*jit->djt_flags |= CPU_DTRACE_KPRIV;
+		cpu_core[cpu_get_id()].cpuc_dtrace_illval = addr;
+		return (0);
+	}
+
+	switch (op) {
+	case DIF_OP_RLDSB:
+		return ((int8_t)dtrace_load8(addr));
+	case DIF_OP_RLDSH:
+		return ((int16_t)dtrace_load16(addr));
+	case DIF_OP_RLDSW:
+		return ((int32_t)dtrace_load32(addr));
+	case DIF_OP_RLDUB:
+		return (dtrace_load8(addr));
+	case DIF_OP_RLDUH:
+		return (dtrace_load16(addr));
+	case DIF_OP_RLDUW:
+		return (dtrace_load32(addr));
+	default:
+		return (dtrace_load64(addr));
+	}
+}
+
+/*
+ * Run a DIF object that has been compiled to native code.  Faults are
+ * reported exactly as dtrace_dif_emulate() would report them.
+ */
+static uint64_t
+dtrace_difjit_exec(dtrace_difo_t *difo, dtrace_mstate_t *mstate,
+    dtrace_vstate_t *vstate, dtrace_state_t *state)
+{
+	dtrace_difjit_t jit;
+	uint64_t rval = 0;
+
+	mstate->dtms_difo = difo;
+
+	jit.djt_regs[DIF_REG_R0] = 0;
+	jit.djt_mstate = mstate;
+	jit.djt_vstate = vstate;
+	jit.djt_state = state;
+	jit.djt_flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
+	jit.djt_opc = 0;
+
+	if (!(*jit.djt_flags & CPU_DTRACE_FAULT))
+		rval = ((dtrace_difjit_func_t *)difo->dtdo_jit)(&jit);
+
+	if (!(*jit.djt_flags & CPU_DTRACE_FAULT))
+		return (rval);
+
+	mstate->dtms_fltoffs = jit.djt_opc * sizeof (dif_instr_t);
+	mstate->dtms_present |= DTRACE_MSTATE_FLTOFFS;
+
+	return (0);
+}
+#endif
+
+#if linux
+/*
+ * Linux:  pre-decoded, direct-threaded DIF interpreter.
+ *
+ * dtrace_difo_predecode() expands the DIF text of a DIF object once, into
+ * one dtrace_difpre_t per instruction with the operands already extracted
+ * and integer/string table references resolved, plus a terminating slot.
+ * Each slot carries the address of its handler in dtrace_dif_threaded(),
+ * so dispatch is a single indirect jump (a GCC computed goto) instead of a
+ * decode and a bounds-checked switch.  Since slots map one-to-one to DIF
+ * instructions, branch targets and fault offsets need no translation.
+ *
+ * Common sequences are fused into superinstructions simply by pointing the
+ * first slot of the sequence at a handler which executes the whole sequence,
+ * reading the operands of the slots that follow.  Those slots keep their own
+ * handlers, so a branch into the middle of a sequence still works.
+ *
+ * Only the instructions which turn up in hot predicates and actions are
+ * handled; DIF objects using anything else (stores other than to
+ * thread-locals, associative arrays, string construction, translators) are
+ * left to the switch in dtrace_dif_emulate(), as is the original DIF text
+ * for validation and for DOF.
+ */
+#define	DIFPRE_END		(DIF_OP_XLARG + 1)
+#define	DIFPRE_CMP_BR		(DIF_OP_XLARG + 2)
+#define	DIFPRE_TST_BR		(DIF_OP_XLARG + 3)
+#define	DIFPRE_LDGS_SETX_CMP_BR	(DIF_OP_XLARG + 4)
+#define	DIFPRE_SETX_LDGA	(DIF_OP_XLARG + 5)
+#define	DIFPRE_FLUSHTS_PUSH	(DIF_OP_XLARG + 6)
+#define	DIFPRE_PUSH_CALL	(DIF_OP_XLARG + 7)
+#define	DIFPRE_FLUSHTS_PUSH_CALL (DIF_OP_XLARG + 8)
+#define	DIFPRE_MAX		(DIF_OP_XLARG + 9)
+
+static const void *const *dtrace_difpre_labels;
+
+unsigned long long cnt_dif_predecoded;
+unsigned long long cnt_dif_fused;
+
+/*
+ * Evaluate a branch condition.  Every instruction setting the condition
+ * codes clears the overflow bit, so it plays no part here.
+ */
+static inline int
+dtrace_difpre_taken(uint_t op, uint8_t cc_n, uint8_t cc_z, uint8_t cc_c)
+{
+	switch (op) {
+	case DIF_OP_BA:		return (1);
+	case DIF_OP_BE:		return (cc_z);
+	case DIF_OP_BNE:	return (cc_z == 0);
+	case DIF_OP_BG:		return ((cc_z | cc_n) == 0);
+	case DIF_OP_BGU:	return ((cc_c | cc_z) == 0);
+	case DIF_OP_BGE:	return (cc_n == 0);
+	case DIF_OP_BGEU:	return (cc_c == 0);
+	case DIF_OP_BL:		return (cc_n);
+	case DIF_OP_BLU:	return (cc_c);
+	case DIF_OP_BLE:	return (cc_z | cc_n);
+	default:		return (cc_c | cc_z);	/* DIF_OP_BLEU */
+	}
+}
+
+/*
+ * DIF_OP_PUSHTR and DIF_OP_PUSHTV; returns -1 if the tuple stack is full.
+ */
+static inline int
+dtrace_difpre_push(const dtrace_difpre_t *ip, const uint64_t *regs,
+    dtrace_key_t *tupregs, uint8_t *ttop)
+{
+	dtrace_key_t *key;
+
+	if (*ttop == DIF_DTR_NREGS)
+		return (-1);
+
+	key = &tupregs[(*ttop)++];
+	key->dttk_value = regs[ip->dpi_rd];
+
+	if (ip->dpi_op == DIF_OP_PUSHTV)
+		key->dttk_size = 0;
+	else if (ip->dpi_r1 == DIF_TYPE_STRING)
+		key->dttk_size = dtrace_strlen((char *)(uintptr_t)
+		    regs[ip->dpi_rd], regs[ip->dpi_r2] ? regs[ip->dpi_r2] :
+		    dtrace_strsize_default) + 1;
+	else
+		key->dttk_size = regs[ip->dpi_r2];
+
+	return (0);
+}
+
+/*
+ * Run a pre-decoded DIF object.  Called with difo == NULL (from
+ * dtrace_difo_predecode()) just to publish the handler addresses.
+ */
+static uint64_t
+dtrace_dif_threaded(dtrace_difo_t *difo, dtrace_mstate_t *mstate,
+    dtrace_vstate_t *vstate, dtrace_state_t *state)
+{
+	static const void *const labels[DIFPRE_MAX] = {
+		[DIF_OP_OR] = &&l_or,		[DIF_OP_XOR] = &&l_xor,
+		[DIF_OP_AND] = &&l_and,		[DIF_OP_SLL] = &&l_sll,
+		[DIF_OP_SRL] = &&l_srl,		[DIF_OP_SRA] = &&l_sra,
+		[DIF_OP_SUB] = &&l_sub,		[DIF_OP_ADD] = &&l_add,
+		[DIF_OP_MUL] = &&l_mul,		[DIF_OP_SDIV] = &&l_sdiv,
+		[DIF_OP_UDIV] = &&l_udiv,	[DIF_OP_SREM] = &&l_srem,
+		[DIF_OP_UREM] = &&l_urem,	[DIF_OP_NOT] = &&l_not,
+		[DIF_OP_MOV] = &&l_mov,		[DIF_OP_CMP] = &&l_cmp,
+		[DIF_OP_TST] = &&l_tst,		[DIF_OP_BA] = &&l_ba,
+		[DIF_OP_BE] = &&l_be,		[DIF_OP_BNE] = &&l_bne,
+		[DIF_OP_BG] = &&l_bg,		[DIF_OP_BGU] = &&l_bgu,
+		[DIF_OP_BGE] = &&l_bge,		[DIF_OP_BGEU] = &&l_bgeu,
+		[DIF_OP_BL] = &&l_bl,		[DIF_OP_BLU] = &&l_blu,
+		[DIF_OP_BLE] = &&l_ble,		[DIF_OP_BLEU] = &&l_bleu,
+		[DIF_OP_LDSB] = &&l_ldsb,	[DIF_OP_LDSH] = &&l_ldsh,
+		[DIF_OP_LDSW] = &&l_ldsw,	[DIF_OP_LDUB] = &&l_ldub,
+		[DIF_OP_LDUH] = &&l_lduh,	[DIF_OP_LDUW] = &&l_lduw,
+		[DIF_OP_LDX] = &&l_ldx,
+		[DIF_OP_RLDSB] = &&l_rldsb,	[DIF_OP_RLDSH] = &&l_rldsh,
+		[DIF_OP_RLDSW] = &&l_rldsw,	[DIF_OP_RLDUB] = &&l_rldub,
+		[DIF_OP_RLDUH] = &&l_rlduh,	[DIF_OP_RLDUW] = &&l_rlduw,
+		[DIF_OP_RLDX] = &&l_rldx,
+		[DIF_OP_ULDSB] = &&l_uldsb,	[DIF_OP_ULDSH] = &&l_uldsh,
+		[DIF_OP_ULDSW] = &&l_uldsw,	[DIF_OP_ULDUB] = &&l_uldub,
+		[DIF_OP_ULDUH] = &&l_ulduh,	[DIF_OP_ULDUW] = &&l_ulduw,
+		[DIF_OP_ULDX] = &&l_uldx,
+		[DIF_OP_RET] = &&l_ret,		[DIF_OP_NOP] = &&l_nop,
+		[DIF_OP_SETX] = &&l_setx,	[DIF_OP_SETS] = &&l_setx,
+		[DIF_OP_SCMP] = &&l_scmp,
+		[DIF_OP_LDGA] = &&l_ldga,	[DIF_OP_LDGS] = &&l_ldgs,
+		[DIF_OP_LDTS] = &&l_ldts,	[DIF_OP_STTS] = &&l_stts,
+		[DIF_OP_PUSHTR] = &&l_push,	[DIF_OP_PUSHTV] = &&l_push,
+		[DIF_OP_POPTS] = &&l_popts,	[DIF_OP_FLUSHTS] = &&l_flushts,
+		[DIF_OP_CALL] = &&l_call,
+		[DIFPRE_END] = &&l_end,
+		[DIFPRE_CMP_BR] = &&l_cmp_br,
+		[DIFPRE_TST_BR] = &&l_tst_br,
+		[DIFPRE_LDGS_SETX_CMP_BR] = &&l_ldgs_setx_cmp_br,
+		[DIFPRE_SETX_LDGA] = &&l_setx_ldga,
+		[DIFPRE_FLUSHTS_PUSH] = &&l_flushts_push,
+		[DIFPRE_PUSH_CALL] = &&l_push_call,
+		[DIFPRE_FLUSHTS_PUSH_CALL] = &&l_flushts_push_call,
+	};
+
+	const dtrace_difpre_t *pre, *ip;
+	volatile uint16_t *flags;
+	dtrace_key_t tupregs[DIF_DTR_NREGS + 2];
+	uint64_t regs[DIF_DIR_NREGS];
+	uint64_t rval = 0;
+	uint8_t cc_n = 0, cc_z = 0, cc_c = 0;
+	uint8_t ttop = 0;
+	uint_t opc = 0;
+
+	if (difo == NULL) {
+		dtrace_difpre_labels = labels;
+		return (0);
+	}
+
+#define	DIFPRE_NEXT(n)	goto *(ip += (n))->dpi_label
+#define	DIFPRE_JUMP(p)	goto *(ip = pre + (p)->dpi_imm)->dpi_label
+#define	DIFPRE_FAULT(p)	do { opc = (p) - pre; goto fault; } while (0)
+#define	DIFPRE_CHECK(p)	if (*flags & CPU_DTRACE_FAULT) DIFPRE_FAULT(p)
+#define	DIFPRE_CMP(p) {							\
+	int64_t cc_r = regs[(p)->dpi_r1] - regs[(p)->dpi_r2];		\
+	cc_n = cc_r < 0;						\
+	cc_z = cc_r == 0;						\
+	cc_c = regs[(p)->dpi_r1] < regs[(p)->dpi_r2];			\
+}
+#define	DIFPRE_BRANCH(p, n)						\
+	if (dtrace_difpre_taken((p)->dpi_op, cc_n, cc_z, cc_c))	\
+		DIFPRE_JUMP(p);						\
+	DIFPRE_NEXT(n)
+
+	mstate->dtms_difo = difo;
+	flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
+	pre = difo->dtdo_pre;
+	ip = pre;
+
+	regs[DIF_REG_R0] = 0;
+
+	DIFPRE_CHECK(ip);
+	goto *ip->dpi_label;
+
+l_or:	regs[ip->dpi_rd] = regs[ip->dpi_r1] | regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_xor:	regs[ip->dpi_rd] = regs[ip->dpi_r1] ^ regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_and:	regs[ip->dpi_rd] = regs[ip->dpi_r1] & regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_sll:	regs[ip->dpi_rd] = regs[ip->dpi_r1] << regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_srl:	regs[ip->dpi_rd] = regs[ip->dpi_r1] >> regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_sra:	regs[ip->dpi_rd] = (int64_t)regs[ip->dpi_r1] >> regs[ip->dpi_r2];
+	DIFPRE_NEXT(1);
+l_sub:	regs[ip->dpi_rd] = regs[ip->dpi_r1] - regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_add:	regs[ip->dpi_rd] = regs[ip->dpi_r1] + regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+l_mul:	regs[ip->dpi_rd] = regs[ip->dpi_r1] * regs[ip->dpi_r2]; DIFPRE_NEXT(1);
+
+l_sdiv:
+	if (regs[ip->dpi_r2] == 0)
+		goto divzero;
+	regs[ip->dpi_rd] = (int64_t)regs[ip->dpi_r1] / (int64_t)regs[ip->dpi_r2];
+	DIFPRE_NEXT(1);
+l_udiv:
+	if (regs[ip->dpi_r2] == 0)
+		goto divzero;
+	regs[ip->dpi_rd] = regs[ip->dpi_r1] / regs[ip->dpi_r2];
+	DIFPRE_NEXT(1);
+l_srem:
+	if (regs[ip->dpi_r2] == 0)
+		goto divzero;
+	regs[ip->dpi_rd] = (int64_t)regs[ip->dpi_r1] % (int64_t)regs[ip->dpi_r2];
+	DIFPRE_NEXT(1);
+l_urem:
+	if (regs[ip->dpi_r2] == 0)
+		goto divzero;
+	regs[ip->dpi_rd] = regs[ip->dpi_r1] % regs[ip->dpi_r2];
+	DIFPRE_NEXT(1);
+
+l_not:	regs[ip->dpi_rd] = ~regs[ip->dpi_r1]; DIFPRE_NEXT(1);
+l_mov:	regs[ip->dpi_rd] = regs[ip->dpi_r1]; DIFPRE_NEXT(1);
+
+l_cmp:
+	DIFPRE_CMP(ip);
+	DIFPRE_NEXT(1);
+l_tst:
+	cc_n = cc_c = 0;
+	cc_z = regs[ip->dpi_r1] == 0;
+	DIFPRE_NEXT(1);
+
+l_ba:	DIFPRE_JUMP(ip);
+l_be:	if (cc_z) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bne:	if (cc_z == 0) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bg:	if ((cc_z | cc_n) == 0) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bgu:	if ((cc_c | cc_z) == 0) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bge:	if (cc_n == 0) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bgeu:	if (cc_c == 0) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bl:	if (cc_n) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_blu:	if (cc_c) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_ble:	if (cc_z | cc_n) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+l_bleu:	if (cc_c | cc_z) DIFPRE_JUMP(ip); DIFPRE_NEXT(1);
+
+	/*
+	 * The restricted loads check the address and then share the code of
+	 * the plain loads.
+	 */
+l_rldsb: if (!dtrace_canstore(regs[ip->dpi_r1], 1, mstate, vstate))
+		goto kpriv;
+l_ldsb:	regs[ip->dpi_rd] = (int8_t)dtrace_load8(regs[ip->dpi_r1]);
+	goto load;
+l_rldsh: if (!dtrace_canstore(regs[ip->dpi_r1], 2, mstate, vstate))
+		goto kpriv;
+l_ldsh:	regs[ip->dpi_rd] = (int16_t)dtrace_load16(regs[ip->dpi_r1]);
+	goto load;
+l_rldsw: if (!dtrace_canstore(regs[ip->dpi_r1], 4, mstate, vstate))
+		goto kpriv;
+l_ldsw:	regs[ip->dpi_rd] = (int32_t)dtrace_load32(regs[ip->dpi_r1]);
+	goto load;
+l_rldub: if (!dtrace_canstore(regs[ip->dpi_r1], 1, mstate, vstate))
+		goto kpriv;
+l_ldub:	regs[ip->dpi_rd] = dtrace_load8(regs[ip->dpi_r1]);
+	goto load;
+l_rlduh: if (!dtrace_canstore(regs[ip->dpi_r1], 2, mstate, vstate))
+		goto kpriv;
+l_lduh:	regs[ip->dpi_rd] = dtrace_load16(regs[ip->dpi_r1]);
+	goto load;
+l_rlduw: if (!dtrace_canstore(regs[ip->dpi_r1], 4, mstate, vstate))
+		goto kpriv;
+l_lduw:	regs[ip->dpi_rd] = dtrace_load32(regs[ip->dpi_r1]);
+	goto load;
+l_rldx: if (!dtrace_canstore(regs[ip->dpi_r1], 8, mstate, vstate))
+		goto kpriv;
+l_ldx:	regs[ip->dpi_rd] = dtrace_load64(regs[ip->dpi_r1]);
+	goto load;
+
+l_uldsb: regs[ip->dpi_rd] = (int8_t)
+	    dtrace_fuword8((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_uldsh: regs[ip->dpi_rd] = (int16_t)
+	    dtrace_fuword16((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_uldsw: regs[ip->dpi_rd] = (int32_t)
+	    dtrace_fuword32((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_uldub: regs[ip->dpi_rd] =
+	    dtrace_fuword8((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_ulduh: regs[ip->dpi_rd] =
+	    dtrace_fuword16((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_ulduw: regs[ip->dpi_rd] =
+	    dtrace_fuword32((void *)(uintptr_t)regs[ip->dpi_r1]);
+	goto load;
+l_uldx:	regs[ip->dpi_rd] =
+	    dtrace_fuword64((void *)(uintptr_t)regs[ip->dpi_r1]);
+load:
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+
+l_ret:
+	rval = regs[ip->dpi_rd];
+l_end:
+	return (rval);
+
+l_nop:	DIFPRE_NEXT(1);
+l_setx:	regs[ip->dpi_rd] = ip->dpi_imm; DIFPRE_NEXT(1);
+
+l_scmp: {
+	size_t sz = state->dts_options[DTRACEOPT_STRSIZE];
+	uintptr_t s1 = regs[ip->dpi_r1];
+	uintptr_t s2 = regs[ip->dpi_r2];
+	int64_t cc_r;
+
+	if ((s1 != NULL && !dtrace_strcanload(s1, sz, mstate, vstate)) ||
+	    (s2 != NULL && !dtrace_strcanload(s2, sz, mstate, vstate))) {
+		DIFPRE_CHECK(ip);
+		DIFPRE_NEXT(1);
+	}
+
+	cc_r = dtrace_strncmp((char *)s1, (char *)s2, sz);
+	cc_n = cc_r < 0;
+	cc_z = cc_r == 0;
+	cc_c = 0;
+	DIFPRE_NEXT(1);
+	}
+
+l_ldga:
+	regs[ip->dpi_rd] = dtrace_dif_variable(mstate, state,
+	    ip->dpi_r1, regs[ip->dpi_r2]);
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+l_ldgs:
+	regs[ip->dpi_rd] = dtrace_dif_ldgs(ip->dpi_imm, mstate, vstate, state);
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+l_ldts:
+	regs[ip->dpi_rd] = dtrace_dif_ldts(ip->dpi_imm, mstate, vstate);
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+l_stts:
+	dtrace_dif_stts(ip->dpi_imm, regs[ip->dpi_rd], mstate, vstate);
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+
+l_push:
+	if (dtrace_difpre_push(ip, regs, tupregs, &ttop) != 0)
+		goto tupoflow;
+	DIFPRE_NEXT(1);
+l_popts:
+	if (ttop != 0)
+		ttop--;
+	DIFPRE_NEXT(1);
+l_flushts:
+	ttop = 0;
+	DIFPRE_NEXT(1);
+l_call:
+	dtrace_dif_subr(ip->dpi_imm, ip->dpi_rd, regs, tupregs, ttop,
+	    mstate, state);
+	DIFPRE_CHECK(ip);
+	DIFPRE_NEXT(1);
+
+	/*
+	 * Superinstructions.
+	 */
+l_cmp_br:					/* cmp; bxx */
+	DIFPRE_CMP(ip);
+	ip++;
+	DIFPRE_BRANCH(ip, 1);
+l_tst_br:					/* tst; bxx */
+	cc_n = cc_c = 0;
+	cc_z = regs[ip->dpi_r1] == 0;
+	ip++;
+	DIFPRE_BRANCH(ip, 1);
+l_ldgs_setx_cmp_br:				/* ldgs; setx; cmp; bxx */
+	regs[ip->dpi_rd] = dtrace_dif_ldgs(ip->dpi_imm, mstate, vstate, state);
+	DIFPRE_CHECK(ip);
+	regs[ip[1].dpi_rd] = ip[1].dpi_imm;
+	DIFPRE_CMP(&ip[2]);
+	ip += 3;
+	DIFPRE_BRANCH(ip, 1);
+l_setx_ldga:					/* setx; ldga */
+	regs[ip->dpi_rd] = ip->dpi_imm;
+	ip++;
+	goto l_ldga;
+l_flushts_push_call:				/* flushts; pusht[rv]; call */
+	ttop = 0;
+	ip++;
+	/*FALLTHROUGH*/
+l_push_call:					/* pusht[rv]; call */
+	if (dtrace_difpre_push(ip, regs, tupregs, &ttop) != 0)
+		goto tupoflow;
+	ip++;
+	goto l_call;
+l_flushts_push:					/* flushts; pusht[rv] */
+	ttop = 0;
+	ip++;
+	goto l_push;
+
+divzero:
+	regs[ip->dpi_rd] = 0;
+	*flags |= CPU_DTRACE_DIVZERO;
+	DIFPRE_FAULT(ip);
+kpriv:
+	*flags |= CPU_DTRACE_KPRIV;
+	cpu_core[cpu_get_id()].cpuc_dtrace_illval = regs[ip->dpi_r1];
+	DIFPRE_FAULT(ip);
+tupoflow:
+	*flags |= CPU_DTRACE_TUPOFLOW;
+	DIFPRE_FAULT(ip);
+
+fault:
+	mstate->dtms_fltoffs = opc * sizeof (dif_instr_t);
+	mstate->dtms_present |= DTRACE_MSTATE_FLTOFFS;
+
+	return (0);
+
+#undef	DIFPRE_NEXT
+#undef	DIFPRE_JUMP
+#undef	DIFPRE_FAULT
+#undef	DIFPRE_CHECK
+#undef	DIFPRE_CMP
+#undef	DIFPRE_BRANCH
+}
+#endif
+
+/*
+ * Emulate the execution of DTrace IR instructions specified by the given
+ * DIF object.  This function is deliberately void of assertions as all of
+ * the necessary checks are handled by a call to dtrace_difo_validate().
+ */
+static uint64_t
+dtrace_dif_emulate(dtrace_difo_t *difo, dtrace_mstate_t *mstate,
+    dtrace_vstate_t *vstate, dtrace_state_t *state)
+{
+	const dif_instr_t *text = difo->dtdo_buf;
+	const uint_t textlen = difo->dtdo_len;
+	const char *strtab = difo->dtdo_strtab;
+	const uint64_t *inttab = difo->dtdo_inttab;
+
+	uint64_t rval = 0;
+	dtrace_statvar_t *svar;
+	dtrace_dstate_t *dstate = &vstate->dtvs_dynvars;
+	dtrace_difv_t *v;
+	volatile uint16_t *flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
+	volatile uintptr_t *illval = &cpu_core[cpu_get_id()].cpuc_dtrace_illval;
+
+	dtrace_key_t tupregs[DIF_DTR_NREGS + 2]; /* +2 for thread and id */
+	uint64_t regs[DIF_DIR_NREGS];
+	uint64_t *tmp;
+
+	uint8_t cc_n = 0, cc_z = 0, cc_v = 0, cc_c = 0;
+	int64_t cc_r;
+	uint_t pc = 0, id, opc = 0;
+	uint8_t ttop = 0;
+	dif_instr_t instr;
+	uint_t r1, r2, rd;
+
+HERE();
+#if linux
+	if (difo->dtdo_jit != NULL)
+		return (dtrace_difjit_exec(difo, mstate, vstate, state));
+	if (difo->dtdo_pre != NULL)
+		return (dtrace_dif_threaded(difo, mstate, vstate, state));
+#endif
+
+	/*
+	 * We stash the current DIF object into the machine state: we need it
+	 * for subsequent access checking.
+	 */
+	mstate->dtms_difo = difo;
+
+	regs[DIF_REG_R0] = 0; 		/* %r0 is fixed at zero */
+
+	while (pc < textlen && !(*flags & CPU_DTRACE_FAULT)) {
+		opc = pc;
+
+		instr = text[pc++];
+/*if (instr == 0x49010001) instr = 0x1e010001;*/
+		r1 = DIF_INSTR_R1(instr);
+		r2 = DIF_INSTR_R2(instr);
+		rd = DIF_INSTR_RD(instr);
+
+		switch (DIF_INSTR_OP(instr)) {
+		case DIF_OP_OR:
+PRINT_CASE(DIF_OP_OR);
+			regs[rd] = regs[r1] | regs[r2];
+			break;
+		case DIF_OP_XOR:
+PRINT_CASE(DIF_OP_XOR);
+			regs[rd] = regs[r1] ^ regs[r2];
+			break;
+		case DIF_OP_AND:
+PRINT_CASE(DIF_OP_AND);
+			regs[rd] = regs[r1] & regs[r2];
+			break;
+		case DIF_OP_SLL:
+PRINT_CASE(DIF_OP_SLL);
+			regs[rd] = regs[r1] << regs[r2];
+			break;
+		case DIF_OP_SRL:
 PRINT_CASE(DIF_OP_SRL);
 			regs[rd] = regs[r1] >> regs[r2];
 			break;
@@ -5404,38 +6640,8 @@ PRINT_CASE(DIF_OP_LDGA);
 			break;
 		case DIF_OP_LDGS:
 PRINT_CASE(DIF_OP_LDGS);
-			id = DIF_INSTR_VAR(instr);
-
-			if (id >= DIF_VAR_OTHER_UBASE) {
-				uintptr_t a;
-HERE();
-				id -= DIF_VAR_OTHER_UBASE;
-				svar = vstate->dtvs_globals[id];
-				ASSERT(svar != NULL);
-				v = &svar->dtsv_var;
-
-				if (!(v->dtdv_type.dtdt_flags & DIF_TF_BYREF)) {
-					regs[rd] = svar->dtsv_data;
-					break;
-				}
-
-				a = (uintptr_t)svar->dtsv_data;
-
-				if (*(uint8_t *)a == UINT8_MAX) {
-					/*
-					 * If the 0th byte is set to UINT8_MAX
-					 * then this is to be treated as a
-					 * reference to a NULL variable.
-					 */
-					regs[rd] = NULL;
-				} else {
-					regs[rd] = a + sizeof (uint64_t);
-				}
-
-				break;
-			}
-
-			regs[rd] = dtrace_dif_variable(mstate, state, id, 0);
+			regs[rd] = dtrace_dif_ldgs(DIF_INSTR_VAR(instr),
+			    mstate, vstate, state);
 			break;
 
 		case DIF_OP_STGS:
@@ -5577,87 +6783,17 @@ PRINT_CASE(DIF_OP_STLS);
 			tmp[cpu_get_id()] = regs[rd];
 			break;
 
-		case DIF_OP_LDTS: {
-			dtrace_dynvar_t *dvar;
-			dtrace_key_t *key;
-
+		case DIF_OP_LDTS:
 PRINT_CASE(DIF_OP_LDTS);
-			id = DIF_INSTR_VAR(instr);
-			ASSERT(id >= DIF_VAR_OTHER_UBASE);
-			id -= DIF_VAR_OTHER_UBASE;
-			v = &vstate->dtvs_tlocals[id];
-
-			key = &tupregs[DIF_DTR_NREGS];
-			key[0].dttk_value = (uint64_t)id;
-			key[0].dttk_size = 0;
-			DTRACE_TLS_THRKEY(key[1].dttk_value);
-			key[1].dttk_size = 0;
-
-			dvar = dtrace_dynvar(dstate, 2, key,
-			    sizeof (uint64_t), DTRACE_DYNVAR_NOALLOC,
+			regs[rd] = dtrace_dif_ldts(DIF_INSTR_VAR(instr),
 			    mstate, vstate);
-
-			if (dvar == NULL) {
-HERE();
-				regs[rd] = 0;
-				break;
-			}
-HERE();
-
-			if (v->dtdv_type.dtdt_flags & DIF_TF_BYREF) {
-				regs[rd] = (uint64_t)(uintptr_t)dvar->dtdv_data;
-			} else {
-				regs[rd] = *((uint64_t *)dvar->dtdv_data);
-			}
-
 			break;
-		}
-
-		case DIF_OP_STTS: {
-			dtrace_dynvar_t *dvar;
-			dtrace_key_t *key;
 
+		case DIF_OP_STTS:
 PRINT_CASE(DIF_OP_STTS);
-			id = DIF_INSTR_VAR(instr);
-			ASSERT(id >= DIF_VAR_OTHER_UBASE);
-			id -= DIF_VAR_OTHER_UBASE;
-
-			key = &tupregs[DIF_DTR_NREGS];
-			key[0].dttk_value = (uint64_t)id;
-			key[0].dttk_size = 0;
-			DTRACE_TLS_THRKEY(key[1].dttk_value);
-			key[1].dttk_size = 0;
-			v = &vstate->dtvs_tlocals[id];
-
-			dvar = dtrace_dynvar(dstate, 2, key,
-			    v->dtdv_type.dtdt_size > sizeof (uint64_t) ?
-			    v->dtdv_type.dtdt_size : sizeof (uint64_t),
-			    regs[rd] ? DTRACE_DYNVAR_ALLOC :
-			    DTRACE_DYNVAR_DEALLOC, mstate, vstate);
-//printk("dvar=%p\n", dvar);
-			/*
-			 * Given that we're storing to thread-local data,
-			 * we need to flush our predicate cache.
-			 */
-			curthread->t_predcache = NULL;
-
-			if (dvar == NULL)
-				break;
-
-			if (v->dtdv_type.dtdt_flags & DIF_TF_BYREF) {
-				if (!dtrace_vcanload(
-				    (void *)(uintptr_t)regs[rd],
-				    &v->dtdv_type, mstate, vstate))
-					break;
-
-				dtrace_vcopy((void *)(uintptr_t)regs[rd],
-				    dvar->dtdv_data, &v->dtdv_type);
-			} else {
-				*((uint64_t *)dvar->dtdv_data) = regs[rd];
-			}
-
+			dtrace_dif_stts(DIF_INSTR_VAR(instr), regs[rd],
+			    mstate, vstate);
 			break;
-		}
 
 		case DIF_OP_SRA:
 PRINT_CASE(DIF_OP_SRA);
@@ -5927,6 +7063,19 @@ HERE();
 	return (0);
 }
 
+#if linux
+/*
+ * Entry point for the DIF JIT self-test, which runs the same DIF objects
+ * with and without native code and compares the results.
+ */
+uint64_t
+dtrace_dif_run(dtrace_difo_t *difo, dtrace_mstate_t *mstate,
+    dtrace_vstate_t *vstate, dtrace_state_t *state)
+{
+	return (dtrace_dif_emulate(difo, mstate, vstate, state));
+}
+#endif
+
 static void
 dtrace_action_breakpoint(dtrace_ecb_t *ecb)
 {
@@ -6223,6 +7372,254 @@ out:
 	TODO_END();
 }
 
+#if linux
+/*
+ * Linux:  stack ID table (see dtrace_stacktab_t).  A stack(), ustack() or
+ * jstack() record with DTRACE_STACKID set is built in scratch space rather
+ * than in the principal buffer; dtrace_stackid_end() then looks it up in the
+ * consumer's stack table, adding it if need be, and stores only its ID in the
+ * buffer.  The table is append-only and lock-free:  entries are carved out of
+ * the arena with a compare-and-swap on dst_alloc, filled in, marked ready and
+ * then pushed onto the head of their hash chain.  If two CPUs race to add the
+ * same stack, the loser marks its own entry dead and uses the winner's ID.
+ */
+unsigned long long cnt_stackid_hit;
+unsigned long long cnt_stackid_new;
+
+/*
+ * Size of the stack record which a DTRACE_STACKID record stands for.
+ */
+static uint32_t
+dtrace_stackid_size(dtrace_recdesc_t *rec)
+{
+	uint32_t nframes = DTRACE_USTACK_NFRAMES(rec->dtrd_arg);
+	uint32_t size;
+
+	if (rec->dtrd_action == DTRACEACT_STACK)
+		return (nframes * sizeof (pc_t));
+
+	size = (nframes + 1) * sizeof (uint64_t);
+	size += DTRACE_USTACK_STRSIZE(rec->dtrd_arg);
+	return (P2ROUNDUP(size, (uint32_t)(sizeof (uintptr_t))));
+}
+
+static dtrace_stackent_t *
+dtrace_stackid_ent(dtrace_stacktab_t *tab, uint32_t id)
+{
+	return ((dtrace_stackent_t *)(tab->dst_base +
+	    DTRACE_STACKID_OFFSET(id)));
+}
+
+static uint32_t
+dtrace_stackid_hash(const uint32_t *stk, uint32_t size)
+{
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	for (i = 0; i < size / sizeof (uint32_t); i++) {
+		hash ^= stk[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+/*
+ * Search a hash chain from stack ID id up to (but not including) stop.
+ */
+static uint32_t
+dtrace_stackid_find(dtrace_stacktab_t *tab, uint32_t id, uint32_t stop,
+    uint32_t hash, const void *stk, uint32_t size)
+{
+	dtrace_stackent_t *ent;
+
+	for (; id != 0 && id != stop; id = ent->dse_next) {
+		ent = dtrace_stackid_ent(tab, id);
+
+		if (ent->dse_hash == hash && ent->dse_size == size &&
+		    dtrace_bcmp(ent + 1, stk, size) == 0)
+			return (id);
+	}
+
+	return (0);
+}
+
+/*
+ * Return the stack ID of the stack record stk, adding it to the table if it
+ * is not already there; returns 0 (and counts a drop) if the table is full.
+ */
+static uint32_t
+dtrace_stackid_insert(dtrace_state_t *state, const void *stk, uint32_t size)
+{
+	dtrace_stacktab_t *tab = &state->dts_stacktab;
+	uint32_t esize = DTRACE_STACKENT_SIZE(size);
+	uint32_t hash, head, nhead, id, found, offs, noffs;
+	uint32_t *bucket;
+	dtrace_stackent_t *ent;
+
+	if (tab->dst_base == NULL) {
+		dtrace_error(&state->dts_stackid_drops);
+		return (0);
+	}
+
+	hash = dtrace_stackid_hash(stk, size);
+	bucket = &tab->dst_hash[hash & tab->dst_hashmask];
+	head = *bucket;
+
+	if ((id = dtrace_stackid_find(tab, head, 0, hash, stk, size)) != 0) {
+		cnt_stackid_hit++;
+		return (id);
+	}
+
+	do {
+		offs = tab->dst_alloc;
+		noffs = offs + esize;
+
+		if (noffs > tab->dst_size || noffs < offs) {
+			dtrace_error(&state->dts_stackid_drops);
+			return (0);
+		}
+	} while (dtrace_cas32((uint32_t *)&tab->dst_alloc,
+	    offs, noffs) != offs);
+
+	id = DTRACE_STACKID_FROMOFFSET(offs);
+	ent = dtrace_stackid_ent(tab, id);
+	ent->dse_hash = hash;
+	ent->dse_size = size;
+	ent->dse_next = head;
+	dtrace_bcopy(stk, ent + 1, size);
+
+	/*
+	 * The entry must be complete before it can be found:  once it is on
+	 * the chain, another CPU may record its ID, and the consumer must
+	 * then be able to read it back with DTRACEIOC_STACKIDS.
+	 */
+	ent->dse_flags = DTRACE_STACKENT_READY;
+
+	for (;;) {
+		dtrace_membar_producer();
+
+		if ((nhead = dtrace_cas32(bucket, head, id)) == head)
+			break;
+
+		/*
+		 * Somebody else got onto this chain first, and may have added
+		 * this very stack; only the new part of the chain need be
+		 * searched.
+		 */
+		found = dtrace_stackid_find(tab, nhead, head, hash, stk, size);
+
+		if (found != 0) {
+			ent->dse_flags = DTRACE_STACKENT_READY |
+			    DTRACE_STACKENT_DEAD;
+			cnt_stackid_hit++;
+			return (found);
+		}
+
+		ent->dse_next = head = nhead;
+	}
+
+	cnt_stackid_new++;
+	return (id);
+}
+
+/*
+ * Return where a stack record should be built:  the buffer itself, or (for a
+ * DTRACE_STACKID record) a zeroed, aligned scratch area, which is released
+ * by dtrace_stackid_end().  Returns NULL if we are out of scratch space.
+ */
+static caddr_t
+dtrace_stackid_scratch(dtrace_mstate_t *mstate, dtrace_recdesc_t *rec,
+    caddr_t dest)
+{
+	uintptr_t stk;
+	uint32_t size;
+
+	if (!DTRACE_STACKID_ISSET(rec->dtrd_arg))
+		return (dest);
+
+	stk = P2ROUNDUP(mstate->dtms_scratch_ptr, 8);
+	size = dtrace_stackid_size(rec);
+
+	if (!DTRACE_INSCRATCH(mstate, stk - mstate->dtms_scratch_ptr + size)) {
+		DTRACE_CPUFLAG_SET(CPU_DTRACE_NOSCRATCH);
+		return (NULL);
+	}
+
+	dtrace_bzero((void *)stk, size);
+	mstate->dtms_scratch_ptr = stk + size;
+
+	return ((caddr_t)stk);
+}
+
+static void
+dtrace_stackid_end(dtrace_mstate_t *mstate, dtrace_state_t *state,
+    dtrace_recdesc_t *rec, caddr_t dest, caddr_t stk)
+{
+	uint16_t *flags = &cpu_core[cpu_get_id()].cpuc_dtrace_flags;
+	uint32_t id = 0;
+
+	if (stk == dest)
+		return;
+
+	if (!(*flags & CPU_DTRACE_ERROR))
+		id = dtrace_stackid_insert(state, stk, dtrace_stackid_size(rec));
+
+	*(uint32_t *)dest = id;
+	mstate->dtms_scratch_ptr = (uintptr_t)stk;
+}
+
+/*
+ * Set up the stack table of a consumer which is about to go.  If we cannot
+ * allocate it, every stack is counted as a drop.
+ */
+static void
+dtrace_stackid_init(dtrace_state_t *state)
+{
+	dtrace_stacktab_t *tab = &state->dts_stacktab;
+	dtrace_optval_t size = state->dts_options[DTRACEOPT_STACKIDSIZE];
+	uint32_t nbuckets = 1;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (size == DTRACEOPT_UNSET || size == 0)
+		return;
+
+	ASSERT(size <= DTRACE_STACKTAB_MAX);
+
+	while (nbuckets < size / 256)
+		nbuckets <<= 1;
+
+	tab->dst_hash = kmem_zalloc(nbuckets * sizeof (uint32_t), KM_NOSLEEP);
+	tab->dst_base = kmem_zalloc(size, KM_NOSLEEP);
+
+	if (tab->dst_hash == NULL || tab->dst_base == NULL) {
+		if (tab->dst_hash != NULL)
+			kmem_free(tab->dst_hash, nbuckets * sizeof (uint32_t));
+		if (tab->dst_base != NULL)
+			kmem_free(tab->dst_base, size);
+		bzero(tab, sizeof (dtrace_stacktab_t));
+		return;
+	}
+
+	tab->dst_hashmask = nbuckets - 1;
+	tab->dst_size = size;
+}
+
+static void
+dtrace_stackid_fini(dtrace_state_t *state)
+{
+	dtrace_stacktab_t *tab = &state->dts_stacktab;
+
+	if (tab->dst_base == NULL)
+		return;
+
+	kmem_free(tab->dst_hash, (tab->dst_hashmask + 1) * sizeof (uint32_t));
+	kmem_free(tab->dst_base, tab->dst_size);
+	bzero(tab, sizeof (dtrace_stacktab_t));
+}
+#endif
+
 #if linux
 /**********************************************************************/
 /*   The following is a locking wrapper around dtrace_probe. We need  */
@@ -6374,6 +7771,60 @@ dtrace_probe(dtrace_id_t id, uintptr_t arg0, uintptr_t arg1,
 }
 #define dtrace_probe __dtrace_probe
 #endif
+
+#if linux
+/*
+ * Called from dtrace_probe(), with interrupts disabled, to decide whether
+ * this CPU's firing of the ECB should be processed at all.  The bucket is
+ * refilled from the time since the last firing, capped at a second, so that
+ * the arithmetic can't overflow and no division is needed here.
+ */
+static int
+dtrace_ecb_sample(dtrace_ecb_t *ecb, dtrace_ecbsample_t *sm, hrtime_t now)
+{
+	uint64_t x, rate, tokens, cap, fill;
+	hrtime_t elapsed;
+
+	if (ecb->dte_samplethresh != 0) {
+		x = sm->dtsm_rand;
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sm->dtsm_rand = x;
+
+		if (x > ecb->dte_samplethresh) {
+			sm->dtsm_sampled++;
+			return (0);
+		}
+	}
+
+	if ((rate = ecb->dte_ratelimit) != 0) {
+		elapsed = now - sm->dtsm_refill;
+
+		if (elapsed < 0)
+			elapsed = 0;
+		else if (elapsed > NANOSEC)
+			elapsed = NANOSEC;
+
+		sm->dtsm_refill = now;
+		cap = rate * NANOSEC;
+		fill = elapsed * rate;
+		tokens = sm->dtsm_tokens;
+		tokens = fill >= cap - tokens ? cap : tokens + fill;
+
+		if (tokens < NANOSEC) {
+			sm->dtsm_tokens = tokens;
+			sm->dtsm_limited++;
+			return (0);
+		}
+
+		sm->dtsm_tokens = tokens - NANOSEC;
+	}
+
+	return (1);
+}
+#endif
+
 /*
  * If you're looking for the epicenter of DTrace, you just found it.  This
  * is the function called by the provider to fire a probe -- from which all
@@ -6395,6 +7846,10 @@ dtrace_probe(dtrace_id_t id, uintptr_t arg0, uintptr_t arg1,
 	int vtime, onintr;
 	volatile uint16_t *flags;
 	hrtime_t now;
+#if linux
+	dtrace_ecbperf_t *perf = NULL;
+	uint64_t perfstart = 0, perfnow;
+#endif
 
 //dtrace_printf("dtrace_probe(%d)\n", __LINE__);
 	cnt_probes++;
@@ -6473,6 +7928,9 @@ dtrace_probe(dtrace_id_t id, uintptr_t arg0, uintptr_t arg1,
 		uint64_t tracememsize = 0;
 		int committed = 0;
 		caddr_t tomax;
+#if linux
+		caddr_t stk;
+#endif
 
 		/*
 		 * A little subtlety with the following (seemingly innocuous)
@@ -6529,9 +7987,38 @@ dtrace_probe(dtrace_id_t id, uintptr_t arg0, uintptr_t arg1,
 			}
 		}
 
+#if linux
+		/*
+		 * Probe effect accounting:  the cycle counter read which ends
+		 * the previous ECB's charge starts this one's.
+		 */
+		if (perf != NULL || ecb->dte_perf != NULL) {
+			perfnow = get_cycles();
+
+			if (perf != NULL)
+				perf->dtep_cycles += perfnow - perfstart;
+
+			if ((perf = ecb->dte_perf) != NULL) {
+				perf = &perf[cpuid];
+				perf->dtep_fires++;
+				perfstart = perfnow;
+			}
+		}
+#endif
+
 		if (ecb->dte_cond && !dtrace_priv_probe(state, &mstate, ecb))
 			continue;
 
+#if linux
+		/*
+		 * sample() and ratelimit() pass over a firing before any
+		 * buffer space is reserved or the predicate is evaluated.
+		 */
+		if (ecb->dte_sample != NULL &&
+		    !dtrace_ecb_sample(ecb, &ecb->dte_sample[cpuid], now))
+			continue;
+#endif
+
 HERE();
 		if (now - state->dts_alive > dtrace_deadman_timeout) {
 			/*
@@ -6560,8 +8047,13 @@ HERE();
 
 
 		if ((offs = dtrace_buffer_reserve(buf, ecb->dte_needed,
-		    ecb->dte_alignment, state, &mstate)) < 0)
+		    ecb->dte_alignment, state, &mstate)) < 0) {
+#if linux
+			if (perf != NULL)
+				perf->dtep_drops++;
+#endif
 			continue;
+		}
 
 		tomax = buf->dtb_tomax;
 		ASSERT(tomax != NULL);
@@ -6649,6 +8141,13 @@ printk("rdpmc(%p)=%p\n", (void *) arg0, (void *) val);
 			case DTRACEACT_TEST2:
 PRINT_CASE("DTRACEACT_TEST2");
 				continue;
+
+			case DTRACEACT_SAMPLE:
+			case DTRACEACT_RATELIMIT:
+				/*
+				 * Already applied, before the predicate.
+				 */
+				continue;
 #endif
 
 			case DTRACEACT_STOP:
@@ -6675,10 +8174,25 @@ PRINT_CASE(DTRACEACT_STACK);
 				if (!dtrace_priv_kernel(state))
 					continue;
 
+#if linux
+				if ((stk = dtrace_stackid_scratch(&mstate, rec,
+				    tomax + valoffs)) == NULL)
+					continue;
+
+				dtrace_getpcstack((pc_t *)stk,
+				    DTRACE_USTACK_NFRAMES(rec->dtrd_arg),
+				    probe->dtpr_aframes,
+				    DTRACE_ANCHORED(probe) ? NULL :
+				    (uint32_t *)arg0);
+
+				dtrace_stackid_end(&mstate, state, rec,
+				    tomax + valoffs, stk);
+#else
 				dtrace_getpcstack((pc_t *)(tomax + valoffs),
 				    size / sizeof (pc_t), probe->dtpr_aframes,
 				    DTRACE_ANCHORED(probe) ? NULL :
 				    (uint32_t *)arg0);
+#endif
 
 				continue;
 
@@ -6688,6 +8202,40 @@ PRINT_CASE(DTRACEACT_JSTACK/DTRACEACT_USTACK);
 				if (!dtrace_priv_proc(state, &mstate))
 					continue;
 
+#if linux
+				/*
+				 * Linux:  build the stack where it belongs
+				 * (see dtrace_stackid_scratch()), then hand it
+				 * to dtrace_stackid_end().
+				 */
+				if ((stk = dtrace_stackid_scratch(&mstate, rec,
+				    tomax + valoffs)) == NULL)
+					continue;
+
+				if (DTRACE_ANCHORED(mstate.dtms_probe) &&
+				    CPU_ON_INTR(CPU)) {
+					int depth = DTRACE_USTACK_NFRAMES(
+					    rec->dtrd_arg) + 1;
+
+					dtrace_bzero((void *)stk,
+					    DTRACE_USTACK_STRSIZE(rec->dtrd_arg)
+					    + depth * sizeof (uint64_t));
+				} else if (DTRACE_USTACK_STRSIZE(
+				    rec->dtrd_arg) != 0 &&
+				    curproc->p_dtrace_helpers != NULL) {
+					dtrace_action_ustack(&mstate, state,
+					    (uint64_t *)stk, rec->dtrd_arg);
+				} else {
+					DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
+					dtrace_getupcstack((uint64_t *)stk,
+					    DTRACE_USTACK_NFRAMES(
+					    rec->dtrd_arg) + 1);
+					DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT);
+				}
+
+				dtrace_stackid_end(&mstate, state, rec,
+				    tomax + valoffs, stk);
+#else
 				/*
 				 * See comment in DIF_VAR_PID.
 				 */
@@ -6724,6 +8272,7 @@ HERE();
 				    (tomax + valoffs),
 				    DTRACE_USTACK_NFRAMES(rec->dtrd_arg) + 1);
 				DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT);
+#endif
 				continue;
 
 			default:
@@ -6959,14 +8508,22 @@ HERE();
 		}
 HERE();
 
-		if (*flags & CPU_DTRACE_DROP)
+		if (*flags & CPU_DTRACE_DROP) {
+#if linux
+			if (perf != NULL)
+				perf->dtep_drops++;
+#endif
 			continue;
+		}
 
 		if (*flags & CPU_DTRACE_FAULT) {
 			int ndx;
 			dtrace_action_t *err;
 
 			buf->dtb_errors++;
+#if linux
+			dtrace_buffer_wakeup(buf, state);
+#endif
 
 			if (probe->dtpr_id == dtrace_probeid_error) {
 				/*
@@ -7013,9 +8570,21 @@ HERE();
 
 		if (!committed)
 			buf->dtb_offset = offs + ecb->dte_size;
+
+#if linux
+		dtrace_buffer_publish(buf);
+
+		if (perf != NULL)
+			perf->dtep_bytes += ecb->dte_size;
+#endif
 	}
 HERE();
 
+#if linux
+	if (perf != NULL)
+		perf->dtep_cycles += get_cycles() - perfstart;
+#endif
+
 	if (vtime)
 		curthread->t_dtrace_start = dtrace_gethrtime();
 
@@ -7875,6 +9444,54 @@ dtrace_register(const char *name, const dtrace_pattr_t *pap, uint32_t priv,
 	return (0);
 }
 
+# if linux
+/*
+ * Probe IDs are handed out lowest-first, so once a large provider (e.g. a
+ * pid or USDT provider for an exited process) has gone away the top of the
+ * probe array is empty.  Shrink the array by halves while at most a quarter
+ * of it is in use, so that it doesn't stay at its high-water mark forever.
+ * The ordering mirrors the growth path in dtrace_probe_create():  the
+ * smaller dtrace_nprobes is made visible before the array is swapped, and
+ * the old array is only freed once every CPU has been through a
+ * dtrace_sync().
+ */
+static void
+dtrace_probes_compact(void)
+{
+	dtrace_probe_t **probes, **oprobes = dtrace_probes;
+	int nprobes = dtrace_nprobes;
+	size_t osize = dtrace_nprobes * sizeof (dtrace_probe_t *);
+	uintptr_t max;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (oprobes == NULL)
+		return;
+
+	max = vmem_maxid(dtrace_arena);
+
+	while (nprobes > 1 && max <= nprobes / 4)
+		nprobes >>= 1;
+
+	if (nprobes == dtrace_nprobes)
+		return;
+
+	probes = kmem_zalloc(nprobes * sizeof (dtrace_probe_t *), KM_SLEEP);
+	bcopy(oprobes, probes, nprobes * sizeof (dtrace_probe_t *));
+
+	dtrace_printf("dtrace_probes_compact: %d -> %d (max id %lu)\n",
+	    dtrace_nprobes, nprobes, (unsigned long)max);
+
+	dtrace_nprobes = nprobes;
+	dtrace_membar_producer();
+	dtrace_probes = probes;
+
+	dtrace_sync();
+
+	kmem_free(oprobes, osize);
+}
+# endif
+
 /*
  * Unregister the specified provider from the DTrace framework.  This should
  * generally be called by DTrace providers in their detach(9E) entry point.
@@ -8012,7 +9629,8 @@ HERE();
 		kmem_free(probe->dtpr_func, strlen(probe->dtpr_func) + 1);
 		kmem_free(probe->dtpr_name, strlen(probe->dtpr_name) + 1);
 		vmem_free(dtrace_arena, (void *)(uintptr_t)(probe->dtpr_id), 1);
-		kmem_free(probe, sizeof (dtrace_probe_t));
+		dtrace_obj_free(dtrace_probe_kmc, probe,
+		    sizeof (dtrace_probe_t));
 	}
 
 	if ((prev = dtrace_provider) == old) {
@@ -8031,6 +9649,10 @@ HERE();
 		prev->dtpv_next = old->dtpv_next;
 	}
 
+# if linux
+	dtrace_probes_compact();
+# endif
+
 	if (!self) {
 		dmutex_exit(&dtrace_lock);
 		dmutex_exit(&mod_lock);
@@ -8123,10 +9745,15 @@ dtrace_condense(dtrace_provider_id_t id)
 		kmem_free(probe->dtpr_mod, strlen(probe->dtpr_mod) + 1);
 		kmem_free(probe->dtpr_func, strlen(probe->dtpr_func) + 1);
 		kmem_free(probe->dtpr_name, strlen(probe->dtpr_name) + 1);
-		kmem_free(probe, sizeof (dtrace_probe_t));
+		dtrace_obj_free(dtrace_probe_kmc, probe,
+		    sizeof (dtrace_probe_t));
 		vmem_free(dtrace_arena, (void *)((uintptr_t)i + 1), 1);
 	}
 
+# if linux
+	dtrace_probes_compact();
+# endif
+
 	dmutex_exit(&dtrace_lock);
 	dmutex_exit(&dtrace_provider_lock);
 
@@ -8165,7 +9792,7 @@ dtrace_probe_create(dtrace_provider_id_t prov, const char *mod,
 	id = (dtrace_id_t)(uintptr_t)vmem_alloc(dtrace_arena, 1,
 	    VM_BESTFIT | VM_SLEEP);
 
-	probe = kmem_zalloc(sizeof (dtrace_probe_t), KM_SLEEP);
+	probe = dtrace_obj_zalloc(dtrace_probe_kmc, sizeof (dtrace_probe_t));
 	if (probe == NULL) {
 		printk("dtrace_probe_create: Cannot alloc sizeof(dtrace_probe_t) %d\n", (int) sizeof(dtrace_probe_t));
 		return 0;
@@ -8350,6 +9977,14 @@ dtrace_probe_provide(dtrace_probedesc_t *desc, dtrace_provider_t *prv)
                 prv = dtrace_provider;
         }
 
+	/***********************************************/
+	/*   Providing  fbt:::  creates  a probe and  */
+	/*   an  fbt_probe_t  per  kernel  function;  */
+	/*   take them from the object caches in bulk  */
+	/*   as dtrace_enabling_match() does.	       */
+	/***********************************************/
+	dtrace_kmc_bulk_begin();
+
 	/***********************************************/
 	/*   Let  fbt provide all syms in the kernel.  */
 	/*   Code below handles the modules.	       */
@@ -8406,6 +10041,7 @@ dtrace_probe_provide(dtrace_probedesc_t *desc, dtrace_provider_t *prv)
 # endif
 		dmutex_exit(&mod_lock);
 	} while (all && (prv = prv->dtpv_next) != NULL);
+	dtrace_kmc_bulk_end();
 //HERE();
 }
 
@@ -9583,6 +11219,135 @@ dtrace_difo_chunksize(dtrace_difo_t *dp, dtrace_vstate_t *vstate)
 	}
 }
 
+#if linux
+/*
+ * Build the pre-decoded form of a DIF object for dtrace_dif_threaded(), if
+ * every instruction in it is one the threaded interpreter handles.  The DIF
+ * object has been validated, so operands and branch targets are in range.
+ */
+static int
+dtrace_difpre_isbranch(uint_t op)
+{
+	return (op >= DIF_OP_BA && op <= DIF_OP_BLEU);
+}
+
+static int
+dtrace_difpre_ispush(uint_t op)
+{
+	return (op == DIF_OP_PUSHTR || op == DIF_OP_PUSHTV);
+}
+
+void
+dtrace_difo_predecode(dtrace_difo_t *dp)
+{
+	const void *const *labels;
+	dtrace_difpre_t *pre, *ip;
+	uint_t pc, len = dp->dtdo_len;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (dp->dtdo_pre != NULL)
+		return;
+
+	if ((labels = dtrace_difpre_labels) == NULL) {
+		(void) dtrace_dif_threaded(NULL, NULL, NULL, NULL);
+		labels = dtrace_difpre_labels;
+	}
+
+	for (pc = 0; pc < len; pc++) {
+		uint_t op = DIF_INSTR_OP(dp->dtdo_buf[pc]);
+
+		if (op >= DIFPRE_END || labels[op] == NULL)
+			return;
+	}
+
+	pre = kmem_zalloc((len + 1) * sizeof (dtrace_difpre_t), KM_SLEEP);
+
+	for (pc = 0; pc < len; pc++) {
+		dif_instr_t instr = dp->dtdo_buf[pc];
+		uint_t op = DIF_INSTR_OP(instr);
+
+		ip = &pre[pc];
+		ip->dpi_label = labels[op];
+		ip->dpi_op = op;
+		ip->dpi_r1 = DIF_INSTR_R1(instr);
+		ip->dpi_r2 = DIF_INSTR_R2(instr);
+		ip->dpi_rd = DIF_INSTR_RD(instr);
+
+		switch (op) {
+		case DIF_OP_SETX:
+			ip->dpi_imm = dp->dtdo_inttab[DIF_INSTR_INTEGER(instr)];
+			break;
+		case DIF_OP_SETS:
+			ip->dpi_imm = (uint64_t)(uintptr_t)
+			    (dp->dtdo_strtab + DIF_INSTR_STRING(instr));
+			break;
+		case DIF_OP_LDGS:
+		case DIF_OP_LDTS:
+		case DIF_OP_STTS:
+			ip->dpi_imm = DIF_INSTR_VAR(instr);
+			break;
+		case DIF_OP_CALL:
+			ip->dpi_imm = DIF_INSTR_SUBR(instr);
+			break;
+		default:
+			if (dtrace_difpre_isbranch(op))
+				ip->dpi_imm = DIF_INSTR_LABEL(instr);
+			break;
+		}
+	}
+
+	pre[len].dpi_label = labels[DIFPRE_END];
+
+	/*
+	 * Superinstructions.  These are the sequences the D compiler emits
+	 * for comparisons in predicates, args[] and subroutine calls.
+	 */
+	for (pc = 0; pc < len; pc++) {
+		uint_t n = len - pc;
+		uint_t op0 = pre[pc].dpi_op;
+		uint_t op1 = n > 1 ? pre[pc + 1].dpi_op : 0;
+		uint_t op2 = n > 2 ? pre[pc + 2].dpi_op : 0;
+		uint_t op3 = n > 3 ? pre[pc + 3].dpi_op : 0;
+		int si = 0;
+
+		if (op0 == DIF_OP_LDGS && op1 == DIF_OP_SETX &&
+		    op2 == DIF_OP_CMP && dtrace_difpre_isbranch(op3))
+			si = DIFPRE_LDGS_SETX_CMP_BR;
+		else if (op0 == DIF_OP_CMP && dtrace_difpre_isbranch(op1))
+			si = DIFPRE_CMP_BR;
+		else if (op0 == DIF_OP_TST && dtrace_difpre_isbranch(op1))
+			si = DIFPRE_TST_BR;
+		else if (op0 == DIF_OP_SETX && op1 == DIF_OP_LDGA)
+			si = DIFPRE_SETX_LDGA;
+		else if (op0 == DIF_OP_FLUSHTS && dtrace_difpre_ispush(op1))
+			si = op2 == DIF_OP_CALL ? DIFPRE_FLUSHTS_PUSH_CALL :
+			    DIFPRE_FLUSHTS_PUSH;
+		else if (dtrace_difpre_ispush(op0) && op1 == DIF_OP_CALL)
+			si = DIFPRE_PUSH_CALL;
+
+		if (si != 0) {
+			pre[pc].dpi_label = labels[si];
+			cnt_dif_fused++;
+		}
+	}
+
+	dtrace_membar_producer();
+	dp->dtdo_pre = pre;
+	cnt_dif_predecoded++;
+}
+
+void
+dtrace_difo_predecode_free(dtrace_difo_t *dp)
+{
+	if (dp->dtdo_pre == NULL)
+		return;
+
+	kmem_free(dp->dtdo_pre, (dp->dtdo_len + 1) * sizeof (dtrace_difpre_t));
+	dp->dtdo_pre = NULL;
+}
+#endif
+
 static void
 dtrace_difo_init(dtrace_difo_t *dp, dtrace_vstate_t *vstate)
 {
@@ -9693,6 +11458,9 @@ dtrace_difo_init(dtrace_difo_t *dp, dtrace_vstate_t *vstate)
 	}
 
 	dtrace_difo_chunksize(dp, vstate);
+#if linux
+	dtrace_difo_predecode(dp);
+#endif
 	dtrace_difo_hold(dp);
 }
 
@@ -9795,6 +11563,10 @@ dtrace_difo_destroy(dtrace_difo_t *dp, dtrace_vstate_t *vstate)
 		svarp[id] = NULL;
 	}
 
+#if linux
+	dtrace_difjit_free(dp);
+	dtrace_difo_predecode_free(dp);
+#endif
 	kmem_free(dp->dtdo_buf, dp->dtdo_len * sizeof (dif_instr_t));
 	kmem_free(dp->dtdo_inttab, dp->dtdo_intlen * sizeof (uint64_t));
 	kmem_free(dp->dtdo_strtab, dp->dtdo_strlen);
@@ -10040,7 +11812,7 @@ dtrace_ecb_add(dtrace_state_t *state, dtrace_probe_t *probe)
 
 	ASSERT(MUTEX_HELD(&dtrace_lock));
 
-	ecb = kmem_zalloc(sizeof (dtrace_ecb_t), KM_SLEEP);
+	ecb = dtrace_obj_zalloc(dtrace_ecb_kmc, sizeof (dtrace_ecb_t));
 	ecb->dte_predicate = NULL;
 	ecb->dte_probe = probe;
 
@@ -10570,11 +12342,19 @@ PRINT_CASE("DTRACEACT_LIBACT/TRACEMEM/TRACEMEM_DYNSIZE");
 
 		case DTRACEACT_STACK:
 PRINT_CASE("DTRACEACT_STACK");
+#if linux
+			if ((nframes = DTRACE_USTACK_NFRAMES(arg)) == 0) {
+				nframes = opt[DTRACEOPT_STACKFRAMES];
+				ASSERT(nframes > 0);
+				arg |= nframes;
+			}
+#else
 			if ((nframes = arg) == 0) {
 				nframes = opt[DTRACEOPT_STACKFRAMES];
 				ASSERT(nframes > 0);
 				arg = nframes;
 			}
+#endif
 
 			size = nframes * sizeof (pc_t);
 			break;
@@ -10587,7 +12367,12 @@ PRINT_CASE("DTRACEACT_JSTACK");
 			if ((nframes = DTRACE_USTACK_NFRAMES(arg)) == 0)
 				nframes = opt[DTRACEOPT_JSTACKFRAMES];
 
+#if linux
+			arg = DTRACE_USTACK_ARG(nframes, strsize) |
+			    (arg & DTRACE_STACKID);
+#else
 			arg = DTRACE_USTACK_ARG(nframes, strsize);
+#endif
 
 			/*FALLTHROUGH*/
 		case DTRACEACT_USTACK:
@@ -10599,7 +12384,12 @@ HERE();
 				nframes = opt[DTRACEOPT_USTACKFRAMES];
 //printk("strsize=%d nframes=%d\n", (int) strsize, (int) nframes);
 				ASSERT(nframes > 0);
+#if linux
+				arg = DTRACE_USTACK_ARG(nframes, strsize) |
+				    (arg & DTRACE_STACKID);
+#else
 				arg = DTRACE_USTACK_ARG(nframes, strsize);
+#endif
 			}
 
 			/*
@@ -10684,6 +12474,28 @@ PRINT_CASE("DTRACEACT_COMMIT");
 		}
 
 #if linux
+		case DTRACEACT_SAMPLE:
+		case DTRACEACT_RATELIMIT: {
+			dtrace_action_t *act;
+
+			if (arg == 0 || dp != NULL)
+				RETURN(EINVAL);
+
+			if (desc->dtad_kind == DTRACEACT_RATELIMIT &&
+			    arg > UINT64_MAX / NANOSEC)
+				RETURN(EINVAL);
+
+			/*
+			 * There is one filter of each kind per ECB.
+			 */
+			for (act = ecb->dte_action; act != NULL;
+			    act = act->dta_next) {
+				if (act->dta_kind == desc->dtad_kind)
+					RETURN(EINVAL);
+			}
+			break;
+		}
+
 		case DTRACEACT_TEST1:
 PRINT_CASE("DTRACEACT_TEST1");
 			size = sizeof (uint64_t);
@@ -10698,6 +12510,18 @@ PRINT_CASE("DTRACEACT_TEST2");
 			RETURN(EINVAL);
 		}
 
+#if linux
+		/*
+		 * A stack which goes in the stack table leaves only its ID in
+		 * the record.
+		 */
+		if ((desc->dtad_kind == DTRACEACT_STACK ||
+		    desc->dtad_kind == DTRACEACT_USTACK ||
+		    desc->dtad_kind == DTRACEACT_JSTACK) &&
+		    DTRACE_STACKID_ISSET(arg))
+			size = sizeof (uint32_t);
+#endif
+
 		if (size != 0 || desc->dtad_kind == DTRACEACT_SPECULATE) {
 			/*
 			 * If this is a data-storing action or a speculate,
@@ -10712,7 +12536,8 @@ PRINT_CASE("DTRACEACT_TEST2");
 			}
 		}
 
-		action = kmem_zalloc(sizeof (dtrace_action_t), KM_SLEEP);
+		action = dtrace_obj_zalloc(dtrace_action_kmc,
+		    sizeof (dtrace_action_t));
 		action->dta_rec.dtrd_size = size;
 	}
 
@@ -10778,7 +12603,8 @@ dtrace_ecb_action_remove(dtrace_ecb_t *ecb)
 			if (DTRACEACT_ISAGG(act->dta_kind)) {
 				dtrace_ecb_aggregation_destroy(ecb, act);
 			} else {
-				kmem_free(act, sizeof (dtrace_action_t));
+				dtrace_obj_free(dtrace_action_kmc, act,
+				    sizeof (dtrace_action_t));
 			}
 		}
 	}
@@ -10882,6 +12708,70 @@ HERE();
 	}
 }
 
+#if linux
+/*
+ * Set up the sample() and ratelimit() filters of a new ECB from its
+ * description.  Bad arguments are left for dtrace_ecb_action_add() to
+ * reject; we just don't act on them.
+ */
+static int
+dtrace_ecb_sample_init(dtrace_ecb_t *ecb, dtrace_ecbdesc_t *desc)
+{
+	dtrace_actdesc_t *act;
+	dtrace_ecbsample_t *sm;
+	uint64_t seed;
+	int i;
+
+	for (act = desc->dted_action; act != NULL; act = act->dtad_next) {
+		if (act->dtad_arg == 0)
+			continue;
+
+		if (act->dtad_kind == DTRACEACT_SAMPLE) {
+			if (ecb->dte_samplethresh != 0)
+				return (EINVAL);
+			ecb->dte_samplethresh = UINT64_MAX / act->dtad_arg;
+		}
+
+		if (act->dtad_kind == DTRACEACT_RATELIMIT &&
+		    act->dtad_arg <= UINT64_MAX / NANOSEC) {
+			if (ecb->dte_ratelimit != 0)
+				return (EINVAL);
+			ecb->dte_ratelimit = act->dtad_arg;
+		}
+	}
+
+	if (ecb->dte_samplethresh == 0 && ecb->dte_ratelimit == 0)
+		return (0);
+
+	/*
+	 * One per CPU we actually have (see cpu_list), not per NCPU:  that
+	 * is NR_CPUS, and this is paid for every ECB.
+	 */
+	ecb->dte_sample = kmem_zalloc(nr_cpus * sizeof (dtrace_ecbsample_t),
+	    KM_SLEEP);
+
+	if (ecb->dte_sample == NULL)
+		return (ENOMEM);
+
+	/*
+	 * A zero refill time gives each bucket a full second's worth of
+	 * tokens on its first firing.  The generators just need distinct,
+	 * non-zero seeds.
+	 */
+	seed = dtrace_gethrtime() ^ ((uint64_t)ecb->dte_epid << 32);
+
+	for (i = 0; i < nr_cpus; i++) {
+		sm = &ecb->dte_sample[i];
+		sm->dtsm_rand = (seed + i) * 0x9e3779b97f4a7c15ULL;
+
+		if (sm->dtsm_rand == 0)
+			sm->dtsm_rand = 1;
+	}
+
+	return (0);
+}
+#endif
+
 static void
 dtrace_ecb_destroy(dtrace_ecb_t *ecb)
 {
@@ -10902,6 +12792,14 @@ dtrace_ecb_destroy(dtrace_ecb_t *ecb)
 	ASSERT(state->dts_ecbs[epid - 1] == ecb);
 	state->dts_ecbs[epid - 1] = NULL;
 
+#if linux
+	if (ecb->dte_sample != NULL)
+		kmem_free(ecb->dte_sample, nr_cpus * sizeof (dtrace_ecbsample_t));
+
+	if (ecb->dte_perf != NULL)
+		kmem_free(ecb->dte_perf, nr_cpus * sizeof (dtrace_ecbperf_t));
+#endif
+
 	/***********************************************/
 	/*   Mark us as the teardown leader, and keep  */
 	/*   track of how many probes as we started.   */
@@ -10925,7 +12823,7 @@ dtrace_ecb_destroy(dtrace_ecb_t *ecb)
 
 	cnt++;
 
-	kmem_free(ecb, sizeof (dtrace_ecb_t));
+	dtrace_obj_free(dtrace_ecb_kmc, ecb, sizeof (dtrace_ecb_t));
 
 	s = dtrace_gethrtime() - s;
 	if (s > max_t) {
@@ -10937,7 +12835,7 @@ dtrace_ecb_destroy(dtrace_ecb_t *ecb)
 	}
 
 #else
-	kmem_free(ecb, sizeof (dtrace_ecb_t));
+	dtrace_obj_free(dtrace_ecb_kmc, ecb, sizeof (dtrace_ecb_t));
 #endif
 }
 
@@ -10994,6 +12892,18 @@ HERE();
 			ecb->dte_cond |= DTRACE_COND_USERMODE;
 	}
 
+#if linux
+	/*
+	 * Filter state is per-ECB, so must be set up even when the action
+	 * list is shared with a cached ECB.  A second sample() or ratelimit()
+	 * is an error, rather than quietly replacing the first.
+	 */
+	if ((enab->dten_error = dtrace_ecb_sample_init(ecb, desc)) != 0) {
+		dtrace_ecb_destroy(ecb);
+		return (NULL);
+	}
+#endif
+
 	if (dtrace_ecb_create_cache != NULL) {
 		/*
 		 * If we have a cached ecb, we'll use its action list instead
@@ -11030,6 +12940,61 @@ HERE();
 	return (dtrace_ecb_create_cache = ecb);
 }
 
+#if linux
+/*
+ * Compile the predicate and action DIF objects of an ECB to native code, if
+ * the consumer asked for it.  DIF objects that use instructions the JIT does
+ * not handle are left to the interpreter.
+ */
+static void
+dtrace_ecb_jit(dtrace_ecb_t *ecb)
+{
+	dtrace_optval_t opt = ecb->dte_state->dts_options[DTRACEOPT_DIFJIT];
+	dtrace_action_t *act;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (opt == DTRACEOPT_UNSET)
+		return;
+
+	if (ecb->dte_predicate != NULL)
+		(void) dtrace_difjit_compile(ecb->dte_predicate->dtp_difo);
+
+	for (act = ecb->dte_action; act != NULL; act = act->dta_next) {
+		if (act->dta_difo != NULL)
+			(void) dtrace_difjit_compile(act->dta_difo);
+	}
+}
+
+/*
+ * Give an ECB its probe effect counters, if the consumer asked for them.
+ * Like dtrace_ecb_jit(), this waits until the options are known; the ECB
+ * may already be on its probe, so the counters are zeroed before they are
+ * made visible to dtrace_probe().
+ */
+static void
+dtrace_ecb_perf(dtrace_ecb_t *ecb)
+{
+	dtrace_optval_t opt = ecb->dte_state->dts_options[DTRACEOPT_OVERHEAD];
+	dtrace_ecbperf_t *perf;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (opt == DTRACEOPT_UNSET || ecb->dte_perf != NULL)
+		return;
+
+	/*
+	 * As with dte_sample, one per CPU we have rather than per NCPU.
+	 * Without the memory, the ECB just goes unaccounted.
+	 */
+	if ((perf = kmem_zalloc(nr_cpus * sizeof (dtrace_ecbperf_t),
+	    KM_SLEEP)) == NULL)
+		return;
+	dtrace_membar_producer();
+	ecb->dte_perf = perf;
+}
+#endif
+
 static int
 dtrace_ecb_create_enable(dtrace_probe_t *probe, void *arg)
 {
@@ -11051,6 +13016,17 @@ dtrace_ecb_create_enable(dtrace_probe_t *probe, void *arg)
 	if ((ecb = dtrace_ecb_create(state, probe, enab)) == NULL)
 		return (DTRACE_MATCH_DONE);
 
+#if linux
+	/*
+	 * ECBs created before DTRACEIOC_GO are compiled by
+	 * dtrace_state_go(), once the options are known.
+	 */
+	if (state->dts_activity != DTRACE_ACTIVITY_INACTIVE) {
+		dtrace_ecb_jit(ecb);
+		dtrace_ecb_perf(ecb);
+	}
+#endif
+
 	if (dtrace_ecb_enable(ecb) < 0)
 		return (DTRACE_MATCH_FAIL);
 
@@ -11126,7 +13102,8 @@ dtrace_buffer_switch(dtrace_buffer_t *buf)
 	buf->dtb_offset = 0;
 	buf->dtb_drops = 0;
 	buf->dtb_errors = 0;
-	buf->dtb_flags &= ~(DTRACEBUF_ERROR | DTRACEBUF_DROPPED);
+	buf->dtb_flags &= ~(DTRACEBUF_ERROR | DTRACEBUF_DROPPED |
+	    DTRACEBUF_WMARK);
 	buf->dtb_interval = now - buf->dtb_switched;
 	buf->dtb_switched = now;
 	dtrace_interrupt_enable(cookie);
@@ -11161,6 +13138,24 @@ HERE();
 	dtrace_interrupt_enable(cookie);
 }
 
+#if linux
+/*
+ * Linux: dtrace_bufmap_lock covers what the mmap(2) fault path may look at;
+ * see dtrace_buffer_page().  A buffer is published once it (and any control
+ * page) is fully allocated, and withdrawn before any of it is freed.
+ */
+static DEFINE_SPINLOCK(dtrace_bufmap_lock);
+
+static void
+dtrace_buffer_mapset(dtrace_buffer_t *buf, caddr_t base, caddr_t xamot)
+{
+	spin_lock(&dtrace_bufmap_lock);
+	buf->dtb_mapbase = base;
+	buf->dtb_mapxamot = xamot;
+	spin_unlock(&dtrace_bufmap_lock);
+}
+#endif
+
 static int
 dtrace_buffer_alloc(dtrace_buffer_t *bufs, size_t size, int flags,
     processorid_t cpu, int *factor)
@@ -11198,8 +13193,8 @@ dtrace_buffer_alloc(dtrace_buffer_t *bufs, size_t size, int flags,
 
 		ASSERT(buf->dtb_xamot == NULL);
 
-		if ((buf->dtb_tomax = kmem_zalloc(size,
-		    KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+		if ((buf->dtb_tomax = dtrace_buffer_memalloc(size,
+		    cp->cpu_id)) == NULL)
 			goto err;
 
 		buf->dtb_size = size;
@@ -11210,9 +13205,22 @@ dtrace_buffer_alloc(dtrace_buffer_t *bufs, size_t size, int flags,
 		if (flags & DTRACEBUF_NOSWITCH)
 			continue;
 
-		if ((buf->dtb_xamot = kmem_zalloc(size,
-		    KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+		if ((buf->dtb_xamot = dtrace_buffer_memalloc(size,
+		    cp->cpu_id)) == NULL)
 			goto err;
+
+#if linux
+		if (flags & DTRACEBUF_STREAM) {
+			if ((buf->dtb_ctl = dtrace_buffer_memalloc(PAGESIZE,
+			    cp->cpu_id)) == NULL)
+				goto err;
+
+			buf->dtb_ctl->dtbc_size = size;
+			buf->dtb_lapbase = 0;
+		}
+
+		dtrace_buffer_mapset(buf, buf->dtb_tomax, buf->dtb_xamot);
+#endif
 	} while ((cp = cp->cpu_next) != cpu_list);
 
 	return (0);
@@ -11226,23 +13234,32 @@ err:
 
 		buf = &bufs[cp->cpu_id];
 		desired += 2;
+#if linux
+		dtrace_buffer_mapset(buf, NULL, NULL);
+#endif
 
 		if (buf->dtb_xamot != NULL) {
 			ASSERT(buf->dtb_tomax != NULL);
 			ASSERT(buf->dtb_size == size);
-			kmem_free(buf->dtb_xamot, size);
+			dtrace_buffer_memfree(buf->dtb_xamot, size);
 			allocated++;
 		}
 
 		if (buf->dtb_tomax != NULL) {
 			ASSERT(buf->dtb_size == size);
-			kmem_free(buf->dtb_tomax, size);
+			dtrace_buffer_memfree(buf->dtb_tomax, size);
 			allocated++;
 		}
 
+#if linux
+		if (buf->dtb_ctl != NULL)
+			dtrace_buffer_memfree(buf->dtb_ctl, PAGESIZE);
+		buf->dtb_ctl = NULL;
+#endif
 		buf->dtb_tomax = NULL;
 		buf->dtb_xamot = NULL;
 		buf->dtb_size = 0;
+		buf->dtb_flags = 0;
 	} while ((cp = cp->cpu_next) != cpu_list);
 
 	*factor = desired / (allocated > 0 ? allocated : 1);
@@ -11263,6 +13280,203 @@ dtrace_buffer_drop(dtrace_buffer_t *buf)
 	buf->dtb_drops++;
 }
 
+#if linux
+/*
+ * Note:  called from probe context.  A principal buffer with a watermark has
+ * filled past it, or has seen a drop or an error:  let any poll() on the
+ * consumer's descriptor know.  The wakeup itself cannot be done from probe
+ * context, so dtrace_poll_notify() defers it; only the first such event
+ * between buffer switches does so.
+ */
+static void
+dtrace_buffer_wakeup(dtrace_buffer_t *buf, dtrace_state_t *state)
+{
+	if (buf->dtb_wmark == 0 || (buf->dtb_flags & DTRACEBUF_WMARK))
+		return;
+
+	buf->dtb_flags |= DTRACEBUF_WMARK;
+	dtrace_membar_producer();
+	state->dts_pollpend = 1;
+	dtrace_poll_notify();
+}
+
+/*
+ * Note:  called from probe context.  Make everything committed to a "stream"
+ * buffer so far visible to the consumer.  The records must be visible
+ * before the head that covers them.
+ */
+static void
+dtrace_buffer_publish(dtrace_buffer_t *buf)
+{
+	dtrace_bufctl_t *ctl = buf->dtb_ctl;
+
+	if (!(buf->dtb_flags & DTRACEBUF_STREAM))
+		return;
+
+	ctl->dtbc_drops = buf->dtb_drops;
+	ctl->dtbc_errors = buf->dtb_errors;
+	dtrace_membar_producer();
+	ctl->dtbc_head = buf->dtb_lapbase + buf->dtb_offset;
+}
+
+/*
+ * Note:  called from probe context.  Reserve space in a "stream" buffer;
+ * see "Stream Buffering" in dtrace_impl.h.  The tail is written by the
+ * consumer, so it is clamped to something that makes sense before we
+ * decide what is free.
+ */
+static intptr_t
+dtrace_buffer_reserve_stream(dtrace_buffer_t *buf, size_t needed,
+    size_t align, dtrace_state_t *state, dtrace_mstate_t *mstate)
+{
+	dtrace_bufctl_t *ctl = buf->dtb_ctl;
+	caddr_t tomax = buf->dtb_tomax;
+	intptr_t offs = buf->dtb_offset;
+	uint64_t head = buf->dtb_lapbase + offs;
+	uint64_t tail, used;
+	size_t pad;
+
+	tail = ctl->dtbc_tail;
+	dtrace_membar_consumer();
+
+	if (tail > head)
+		tail = head;
+	if (head - tail > buf->dtb_size)
+		tail = head - buf->dtb_size;
+	used = head - tail;
+
+	pad = P2ROUNDUP(offs, align) - offs;
+
+	if (offs + pad + needed > buf->dtb_size)
+		pad = buf->dtb_size - offs;
+
+	if (needed > buf->dtb_size || used + pad + needed > buf->dtb_size) {
+		dtrace_buffer_drop(buf);
+		ctl->dtbc_drops = buf->dtb_drops;
+		dtrace_buffer_wakeup(buf, state);
+		return (-1);
+	}
+
+	if (offs + pad == buf->dtb_size) {
+		/*
+		 * We don't fit before the end of the ring:  pad it out and
+		 * start again at the top, which is always aligned.
+		 */
+		while (offs < buf->dtb_size)
+			tomax[offs++] = 0;
+
+		buf->dtb_lapbase += buf->dtb_size;
+		buf->dtb_offset = 0;
+		offs = 0;
+	} else {
+		while (offs & (align - 1)) {
+			DTRACE_STORE(uint32_t, tomax, offs, DTRACE_EPIDNONE);
+			offs += sizeof (uint32_t);
+		}
+	}
+
+	if (buf->dtb_wmark != 0) {
+		if (used + pad + needed >= buf->dtb_wmark)
+			dtrace_buffer_wakeup(buf, state);
+		else
+			buf->dtb_flags &= ~DTRACEBUF_WMARK;
+	}
+
+	if (mstate == NULL)
+		return (offs);
+
+	mstate->dtms_scratch_base = (uintptr_t)buf->dtb_xamot;
+	mstate->dtms_scratch_size = buf->dtb_size;
+	mstate->dtms_scratch_ptr = mstate->dtms_scratch_base;
+
+	return (offs);
+}
+
+typedef struct dtrace_streamsnap {
+	dtrace_buffer_t *dtss_buf;		/* buffer to snapshot */
+	uint64_t dtss_head;			/* head, as the producer has it */
+	uint64_t dtss_drops;			/* total drops */
+	uint64_t dtss_errors;			/* total errors */
+} dtrace_streamsnap_t;
+
+/*
+ * Note:  called from cross call context.  The head and the drop and error
+ * counts are read on the CPU that owns the buffer, with interrupts disabled,
+ * so that a probe firing there cannot tear them (dtb_lapbase and dtb_offset
+ * are not updated together when the ring wraps).  They are taken from the
+ * buffer itself rather than from the control page, which the consumer can
+ * write to.
+ */
+static void
+dtrace_buffer_stream_head(dtrace_streamsnap_t *ss)
+{
+	dtrace_buffer_t *buf = ss->dtss_buf;
+	dtrace_icookie_t cookie = dtrace_interrupt_disable();
+
+	ss->dtss_head = buf->dtb_lapbase + buf->dtb_offset;
+	ss->dtss_drops = buf->dtb_drops;
+	ss->dtss_errors = buf->dtb_errors;
+	dtrace_interrupt_enable(cookie);
+}
+
+/*
+ * Copy out whatever the consumer has not yet seen in a "stream" buffer, for
+ * consumers which have not mapped it, and consume it on their behalf.
+ * Called with dtrace_lock held.  The control page is output-only for the
+ * head and input-only for the tail:  the tail is the only thing we take
+ * from it, and it is clamped to the head we computed ourselves.
+ */
+static int
+dtrace_buffer_stream_snap(dtrace_buffer_t *buf, dtrace_bufdesc_t *desc)
+{
+	dtrace_bufctl_t *ctl = buf->dtb_ctl;
+	dtrace_streamsnap_t ss;
+	uint64_t head, tail, offs, len;
+	caddr_t dst = desc->dtbd_data;
+
+	ss.dtss_buf = buf;
+	dtrace_xcall(desc->dtbd_cpu,
+	    (dtrace_xcall_t)dtrace_buffer_stream_head, &ss);
+	head = ss.dtss_head;
+
+	tail = ctl->dtbc_tail;
+	dtrace_membar_consumer();
+
+	if (tail > head)
+		tail = head;
+	if (head - tail > buf->dtb_size)
+		tail = head - buf->dtb_size;
+
+	desc->dtbd_size = head - tail;
+
+	while (tail < head) {
+		offs = tail % buf->dtb_size;
+		len = MIN(head - tail, buf->dtb_size - offs);
+
+		if (copyout(buf->dtb_tomax + offs, dst, len) != 0)
+			return (EFAULT);
+
+		dst += len;
+		tail += len;
+	}
+
+	/*
+	 * The consumed counts live on the control page too; if the consumer
+	 * scribbles on them, it only misreports its own drops to itself.
+	 */
+	desc->dtbd_drops = ss.dtss_drops - ctl->dtbc_cdrops;
+	desc->dtbd_errors = ss.dtss_errors - ctl->dtbc_cerrors;
+	desc->dtbd_oldest = 0;
+	ctl->dtbc_cdrops = ss.dtss_drops;
+	ctl->dtbc_cerrors = ss.dtss_errors;
+
+	dtrace_membar_producer();
+	ctl->dtbc_tail = tail;
+
+	return (0);
+}
+#endif
+
 /*
  * Note:  called from probe context.  This function is called to reserve space
  * in a buffer.  If mstate is non-NULL, sets the scratch base and size in the
@@ -11286,6 +13500,12 @@ dtrace_buffer_reserve(dtrace_buffer_t *buf, size_t needed, size_t align,
 		return (-1);
 	}
 
+#if linux
+	if (buf->dtb_flags & DTRACEBUF_STREAM)
+		return (dtrace_buffer_reserve_stream(buf, needed, align,
+		    state, mstate));
+#endif
+
 	if (!(buf->dtb_flags & (DTRACEBUF_RING | DTRACEBUF_FILL))) {
 		while (offs & (align - 1)) {
 			/*
@@ -11300,9 +13520,17 @@ dtrace_buffer_reserve(dtrace_buffer_t *buf, size_t needed, size_t align,
 
 		if ((soffs = offs + needed) > buf->dtb_size) {
 			dtrace_buffer_drop(buf);
+#if linux
+			dtrace_buffer_wakeup(buf, state);
+#endif
 			return (-1);
 		}
 
+#if linux
+		if (buf->dtb_wmark != 0 && soffs >= buf->dtb_wmark)
+			dtrace_buffer_wakeup(buf, state);
+#endif
+
 		if (mstate == NULL)
 			return (offs);
 
@@ -11592,18 +13820,197 @@ dtrace_buffer_free(dtrace_buffer_t *bufs)
 			continue;
 		}
 
+#if linux
+		dtrace_buffer_mapset(buf, NULL, NULL);
+#endif
 		if (buf->dtb_xamot != NULL) {
 			ASSERT(!(buf->dtb_flags & DTRACEBUF_NOSWITCH));
-			kmem_free(buf->dtb_xamot, buf->dtb_size);
+			dtrace_buffer_memfree(buf->dtb_xamot, buf->dtb_size);
 		}
 
-		kmem_free(buf->dtb_tomax, buf->dtb_size);
+		dtrace_buffer_memfree(buf->dtb_tomax, buf->dtb_size);
+#if linux
+		if (buf->dtb_ctl != NULL)
+			dtrace_buffer_memfree(buf->dtb_ctl, PAGESIZE);
+		buf->dtb_ctl = NULL;
+#endif
 		buf->dtb_size = 0;
+		buf->dtb_flags = 0;
 		buf->dtb_tomax = NULL;
 		buf->dtb_xamot = NULL;
 	}
 }
 
+#if linux
+/*
+ * Linux: find (and take a reference on) the page backing a given page
+ * offset of an mmap(2) of the principal buffers.  See DTRACEIOC_BUFSWAP for
+ * the layout.  Returns NULL if there is no such buffer page.
+ *
+ * This is called from the page fault handler with the mm's mmap lock held,
+ * and dtrace_lock is held across copyin()/copyout() elsewhere, so it must
+ * not take dtrace_lock.  Instead, the fields that an mmap(2) can see --
+ * dtb_mapbase and dtb_mapxamot, which do not move when the buffers are
+ * switched -- are set and cleared under dtrace_bufmap_lock (see
+ * dtrace_buffer_mapset()), and the buffers are freed only after they have
+ * been cleared.  A page we find has had its reference taken under the lock;
+ * the state itself cannot go away while the mapping holds the file open.
+ */
+struct page *
+dtrace_buffer_page(dtrace_state_t *state, unsigned long pgoff)
+{
+	dtrace_buffer_t *buf;
+	struct page *page = NULL;
+	unsigned long stride, slot;
+	caddr_t base = NULL;
+	size_t off;
+
+	if (state->dts_anon)
+		state = state->dts_anon;
+
+	if (state->dts_buffer == NULL ||
+	    state->dts_options[DTRACEOPT_BUFSIZE] <= 0)
+		return (NULL);
+
+	stride = P2ROUNDUP(state->dts_options[DTRACEOPT_BUFSIZE],
+	    PAGESIZE) >> PAGE_SHIFT;
+	slot = pgoff / stride;
+	off = (pgoff % stride) * PAGESIZE;
+
+	if (slot / 2 >= NCPU)
+		return (NULL);
+
+	buf = &state->dts_buffer[slot / 2];
+
+	spin_lock(&dtrace_bufmap_lock);
+
+	/*
+	 * The option we took the stride from is read without the lock; only
+	 * trust it if it describes the buffer we found.
+	 */
+	if (buf->dtb_mapbase == NULL ||
+	    (P2ROUNDUP(buf->dtb_size, PAGESIZE) >> PAGE_SHIFT) != stride ||
+	    off >= buf->dtb_size)
+		goto out;
+
+	if (buf->dtb_flags & DTRACEBUF_STREAM) {
+		/*
+		 * The ring, then its control page.
+		 */
+		if ((slot & 1) == 0)
+			base = buf->dtb_mapbase + off;
+		else if (off == 0)
+			base = (caddr_t)buf->dtb_ctl;
+	} else if (!(buf->dtb_flags & (DTRACEBUF_RING | DTRACEBUF_FILL))) {
+		base = ((slot & 1) ? buf->dtb_mapxamot : buf->dtb_mapbase) +
+		    off;
+	}
+
+	if (base != NULL && (page = dtrace_buffer_mempage(base)) != NULL)
+		get_page(page);
+out:
+	spin_unlock(&dtrace_bufmap_lock);
+	return (page);
+}
+
+/*
+ * Linux: the buffer mapping is read-only, except that a consumer of a
+ * "stream" buffer may map its control page on its own, writably, so that it
+ * can advance the tail.  Returns non-zero if [pgoff, pgoff + npages) is
+ * exactly such a page.  Like dtrace_buffer_page(), this is called with the
+ * mmap lock held, so it too makes do with dtrace_bufmap_lock.
+ */
+int
+dtrace_buffer_ctlmap(dtrace_state_t *state, unsigned long pgoff,
+    unsigned long npages)
+{
+	dtrace_buffer_t *buf;
+	unsigned long stride, slot;
+	int rval;
+
+	if (state->dts_anon)
+		state = state->dts_anon;
+
+	if (npages != 1 || state->dts_buffer == NULL ||
+	    state->dts_options[DTRACEOPT_BUFSIZE] <= 0)
+		return (0);
+
+	stride = P2ROUNDUP(state->dts_options[DTRACEOPT_BUFSIZE],
+	    PAGESIZE) >> PAGE_SHIFT;
+	slot = pgoff / stride;
+
+	if (slot / 2 >= NCPU || (slot & 1) == 0 || pgoff % stride != 0)
+		return (0);
+
+	buf = &state->dts_buffer[slot / 2];
+
+	spin_lock(&dtrace_bufmap_lock);
+	rval = buf->dtb_mapbase != NULL &&
+	    (buf->dtb_flags & DTRACEBUF_STREAM) && buf->dtb_ctl != NULL;
+	spin_unlock(&dtrace_bufmap_lock);
+
+	return (rval);
+}
+
+/*
+ * Linux: poll() support.  Returns non-zero if any CPU's principal buffer has
+ * something for the consumer:  a switching buffer that has passed its
+ * watermark, dropped or seen an error since it was last switched, or a
+ * stream buffer whose unconsumed data reaches the watermark or whose drops
+ * and errors have not yet been consumed.  This is worked out afresh from
+ * each CPU's buffer, rather than kept in one flag on the state, so that
+ * snapshotting one CPU's buffer cannot hide what is pending on another.
+ * Ring and fill buffers are only read once tracing has stopped, so they
+ * never make the descriptor readable.
+ */
+int
+dtrace_state_pollready(dtrace_state_t *state)
+{
+	dtrace_buffer_t *buf;
+	dtrace_bufctl_t *ctl;
+	uint64_t head, tail;
+	int i, rval = 0;
+
+	if (state->dts_anon)
+		state = state->dts_anon;
+
+	if (state->dts_buffer == NULL)
+		return (0);
+
+	for (i = 0; i < NCPU && rval == 0; i++) {
+		buf = &state->dts_buffer[i];
+
+		if (buf->dtb_wmark == 0)
+			continue;
+
+		spin_lock(&dtrace_bufmap_lock);
+
+		if (buf->dtb_mapbase == NULL ||
+		    (buf->dtb_flags & (DTRACEBUF_RING | DTRACEBUF_FILL))) {
+			rval = 0;
+		} else if (buf->dtb_flags & DTRACEBUF_STREAM) {
+			if ((ctl = buf->dtb_ctl) != NULL) {
+				head = ctl->dtbc_head;
+				tail = ctl->dtbc_tail;
+
+				if (tail > head)
+					tail = head;
+
+				rval = head - tail >= buf->dtb_wmark ||
+				    ctl->dtbc_drops != ctl->dtbc_cdrops ||
+				    ctl->dtbc_errors != ctl->dtbc_cerrors;
+			}
+		} else {
+			rval = (buf->dtb_flags & DTRACEBUF_WMARK) != 0;
+		}
+
+		spin_unlock(&dtrace_bufmap_lock);
+	}
+
+	return (rval);
+}
+#endif
+
 /*
  * DTrace Enabling Functions
  */
@@ -11881,17 +14288,53 @@ dtrace_enabling_retract(dtrace_state_t *state)
 		 */
 		ASSERT(enab->dten_vstate->dtvs_state != NULL);
 
-		if (enab->dten_vstate->dtvs_state == state) {
-			ASSERT(state->dts_nretained > 0);
-			dtrace_enabling_destroy(enab);
-		}
-	}
+		if (enab->dten_vstate->dtvs_state == state) {
+			ASSERT(state->dts_nretained > 0);
+			dtrace_enabling_destroy(enab);
+		}
+	}
+
+	ASSERT(state->dts_nretained == 0);
+}
+
+# if linux
+static int dtrace_enabling_match_probes(dtrace_enabling_t *, int *);
+
+/*
+ * Enabling a wide probe description (e.g. fbt:::) can patch tens of
+ * thousands of instructions.  Queue the provider patches for the whole
+ * pass, so they are applied a page at a time with a single cross call
+ * at the end, rather than one at a time.
+ */
+static int
+dtrace_enabling_match(dtrace_enabling_t *enab, int *nmatched)
+{
+	extern unsigned long cnt_xcall1;
+	extern unsigned long long cnt_patch_sites;
+	unsigned long xcalls = cnt_xcall1;
+	unsigned long long sites = cnt_patch_sites;
+	hrtime_t s = dtrace_gethrtime();
+	int ret;
+
+	dtrace_patch_begin();
+	dtrace_kmc_bulk_begin();
+	ret = dtrace_enabling_match_probes(enab, nmatched);
+	dtrace_kmc_bulk_end();
+	dtrace_patch_end();
+
+	s = dtrace_gethrtime() - s;
+	dtrace_printf("enabling done %s xcalls=%lu patches=%llu\n",
+	    hrtime_str(s), cnt_xcall1 - xcalls, cnt_patch_sites - sites);
 
-	ASSERT(state->dts_nretained == 0);
+	return (ret);
 }
 
+static int
+dtrace_enabling_match_probes(dtrace_enabling_t *enab, int *nmatched)
+# else
 static int
 dtrace_enabling_match(dtrace_enabling_t *enab, int *nmatched)
+# endif
 {
 	int i = 0;
 	int total_matched = 0, matched = 0;
@@ -13332,10 +15775,47 @@ dtrace_dstate_fini(dtrace_dstate_t *dstate)
 	if (dstate->dtds_base == NULL)
 		return;
 
+#if linux
+	if (dstate->dtds_hashalloc != NULL) {
+		kmem_free(dstate->dtds_hashalloc,
+		    dstate->dtds_hashsize * sizeof (dtrace_dynhash_t));
+	}
+
+	if (dstate->dtds_vardrops != NULL) {
+		kmem_free(dstate->dtds_vardrops, nr_cpus *
+		    (dstate->dtds_nglobals + dstate->dtds_ntlocals) *
+		    sizeof (uint64_t));
+	}
+#endif
+
 	kmem_free(dstate->dtds_base, dstate->dtds_size);
 	kmem_cache_free(dtrace_state_cache, dstate->dtds_percpu);
 }
 
+#if linux
+/*
+ * Record how many variables DTRACEIOC_DYNSTAT may have to describe, and
+ * allocate their per-CPU drop counts.  These are only statistics; if we
+ * can't have the memory, we do without.
+ */
+static void
+dtrace_dstate_vars(dtrace_vstate_t *vstate)
+{
+	dtrace_dstate_t *dstate = &vstate->dtvs_dynvars;
+	uint_t nids = vstate->dtvs_nglobals + vstate->dtvs_ntlocals;
+
+	ASSERT(dstate->dtds_vardrops == NULL);
+
+	dstate->dtds_nglobals = vstate->dtvs_nglobals;
+	dstate->dtds_ntlocals = vstate->dtvs_ntlocals;
+
+	if (nids != 0) {
+		dstate->dtds_vardrops = kmem_zalloc(nr_cpus * nids *
+		    sizeof (uint64_t), KM_NOSLEEP | KM_NORMALPRI);
+	}
+}
+#endif
+
 static void
 dtrace_vstate_fini(dtrace_vstate_t *vstate)
 {
@@ -13349,6 +15829,10 @@ dtrace_vstate_fini(dtrace_vstate_t *vstate)
 		    sizeof (dtrace_statvar_t *));
 	}
 
+#if linux
+	dtrace_tls_fini(vstate);
+#endif
+
 	if (vstate->dtvs_ntlocals > 0) {
 		kmem_free(vstate->dtvs_tlocals, vstate->dtvs_ntlocals *
 		    sizeof (dtrace_difv_t));
@@ -13370,6 +15854,19 @@ dtrace_state_clean(dtrace_state_t *state)
 
 	dtrace_dynvar_clean(&state->dts_vstate.dtvs_dynvars);
 	dtrace_speculation_clean(state);
+#if linux
+	dtrace_dynvar_adapt(&state->dts_vstate.dtvs_dynvars);
+
+	/*
+	 * Catch any poll() wakeup that dtrace_poll_notify() could not
+	 * deliver directly.  Whether there is anything to read is up to
+	 * dtrace_state_pollready(); the flag only says a wakeup is owed.
+	 */
+	if (state->dts_pollpend) {
+		state->dts_pollpend = 0;
+		dtrace_poll_wakeup();
+	}
+#endif
 }
 
 static void
@@ -13627,6 +16124,26 @@ dtrace_state_create(struct file *fp, cred_t *cr)
 	return (state);
 }
 
+#if linux
+/*
+ * Set the poll() watermark on each of the principal buffers from the
+ * "bufwatermark" option, a percentage of the (possibly resized) buffer.
+ */
+static void
+dtrace_state_wmark(dtrace_state_t *state, dtrace_buffer_t *buf, size_t size)
+{
+	dtrace_optval_t pct = state->dts_options[DTRACEOPT_BUFWATERMARK];
+	uint64_t wmark = 0;
+	int i;
+
+	if (pct != DTRACEOPT_UNSET && pct > 0)
+		wmark = MAX((size * pct) / 100, sizeof (uint64_t));
+
+	for (i = 0; i < NCPU; i++)
+		buf[i].dtb_wmark = wmark;
+}
+#endif
+
 static int
 dtrace_state_buffer(dtrace_state_t *state, dtrace_buffer_t *buf, int which)
 {
@@ -13658,6 +16175,11 @@ dtrace_state_buffer(dtrace_state_t *state, dtrace_buffer_t *buf, int which)
 		if (opt[DTRACEOPT_BUFPOLICY] == DTRACEOPT_BUFPOLICY_FILL)
 			flags |= DTRACEBUF_FILL;
 
+#if linux
+		if (opt[DTRACEOPT_BUFPOLICY] == DTRACEOPT_BUFPOLICY_STREAM)
+			flags |= DTRACEBUF_STREAM;
+#endif
+
 
 		if (state != dtrace_anon.dta_state ||
 		    state->dts_activity != DTRACE_ACTIVITY_ACTIVE)
@@ -13690,6 +16212,11 @@ HERE();
 
 		if (rval != ENOMEM) {
 			opt[which] = size;
+#if linux
+			if (rval == 0 && which == DTRACEOPT_BUFSIZE &&
+			    !(flags & (DTRACEBUF_RING | DTRACEBUF_FILL)))
+				dtrace_state_wmark(state, buf, size);
+#endif
 			return (rval);
 		}
 
@@ -13936,6 +16463,10 @@ HERE();
 	if (rval != 0)
 		goto err;
 
+#if linux
+	dtrace_dstate_vars(&state->dts_vstate);
+#endif
+
 HERE();
 	if (opt[DTRACEOPT_STATUSRATE] > dtrace_statusrate_max)
 		opt[DTRACEOPT_STATUSRATE] = dtrace_statusrate_max;
@@ -13969,6 +16500,20 @@ HERE();
 	state->dts_alive = state->dts_laststatus = dtrace_gethrtime();
 	state->dts_deadman = cyclic_add(&hdlr, &when);
 
+#if linux
+	for (i = 0; i < state->dts_necbs; i++) {
+		if (state->dts_ecbs[i] == NULL)
+			continue;
+
+		dtrace_ecb_jit(state->dts_ecbs[i]);
+		dtrace_ecb_perf(state->dts_ecbs[i]);
+	}
+
+	dtrace_tls_init(&state->dts_vstate);
+	dtrace_stackid_init(state);
+	dtrace_hrtime_start();
+#endif
+
 	state->dts_activity = DTRACE_ACTIVITY_WARMUP;
 HERE();
 
@@ -14110,6 +16655,26 @@ dtrace_state_option(dtrace_state_t *state, dtrace_optid_t option,
 
 HERE();
 	switch (option) {
+#if linux
+	case DTRACEOPT_BUFWATERMARK:
+		if (val > 100)
+			RETURN(EINVAL);
+		break;
+
+	case DTRACEOPT_STACKIDSIZE:
+		if (val > DTRACE_STACKTAB_MAX)
+			val = DTRACE_STACKTAB_MAX;
+
+		/*
+		 * The table is kernel memory like any buffer, so an
+		 * unprivileged consumer is held to the same limit.
+		 */
+		if (val > dtrace_nonroot_maxsize &&
+		    !PRIV_POLICY_CHOICE(CRED(), PRIV_ALL, B_FALSE))
+			val = dtrace_nonroot_maxsize;
+		break;
+
+#endif
 	case DTRACEOPT_DESTRUCTIVE:
 PRINT_CASE(DTRACEOPT_DESTRUCTIVE);
 		if (dtrace_destructive_disallow)
@@ -14210,6 +16775,12 @@ dtrace_printf("teardown start xcalls=%lu probes=%llu\n", cnt_xcall1, cnt_probes
 
 	dtrace_sync();
 
+	/***********************************************/
+	/*   Unpatch  all  the  probes  in one go; see  */
+	/*   dtrace_enabling_match().		       */
+	/***********************************************/
+	dtrace_patch_begin();
+
 	for (match = DTRACE_PRIV_KERNEL; ; match = 0) {
 		for (i = 0; i < state->dts_necbs; i++) {
 			if ((ecb = state->dts_ecbs[i]) == NULL)
@@ -14231,6 +16802,8 @@ dtrace_printf("teardown start xcalls=%lu probes=%llu\n", cnt_xcall1, cnt_probes
 			break;
 	}
 
+	dtrace_patch_end();
+
 	/***********************************************/
 	/*   Exit the 'critical' region for teardown.  */
 	/***********************************************/
@@ -14241,9 +16814,12 @@ dtrace_printf("teardown start xcalls=%lu probes=%llu\n", cnt_xcall1, cnt_probes
 	/*   took.				       */
 	/***********************************************/
 	s = dtrace_gethrtime() - s;
-	dtrace_printf("teardown done %s xcalls=%lu probes=%llu\n", hrtime_str(s),
+	{extern unsigned long long cnt_patch_sites;
+	dtrace_printf("teardown done %s xcalls=%lu probes=%llu patches=%llu\n", hrtime_str(s),
 		cnt_xcall1,
-		cnt_probes - cnt_free1);
+		cnt_probes - cnt_free1,
+		cnt_patch_sites);
+	}
 }
 
 	/*
@@ -14270,6 +16846,12 @@ HERE();
 
 	dtrace_dstate_fini(&vstate->dtvs_dynvars);
 	dtrace_vstate_fini(vstate);
+#if linux
+	dtrace_stackid_fini(state);
+	dtrace_unwind_release(state);
+	if (state->dts_activity != DTRACE_ACTIVITY_INACTIVE)
+		dtrace_hrtime_stop();
+#endif
 	kmem_free(state->dts_ecbs, state->dts_necbs * sizeof (dtrace_ecb_t *));
 
 	if (state->dts_aggregations != NULL) {
@@ -15678,7 +18260,8 @@ printk("dtrace_module_unloaded called %p '%s'\n", modctl, ctl->name);
 		kmem_free(probe->dtpr_func, strlen(probe->dtpr_func) + 1);
 		kmem_free(probe->dtpr_name, strlen(probe->dtpr_name) + 1);
 		vmem_free(dtrace_arena, (void *)(uintptr_t)probe->dtpr_id, 1);
-		kmem_free(probe, sizeof (dtrace_probe_t));
+		dtrace_obj_free(dtrace_probe_kmc, probe,
+		    sizeof (dtrace_probe_t));
 	}
 
 	dmutex_exit(&dtrace_lock);
@@ -15871,9 +18454,11 @@ dtrace_attach(dev_info_t *devi, ddi_attach_cmd_t cmd)
 	dtrace_debugger_fini = dtrace_resume;
 #endif
 
-#if defined(sun)
+	/***********************************************/
+	/*   On Linux, this is driven from the cpu      */
+	/*   hotplug notifier in cyclic_linux.c.       */
+	/***********************************************/
 	register_cpu_setup_func((cpu_setup_func_t *)dtrace_cpu_setup, NULL);
-# endif
 
 	ASSERT(MUTEX_HELD(&cpu_lock));
 
@@ -15900,6 +18485,19 @@ dtrace_attach(dev_info_t *devi, ddi_attach_cmd_t cmd)
 # else
            0, NULL, NULL);
 #endif
+	/*
+	 * If we can't have a cache, its objects come from kmem_zalloc().
+	 */
+	dtrace_probe_kmc = dtrace_kmc_create("dtrace_probe",
+	    sizeof (dtrace_probe_t));
+	dtrace_ecb_kmc = dtrace_kmc_create("dtrace_ecb", sizeof (dtrace_ecb_t));
+	dtrace_action_kmc = dtrace_kmc_create("dtrace_action",
+	    sizeof (dtrace_action_t));
+
+	if (dtrace_probe_kmc == NULL || dtrace_ecb_kmc == NULL ||
+	    dtrace_action_kmc == NULL)
+		cmn_err(CE_WARN, "dtrace: object caches unavailable; "
+		    "using kmem_zalloc");
 # endif
 
 	ASSERT(MUTEX_HELD(&cpu_lock));
@@ -16776,6 +19374,26 @@ PRINT_CASE(DTRACEIOC_DOFGET);
 		}
 //printk("snap cpu=%d flags=%x\n", desc.dtbd_cpu, buf->dtb_flags);
 
+# if linux
+		/*
+		 * A stream buffer is never switched; just copy out what has
+		 * been produced since the last snapshot.
+		 */
+		if (buf->dtb_flags & DTRACEBUF_STREAM) {
+			if (dtrace_buffer_stream_snap(buf, &desc) != 0) {
+				mutex_exit(&dtrace_lock);
+				RETURN(EFAULT);
+			}
+
+			mutex_exit(&dtrace_lock);
+
+			if (copyout(&desc, (void *)arg, sizeof (desc)) != 0)
+				RETURN(EFAULT);
+
+			return (0);
+		}
+# endif
+
 		if (buf->dtb_flags & (DTRACEBUF_RING | DTRACEBUF_FILL)) {
 			size_t sz = buf->dtb_offset;
 
@@ -16892,6 +19510,243 @@ HERE();
 		return (0);
 	}
 
+# if linux
+	case DTRACEIOC_BUFSWAP: {
+		dtrace_bufswap_t sw;
+		dtrace_buffer_t *buf;
+		caddr_t cached;
+		size_t stride;
+
+PRINT_CASE(DTRACEIOC_BUFSWAP);
+		if (copyin((void *)arg, &sw, sizeof (sw)) != 0)
+			RETURN(EFAULT);
+
+		if (sw.dtbs_cpu >= NCPU)
+			RETURN(EINVAL);
+
+		mutex_enter(&dtrace_lock);
+
+		buf = &state->dts_buffer[sw.dtbs_cpu];
+
+		/*
+		 * Only switching buffers can be mapped; ring and fill
+		 * buffers are snapshotted once, after we have stopped.
+		 * Stream buffers are never switched at all.
+		 */
+		if (buf->dtb_flags & (DTRACEBUF_RING | DTRACEBUF_FILL |
+		    DTRACEBUF_NOSWITCH | DTRACEBUF_STREAM)) {
+			mutex_exit(&dtrace_lock);
+			RETURN(EINVAL);
+		}
+
+		if (buf->dtb_tomax == NULL) {
+			ASSERT(buf->dtb_xamot == NULL);
+			mutex_exit(&dtrace_lock);
+			RETURN(ENOENT);
+		}
+
+		cached = buf->dtb_tomax;
+
+		dtrace_xcall(sw.dtbs_cpu,
+		    (dtrace_xcall_t)dtrace_buffer_switch, buf);
+
+		state->dts_errors += buf->dtb_xamot_errors;
+
+		if (buf->dtb_tomax == cached) {
+			mutex_exit(&dtrace_lock);
+			RETURN(ENOENT);
+		}
+
+		stride = P2ROUNDUP(buf->dtb_size, PAGESIZE);
+		sw.dtbs_offset = (sw.dtbs_cpu * 2 +
+		    (buf->dtb_xamot == buf->dtb_mapbase ? 0 : 1)) * stride;
+		sw.dtbs_size = buf->dtb_xamot_offset;
+		sw.dtbs_drops = buf->dtb_xamot_drops;
+		sw.dtbs_errors = buf->dtb_xamot_errors;
+
+		mutex_exit(&dtrace_lock);
+
+		if (copyout(&sw, (void *)arg, sizeof (sw)) != 0)
+			RETURN(EFAULT);
+
+		return (0);
+	}
+# endif
+
+# if linux
+	case DTRACEIOC_DYNSTAT: {
+		dtrace_dynstat_t ds, *dsp;
+		dtrace_dstate_t *dstate;
+		uint32_t nvars;
+		size_t size;
+
+PRINT_CASE(DTRACEIOC_DYNSTAT);
+		if (copyin((void *)arg, &ds, sizeof (ds)) != 0)
+			RETURN(EFAULT);
+
+		mutex_enter(&dtrace_lock);
+
+		if (state->dts_activity == DTRACE_ACTIVITY_INACTIVE) {
+			mutex_exit(&dtrace_lock);
+			RETURN(ENOENT);
+		}
+
+		/*
+		 * There can't be more variables to describe than we have
+		 * drop counts for; don't let the caller size our allocation
+		 * beyond that.
+		 */
+		dstate = &state->dts_vstate.dtvs_dynvars;
+		nvars = MIN(ds.dtdy_nvars,
+		    dstate->dtds_nglobals + dstate->dtds_ntlocals);
+		size = sizeof (dtrace_dynstat_t) + (nvars > 0 ? nvars - 1 : 0) *
+		    sizeof (dtrace_dynstat_var_t);
+
+		dsp = kmem_zalloc(size, KM_SLEEP);
+		dtrace_dynvar_stat(dstate, dsp, nvars);
+
+		mutex_exit(&dtrace_lock);
+
+		if (copyout(dsp, (void *)arg, size) != 0) {
+			kmem_free(dsp, size);
+			RETURN(EFAULT);
+		}
+
+		kmem_free(dsp, size);
+		return (0);
+	}
+
+	case DTRACEIOC_ECBSTAT: {
+		dtrace_ecbstat_t es;
+		dtrace_ecb_t *ecb;
+		int i;
+
+PRINT_CASE(DTRACEIOC_ECBSTAT);
+		if (copyin((void *)arg, &es, sizeof (es)) != 0)
+			RETURN(EFAULT);
+
+		mutex_enter(&dtrace_lock);
+
+		if (es.dtes_epid == 0 || es.dtes_epid > state->dts_necbs) {
+			mutex_exit(&dtrace_lock);
+			RETURN(EINVAL);
+		}
+
+		if ((ecb = dtrace_epid2ecb(state, es.dtes_epid)) == NULL) {
+			mutex_exit(&dtrace_lock);
+			RETURN(ENOENT);
+		}
+
+		bzero(&es.dtes_sampled,
+		    sizeof (es) - offsetof(dtrace_ecbstat_t, dtes_sampled));
+
+		if (ecb->dte_sample != NULL) {
+			for (i = 0; i < nr_cpus; i++) {
+				es.dtes_sampled +=
+				    ecb->dte_sample[i].dtsm_sampled;
+				es.dtes_limited +=
+				    ecb->dte_sample[i].dtsm_limited;
+			}
+		}
+
+		if (ecb->dte_perf != NULL) {
+			for (i = 0; i < nr_cpus; i++) {
+				dtrace_ecbperf_t *perf = &ecb->dte_perf[i];
+
+				es.dtes_fires += perf->dtep_fires;
+				es.dtes_cycles += perf->dtep_cycles;
+				es.dtes_bytes += perf->dtep_bytes;
+				es.dtes_drops += perf->dtep_drops;
+			}
+		}
+
+		mutex_exit(&dtrace_lock);
+
+		if (copyout(&es, (void *)arg, sizeof (es)) != 0)
+			RETURN(EFAULT);
+
+		return (0);
+	}
+
+	case DTRACEIOC_STACKIDS: {
+		dtrace_stackids_t si;
+		dtrace_stacktab_t *tab = &state->dts_stacktab;
+		dtrace_stackent_t *ent;
+		uint64_t offs, end;
+
+PRINT_CASE(DTRACEIOC_STACKIDS);
+		if (copyin((void *)arg, &si, sizeof (si)) != 0)
+			RETURN(EFAULT);
+
+		mutex_enter(&dtrace_lock);
+
+		if (tab->dst_base == NULL) {
+			mutex_exit(&dtrace_lock);
+			RETURN(ENOENT);
+		}
+
+		if ((si.dtsi_offset & 7) != 0 ||
+		    si.dtsi_offset > tab->dst_alloc) {
+			mutex_exit(&dtrace_lock);
+			RETURN(EINVAL);
+		}
+
+		/*
+		 * Entries are only ever appended, and the arena stays put
+		 * until the consumer closes us, so having found out how much
+		 * is complete we can copy it out without the lock.  An entry
+		 * which some CPU is still filling in stops the walk; the
+		 * caller will pick it up next time.
+		 */
+		offs = si.dtsi_offset;
+		end = tab->dst_alloc;
+
+		while (offs < end) {
+			ent = (dtrace_stackent_t *)(tab->dst_base + offs);
+
+			if (!(ent->dse_flags & DTRACE_STACKENT_READY) ||
+			    offs + DTRACE_STACKENT_SIZE(ent->dse_size) -
+			    si.dtsi_offset > si.dtsi_size)
+				break;
+
+			offs += DTRACE_STACKENT_SIZE(ent->dse_size);
+		}
+
+		si.dtsi_total = end;
+		mutex_exit(&dtrace_lock);
+
+		if (offs > si.dtsi_offset &&
+		    copyout(tab->dst_base + si.dtsi_offset,
+		    (void *)(uintptr_t)si.dtsi_buf, offs - si.dtsi_offset) != 0)
+			RETURN(EFAULT);
+
+		si.dtsi_offset = offs;
+
+		if (copyout(&si, (void *)arg, sizeof (si)) != 0)
+			RETURN(EFAULT);
+
+		return (0);
+	}
+
+	case DTRACEIOC_UNWIND: {
+		dtrace_unwind_t uw;
+
+PRINT_CASE(DTRACEIOC_UNWIND);
+		if (copyin((void *)arg, &uw, sizeof (uw)) != 0)
+			RETURN(EFAULT);
+
+		/*
+		 * The table is owned by this consumer, and is thrown away
+		 * when the state is destroyed.  dtrace_unwind_register()
+		 * takes dtrace_lock itself to publish it.
+		 */
+		if ((rval = dtrace_unwind_register(state, &uw)) != 0)
+			RETURN(rval);
+
+		return (0);
+	}
+# endif
+
 	case DTRACEIOC_CONF: {
 		dtrace_conf_t conf;
 
@@ -16947,12 +19802,20 @@ PRINT_CASE(DTRACEIOC_CONF);
 		nerrs = state->dts_errors;
 		dstate = &state->dts_vstate.dtvs_dynvars;
 
+#if linux
+		if (dstate->dtds_resize != 0)
+			dtrace_dynvar_resize(dstate);
+#endif
+
 		for (i = 0; i < NCPU; i++) {
 			dtrace_dstate_percpu_t *dcpu = &dstate->dtds_percpu[i];
 
 			stat.dtst_dyndrops += dcpu->dtdsc_drops;
 			stat.dtst_dyndrops_dirty += dcpu->dtdsc_dirty_drops;
 			stat.dtst_dyndrops_rinsing += dcpu->dtdsc_rinsing_drops;
+#if linux
+			stat.dtst_tlsdrops += dcpu->dtdsc_tlsdrops;
+#endif
 
 			if (state->dts_buffer[i].dtb_flags & DTRACEBUF_FULL)
 				stat.dtst_filled++;
@@ -16972,6 +19835,9 @@ PRINT_CASE(DTRACEIOC_CONF);
 		stat.dtst_specdrops_busy = state->dts_speculations_busy;
 		stat.dtst_specdrops_unavail = state->dts_speculations_unavail;
 		stat.dtst_stkstroverflows = state->dts_stkstroverflows;
+#if linux
+		stat.dtst_stackiddrops = state->dts_stackid_drops;
+#endif
 		stat.dtst_dblerrors = state->dts_dblerrors;
 		stat.dtst_killed =
 		    (state->dts_activity == DTRACE_ACTIVITY_KILLED);
@@ -17117,9 +19983,7 @@ printk("dtrace_unregister is causing us to fail\n");
 	}
 
 	bzero(&dtrace_anon, sizeof (dtrace_anon_t));
-# if defined(sun)
 	unregister_cpu_setup_func((cpu_setup_func_t *)dtrace_cpu_setup, NULL);
-# endif
 	dtrace_cpu_init = NULL;
 	dtrace_helpers_cleanup = NULL;
 	dtrace_helpers_fork = NULL;
@@ -17149,6 +20013,11 @@ printk("dtrace_unregister is causing us to fail\n");
 	dtrace_byname = NULL;
 
 	kmem_cache_destroy(dtrace_state_cache);
+# if linux
+	dtrace_kmc_destroy(dtrace_action_kmc);
+	dtrace_kmc_destroy(dtrace_ecb_kmc);
+	dtrace_kmc_destroy(dtrace_probe_kmc);
+# endif
 	vmem_destroy(dtrace_minor);
 	vmem_destroy(dtrace_arena);
 
@@ -33,6 +33,9 @@
 #undef zone
 #include "dtrace_linux.h"
 #include <linux/sched.h>
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#	include <linux/sched/task.h>
+# endif
 #include <asm/ucontext.h>
 #include <linux/thread_info.h>
 #include <sys/privregs.h>
@@ -275,6 +278,419 @@ end_stack:
 		pcstack[depth++] = (pc_t) NULL;
 }
 
+# if defined(__amd64)
+/**********************************************************************/
+/*   Fast  user  stack  walker for 64-bit processes. Rather than take  */
+/*   a  chance on faulting for every word of every frame, we copy the  */
+/*   top  of  the user stack (dtrace_ustack_window bytes from %rsp)  */
+/*   into  a  per-cpu  buffer  in one go, and walk the frames in the  */
+/*   copy.  The  copy  is  done  a page at a time, and stops at the  */
+/*   first  page  we  cannot  read,  so a short stack costs us one  */
+/*   fault at most. If a frame points outside the window, we move the  */
+/*   window, but only a few times per stack.			      */
+/*   								      */
+/*   Frame  pointers  only  get  us  so  far  on  a modern distro, so  */
+/*   libdtrace  can  give  us  an  unwind  table  for  a  process it  */
+/*   has  grabbed  (DTRACEIOC_UNWIND), built from .eh_frame. Where we  */
+/*   have  a  rule  for  the  pc,  we  use it; otherwise we follow the  */
+/*   frame  pointer;  and  if  that  goes  nowhere,  we  fall back to  */
+/*   scanning the window for things which look like return addresses,  */
+/*   as dtrace_getupcstack() always used to.			      */
+/**********************************************************************/
+extern int dtrace_ustack_fast;
+extern int dtrace_ustack_window;
+extern int nr_cpus;
+
+unsigned long long cnt_ustack_walk;
+unsigned long long cnt_ustack_fill;
+unsigned long long cnt_ustack_unwind;
+unsigned long long cnt_ustack_scan;
+
+# define	USTACK_MAXFILLS		4
+# define	USTACK_MAXDEPTH		1024
+# define	USTACK_MAXTABS		32
+
+static char	*ustack_buf;
+static int	ustack_window;
+
+typedef struct ustack_win {
+	uintptr_t	uw_base;	/* User address of uw_buf[0]. */
+	size_t		uw_len;		/* Bytes we managed to copy. */
+	char		*uw_buf;
+	int		uw_fills;
+} ustack_win_t;
+
+/**********************************************************************/
+/*   Registered  unwind  tables.  Each  belongs  to the consumer that  */
+/*   registered  it,  and  is  matched  to  a  process  by its mm and  */
+/*   start_stack  (so a recycled mm_struct wont pick up a stale one).  */
+/*   Probe  context reads the slots without a lock; we swap them under  */
+/*   dtrace_lock and dtrace_sync() before freeing the old one.	      */
+/**********************************************************************/
+typedef struct ustack_unwind {
+	void		*uu_owner;
+	struct mm_struct *uu_mm;
+	unsigned long	uu_start_stack;
+	uint32_t	uu_nents;
+	dtrace_unwind_ent_t uu_ents[1];
+} ustack_unwind_t;
+
+static ustack_unwind_t *ustack_unwind_tabs[USTACK_MAXTABS];
+
+# define	USTACK_UNWIND_SIZE(n)	\
+	(sizeof (ustack_unwind_t) + ((n) - 1) * sizeof (dtrace_unwind_ent_t))
+
+void
+dtrace_ustack_init(void)
+{
+	ustack_window = P2ROUNDUP(dtrace_ustack_window, PAGE_SIZE);
+	if (ustack_window < PAGE_SIZE)
+		ustack_window = PAGE_SIZE;
+	ustack_buf = kmem_zalloc(ustack_window * nr_cpus, KM_SLEEP);
+}
+
+void
+dtrace_ustack_fini(void)
+{	int	i;
+
+	for (i = 0; i < USTACK_MAXTABS; i++) {
+		if (ustack_unwind_tabs[i]) {
+			kmem_free(ustack_unwind_tabs[i],
+			    USTACK_UNWIND_SIZE(ustack_unwind_tabs[i]->uu_nents));
+			ustack_unwind_tabs[i] = NULL;
+		}
+	}
+	if (ustack_buf)
+		kmem_free(ustack_buf, ustack_window * nr_cpus);
+	ustack_buf = NULL;
+}
+
+/**********************************************************************/
+/*   Copy  up  to  a window's worth of user stack starting at addr, a  */
+/*   page at a time, stopping at the first page we cannot read.	      */
+/**********************************************************************/
+static int
+ustack_fill(ustack_win_t *w, uintptr_t addr)
+{	size_t	len = 0, chunk;
+
+	if (w->uw_fills++ >= USTACK_MAXFILLS)
+		return -1;
+
+	cnt_ustack_fill++;
+	addr &= ~(uintptr_t) 7;
+	w->uw_base = addr;
+	while (len < ustack_window) {
+		chunk = PAGE_SIZE - ((addr + len) & (PAGE_SIZE - 1));
+		if (chunk > ustack_window - len)
+			chunk = ustack_window - len;
+		if (addr + len + chunk > TASK_SIZE ||
+		    addr + len + chunk < addr)
+			break;
+		if (dtrace_memcpy_with_error(w->uw_buf + len,
+		    (void *) (addr + len), chunk) == 0)
+			break;
+		len += chunk;
+	}
+	w->uw_len = len;
+	return len ? 0 : -1;
+}
+
+static int
+ustack_read(ustack_win_t *w, uintptr_t addr, uint64_t *valp)
+{
+	if (addr & 7)
+		return -1;
+	if (addr < w->uw_base || addr + 8 > w->uw_base + w->uw_len) {
+		if (ustack_fill(w, addr) != 0)
+			return -1;
+	}
+	*valp = *(uint64_t *) (w->uw_buf + (addr - w->uw_base));
+	return 0;
+}
+
+static ustack_unwind_t *
+ustack_unwind_find(void)
+{	struct mm_struct *mm = current->mm;
+	ustack_unwind_t *uu;
+	int	i;
+
+	for (i = 0; i < USTACK_MAXTABS; i++) {
+		if ((uu = ustack_unwind_tabs[i]) != NULL &&
+		    uu->uu_mm == mm && uu->uu_start_stack == mm->start_stack)
+			return uu;
+	}
+	return NULL;
+}
+
+static dtrace_unwind_ent_t *
+ustack_unwind_rule(ustack_unwind_t *uu, uintptr_t pc)
+{	int	lo = 0, hi = uu->uu_nents - 1, mid;
+	dtrace_unwind_ent_t *ue;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		ue = &uu->uu_ents[mid];
+		if (pc < ue->dtue_pc)
+			hi = mid - 1;
+		else if (pc >= ue->dtue_pc + ue->dtue_len)
+			lo = mid + 1;
+		else
+			return ue;
+	}
+	return NULL;
+}
+
+/**********************************************************************/
+/*   Is  v  plausibly  a  return  address?  Same  test  as  the  old  */
+/*   stack  scanner  used:  not on the stack, and in an exec mapping.  */
+/**********************************************************************/
+static int
+ustack_is_text(ustack_win_t *w, uint64_t v)
+{	struct vm_area_struct *vma;
+
+	if (v >= w->uw_base && v < w->uw_base + ustack_window)
+		return 0;
+	if (v < PAGE_SIZE || v >= TASK_SIZE)
+		return 0;
+	vma = find_vma(current->mm, (unsigned long) v);
+	return vma && vma->vm_start <= v && (vma->vm_flags & VM_EXEC);
+}
+
+/**********************************************************************/
+/*   Walk  the  user  stack  of  the current (64-bit) thread. Fills in  */
+/*   up  to  limit pcs (and frame pointers, if fpstack is not NULL),  */
+/*   and returns the number of frames. With pcstack NULL, just count.  */
+/**********************************************************************/
+static int
+dtrace_ustack_walk(uint64_t *pcstack, uint64_t *fpstack, int limit)
+{	struct pt_regs *rp = task_pt_regs(current);
+	ustack_unwind_t *uu;
+	dtrace_unwind_ent_t *ue;
+	ustack_win_t w;
+	uint64_t pc = rp->ip, sp = rp->sp, fp = rp->bp, cfa, v;
+	int	n = 0;
+
+	cnt_ustack_walk++;
+	w.uw_buf = ustack_buf + cpu_get_id() * ustack_window;
+	w.uw_fills = 0;
+	if (ustack_fill(&w, sp) != 0)
+		w.uw_len = 0;
+
+	uu = ustack_unwind_find();
+
+	while (pc != 0 && n < limit) {
+		if (pcstack) {
+			pcstack[n] = pc;
+			if (fpstack)
+				fpstack[n] = fp;
+		}
+		n++;
+
+		/***********************************************/
+		/*   Above  the  first  frame,  pc  is a return  */
+		/*   address,  which  may be just past the end  */
+		/*   of a function which doesnt return.	       */
+		/***********************************************/
+		if (uu && (ue = ustack_unwind_rule(uu, n == 1 ? pc : pc - 1))
+		    != NULL) {
+			cnt_ustack_unwind++;
+			cfa = (ue->dtue_cfareg == DTRACE_UNWIND_FP ? fp : sp) +
+				ue->dtue_cfaoff;
+			if (cfa <= sp || ustack_read(&w, cfa - 8, &pc) != 0)
+				break;
+			if (ue->dtue_fpoff != 0 &&
+			    ustack_read(&w, cfa + ue->dtue_fpoff, &fp) != 0)
+				break;
+			sp = cfa;
+			continue;
+		}
+
+		/***********************************************/
+		/*   At  a function entry probe, the frame is  */
+		/*   not set up yet; the caller is at (%rsp).  */
+		/***********************************************/
+		if (n == 1 && DTRACE_CPUFLAG_ISSET(CPU_DTRACE_ENTRY)) {
+			if (ustack_read(&w, sp, &pc) != 0)
+				break;
+			sp += 8;
+			continue;
+		}
+
+		if (fp < sp || ustack_read(&w, fp + 8, &pc) != 0 ||
+		    ustack_read(&w, fp, &v) != 0)
+			break;
+		sp = fp + 16;
+		fp = v;
+	}
+
+	if (pc == 0 || n >= limit || uu || w.uw_len == 0)
+		return n;
+
+	/***********************************************/
+	/*   The  frame pointer chain went off into the  */
+	/*   weeds,  and  we  have no unwind table. Scan  */
+	/*   the rest of the window.		       */
+	/***********************************************/
+	cnt_ustack_scan++;
+	if (sp < w.uw_base || sp >= w.uw_base + w.uw_len)
+		sp = w.uw_base;
+	for (sp = P2ROUNDUP(sp, 8); sp + 8 <= w.uw_base + w.uw_len && n < limit;
+	     sp += 8) {
+		v = *(uint64_t *) (w.uw_buf + (sp - w.uw_base));
+		if (!ustack_is_text(&w, v))
+			continue;
+		if (pcstack) {
+			pcstack[n] = v;
+			if (fpstack)
+				fpstack[n] = 0;
+		}
+		n++;
+	}
+	return n;
+}
+
+/**********************************************************************/
+/*   Should we use the walker above for the current thread?	      */
+/**********************************************************************/
+static int
+dtrace_ustack_fastok(void)
+{
+	return dtrace_ustack_fast && ustack_buf && current->mm &&
+		task_pt_regs(current)->cs == __USER_CS;
+}
+
+/**********************************************************************/
+/*   DTRACEIOC_UNWIND:  register  (or  with  no  entries, drop) the  */
+/*   consumer's  unwind  table  for  a process. The consumer must be  */
+/*   allowed  to  read  the  process,  as  for  the pid provider. A  */
+/*   consumer  only  ever replaces or drops its own table; others'  */
+/*   tables for the same process are left alone.		      */
+/**********************************************************************/
+int
+dtrace_unwind_register(void *owner, dtrace_unwind_t *uw)
+{	ustack_unwind_t *uu = NULL, *old;
+	struct task_struct *tp;
+	struct mm_struct *mm;
+	unsigned long start_stack;
+	uint32_t i;
+	int	slot = -1;
+	int	ret;
+
+	if (uw->dtuw_nents > DTRACE_UNWIND_MAXENTS)
+		return EINVAL;
+
+	if ((tp = prfind_task(uw->dtuw_pid)) == NULL)
+		return ESRCH;
+	if ((ret = dtrace_task_cred_perm(CRED(), tp, VREAD)) != 0) {
+		put_task_struct(tp);
+		return ret;
+	}
+	task_lock(tp);
+	mm = tp->mm;
+	start_stack = mm ? mm->start_stack : 0;
+	task_unlock(tp);
+	put_task_struct(tp);
+	if (mm == NULL)
+		return ESRCH;
+
+	if (uw->dtuw_nents) {
+		uu = kmem_alloc(USTACK_UNWIND_SIZE(uw->dtuw_nents), KM_SLEEP);
+		if (copyin((void *) (uintptr_t) uw->dtuw_ents, uu->uu_ents,
+		    uw->dtuw_nents * sizeof (dtrace_unwind_ent_t)) != 0) {
+			kmem_free(uu, USTACK_UNWIND_SIZE(uw->dtuw_nents));
+			return EFAULT;
+		}
+		for (i = 0; i < uw->dtuw_nents; i++) {
+			dtrace_unwind_ent_t *ue = &uu->uu_ents[i];
+
+			if (ue->dtue_cfareg > DTRACE_UNWIND_FP ||
+			    ue->dtue_len == 0 ||
+			    ue->dtue_pc + ue->dtue_len < ue->dtue_pc ||
+			    (i && ue->dtue_pc < ue[-1].dtue_pc + ue[-1].dtue_len)) {
+				kmem_free(uu, USTACK_UNWIND_SIZE(uw->dtuw_nents));
+				return EINVAL;
+			}
+		}
+		uu->uu_owner = owner;
+		uu->uu_mm = mm;
+		uu->uu_start_stack = start_stack;
+		uu->uu_nents = uw->dtuw_nents;
+	}
+
+	mutex_enter(&dtrace_lock);
+	for (i = 0; i < USTACK_MAXTABS; i++) {
+		old = ustack_unwind_tabs[i];
+		if (old && old->uu_owner == owner && old->uu_mm == mm &&
+		    old->uu_start_stack == start_stack) {
+			slot = i;
+			break;
+		}
+		if (old == NULL && slot < 0 && uu)
+			slot = i;
+	}
+	if (slot < 0) {
+		mutex_exit(&dtrace_lock);
+		if (uu == NULL)
+			return 0;
+		kmem_free(uu, USTACK_UNWIND_SIZE(uu->uu_nents));
+		return ENOSPC;
+	}
+
+	old = ustack_unwind_tabs[slot];
+	membar_producer();
+	ustack_unwind_tabs[slot] = uu;
+	if (old) {
+		dtrace_sync();
+		kmem_free(old, USTACK_UNWIND_SIZE(old->uu_nents));
+	}
+	mutex_exit(&dtrace_lock);
+	return 0;
+}
+
+/**********************************************************************/
+/*   Consumer is going away - drop its unwind tables.		      */
+/**********************************************************************/
+void
+dtrace_unwind_release(void *owner)
+{	ustack_unwind_t *uu[USTACK_MAXTABS];
+	int	i, n = 0;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	for (i = 0; i < USTACK_MAXTABS; i++) {
+		if (ustack_unwind_tabs[i] &&
+		    ustack_unwind_tabs[i]->uu_owner == owner) {
+			uu[n++] = ustack_unwind_tabs[i];
+			ustack_unwind_tabs[i] = NULL;
+		}
+	}
+	if (n == 0)
+		return;
+
+	dtrace_sync();
+	for (i = 0; i < n; i++)
+		kmem_free(uu[i], USTACK_UNWIND_SIZE(uu[i]->uu_nents));
+}
+# else
+void
+dtrace_ustack_init(void)
+{
+}
+void
+dtrace_ustack_fini(void)
+{
+}
+int
+dtrace_unwind_register(void *owner, dtrace_unwind_t *uw)
+{
+	return ENOTSUP;
+}
+void
+dtrace_unwind_release(void *owner)
+{
+}
+# endif
+
 /**********************************************************************/
 /*   Get  user space stack for the probed process. We need to handle  */
 /*   32 + 64 bit binaries, if we are on a 64b kernel, and also frame  */
@@ -300,6 +716,16 @@ dtrace_getupcstack(uint64_t *pcstack, int pcstack_limit)
 	if (pcstack >= pcstack_end)
 		return;
 
+# if defined(__amd64)
+	if (dtrace_ustack_fastok()) {
+		pcstack += dtrace_ustack_walk(pcstack, NULL,
+		    pcstack_end - pcstack);
+		while (pcstack < pcstack_end)
+			*pcstack++ = (pc_t) NULL;
+		return;
+	}
+# endif
+
 	/***********************************************/
 	/*   Linux provides a built in function which  */
 	/*   is  good  because  stack walking is arch  */
@@ -437,6 +863,10 @@ dtrace_getupcstack(uint64_t *pcstack, int pcstack_limit)
 int
 dtrace_getustackdepth(void)
 {
+# if defined(__amd64)
+	if (dtrace_ustack_fastok())
+		return dtrace_ustack_walk(NULL, NULL, USTACK_MAXDEPTH);
+# endif
 printk("need to do this dtrace_getustackdepth\n");
 # if 0
 	klwp_t *lwp = ttolwp(curthread);
@@ -476,6 +906,20 @@ printk("need to do this dtrace_getustackdepth\n");
 void
 dtrace_getufpstack(uint64_t *pcstack, uint64_t *fpstack, int pcstack_limit)
 {
+# if defined(__amd64)
+	int	n;
+
+	if (dtrace_ustack_fastok() && pcstack_limit > 0) {
+		*pcstack++ = (uint64_t)current->pid;
+		pcstack_limit--;
+		n = dtrace_ustack_walk(pcstack, fpstack, pcstack_limit);
+		while (n < pcstack_limit) {
+			pcstack[n] = 0;
+			fpstack[n++] = 0;
+		}
+		return;
+	}
+# endif
 printk("need to do this dtrace_getufpstack\n");
 # if 0
 	klwp_t *lwp = ttolwp(curthread);
@@ -977,54 +1421,75 @@ dtrace_copyoutstr(uintptr_t kaddr, uintptr_t uaddr, size_t size,
 		}
 }
 
+/**********************************************************************/
+/*   Fetch  a  word  for  the  ULD*  DIF  instructions.  The address  */
+/*   has  been checked to be in user space, but may not be mapped, so  */
+/*   read  it  the  way  copyin()  does, and flag a fault rather than  */
+/*   taking the page fault in probe context.			      */
+/**********************************************************************/
+static int
+dtrace_fuword_copy(void *uaddr, void *val, size_t size)
+{
+	if (dtrace_memcpy_with_error(val, uaddr, size) == 0) {
+		DTRACE_CPUFLAG_SET(CPU_DTRACE_BADADDR);
+		cpu_core[cpu_get_id()].cpuc_dtrace_illval = (uintptr_t)uaddr;
+		return (0);
+	}
+	return (1);
+}
+
 uint8_t
 dtrace_fuword8(void *uaddr)
 {
-	extern uint8_t dtrace_fuword8_nocheck(void *);
+	uint8_t val;
+
 	if (!access_ok(VERIFY_READ, uaddr, 1)) {
 		DTRACE_CPUFLAG_SET(CPU_DTRACE_BADADDR);
 		printk("dtrace_fuword8: uaddr=%p CPU_DTRACE_BADADDR\n", uaddr);
 		cpu_core[cpu_get_id()].cpuc_dtrace_illval = (uintptr_t)uaddr;
 		return (0);
 	}
-	return (dtrace_fuword8_nocheck(uaddr));
+	return (dtrace_fuword_copy(uaddr, &val, sizeof (val)) ? val : 0);
 }
 
 uint16_t
 dtrace_fuword16(void *uaddr)
 {
-	extern uint16_t dtrace_fuword16_nocheck(void *);
+	uint16_t val;
+
 	if (!access_ok(VERIFY_WRITE, uaddr, 2)) {
 		printk("dtrace_fuword16: uaddr=%p CPU_DTRACE_BADADDR\n", uaddr);
 		DTRACE_CPUFLAG_SET(CPU_DTRACE_BADADDR);
 		cpu_core[cpu_get_id()].cpuc_dtrace_illval = (uintptr_t)uaddr;
 		return (0);
 	}
-	return (dtrace_fuword16_nocheck(uaddr));
+	return (dtrace_fuword_copy(uaddr, &val, sizeof (val)) ? val : 0);
 }
 
 uint32_t
 dtrace_fuword32(void *uaddr)
 {
-	extern uint32_t dtrace_fuword32_nocheck(void *);
+	uint32_t val;
+
 	if (!addr_valid(uaddr)) {
 HERE2();
 		DTRACE_CPUFLAG_SET(CPU_DTRACE_BADADDR);
 		cpu_core[cpu_get_id()].cpuc_dtrace_illval = (uintptr_t)uaddr;
 		return (0);
 	}
-	return (dtrace_fuword32_nocheck(uaddr));
+	return (dtrace_fuword_copy(uaddr, &val, sizeof (val)) ? val : 0);
 }
 
 uint64_t
 dtrace_fuword64(void *uaddr)
 {
-	extern uint64_t dtrace_fuword64_nocheck(void *);
+	uint64_t val;
+
 	if (!addr_valid(uaddr)) {
 HERE2();
 		DTRACE_CPUFLAG_SET(CPU_DTRACE_BADADDR);
 		cpu_core[cpu_get_id()].cpuc_dtrace_illval = (uintptr_t)uaddr;
 		return (0);
 	}
-	return (dtrace_fuword64_nocheck(uaddr));
+	return (dtrace_fuword_copy(uaddr, &val, sizeof (val)) ? val : 0);
 }
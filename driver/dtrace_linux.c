@@ -31,6 +31,21 @@
 #include <linux/thread_info.h>
 #include <linux/profile.h>
 #include <linux/vmalloc.h>
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 16)
+	void sort(void *base, size_t num, size_t size,
+          int (*cmp)(const void *, const void *),
+          void (*swap)(void *, void *, int));
+#else
+#	include <linux/sort.h>
+#endif
+#include <linux/poll.h>
+#include <linux/wait.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#	include <linux/sched/task.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+#include <linux/irq_work.h>
+#endif
 #include <asm/tlbflush.h>
 #include <asm/current.h>
 # if defined(__i386) || defined(__amd64)
@@ -58,8 +73,20 @@ int dtrace_unhandled;
 module_param(dtrace_unhandled, int, 0);
 int fbt_name_opcodes;
 module_param(fbt_name_opcodes, int, 0);
+int fbt_optimize;
+module_param(fbt_optimize, int, 0);
 int grab_panic;
 module_param(grab_panic, int, 0);
+int dtrace_buf_hugepages;
+module_param(dtrace_buf_hugepages, int, 0);
+int dtrace_tsc_clock = 1;
+module_param(dtrace_tsc_clock, int, 0);
+int fasttrap_emulate = 1;
+module_param(fasttrap_emulate, int, 0);
+int dtrace_ustack_fast = 1;
+module_param(dtrace_ustack_fast, int, 0);
+int dtrace_ustack_window = 16384;
+module_param(dtrace_ustack_window, int, 0);
 char *arg_kallsyms_lookup_name; /* Done as a string, because kernel doesnt */
 				/* like 0xfffffff12345678 as a number. */
 module_param(arg_kallsyms_lookup_name, charp, 0);
@@ -119,6 +146,46 @@ char *(*dentry_path_fn)(struct dentry *, char *, int);
 static struct module *(*fn__module_text_address)(unsigned long);
 void *(*fn_pid_task)(void *, int);
 void *(*fn_find_get_pid)(int);
+static void (*fn_put_pid)(void *);
+
+/**********************************************************************/
+/*   poll(2)  support.  Probes  note  a  buffer  crossing its "fill"  */
+/*   watermark  in  the state, but cannot safely wake anyone up from  */
+/*   probe  context,  so we bounce the wakeup through irq_work where  */
+/*   the kernel has it, and the state's cleaner cyclic otherwise.     */
+/**********************************************************************/
+static DECLARE_WAIT_QUEUE_HEAD(dtrace_pollwait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+static void (*fn_irq_work_queue)(struct irq_work *);
+static void (*fn_irq_work_sync)(struct irq_work *);
+static struct irq_work dtrace_poll_work;
+
+static void
+dtrace_poll_work_func(struct irq_work *work)
+{
+	wake_up_interruptible(&dtrace_pollwait);
+}
+#endif
+
+/**********************************************************************/
+/*   Called from probe context.					      */
+/**********************************************************************/
+void
+dtrace_poll_notify(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	if (fn_irq_work_queue)
+		fn_irq_work_queue(&dtrace_poll_work);
+#endif
+}
+/**********************************************************************/
+/*   Called from the cleaner cyclic, which is not probe context.      */
+/**********************************************************************/
+void
+dtrace_poll_wakeup(void)
+{
+	wake_up_interruptible(&dtrace_pollwait);
+}
 
 /**********************************************************************/
 /*   Stats    counters   for   ad   hoc   debugging;   exposed   via  */
@@ -146,7 +213,7 @@ cpu_core_t	*cpu_core;
 cpu_t		*cpu_table;
 cred_t		*cpu_cred;
 int	nr_cpus = 1;
-MUTEX_DEFINE(mod_lock);
+MUTEX_DEFINE_QUEUED(mod_lock);
 
 /**********************************************************************/
 /*   Set  to  true  by  debug code that wants to immediately disable  */
@@ -163,8 +230,9 @@ int dtrace_shutdown;
 /*   can change, but typically doesnt.				      */
 /**********************************************************************/
 sol_proc_t	*shadow_procs;
+static sol_proc_t *par_overflow;	/* Per-cpu, when shadow_procs is full. */
 
-MUTEX_DEFINE(cpu_lock);
+MUTEX_DEFINE_QUEUED(cpu_lock);
 int	panic_quiesce;
 sol_proc_t	*curthread;
 
@@ -244,17 +312,35 @@ extern unsigned long cnt_xcall5;
 extern unsigned long long cnt_xcall6;
 extern unsigned long long cnt_xcall7;
 extern unsigned long cnt_xcall8;
+extern unsigned long cnt_xcall_overflow;
 extern unsigned long cnt_nmi1;
 extern unsigned long cnt_nmi2;
 extern unsigned long long cnt_timer1;
 extern unsigned long long cnt_timer2;
 extern unsigned long long cnt_timer3;
+extern unsigned long long cnt_timer_omni;
+extern unsigned long long cnt_difjit_compiled;
+extern unsigned long long cnt_difjit_unsupported;
+extern unsigned long long cnt_dif_predecoded;
+extern unsigned long long cnt_dif_fused;
+extern unsigned long long cnt_tls_slot;
+extern unsigned long long cnt_tls_dynvar;
+extern unsigned long long cnt_stackid_hit;
+extern unsigned long long cnt_stackid_new;
+extern unsigned long long cnt_ustack_walk;
+extern unsigned long long cnt_ustack_fill;
+extern unsigned long long cnt_ustack_unwind;
+extern unsigned long long cnt_ustack_scan;
+extern unsigned long long cnt_dynhash_resize;
+extern unsigned long long cnt_dynhash_resize_abort;
+extern unsigned long long cnt_hrtime_clamp;
+extern unsigned long long cnt_hrtime_retry;
+extern int hrtime_mode;
 
 /**********************************************************************/
 /*   Prototypes.						      */
 /**********************************************************************/
 void ctf_setup(void);
-static void * par_lookup(void *ptr);
 # define	cas32 dtrace_cas32
 uint32_t dtrace_cas32(uint32_t *target, uint32_t cmp, uint32_t new);
 int	ctf_init(void);
@@ -328,6 +414,58 @@ CRED()
 
 	return cr;
 }
+/**********************************************************************/
+/*   Solaris  priv_proc_cred_perm(): may the holder of cr get at the  */
+/*   process  p  (VREAD/VWRITE)?  We  dont  have  the  Solaris  proc  */
+/*   privileges,  so  use  the same rule as ctl.c does for reading a  */
+/*   process'  memory:  root  may, and otherwise the target's real,  */
+/*   effective  and  saved uids must all be the caller's (so nobody  */
+/*   gets into a setuid process just because they started it).	      */
+/*   								      */
+/*   The  proc_t's  p_task  may  be  stale  -  the  process may have  */
+/*   exited  since  we  found  it - so look the task up afresh by pid  */
+/*   and  hold  it whilst we look. Its creds can be replaced under us  */
+/*   (setuid(2)), so read them under rcu_read_lock().		      */
+/**********************************************************************/
+int
+dtrace_task_cred_perm(const cred_t *cr, struct task_struct *tp, int mode)
+{	uid_t	uid = KUIDT_VALUE(cr->cr_uid);
+	int	ret = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	const struct cred *tcr;
+#endif
+
+	if (uid == 0)
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+	rcu_read_lock();
+	tcr = __task_cred(tp);
+	if (KUIDT_VALUE(tcr->uid) != uid ||
+	    KUIDT_VALUE(tcr->euid) != uid ||
+	    KUIDT_VALUE(tcr->suid) != uid)
+		ret = EACCES;
+	rcu_read_unlock();
+#else
+	if (tp->uid != uid || tp->euid != uid || tp->suid != uid)
+		ret = EACCES;
+#endif
+	return ret;
+}
+int
+priv_proc_cred_perm(const cred_t *cr, proc_t *p, cred_t **pcr, int mode)
+{	struct task_struct *tp;
+	int	ret;
+
+	if (KUIDT_VALUE(cr->cr_uid) == 0)
+		return 0;
+	if ((tp = prfind_task(p->p_pid)) == NULL)
+		return ESRCH;
+
+	ret = dtrace_task_cred_perm(cr, tp, mode);
+	put_task_struct(tp);
+	return ret;
+}
 # if 0
 /**********************************************************************/
 /*   Placeholder  code  --  we  need  to  avoid a linear tomax/xamot  */
@@ -393,12 +531,19 @@ atomic_add_64(uint64_t *p, int n)
 /*   								      */
 /* dtrace -n 'syscall:::entry { self->ts = timestamp; }
     syscall:::return /self->ts/ { @["ns"] = quantize(timestamp - self->ts); }' */
+/*   								      */
+/*   Once  dtrace_linux_init()  has  run, we use our own clock (see  */
+/*   hrtime.c). The code below is only for before then, or if we      */
+/*   could not find ktime_get().				      */
 /**********************************************************************/
 hrtime_t
 dtrace_gethrtime()
 {
 	struct timespec ts;
 
+	if (hrtime_mode)
+		return dtrace_hrtime_read();
+
 	/*
 	void (*ktime_get_ts)() = get_proc_addr("ktime_get_ts");
 	if (ktime_get_ts == NULL) return 0;
@@ -677,6 +822,16 @@ dtrace_linux_init(void)
 	/***********************************************/
 	fn_pid_task = get_proc_addr("pid_task");
 	fn_find_get_pid = get_proc_addr("find_get_pid");
+	fn_put_pid = get_proc_addr("put_pid");
+
+	/***********************************************/
+	/*   Used to wake poll(2)ers from probes.      */
+	/***********************************************/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	fn_irq_work_queue = get_proc_addr("irq_work_queue");
+	fn_irq_work_sync = get_proc_addr("irq_work_sync");
+	init_irq_work(&dtrace_poll_work, dtrace_poll_work_func);
+#endif
 
 	/***********************************************/
 	/*   Initialise the interrupt vectors.	       */
@@ -757,6 +912,12 @@ dtrace_linux_init(void)
 			xtime_cache_ptr = (struct timespec *) (p + sizeof(struct timekeeper_hack));
 		}
 	}
+
+	/***********************************************/
+	/*   Now set up our own clock.		       */
+	/***********************************************/
+	dtrace_hrtime_init();
+
 # if defined(__arm__)
 	ktime_get_ptr = (ktime_t (*)(void)) get_proc_addr("ktime_get");
 	# define rdtscll(t) t = ktime_get_ptr().tv64
@@ -785,6 +946,11 @@ static int
 dtrace_linux_fini(void)
 {	int	ret = 1;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	if (fn_irq_work_queue && fn_irq_work_sync)
+		fn_irq_work_sync(&dtrace_poll_work);
+#endif
+
 	/***********************************************/
 	/*   If kernel doesnt have this enabled, then  */
 	/*   we  wont  have  set  up the notifier and  */
@@ -806,6 +972,8 @@ dtrace_linux_fini(void)
 		ret = 0;
 	}
 
+	fini_cyclic();
+
 	/***********************************************/
 	/*   Stop  the IPI interrupt from firing (and  */
 	/*   hanging  dtrace_xcall)  as we unload the  */
@@ -1282,6 +1450,31 @@ km_check(unsigned long flags)
 }
 
 # define	VMALLOC_SIZE	(100 * 1024)
+
+/**********************************************************************/
+/*   Bytes  handed  out  via kmem_alloc/kmem_zalloc and not yet freed,  */
+/*   and  the  high-water mark, for /proc/dtrace/memory. The peak is  */
+/*   updated without a lock, so may be a little behind.		      */
+/**********************************************************************/
+static atomic_long_t kmem_live;
+static long kmem_peak;
+static atomic_long_t vmalloc_live;
+static long vmalloc_peak;
+
+static void
+kmem_account(void *ptr, long size)
+{	int	big = (size < 0 ? -size : size) > VMALLOC_SIZE;
+	atomic_long_t *live = big ? &vmalloc_live : &kmem_live;
+	long	*peak = big ? &vmalloc_peak : &kmem_peak;
+	long	n;
+
+	if (ptr == NULL)
+		return;
+	n = atomic_long_add_return(size, live);
+	if (n > *peak)
+		*peak = n;
+}
+
 void *
 kmem_alloc(size_t size, int flags)
 {	void *ptr;
@@ -1292,6 +1485,7 @@ kmem_alloc(size_t size, int flags)
 	} else {
 		ptr = kmalloc(size, flags);
 	}
+	kmem_account(ptr, size);
 	if (TRACE_ALLOC || dtrace_mem_alloc)
 		dtrace_printf("kmem_alloc(%d) := %p ret=%p\n", (int) size, ptr, __builtin_return_address(0));
 	return ptr;
@@ -1308,6 +1502,7 @@ kmem_zalloc(size_t size, int flags)
 	} else {
 		ptr = kzalloc(size, flags);
 	}
+	kmem_account(ptr, size);
 	if (TRACE_ALLOC || dtrace_mem_alloc)
 		dtrace_printf("kmem_zalloc(%d) := %p\n", (int) size, ptr);
 	return ptr;
@@ -1317,12 +1512,337 @@ kmem_free(void *ptr, int size)
 {
 	if (TRACE_ALLOC || dtrace_mem_alloc)
 		dtrace_printf("kmem_free(%p, size=%d)\n", ptr, size);
+	kmem_account(ptr, -size);
 	if (size > VMALLOC_SIZE)
 		vfree(ptr);
 	else
 		kfree(ptr);
 }
 
+/**********************************************************************/
+/*   Typed  object  caches.  A broad enabling (fbt:::) creates one or  */
+/*   more  dtrace_probe_t,  fbt_probe_t,  dtrace_ecb_t  and dtrace_  */
+/*   action_t  per  kernel  function;  going  through  kmalloc  for  */
+/*   each  scatters  them  across  the  general size classes. Give each  */
+/*   type  its own slab, and count live objects per type so we can see  */
+/*   where the memory has gone.					      */
+/*   								      */
+/*   Between dtrace_kmc_bulk_begin() and dtrace_kmc_bulk_end() (i.e.  */
+/*   for  the  duration  of  dtrace_enabling_match())  allocations are  */
+/*   served  from a small per-cache magazine which is refilled in one  */
+/*   go,  using  kmem_cache_alloc_bulk()  where the kernel has it. Any  */
+/*   objects left over are handed back at the end of the pass.	      */
+/*   								      */
+/*   A  NULL  cache (we could not create it) is not fatal: allocations  */
+/*   just  go  to  kmem_zalloc(),  which  is  why the size is passed  */
+/*   again on every call.					      */
+/**********************************************************************/
+# define	KMC_MAX		8
+# define	KMC_BATCH	64
+
+struct dtrace_kmc {
+	const char	*kc_name;
+	size_t		kc_size;
+	kmem_cache_t	*kc_cache;
+	spinlock_t	kc_lock;
+	int		kc_nmag;
+	void		*kc_mag[KMC_BATCH];
+	unsigned long long kc_allocs;
+	unsigned long long kc_refills;
+	long		kc_live;
+	long		kc_peak;
+	};
+static dtrace_kmc_t *kmc_tab[KMC_MAX];
+static atomic_t kmc_bulk;
+static DEFINE_SPINLOCK(kmc_tab_lock);
+
+dtrace_kmc_t *
+dtrace_kmc_create(const char *name, size_t size)
+{	dtrace_kmc_t *kc;
+	int	i;
+
+	if ((kc = kzalloc(sizeof *kc, GFP_KERNEL)) == NULL)
+		return NULL;
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	spin_lock_init(&kc->kc_lock);
+	kc->kc_cache = kmem_cache_create(name, size, 0, 0, NULL
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
+		, NULL
+#endif
+		);
+	if (kc->kc_cache == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	spin_lock(&kmc_tab_lock);
+	for (i = 0; i < KMC_MAX; i++) {
+		if (kmc_tab[i] == NULL) {
+			kmc_tab[i] = kc;
+			break;
+		}
+	}
+	spin_unlock(&kmc_tab_lock);
+	return kc;
+}
+
+static void
+kmc_drain(dtrace_kmc_t *kc)
+{	void	*objs[KMC_BATCH];
+	int	n;
+
+	spin_lock(&kc->kc_lock);
+	n = kc->kc_nmag;
+	memcpy(objs, kc->kc_mag, n * sizeof objs[0]);
+	kc->kc_nmag = 0;
+	spin_unlock(&kc->kc_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+	if (n)
+		kmem_cache_free_bulk(kc->kc_cache, n, objs);
+#else
+	while (n-- > 0)
+		kmem_cache_free(kc->kc_cache, objs[n]);
+#endif
+}
+
+void
+dtrace_kmc_destroy(dtrace_kmc_t *kc)
+{	int	i;
+
+	if (kc == NULL)
+		return;
+
+	kmc_drain(kc);
+	if (kc->kc_live)
+		dtrace_printf("dtrace_kmc_destroy(%s): %ld objects leaked\n",
+			kc->kc_name, kc->kc_live);
+
+	spin_lock(&kmc_tab_lock);
+	for (i = 0; i < KMC_MAX; i++) {
+		if (kmc_tab[i] == kc)
+			kmc_tab[i] = NULL;
+	}
+	spin_unlock(&kmc_tab_lock);
+
+	kmem_cache_destroy(kc->kc_cache);
+	kfree(kc);
+}
+
+/**********************************************************************/
+/*   Refill  the  magazine.  The  allocation  may  sleep,  so it's done  */
+/*   outside kc_lock into a local array.			      */
+/**********************************************************************/
+static void
+kmc_refill(dtrace_kmc_t *kc, int flags)
+{	void	*objs[KMC_BATCH];
+	int	n, i;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+	n = kmem_cache_alloc_bulk(kc->kc_cache, flags, KMC_BATCH, objs);
+#else
+	for (n = 0; n < KMC_BATCH; n++) {
+		if ((objs[n] = kmem_cache_alloc(kc->kc_cache, flags)) == NULL)
+			break;
+	}
+#endif
+	spin_lock(&kc->kc_lock);
+	for (i = 0; i < n && kc->kc_nmag < KMC_BATCH; i++)
+		kc->kc_mag[kc->kc_nmag++] = objs[i];
+	kc->kc_refills++;
+	spin_unlock(&kc->kc_lock);
+
+	/***********************************************/
+	/*   Someone  else  refilled  at the same time  */
+	/*   - give back what didnt fit.	       */
+	/***********************************************/
+	for ( ; i < n; i++)
+		kmem_cache_free(kc->kc_cache, objs[i]);
+}
+
+void *
+dtrace_kmc_zalloc(dtrace_kmc_t *kc, size_t size, int flags)
+{	void	*ptr = NULL;
+
+	if (kc == NULL)
+		return kmem_zalloc(size, flags);
+
+	if (atomic_read(&kmc_bulk) && flags == KM_SLEEP) {
+		if (kc->kc_nmag == 0)
+			kmc_refill(kc, flags);
+		spin_lock(&kc->kc_lock);
+		if (kc->kc_nmag)
+			ptr = kc->kc_mag[--kc->kc_nmag];
+		spin_unlock(&kc->kc_lock);
+	}
+	if (ptr == NULL && (ptr = kmem_cache_alloc(kc->kc_cache, flags)) == NULL)
+		return NULL;
+	memset(ptr, 0, kc->kc_size);
+
+	spin_lock(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (++kc->kc_live > kc->kc_peak)
+		kc->kc_peak = kc->kc_live;
+	spin_unlock(&kc->kc_lock);
+
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_kmc_zalloc(%s) := %p\n", kc->kc_name, ptr);
+	return ptr;
+}
+
+void
+dtrace_kmc_free(dtrace_kmc_t *kc, void *ptr, size_t size)
+{
+	if (kc == NULL) {
+		kmem_free(ptr, size);
+		return;
+	}
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_kmc_free(%s, %p)\n", kc->kc_name, ptr);
+	if (ptr == NULL)
+		return;
+
+	spin_lock(&kc->kc_lock);
+	kc->kc_live--;
+	spin_unlock(&kc->kc_lock);
+	kmem_cache_free(kc->kc_cache, ptr);
+}
+
+/**********************************************************************/
+/*   Bulk  windows  may  nest;  only the outermost one drains the  */
+/*   magazines.  They  are  opened  under dtrace_lock when matching  */
+/*   enablings,  but  under dtrace_provider_lock alone when asking  */
+/*   the providers for probes, so the count is atomic.		      */
+/**********************************************************************/
+void
+dtrace_kmc_bulk_begin(void)
+{
+	atomic_inc(&kmc_bulk);
+}
+void
+dtrace_kmc_bulk_end(void)
+{	int	i;
+
+	if (!atomic_dec_and_test(&kmc_bulk))
+		return;
+
+	spin_lock(&kmc_tab_lock);
+	for (i = 0; i < KMC_MAX; i++) {
+		if (kmc_tab[i])
+			kmc_drain(kmc_tab[i]);
+	}
+	spin_unlock(&kmc_tab_lock);
+}
+
+/**********************************************************************/
+/*   Trace  buffers.  These  are page aligned and page granular so that  */
+/*   the consumer can mmap(2) them; see dtracedrv_mmap().	      */
+/*   								      */
+/*   Each  CPU's  buffers  are  placed on that CPU's NUMA node, since  */
+/*   every  probe  firing  on  the  CPU stores into them. With the  */
+/*   dtrace_buf_hugepages  module  parameter  set, buffers of at least  */
+/*   2MB  are  first tried as physically contiguous pages, which live  */
+/*   in  the  kernel  direct  map  and  so  are  covered  by large TLB  */
+/*   entries.  If  that  fails  we  fall  back to a node-local vmalloc,  */
+/*   which  will  itself  spill onto another node if it must. Only if  */
+/*   that  fails  do  we return NULL, and let bufresize=auto shrink the  */
+/*   request as usual.						      */
+/*                                                                    */
+/*   Neither may try too hard: a consumer asking for more than the    */
+/*   machine can spare should get NULL (and a smaller buffer), not    */
+/*   set the OOM killer on everyone else. So the vmalloc is done      */
+/*   with __GFP_NORETRY, which means going behind vzalloc_node()'s    */
+/*   back to __vmalloc_node(); where we cannot find that, we give up  */
+/*   node placement for __vmalloc().                                  */
+/**********************************************************************/
+# if defined(MAX_PAGE_ORDER)
+#	define	BUF_MAX_ORDER	MAX_PAGE_ORDER
+# else
+#	define	BUF_MAX_ORDER	(MAX_ORDER - 1)
+# endif
+# define	BUF_HUGE_SIZE	(2 * 1024 * 1024)
+
+# define	BUF_GFP		(GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN)
+
+unsigned long long cnt_buf_huge;
+unsigned long long cnt_buf_local;
+unsigned long long cnt_buf_remote;
+
+static void *
+buf_vmalloc(size_t size, int node)
+{
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static int first_time = TRUE;
+static void *(*fn_vmalloc_node)(unsigned long, unsigned long, gfp_t, int,
+	const void *);
+
+	if (first_time) {
+		first_time = FALSE;
+		fn_vmalloc_node = get_proc_addr("__vmalloc_node_noprof");
+		if (fn_vmalloc_node == NULL)
+			fn_vmalloc_node = get_proc_addr("__vmalloc_node");
+	}
+	if (fn_vmalloc_node)
+		return fn_vmalloc_node(size, 1, BUF_GFP, node,
+			__builtin_return_address(0));
+	return __vmalloc(size, BUF_GFP);
+# else
+	return __vmalloc(size, BUF_GFP, PAGE_KERNEL);
+# endif
+}
+
+void *
+dtrace_buffer_memalloc(size_t size, processorid_t cpu)
+{	void	*ptr = NULL;
+	int	node = cpu_online(cpu) ? cpu_to_node(cpu) : NUMA_NO_NODE;
+
+	if (dtrace_buf_hugepages && size >= BUF_HUGE_SIZE &&
+	    get_order(size) <= BUF_MAX_ORDER) {
+		ptr = alloc_pages_exact_nid(node == NUMA_NO_NODE ? numa_node_id() : node,
+			size, BUF_GFP);
+		if (ptr)
+			cnt_buf_huge++;
+	}
+	if (ptr == NULL) {
+		ptr = buf_vmalloc(size, node);
+		if (ptr == NULL)
+			return NULL;
+	}
+
+	if (node != NUMA_NO_NODE) {
+		if (page_to_nid(dtrace_buffer_mempage(ptr)) == node)
+			cnt_buf_local++;
+		else
+			cnt_buf_remote++;
+	}
+
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_buffer_memalloc(%d, cpu=%d node=%d) := %p\n",
+			(int) size, cpu, node, ptr);
+	return ptr;
+}
+void
+dtrace_buffer_memfree(void *ptr, size_t size)
+{
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_buffer_memfree(%p, size=%d)\n", ptr, (int) size);
+	if (ptr == NULL)
+		return;
+	if (is_vmalloc_addr(ptr))
+		vfree(ptr);
+	else
+		free_pages_exact(ptr, size);
+}
+struct page *
+dtrace_buffer_mempage(void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	return virt_to_page(addr);
+}
+
 int
 lx_get_curthread_id()
 {
@@ -1756,170 +2276,613 @@ printk("set_memory_rw(%p, %d) := %d\n", addr, num_pages, ret);
 }
 
 /**********************************************************************/
-/*   Called from fbt_linux.c. Dont let us register a probe point for  */
-/*   something  on the notifier chain because if we trigger, we will  */
-/*   panic/hang/reset the kernel due to reentrancy.		      */
+/*   Batched  text  patching. Enabling fbt::: touches tens of thousands  */
+/*   of  patchpoints, and doing memory_set_rw() and a write for each one  */
+/*   in turn is slow. Between dtrace_patch_begin() and dtrace_patch_end()  */
+/*   the  providers  patch  calls are queued; at the end we sort them by  */
+/*   address,  make  each  page  writable once, apply the writes, and do  */
+/*   one  dtrace_sync()  so  every  cpu  has  serialised  against  the  */
+/*   modified  text  before  we  return. Outside of a batch, the writes  */
+/*   happen immediately as before. Called with dtrace_lock held.      */
 /*   								      */
-/*   Since  our entry may be towards the end of the list, we need to  */
-/*   scan  from  the front of the list, but we dont have that, so we  */
-/*   need to dig into the kernel to find it.			      */
+/*   Multi-byte writes (fbt's jump-optimized probes) go via a trap    */
+/*   in the first byte whilst the rest is inconsistent, and need      */
+/*   every cpu to have seen each step before the next. Batched, that  */
+/*   is three passes over the table - trap, tail, first byte - with   */
+/*   a dtrace_sync() between each, rather than two per site.          */
+/**********************************************************************/
+# define	PATCH_MAX_TAIL	7
+
+typedef struct dtrace_patch {
+	instr_t		*dp_addr;
+	int		dp_seq;		/* Keep same-address writes in order. */
+	instr_t		dp_val;
+	instr_t		dp_expect;	/* Only write if this is there...  */
+	char		dp_cond;	/* ...when set.			 */
+	char		dp_ok;		/* Page made writable.		 */
+	uint8_t		dp_len;		/* Multi-byte: bytes in dp_tail. */
+	instr_t		dp_trap;	/* Goes first, until...		 */
+	uint8_t		dp_tail[PATCH_MAX_TAIL]; /* ...this is in. */
+	} dtrace_patch_t;
+
+static dtrace_patch_t *patch_tbl;
+static int	patch_cnt;
+static int	patch_size;
+static int	patch_depth;
+
+unsigned long long cnt_patch_sites;
+unsigned long long cnt_patch_pages;
+unsigned long long cnt_patch_batches;
+
+static int
+dtrace_patch_cmp(const void *p1, const void *p2)
+{	const dtrace_patch_t *dp1 = p1;
+	const dtrace_patch_t *dp2 = p2;
+
+	if (dp1->dp_addr != dp2->dp_addr)
+		return dp1->dp_addr < dp2->dp_addr ? -1 : 1;
+	return dp1->dp_seq - dp2->dp_seq;
+}
+static void
+dtrace_patch_swap(void *p1, void *p2, int size)
+{	dtrace_patch_t t = *(dtrace_patch_t *) p1;
+
+	*(dtrace_patch_t *) p1 = *(dtrace_patch_t *) p2;
+	*(dtrace_patch_t *) p2 = t;
+}
+static void
+dtrace_patch_write(instr_t *addr, instr_t val, int cond, instr_t expect)
+{
+	if (!cond || *addr == expect)
+		*addr = val;
+}
 /**********************************************************************/
-int
-on_notifier_list(uint8_t *ptr)
-{	struct notifier_block *np;
-#if !defined(ATOMIC_NOTIFIER_HEAD)
-#       define atomic_notifier_head notifier_block
-#       define atomic_head(x) x
-# else
-#       define atomic_head(x) (x)->head
-# endif
-	static struct atomic_notifier_head *die_chain;
-	static struct blocking_notifier_head *task_exit_notifier;
-	int	do_print = 0; // set to 1 for debug
-static int first_time = TRUE;
+/*   Next free slot in the batch, or NULL if we are not batching or   */
+/*   cant grow it, in which case the caller writes it now.            */
+/**********************************************************************/
+static dtrace_patch_t *
+dtrace_patch_slot(instr_t *addr)
+{	dtrace_patch_t *dp;
 
-return 0;
+	if (patch_depth == 0)
+		return NULL;
 
-	if (first_time) {
-		first_time = FALSE;
-		if (die_chain == NULL)
-			die_chain = (struct atomic_notifier_head *) get_proc_addr("die_chain");
-		if (task_exit_notifier == NULL)
-			task_exit_notifier = (struct blocking_notifier_head *) get_proc_addr("task_exit_notifier");
-	}
+	if (patch_cnt >= patch_size) {
+		int	size = patch_size ? patch_size * 2 : 256;
 
-	if (die_chain) {
-		for (np = atomic_head(die_chain); np; np = np->next) {
-			if (do_print) 
-				printk("illop-chain: %p\n", np->notifier_call);
-			if ((uint8_t *) np->notifier_call == ptr)
-				return 1;
+		if ((dp = kmem_alloc(size * sizeof *dp, KM_SLEEP)) == NULL)
+			return NULL;
+		if (patch_tbl) {
+			memcpy(dp, patch_tbl, patch_cnt * sizeof *dp);
+			kmem_free(patch_tbl, patch_size * sizeof *dp);
 		}
+		patch_tbl = dp;
+		patch_size = size;
 	}
 
-	if (task_exit_notifier) {
-		for (np = atomic_head(task_exit_notifier); np; np = np->next) {
-			if (do_print)
-				printk("exit-chain: %p\n", np->notifier_call);
-			if ((uint8_t *) np->notifier_call == ptr)
-				return 1;
-		}
+	dp = &patch_tbl[patch_cnt];
+	dp->dp_addr = addr;
+	dp->dp_seq = patch_cnt++;
+	dp->dp_len = 0;
+	return dp;
+}
+static void
+dtrace_patch_queue(instr_t *addr, instr_t val, int cond, instr_t expect)
+{	dtrace_patch_t *dp;
+
+	if ((dp = dtrace_patch_slot(addr)) == NULL) {
+		if (memory_set_rw(addr, 1, TRUE))
+			dtrace_patch_write(addr, val, cond, expect);
+		return;
 	}
 
-	return 0;
+	dp->dp_val = val;
+	dp->dp_expect = expect;
+	dp->dp_cond = cond;
 }
 /**********************************************************************/
-/*   Parallel  allocator  to  avoid touching kernel data structures.  */
-/*   This  is presently used to create a shadow "struct module" - it  */
-/*   used  to  be  used  for  processes  and  threads,  but  we  use  */
-/*   shadow_procs for this purpose now.				      */
+/*   Write a patch value, e.g. to arm a probe.			      */
 /**********************************************************************/
-static struct par_alloc_t *hd_par;
-static mutex_t par_mutex;
-
-void *
-par_alloc(int domain, void *ptr, int size, int *init)
+void
+dtrace_patch_set(instr_t *addr, instr_t val)
+{
+	dtrace_patch_queue(addr, val, FALSE, 0);
+}
+/**********************************************************************/
+/*   Put  back  the  original  instruction, but only if our patch is  */
+/*   still there (e.g. an .init section may have been freed, or the  */
+/*   enable failed to make the page writable).			      */
+/**********************************************************************/
+void
+dtrace_patch_restore(instr_t *addr, instr_t expect, instr_t val)
+{
+	dtrace_patch_queue(addr, val, TRUE, expect);
+}
+/**********************************************************************/
+/*   Write val followed by len bytes of tail at addr, with trap       */
+/*   standing in for val until the tail is in place everywhere. The   */
+/*   caller makes sure nothing can be executing inside the bytes      */
+/*   being replaced, and that they are all on the one page.           */
+/**********************************************************************/
+void
+dtrace_patch_multi(instr_t *addr, instr_t trap, const void *tail, int len,
+    instr_t val)
+{	dtrace_patch_t *dp;
+
+	ASSERT(len <= PATCH_MAX_TAIL);
+	if ((dp = dtrace_patch_slot(addr)) != NULL) {
+		dp->dp_val = val;
+		dp->dp_cond = FALSE;
+		dp->dp_trap = trap;
+		memcpy(dp->dp_tail, tail, len);
+		dp->dp_len = len;
+		return;
+	}
+
+	/***********************************************/
+	/*   Not in a batch (or we couldnt grow it),   */
+	/*   so do it now, a site at a time.           */
+	/***********************************************/
+	if (!memory_set_rw(addr, 1, TRUE))
+		return;
+	*addr = trap;
+	dtrace_sync();
+	memcpy((uint8_t *) addr + 1, tail, len);
+	dtrace_sync();
+	*addr = val;
+}
+void
+dtrace_patch_begin(void)
+{
+	patch_depth++;
+}
+void
+dtrace_patch_end(void)
+{	dtrace_patch_t *dp;
+	unsigned long page = 0;
+	int	page_ok = FALSE;
+	int	multi = FALSE;
+
+	ASSERT(patch_depth > 0);
+	if (--patch_depth > 0 || patch_cnt == 0)
+		return;
+
+	sort(patch_tbl, patch_cnt, sizeof *patch_tbl, 
+		dtrace_patch_cmp, dtrace_patch_swap);
+
+	for (dp = patch_tbl; dp < &patch_tbl[patch_cnt]; dp++) {
+		/***********************************************/
+		/*   One  memory_set_rw()  per page; it does  */
+		/*   the following page too, for patches that  */
+		/*   straddle a page boundary.		       */
+		/***********************************************/
+		if (((unsigned long) dp->dp_addr & PAGE_MASK) != page) {
+			page = (unsigned long) dp->dp_addr & PAGE_MASK;
+			page_ok = memory_set_rw(dp->dp_addr, 1, TRUE);
+			cnt_patch_pages++;
+		}
+		dp->dp_ok = page_ok;
+		if (!page_ok)
+			continue;
+		if (dp->dp_len) {
+			*dp->dp_addr = dp->dp_trap;
+			multi = TRUE;
+			continue;
+		}
+		dtrace_patch_write(dp->dp_addr, dp->dp_val, 
+			dp->dp_cond, dp->dp_expect);
+	}
+
+	if (multi) {
+		dtrace_sync();
+		for (dp = patch_tbl; dp < &patch_tbl[patch_cnt]; dp++) {
+			if (dp->dp_len && dp->dp_ok)
+				memcpy((uint8_t *) dp->dp_addr + 1, dp->dp_tail, dp->dp_len);
+		}
+		dtrace_sync();
+		for (dp = patch_tbl; dp < &patch_tbl[patch_cnt]; dp++) {
+			if (dp->dp_len && dp->dp_ok)
+				*dp->dp_addr = dp->dp_val;
+		}
+	}
+
+	cnt_patch_sites += patch_cnt;
+	cnt_patch_batches++;
+	patch_cnt = 0;
+
+	dtrace_sync();
+}
+/**********************************************************************/
+/*   Called on driver unload.					      */
+/**********************************************************************/
+static void
+dtrace_patch_fini(void)
+{
+	if (patch_tbl)
+		kmem_free(patch_tbl, patch_size * sizeof *patch_tbl);
+	patch_tbl = NULL;
+	patch_size = 0;
+	patch_cnt = 0;
+}
+
+/**********************************************************************/
+/*   Called from fbt_linux.c. Dont let us register a probe point for  */
+/*   something  on the notifier chain because if we trigger, we will  */
+/*   panic/hang/reset the kernel due to reentrancy.		      */
+/*   								      */
+/*   Since  our entry may be towards the end of the list, we need to  */
+/*   scan  from  the front of the list, but we dont have that, so we  */
+/*   need to dig into the kernel to find it.			      */
+/**********************************************************************/
+int
+on_notifier_list(uint8_t *ptr)
+{	struct notifier_block *np;
+#if !defined(ATOMIC_NOTIFIER_HEAD)
+#       define atomic_notifier_head notifier_block
+#       define atomic_head(x) x
+# else
+#       define atomic_head(x) (x)->head
+# endif
+	static struct atomic_notifier_head *die_chain;
+	static struct blocking_notifier_head *task_exit_notifier;
+	int	do_print = 0; // set to 1 for debug
+static int first_time = TRUE;
+
+return 0;
+
+	if (first_time) {
+		first_time = FALSE;
+		if (die_chain == NULL)
+			die_chain = (struct atomic_notifier_head *) get_proc_addr("die_chain");
+		if (task_exit_notifier == NULL)
+			task_exit_notifier = (struct blocking_notifier_head *) get_proc_addr("task_exit_notifier");
+	}
+
+	if (die_chain) {
+		for (np = atomic_head(die_chain); np; np = np->next) {
+			if (do_print) 
+				printk("illop-chain: %p\n", np->notifier_call);
+			if ((uint8_t *) np->notifier_call == ptr)
+				return 1;
+		}
+	}
+
+	if (task_exit_notifier) {
+		for (np = atomic_head(task_exit_notifier); np; np = np->next) {
+			if (do_print)
+				printk("exit-chain: %p\n", np->notifier_call);
+			if ((uint8_t *) np->notifier_call == ptr)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+/**********************************************************************/
+/*   Parallel  allocator  to  avoid touching kernel data structures.  */
+/*   This  is presently used to create a shadow "struct module" - it  */
+/*   used  to  be  used  for  processes  and  threads,  but  we  use  */
+/*   shadow_procs for this purpose now.				      */
+/*   								      */
+/*   Entries  are  hashed on the kernel object pointer, so we dont  */
+/*   walk every module we have ever seen under par_mutex.	      */
+/**********************************************************************/
+# define	PAR_HASH_SIZE	256
+# define	PAR_HASH(ptr)	((((unsigned long) (ptr)) >> 6) & (PAR_HASH_SIZE - 1))
+static par_alloc_t *par_hash[PAR_HASH_SIZE];
+static mutex_t par_mutex;
+
+/**********************************************************************/
+/*   Counters for /proc/dtrace/stats. All but cnt_par_gc are bumped   */
+/*   from probe context, so are kept per cpu (cpuc_par_*) and summed  */
+/*   here by par_stats() when the stats are read.                     */
+/**********************************************************************/
+unsigned long long cnt_par_hit;		/* Found in per-cpu cache */
+unsigned long long cnt_par_lookup;	/* Found by walking the hash chain */
+unsigned long long cnt_par_miss;	/* New shadow slot claimed */
+unsigned long long cnt_par_gc;		/* Slot released on proc exit */
+unsigned long long cnt_par_full;	/* Probe sequence exhausted */
+
+static par_alloc_t *
+par_hash_find(int domain, void *ptr)
 {	par_alloc_t *p;
 
-#if 0
-/* Whilst this is NULL, we dont get dynamic module probing.
-We need to redo process par_alloc so we dont need dynamic memory from
-probe context.
+	for (p = par_hash[PAR_HASH(ptr)]; p; p = p->pa_next) {
+		if (p->pa_ptr == ptr && p->pa_domain == domain)
+			return p;
+	}
+	return NULL;
+}
 
-Need to FIX!
-*/
-return NULL;
-#endif
+void *
+par_alloc(int domain, void *ptr, int size, int *init)
+{	par_alloc_t *p;
+	par_alloc_t *p1;
+	int	h = PAR_HASH(ptr);
 
 	dmutex_enter(&par_mutex);
-	for (p = hd_par; p; p = p->pa_next) {
-		if (p->pa_ptr == ptr && p->pa_domain == domain) {
-			if (init)
-				*init = FALSE;
-			dmutex_exit(&par_mutex);
-			return p;
-		}
+	if ((p = par_hash_find(domain, ptr)) != NULL) {
+		dmutex_exit(&par_mutex);
+		if (init)
+			*init = FALSE;
+		return p;
 	}
 	dmutex_exit(&par_mutex);
 
-	if (init)
-		*init = TRUE;
-
 	if ((p = kmalloc(size + sizeof(*p), GFP_ATOMIC)) == NULL)
 		return NULL;
 	dtrace_bzero(p+1, size);
 	p->pa_domain = domain;
 	p->pa_ptr = ptr;
+
+	/***********************************************/
+	/*   Someone  may  have beaten us to it while  */
+	/*   we dropped the lock to allocate.	       */
+	/***********************************************/
 	dmutex_enter(&par_mutex);
-	p->pa_next = hd_par;
-	hd_par = p;
+	if ((p1 = par_hash_find(domain, ptr)) != NULL) {
+		dmutex_exit(&par_mutex);
+		kfree(p);
+		if (init)
+			*init = FALSE;
+		return p1;
+	}
+	if (init)
+		*init = TRUE;
+	p->pa_next = par_hash[h];
+	par_hash[h] = p;
 	dmutex_exit(&par_mutex);
 
 	return p;
 }
 /**********************************************************************/
-/*   Find  thread  without allocating a shadow struct. Needed during  */
-/*   proc exit.							      */
-/**********************************************************************/
-proc_t *
-par_find_thread(struct task_struct *t)
-{	par_alloc_t *p = par_lookup(t);
-
-	if (p == NULL)
-		return NULL;
-
-	return (proc_t *) (p + 1);
-}
-/**********************************************************************/
 /*   Free the parallel pointer.					      */
 /**********************************************************************/
 void
 par_free(int domain, void *ptr)
 {	par_alloc_t *p = (par_alloc_t *) ptr;
-	par_alloc_t *p1;
+	par_alloc_t **pp;
 
-#if 0
-return;
-#endif
 	dmutex_enter(&par_mutex);
-	if (hd_par == p && hd_par->pa_domain == domain) {
-		hd_par = hd_par->pa_next;
-		dmutex_exit(&par_mutex);
-		kfree(ptr);
-		return;
-		}
-	for (p1 = hd_par; p1 && p1->pa_next != p; p1 = p1->pa_next) {
-//		printk("p1=%p\n", p1);
-		}
-	if (p1 == NULL) {
+	for (pp = &par_hash[PAR_HASH(p->pa_ptr)]; *pp; pp = &(*pp)->pa_next) {
+		if (*pp == p && p->pa_domain == domain)
+			break;
+	}
+	if (*pp == NULL) {
 		dmutex_exit(&par_mutex);
 		printk("where did p1 go?\n");
 		return;
 	}
-	if (p1->pa_next == p && p1->pa_domain == domain)
-		p1->pa_next = p->pa_next;
+	*pp = p->pa_next;
 	dmutex_exit(&par_mutex);
 	kfree(ptr);
 }
 /**********************************************************************/
-/*   Map  pointer to the shadowed area. Dont create if its not there  */
-/*   already.							      */
+/*   Shadow  thread  state  lives  in shadow_procs[], which we treat  */
+/*   as  an open addressed hash keyed by the task_struct (and pid,  */
+/*   since  a  task_struct  may  be  recycled).  For  pids less than  */
+/*   PID_MAX_DEFAULT  the home slot is the pid itself, so the common  */
+/*   case  is  a  single compare. Slots are claimed with a cas, so we  */
+/*   never  take  a lock from probe context, and are handed back by  */
+/*   proc_exit_notifier(). Each cpu remembers the last slot it used,  */
+/*   since a burst of probes tends to fire in the same thread.	      */
 /**********************************************************************/
-static void *
-par_lookup(void *ptr)
-{	par_alloc_t *p;
-	
-	dmutex_enter(&par_mutex);
-	for (p = hd_par; p; p = p->pa_next) {
-		if (p->pa_ptr == ptr) {
-			dmutex_exit(&par_mutex);
-			return p;
-		}
+# define	PAR_SHADOW_MASK	(PID_MAX_DEFAULT - 1)
+# define	PAR_SHADOW_PROBES	8
+
+/**********************************************************************/
+/*   Threads which, for want of a shadow slot, have had to keep       */
+/*   their self-> variables in the dynamic variable space. They stay  */
+/*   there for the rest of the thread's life, even if it gets a slot  */
+/*   later (t_dtrace_tlsspill), rather than have some of a thread's   */
+/*   variables in one place and some in the other. Entries are        */
+/*   claimed with a cas and handed back by par_release_thread().      */
+/**********************************************************************/
+# define	PAR_SPILL_SIZE	1024
+# define	PAR_SPILL_HASH(tp)	((((unsigned long) (tp)) >> 6) & (PAR_SPILL_SIZE - 1))
+static struct task_struct *par_spilled[PAR_SPILL_SIZE];
+
+static int
+par_spill_find(struct task_struct *tp)
+{	int	i, h = PAR_SPILL_HASH(tp);
+
+	for (i = 0; i < PAR_SHADOW_PROBES; i++) {
+		if (par_spilled[(h + i) & (PAR_SPILL_SIZE - 1)] == tp)
+			return TRUE;
 	}
-	dmutex_exit(&par_mutex);
+	return FALSE;
+}
+static int
+par_spill_add(struct task_struct *tp)
+{	struct task_struct **tpp;
+	int	i, h = PAR_SPILL_HASH(tp);
+
+	for (i = 0; i < PAR_SHADOW_PROBES; i++) {
+		tpp = &par_spilled[(h + i) & (PAR_SPILL_SIZE - 1)];
+		if (*tpp == tp)
+			return TRUE;
+		if (*tpp == NULL && dtrace_casptr(tpp, NULL, tp) == NULL)
+			return TRUE;
+	}
+	return FALSE;
+}
+static void
+par_spill_remove(struct task_struct *tp)
+{	struct task_struct **tpp;
+	int	i, h = PAR_SPILL_HASH(tp);
+
+	for (i = 0; i < PAR_SHADOW_PROBES; i++) {
+		tpp = &par_spilled[(h + i) & (PAR_SPILL_SIZE - 1)];
+		if (*tpp == tp)
+			dtrace_casptr(tpp, tp, NULL);
+	}
+}
+
+static sol_proc_t *
+par_shadow_find(struct task_struct *tp)
+{	sol_proc_t	*solp;
+	int	i;
+
+	for (i = 0; i < PAR_SHADOW_PROBES; i++) {
+		solp = &shadow_procs[(tp->pid + i) & PAR_SHADOW_MASK];
+		if (solp->p_task == tp && solp->pid == tp->pid)
+			return solp;
+	}
+	return NULL;
+}
+/**********************************************************************/
+/*   Reset  the per-thread state when a slot changes hands. Leave the  */
+/*   mutexes alone.						      */
+/**********************************************************************/
+static void
+par_shadow_reset(sol_proc_t *solp, struct task_struct *tp)
+{
+	solp->p_flag = 0;
+	solp->p_stat = 0;
+	solp->p_private_page = NULL;
+	solp->t_predcache = 0;
+	solp->t_dtrace_vtime = 0;
+	solp->t_dtrace_start = 0;
+	solp->t_dtrace_stop = 0;
+	solp->t_dtrace_sig = 0;
+	solp->t_dtrace_ft = 0;
+	solp->t_sig_check = 0;
+	solp->p_dtrace_probes = 0;
+	solp->p_dtrace_count = 0;
+	solp->pid = tp->pid;
+	solp->t_dtrace_tlsgen++;
+	membar_producer();
+}
+
+static sol_proc_t *
+par_shadow_alloc(struct task_struct *tp, cpu_core_t *cp)
+{	sol_proc_t	*solp;
+	struct task_struct *old;
+	int	i;
+
+	for (i = 0; i < PAR_SHADOW_PROBES; i++) {
+		solp = &shadow_procs[(tp->pid + i) & PAR_SHADOW_MASK];
+		old = solp->p_task;
+		/***********************************************/
+		/*   A  slot  whose  owner  has the same pid  */
+		/*   but  a  different task is stale - the  */
+		/*   exit notifier didnt see it go.	       */
+		/***********************************************/
+		if (old != NULL && old != tp && solp->pid != tp->pid)
+			continue;
+		if (old != NULL && solp->p_dtrace_helpers)
+			continue;
+		if (dtrace_casptr(&solp->p_task, old, tp) != old)
+			continue;
+		par_shadow_reset(solp, tp);
+		/***********************************************/
+		/*   Look after the cas; par_setup_thread1     */
+		/*   looks for us after it marks the thread,   */
+		/*   so one of us sees the other.              */
+		/***********************************************/
+		solp->t_dtrace_tlsspill = par_spill_find(tp);
+		cp->cpuc_par_miss++;
+		return solp;
+	}
+
+	/***********************************************/
+	/*   Table  is  crowded around this pid. Every  */
+	/*   slot  in  the window belongs to a thread  */
+	/*   which  is  still alive, and taking one  */
+	/*   would  wipe  out  its  self-> variables.  */
+	/*   Let the caller make do without.	       */
+	/***********************************************/
+	cp->cpuc_par_full++;
 	return NULL;
 }
 /**********************************************************************/
+/*   A thread which couldnt get a shadow slot borrows this cpu's      */
+/*   overflow entry for the duration of the probe. It has no TLS      */
+/*   row, so its self-> variables live in the dynamic variable space  */
+/*   (see par_spilled[]).                                             */
+/**********************************************************************/
+static sol_proc_t *
+par_shadow_overflow(struct task_struct *tp)
+{	sol_proc_t	*solp = &par_overflow[cpu_get_id()];
+
+	if (solp->p_task != tp || solp->pid != tp->pid) {
+		solp->p_task = tp;
+		par_shadow_reset(solp, tp);
+	}
+	return solp;
+}
+/**********************************************************************/
+/*   Find  thread  without allocating a shadow struct. Needed during  */
+/*   proc exit.							      */
+/**********************************************************************/
+proc_t *
+par_find_thread(struct task_struct *t)
+{
+	return par_shadow_find(t);
+}
+/**********************************************************************/
+/*   Thread-local variable slots are kept in per-consumer tables      */
+/*   with a row per shadow_procs[] entry. Return the row for the      */
+/*   current thread (and the generation of its shadow slot, so the    */
+/*   caller can spot a row left by the previous owner), -1 if the     */
+/*   variables belong in the dynamic variable space (we are not in    */
+/*   probe context for this thread, or it has spilled), or -2 if it   */
+/*   has no slot and we could not note it as spilled, so there is     */
+/*   nowhere consistent to keep them. cpuc_proc was set up by         */
+/*   par_setup_thread() when the probe fired.                         */
+/**********************************************************************/
+int
+par_tls_index(uint32_t *gen)
+{	sol_proc_t	*solp = cpu_core[cpu_get_id()].cpuc_proc;
+	struct task_struct *tp = get_current();
+
+	if (solp == NULL || solp->p_task != tp || solp->pid != tp->pid)
+		return -1;
+	if (solp < shadow_procs || solp >= shadow_procs + PID_MAX_DEFAULT)
+		return par_spill_find(tp) ? -1 : -2;
+	if (solp->t_dtrace_tlsspill)
+		return -1;
+
+	*gen = solp->t_dtrace_tlsgen;
+	return solp - shadow_procs;
+}
+/**********************************************************************/
+/*   Called from proc_exit_notifier() to hand back the shadow slot.   */
+/*   Slots with helpers attached are left for                         */
+/*   dtrace_helper_remove_all to clean up. Other cpus may still have  */
+/*   the slot in cpuc_proc; that is only a hint, checked against      */
+/*   p_task and pid before use, so we leave it alone rather than      */
+/*   race with their probes.                                          */
+/**********************************************************************/
+static void
+par_release_thread(struct task_struct *tp)
+{	sol_proc_t	*solp;
+
+	par_spill_remove(tp);
+	if (shadow_procs == NULL || (solp = par_shadow_find(tp)) == NULL)
+		return;
+	if (solp->p_dtrace_helpers)
+		return;
+
+	if (dtrace_casptr(&solp->p_task, tp, NULL) == tp)
+		cnt_par_gc++;
+}
+/**********************************************************************/
+/*   Sum the per-cpu counters for /proc/dtrace/stats.		      */
+/**********************************************************************/
+static void
+par_stats(void)
+{	int	i;
+
+	cnt_par_hit = cnt_par_lookup = cnt_par_miss = cnt_par_full = 0;
+	for (i = 0; i < nr_cpus; i++) {
+		cnt_par_hit += cpu_core[i].cpuc_par_hit;
+		cnt_par_lookup += cpu_core[i].cpuc_par_lookup;
+		cnt_par_miss += cpu_core[i].cpuc_par_miss;
+		cnt_par_full += cpu_core[i].cpuc_par_full;
+	}
+}
+/**********************************************************************/
 /*   We want curthread to point to something -- but we cannot modify  */
 /*   the Linux kernel to add stuff to the proc/thread structures, so  */
 /*   we will create a shadow data structure on demand. This means we  */
@@ -1947,14 +2910,33 @@ par_setup_thread()
 void *
 par_setup_thread1(struct task_struct *tp)
 {	sol_proc_t	*solp;
+	cpu_core_t	*cp = &cpu_core[cpu_get_id()];
 
-//	solp = cpu_core[cpu_get_id()].cpuc_proc;
-	solp = &shadow_procs[tp->pid];
+	/***********************************************/
+	/*   A thread on the overflow entry gets       */
+	/*   another go at a slot of its own. If it    */
+	/*   has to make do without, note that its     */
+	/*   self-> variables are going into the       */
+	/*   dynamic variable space, and look for a    */
+	/*   slot someone (e.g. prfind()) gave it      */
+	/*   meanwhile; see par_shadow_alloc().        */
+	/***********************************************/
+	solp = cp->cpuc_proc;
+	if (solp && solp->p_task == tp && solp->pid == tp->pid &&
+	    solp != &par_overflow[cpu_get_id()]) {
+		cp->cpuc_par_hit++;
+	} else if ((solp = par_shadow_find(tp)) != NULL) {
+		cp->cpuc_par_lookup++;
+	} else if ((solp = par_shadow_alloc(tp, cp)) == NULL) {
+		if (par_spill_add(tp) && (solp = par_shadow_find(tp)) != NULL)
+			solp->t_dtrace_tlsspill = TRUE;
+		else
+			solp = par_shadow_overflow(tp);
+	}
+	cp->cpuc_proc = solp;
 
 	curthread = solp;
-	curthread->pid = tp->pid;
 	curthread->p_pid = tp->pid;
-	curthread->p_task = tp;
 	/***********************************************/
 	/*   2.6.24.4    kernel    has   parent   and  */
 	/*   real_parent,  but RH FC8 (2.6.24.4 also)  */
@@ -1967,6 +2949,31 @@ par_setup_thread1(struct task_struct *tp)
 	return curthread;
 }
 /**********************************************************************/
+/*   Find  or  make the shadow slot for a task which may not be the  */
+/*   one  running  here  (e.g.  prfind()  from  an ioctl). Unlike  */
+/*   par_setup_thread1(),  leave  cpuc_proc and curthread alone: they  */
+/*   describe  the current thread, and par_tls_index() relies on them  */
+/*   for  the rest of the probe. Returns NULL if the task cannot get  */
+/*   a slot.							      */
+/**********************************************************************/
+static sol_proc_t *
+par_lookup_thread(struct task_struct *tp)
+{	sol_proc_t	*solp;
+	cpu_core_t	*cp = &cpu_core[cpu_get_id()];
+
+	if ((solp = par_shadow_find(tp)) != NULL)
+		cp->cpuc_par_lookup++;
+	else if ((solp = par_shadow_alloc(tp, cp)) == NULL)
+		return NULL;
+
+	solp->p_pid = tp->pid;
+	if (tp->parent) {
+		solp->p_ppid = tp->parent->pid;
+		solp->ppid = tp->parent->pid;
+	}
+	return solp;
+}
+/**********************************************************************/
 /*   Lookup a proc without allocating a shadow structure.	      */
 /**********************************************************************/
 void *
@@ -2017,6 +3024,11 @@ proc_exit_notifier(struct notifier_block *n, unsigned long code, void *ptr)
 	sol_proc_t sol_proc;
 
 //printk("proc_exit_notifier: code=%lu ptr=%p\n", code, ptr);
+	/***********************************************/
+	/*   Garbage collect the shadow thread slot.   */
+	/***********************************************/
+	par_release_thread(current);
+
 	/***********************************************/
 	/*   See  if  we know this proc - if so, need  */
 	/*   to let fasttrap retire the probes.	       */
@@ -2087,7 +3099,30 @@ prfind(int p)
 	if (!tp)
 		return (proc_t *) NULL;
 HERE();
-	return par_setup_thread1(tp);
+	return par_lookup_thread(tp);
+}
+/**********************************************************************/
+/*   Like  prfind(),  but  hand back the task itself, with a reference  */
+/*   the  caller  must  put_task_struct().  The  lookup  and  the  */
+/*   get_task_struct()  are  done  under  rcu_read_lock(), which is  */
+/*   what keeps an exiting task from being freed in between.	      */
+/**********************************************************************/
+struct task_struct *
+prfind_task(int p)
+{	struct task_struct *tp = NULL;
+	struct pid *pid;
+
+	if (fn_find_get_pid == NULL || fn_pid_task == NULL || fn_put_pid == NULL)
+		return NULL;
+
+	rcu_read_lock();
+	if ((pid = fn_find_get_pid(p)) != NULL) {
+		if ((tp = fn_pid_task(pid, PIDTYPE_PID)) != NULL)
+			get_task_struct(tp);
+		fn_put_pid(pid);
+	}
+	rcu_read_unlock();
+	return tp;
 }
 /**********************************************************************/
 /*   Reader/writer lock - allow any readers, but only one writer.     */
@@ -2342,19 +3377,31 @@ uwrite(proc_t *p, void *src, size_t len, uintptr_t addr)
 	return ret == len ? 0 : -1;
 }
 /**********************************************************************/
-/*   Need to implement this or use the unr code from FreeBSD.	      */
+/*   Identifier  arenas  (probe IDs, aggregation IDs). We only ever  */
+/*   allocate  one  at  a  time,  so  rather than a real vmem, keep a  */
+/*   bitmap  of  the IDs in use, and hand out the lowest free one. That  */
+/*   way  IDs are reused when a pid/USDT provider goes away, and arrays  */
+/*   indexed  by  ID  (e.g. dtrace_probes[]) stay dense. seq_hint is  */
+/*   the first word which may have a free bit in it.		      */
 /**********************************************************************/
 #define	SEQ_MAGIC (('m' << 24) | ('s' << 16) | ('e' << 8) | 'q')
+#define	SEQ_MINWORDS	4
 typedef struct seq_t {
 	mutex_t seq_mutex;
 	long	seq_magic;
-	int	seq_id;
+	uintptr_t seq_base;	/* First ID. */
+	size_t	seq_size;	/* Number of IDs. */
+	unsigned long *seq_map;
+	size_t	seq_words;
+	size_t	seq_hint;
+	size_t	seq_inuse;
 	} seq_t;
 
 void *
 vmem_alloc(vmem_t *hdr, size_t s, int flags)
 {	seq_t *seqp = (seq_t *) hdr;
-	void	*ret;
+	unsigned long *map;
+	size_t	w, n;
 
 	if (TRACE_ALLOC || dtrace_mem_alloc)
 		dtrace_printf("vmem_alloc(size=%d)\n", (int) s);
@@ -2365,25 +3412,59 @@ vmem_alloc(vmem_t *hdr, size_t s, int flags)
 			dtrace_printf("%p: vmem_alloc: bad magic\n", seqp);
 		}
 	}
+	ASSERT(s == 1);
 
 	mutex_enter(&seqp->seq_mutex);
-	ret = (void *) (long) ++seqp->seq_id;
+	for (w = seqp->seq_hint; w < seqp->seq_words; w++) {
+		if (seqp->seq_map[w] != ~0UL)
+			break;
+	}
+
+	/***********************************************/
+	/*   All full - double the bitmap.	       */
+	/***********************************************/
+	if (w >= seqp->seq_words) {
+		size_t nwords = seqp->seq_words ? seqp->seq_words * 2 : SEQ_MINWORDS;
+
+		if ((map = kmem_zalloc(nwords * sizeof *map, KM_SLEEP)) == NULL) {
+			mutex_exit(&seqp->seq_mutex);
+			return NULL;
+		}
+		if (seqp->seq_map) {
+			memcpy(map, seqp->seq_map, seqp->seq_words * sizeof *map);
+			kmem_free(seqp->seq_map, seqp->seq_words * sizeof *map);
+		}
+		seqp->seq_map = map;
+		w = seqp->seq_words;
+		seqp->seq_words = nwords;
+	}
+
+	n = w * BITS_PER_LONG + ffz(seqp->seq_map[w]);
+	if (n >= seqp->seq_size) {
+		mutex_exit(&seqp->seq_mutex);
+		return NULL;
+	}
+	__set_bit(n % BITS_PER_LONG, &seqp->seq_map[w]);
+	seqp->seq_hint = w;
+	seqp->seq_inuse++;
 	mutex_exit(&seqp->seq_mutex);
-	return ret;
+
+	return (void *) (seqp->seq_base + n);
 }
 
 void *
 vmem_create(const char *name, void *base, size_t size, size_t quantum,
         vmem_alloc_t *afunc, vmem_free_t *ffunc, vmem_t *source,
         size_t qcache_max, int vmflag)
-{	seq_t *seqp = kmalloc(sizeof *seqp, GFP_KERNEL);
+{	seq_t *seqp = kzalloc(sizeof *seqp, GFP_KERNEL);
 
 	if (TRACE_ALLOC || dtrace_here)
 		dtrace_printf("vmem_create(size=%d)\n", (int) size);
 
 	dmutex_init(&seqp->seq_mutex);
-	seqp->seq_id = 0;
 	seqp->seq_magic = SEQ_MAGIC;
+	seqp->seq_base = (uintptr_t) base;
+	seqp->seq_size = size;
 
 	dtrace_printf("vmem_create(%s) %p\n", name, seqp);
 /*	mutex_dump(&seqp->seq_mutex);*/
@@ -2394,13 +3475,47 @@ vmem_create(const char *name, void *base, size_t size, size_t quantum,
 void
 vmem_free(vmem_t *hdr, void *ptr, size_t size)
 {	seq_t *seqp = (seq_t *) hdr;
+	size_t	n = (uintptr_t) ptr - seqp->seq_base;
 
 	if (TRACE_ALLOC || dtrace_here)
 		dtrace_printf("vmem_free(ptr=%p, size=%d)\n", ptr, (int) size);
 	if (seqp->seq_magic != SEQ_MAGIC) {
 		dtrace_printf("%p: vmem_free: bad magic\n", seqp);
+		return;
 	}
 
+	mutex_enter(&seqp->seq_mutex);
+	if (n / BITS_PER_LONG >= seqp->seq_words ||
+	    !__test_and_clear_bit(n % BITS_PER_LONG, &seqp->seq_map[n / BITS_PER_LONG])) {
+		mutex_exit(&seqp->seq_mutex);
+		dtrace_printf("%p: vmem_free: %p not allocated\n", seqp, ptr);
+		return;
+	}
+	if (n / BITS_PER_LONG < seqp->seq_hint)
+		seqp->seq_hint = n / BITS_PER_LONG;
+	seqp->seq_inuse--;
+	mutex_exit(&seqp->seq_mutex);
+}
+/**********************************************************************/
+/*   Return  the  highest ID currently allocated, or zero if there are  */
+/*   none. Used to decide when dtrace_probes[] can be shrunk.	      */
+/**********************************************************************/
+uintptr_t
+vmem_maxid(vmem_t *hdr)
+{	seq_t *seqp = (seq_t *) hdr;
+	uintptr_t ret = 0;
+	size_t	w;
+
+	mutex_enter(&seqp->seq_mutex);
+	for (w = seqp->seq_words; w-- > 0; ) {
+		if (seqp->seq_map[w]) {
+			ret = seqp->seq_base + w * BITS_PER_LONG + 
+				__fls(seqp->seq_map[w]);
+			break;
+		}
+	}
+	mutex_exit(&seqp->seq_mutex);
+	return ret;
 }
 void 
 vmem_destroy(vmem_t *hdr)
@@ -2409,6 +3524,8 @@ vmem_destroy(vmem_t *hdr)
 	if (seqp->seq_magic != SEQ_MAGIC) {
 		dtrace_printf("%p: vmem_destroy: bad magic\n", seqp);
 	}
+	if (seqp->seq_map)
+		kmem_free(seqp->seq_map, seqp->seq_words * sizeof *seqp->seq_map);
 	kfree(hdr);
 }
 /**********************************************************************/
@@ -2731,6 +3848,50 @@ static struct file_operations proc_dtrace_debug = {
 	.release = single_release
 };
 
+/** "proc/dtrace/difjit" */
+static int proc_dtrace_difjit_show(struct seq_file *seq, void *v)
+{
+	/***********************************************/
+	/*   Reading  this  runs  the  JIT self-test,  */
+	/*   comparing it against the interpreter.     */
+	/***********************************************/
+	dtrace_difjit_selftest(seq);
+	return 0;
+}
+static int proc_dtrace_difjit_single_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, &proc_dtrace_difjit_show, NULL);
+}
+static struct file_operations proc_dtrace_difjit = {
+	.owner   = THIS_MODULE,
+	.open    = proc_dtrace_difjit_single_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+/** "proc/dtrace/clock" */
+static int proc_dtrace_clock_show(struct seq_file *seq, void *v)
+{
+	/***********************************************/
+	/*   Reading  this  runs  the  clock self-test  */
+	/*   (call cost and cross-CPU skew).	       */
+	/***********************************************/
+	dtrace_hrtime_selftest(seq);
+	return 0;
+}
+static int proc_dtrace_clock_single_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, &proc_dtrace_clock_show, NULL);
+}
+static struct file_operations proc_dtrace_clock = {
+	.owner   = THIS_MODULE,
+	.open    = proc_dtrace_clock_single_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
 /** "proc/dtrace/security" */
 static int proc_dtrace_security_show(struct seq_file *seq, void *v)
 {
@@ -2841,6 +4002,7 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 		{TYPE_LONG_LONG, (unsigned long *) &cnt_timer3, "timer3(defer-cancel)"},
 		{TYPE_LONG_LONG, (unsigned long *) &cnt_timer_add, "timer_add"},
 		{TYPE_LONG_LONG, (unsigned long *) &cnt_timer_remove, "timer_remove"},
+		{TYPE_LONG_LONG, (unsigned long *) &cnt_timer_omni, "timer_omni"},
 		{TYPE_LONG, &cnt_xcall0, "xcall0"},
 		{TYPE_LONG, &cnt_xcall1, "xcall1"},
 		{TYPE_LONG, &cnt_xcall2, "xcall2"},
@@ -2850,6 +4012,34 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 		{TYPE_LONG_LONG, (unsigned long *) &cnt_xcall6, "xcall6(ack_waits)"},
 		{TYPE_LONG_LONG, (unsigned long *) &cnt_xcall7, "xcall7(fast)"},
 		{TYPE_LONG, (unsigned long *) &cnt_xcall8, "xcall8"},
+		{TYPE_LONG, &cnt_xcall_overflow, "xcall_overflow"},
+		LONG_LONG(cnt_par_hit, "par_hit"),
+		LONG_LONG(cnt_par_lookup, "par_lookup"),
+		LONG_LONG(cnt_par_miss, "par_miss"),
+		LONG_LONG(cnt_par_gc, "par_gc"),
+		LONG_LONG(cnt_par_full, "par_full"),
+		LONG_LONG(cnt_difjit_compiled, "difjit_compiled"),
+		LONG_LONG(cnt_difjit_unsupported, "difjit_unsupported"),
+		LONG_LONG(cnt_dif_predecoded, "dif_predecoded"),
+		LONG_LONG(cnt_dif_fused, "dif_fused"),
+		LONG_LONG(cnt_tls_slot, "tls_slot"),
+		LONG_LONG(cnt_tls_dynvar, "tls_dynvar"),
+		LONG_LONG(cnt_stackid_hit, "stackid_hit"),
+		LONG_LONG(cnt_stackid_new, "stackid_new"),
+		LONG_LONG(cnt_ustack_walk, "ustack_walk"),
+		LONG_LONG(cnt_ustack_fill, "ustack_fill"),
+		LONG_LONG(cnt_ustack_unwind, "ustack_unwind"),
+		LONG_LONG(cnt_ustack_scan, "ustack_scan"),
+		LONG_LONG(cnt_dynhash_resize, "dynhash_resize"),
+		LONG_LONG(cnt_dynhash_resize_abort, "dynhash_resize_abort"),
+		LONG_LONG(cnt_patch_sites, "patch_sites"),
+		LONG_LONG(cnt_patch_pages, "patch_pages"),
+		LONG_LONG(cnt_patch_batches, "patch_batches"),
+		LONG_LONG(cnt_buf_huge, "buf_huge"),
+		LONG_LONG(cnt_buf_local, "buf_local"),
+		LONG_LONG(cnt_buf_remote, "buf_remote"),
+		LONG_LONG(cnt_hrtime_clamp, "hrtime_clamp"),
+		LONG_LONG(cnt_hrtime_retry, "hrtime_retry"),
 		{TYPE_INT, (unsigned long *) &dtrace_shutdown, "shutdown"},
 		{0}
 		};
@@ -2860,6 +4050,7 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 		seq_printf(seq, "dcnt%d=%lu\n", i, dcnt[i]);
 	}
 
+	par_stats();
 	for (i = 0; stats[i].name; i++) {
 		if (stats[i].type == TYPE_LONG_LONG)
 			seq_printf(seq, "%s=%llu\n", stats[i].name, *(unsigned long long *) stats[i].ptr);
@@ -2869,6 +4060,27 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 			seq_printf(seq, "%s=%d\n", stats[i].name, *(int *) stats[i].ptr);
 	}
 
+	{extern mutex_t dtrace_lock;
+	extern mutex_t dtrace_provider_lock;
+	extern mutex_t dtrace_meta_lock;
+	mutex_stats(seq, "dtrace_lock", &dtrace_lock);
+	mutex_stats(seq, "dtrace_provider_lock", &dtrace_provider_lock);
+	mutex_stats(seq, "dtrace_meta_lock", &dtrace_meta_lock);
+	mutex_stats(seq, "cpu_lock", &cpu_lock);
+	mutex_stats(seq, "mod_lock", &mod_lock);
+	}
+
+	/***********************************************/
+	/*   xcall  latency  histogram;  each line is  */
+	/*   the number of calls which took less than  */
+	/*   the given number of nanoseconds.	       */
+	/***********************************************/
+	for (i = 0; i < XCALL_LAT_BUCKETS; i++) {
+		if (cnt_xcall_lat[i] == 0)
+			continue;
+		seq_printf(seq, "xcall_lat_%lluns=%llu\n", 2ULL << i, cnt_xcall_lat[i]);
+	}
+
 	return 0;
 }
 
@@ -2884,6 +4096,46 @@ static struct file_operations proc_dtrace_stats = {
 	.release = single_release
 };
 
+/** "proc/dtrace/memory" */
+static int proc_dtrace_memory_show(struct seq_file *seq, void *v)
+{	int	i;
+
+	seq_printf(seq, "%-20s %6s %10s %12s %12s %12s %8s\n",
+		"cache", "objsz", "live", "live_bytes", "peak_bytes",
+		"allocs", "refills");
+	spin_lock(&kmc_tab_lock);
+	for (i = 0; i < KMC_MAX; i++) {
+		dtrace_kmc_t *kc = kmc_tab[i];
+		if (kc == NULL)
+			continue;
+		seq_printf(seq, "%-20s %6lu %10ld %12lu %12lu %12llu %8llu\n",
+			kc->kc_name,
+			(unsigned long) kc->kc_size,
+			kc->kc_live,
+			kc->kc_live * (unsigned long) kc->kc_size,
+			kc->kc_peak * (unsigned long) kc->kc_size,
+			kc->kc_allocs,
+			kc->kc_refills);
+	}
+	spin_unlock(&kmc_tab_lock);
+	seq_printf(seq, "kmem_alloc_live=%ld\n", atomic_long_read(&kmem_live));
+	seq_printf(seq, "kmem_alloc_peak=%ld\n", kmem_peak);
+	seq_printf(seq, "vmalloc_live=%ld\n", atomic_long_read(&vmalloc_live));
+	seq_printf(seq, "vmalloc_peak=%ld\n", vmalloc_peak);
+	return 0;
+}
+static int proc_dtrace_memory_single_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, &proc_dtrace_memory_show, NULL);
+}
+static struct file_operations proc_dtrace_memory = {
+	.owner   = THIS_MODULE,
+	.open    = proc_dtrace_memory_single_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
 /**********************************************************************/
 /*   Special hack for debugging.				      */
 /**********************************************************************/
@@ -3007,6 +4259,70 @@ static long dtracedrv_compat_ioctl(struct file *file, unsigned int cmd, unsigned
 }
 #endif
 
+/**********************************************************************/
+/*   mmap(2)  of  /dev/dtrace  gives the consumer a read-only view of  */
+/*   the  principal  buffers,  so  it  can  parse  them in place after  */
+/*   DTRACEIOC_BUFSWAP  rather  than  having  DTRACEIOC_BUFSNAP  copy  */
+/*   them out. Pages are found on demand, since the buffers dont exist  */
+/*   until DTRACEIOC_GO.					      */
+/**********************************************************************/
+static int
+dtracedrv_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{	struct page *page;
+
+	if (vma->vm_file == NULL || vma->vm_file->private_data == NULL)
+		return VM_FAULT_SIGBUS;
+
+	page = dtrace_buffer_page(vma->vm_file->private_data, vmf->pgoff);
+	if (page == NULL)
+		return VM_FAULT_SIGBUS;
+
+	vmf->page = page;
+	return 0;
+}
+static struct vm_operations_struct dtracedrv_vm_ops = {
+	.fault = dtracedrv_vm_fault,
+};
+static int
+dtracedrv_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	/***********************************************/
+	/*   The  one  writable  thing  is  a "stream"  */
+	/*   buffer's control page, mapped on its own.  */
+	/***********************************************/
+	if (vma->vm_flags & VM_WRITE) {
+		if (file->private_data == NULL ||
+		    !dtrace_buffer_ctlmap(file->private_data, vma->vm_pgoff,
+		    vma_pages(vma)))
+			return -EPERM;
+	} else {
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_flags |= VM_DONTEXPAND;
+	vma->vm_ops = &dtracedrv_vm_ops;
+	return 0;
+}
+
+/**********************************************************************/
+/*   Readable  while  any  CPU's  principal  buffer  has  passed its  */
+/*   watermark,  dropped  or  seen an error and the consumer has not  */
+/*   yet read it; see dtrace_state_pollready().			      */
+/**********************************************************************/
+static unsigned int
+dtracedrv_poll(struct file *file, poll_table *wait)
+{	dtrace_state_t *state = file->private_data;
+
+	poll_wait(file, &dtrace_pollwait, wait);
+
+	if (state == NULL)
+		return 0;
+
+	if (dtrace_state_pollready(state))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
 static const struct file_operations dtracedrv_fops = {
 	.owner = THIS_MODULE,
         .read = dtracedrv_read,
@@ -3020,6 +4336,8 @@ static const struct file_operations dtracedrv_fops = {
 #ifdef HAVE_COMPAT_IOCTL
         .compat_ioctl = dtracedrv_compat_ioctl,
 #endif
+        .mmap = dtracedrv_mmap,
+        .poll = dtracedrv_poll,
         .open = dtracedrv_open,
         .release = dtracedrv_release,
 };
@@ -3106,22 +4424,47 @@ static struct proc_dir_entry *dir;
 	for (i = 0; i < nr_cpus; i++) {
 		dmutex_init(&cpu_core[i].cpuc_pid_lock);
 	}
+	dtrace_ustack_init();
 	/***********************************************/
 	/*   Initialise  the  shadow  procs.  We dont  */
 	/*   cope  with pid_max changing on us. So be  */
 	/*   careful.				       */
 	/***********************************************/
 	shadow_procs = (sol_proc_t *) vmalloc(sizeof(sol_proc_t) * PID_MAX_DEFAULT);
+	par_overflow = (sol_proc_t *) vmalloc(sizeof(sol_proc_t) * nr_cpus);
+	if (shadow_procs == NULL || par_overflow == NULL) {
+		printk(KERN_WARNING "dtracedrv: cannot allocate shadow procs\n");
+		if (shadow_procs)
+			vfree(shadow_procs);
+		if (par_overflow)
+			vfree(par_overflow);
+		shadow_procs = par_overflow = NULL;
+		dtrace_ustack_fini();
+		kfree(cpu_cred);
+		kfree(cpu_table);
+		kfree(cpu_core);
+		kfree(cpu_list);
+		remove_proc_entry("dtrace", 0);
+		return -ENOMEM;
+	}
 	memset(shadow_procs, 0, sizeof(sol_proc_t) * PID_MAX_DEFAULT);
 	for (i = 0; i < PID_MAX_DEFAULT; i++) {
 		dmutex_init(&shadow_procs[i].p_lock);
 		dmutex_init(&shadow_procs[i].p_crlock);
 		}
+	memset(par_overflow, 0, sizeof(sol_proc_t) * nr_cpus);
+	for (i = 0; i < nr_cpus; i++) {
+		dmutex_init(&par_overflow[i].p_lock);
+		dmutex_init(&par_overflow[i].p_crlock);
+		}
 
 	/***********************************************/
 	/*   Create /proc/dtrace subentries.	       */
 	/***********************************************/
+	proc_create("clock", S_IFREG | S_IRUSR, dir, &proc_dtrace_clock);
 	proc_create("debug", S_IFREG | S_IRUGO | S_IWUGO, dir, &proc_dtrace_debug);
+	proc_create("difjit", S_IFREG | S_IRUSR, dir, &proc_dtrace_difjit);
+	proc_create("memory", S_IFREG | S_IRUGO, dir, &proc_dtrace_memory);
 	proc_create("security", S_IFREG | S_IRUGO | S_IWUGO, dir, &proc_dtrace_security);
 	proc_create("stats", S_IFREG | S_IRUGO | S_IWUGO, dir, &proc_dtrace_stats);
 	proc_create("trace", S_IFREG | S_IRUGO | S_IWUGO, dir, &proc_dtrace_trace);
@@ -3178,6 +4521,7 @@ static void __exit dtracedrv_exit(void)
 		return;
 	}
 
+	dtrace_hrtime_fini();
 	signal_fini();
 	intr_exit();
 	dcpc_exit();
@@ -3197,15 +4541,21 @@ static void __exit dtracedrv_exit(void)
 		}
 	}
 
+	dtrace_ustack_fini();
 	kfree(cpu_cred);
 	kfree(cpu_table);
 	kfree(cpu_core);
 	kfree(cpu_list);
 	vfree(shadow_procs);
+	vfree(par_overflow);
+	dtrace_patch_fini();
 
 	printk(KERN_WARNING "dtracedrv driver unloaded.\n");
 
+	remove_proc_entry("dtrace/clock", 0);
 	remove_proc_entry("dtrace/debug", 0);
+	remove_proc_entry("dtrace/difjit", 0);
+	remove_proc_entry("dtrace/memory", 0);
 	remove_proc_entry("dtrace/security", 0);
 	remove_proc_entry("dtrace/stats", 0);
 	remove_proc_entry("dtrace/trace", 0);
@@ -170,6 +170,8 @@ typedef struct	sol_proc_t {
 	uint64_t	t_dtrace_regv;	/* DTrace saved reg from fasttrap */
 #endif
 	struct pt_regs	*t_regs;
+	uint32_t	t_dtrace_tlsgen; /* bumped when slot changes owner */
+	char		t_dtrace_tlsspill; /* self-> vars are in the dynvar space */
 	} sol_proc_t;
 
 typedef sol_proc_t proc_t;
@@ -183,6 +185,10 @@ extern sol_proc_t	*curthread;
 
 int priv_policy(const cred_t *, int, int, int, const char *);
 int priv_policy_only(const cred_t *, int, int);
+int priv_proc_cred_perm(const cred_t *, proc_t *, cred_t **, int);
+int dtrace_task_cred_perm(const cred_t *, struct task_struct *, int);
+#define VREAD           00400
+#define VWRITE          00200
 //int priv_policy_choice(const cred_t *, int, int);
 
 /**********************************************************************/
@@ -246,6 +252,19 @@ void	freeenv(char *);
 //void	kmem_free(void *, int);
 void	vmem_destroy(vmem_t *);
 void	vmem_free(vmem_t *, void *, size_t);
+uintptr_t vmem_maxid(vmem_t *);
+
+/**********************************************************************/
+/*   Typed  slab  caches for the objects DTrace creates by the tens of  */
+/*   thousands (probes, ECBs, actions, fbt sites). See dtrace_linux.c.  */
+/**********************************************************************/
+typedef struct dtrace_kmc dtrace_kmc_t;
+dtrace_kmc_t *dtrace_kmc_create(const char *, size_t);
+void	dtrace_kmc_destroy(dtrace_kmc_t *);
+void	*dtrace_kmc_zalloc(dtrace_kmc_t *, size_t, int);
+void	dtrace_kmc_free(dtrace_kmc_t *, void *, size_t);
+void	dtrace_kmc_bulk_begin(void);
+void	dtrace_kmc_bulk_end(void);
 #define	vmem_alloc_t int
 #define	vmem_free_t int
 #define	vmem_mem_t int
@@ -410,9 +429,16 @@ extern int dtrace_shutdown;
 # define MAX_DCNT	32
 extern unsigned long dcnt[MAX_DCNT];
 
+/**********************************************************************/
+/*   xcall latency histogram, log2(ns) buckets. See x_call.c.	      */
+/**********************************************************************/
+# define XCALL_LAT_BUCKETS	32
+extern unsigned long long cnt_xcall_lat[XCALL_LAT_BUCKETS];
+
 int priv_policy_choice(const cred_t *a, int priv, int allzone);
 void *par_alloc(int, void *, int, int *);
 proc_t * par_find_thread(struct task_struct *t);
+int par_tls_index(uint32_t *);
 void par_free(int, void *ptr);
 int fulword(const void *addr, uintptr_t *valuep);
 int fuword8(const void *addr, unsigned char *valuep);
@@ -11,6 +11,7 @@ ssize_t syms_read(struct file *fp, char __user *buf, size_t len, loff_t *off);
 void *get_proc_addr(char *name);
 
 int	init_cyclic(void);
+void	fini_cyclic(void);
 void	dtrace_probe_provide(dtrace_probedesc_t *desc, dtrace_provider_t *);
 void	dtrace_cred2priv(cred_t *cr, uint32_t *privp, uid_t *uidp, zoneid_t *zoneidp);
 int dtrace_detach(dev_info_t *devi, ddi_detach_cmd_t cmd);
@@ -32,6 +33,7 @@ void *fbt_get_access_process_vm(void);
 int	fasttrap_attach(void);
 int	fasttrap_detach(void);
 proc_t *prfind(int p);
+struct task_struct *prfind_task(int p);
 int	tsignal(proc_t *, int);
 void	trap(struct pt_regs *rp, caddr_t addr, processorid_t cpu);
 int	dtrace_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *);
@@ -54,6 +56,11 @@ char	*dtrace_memchr(const char *, int, int);
 int	is_toxic_func(unsigned long a, const char *name);
 int	is_toxic_return(const char *name);
 int	memory_set_rw(void *addr, int num_pages, int is_kernel_addr);
+void	dtrace_patch_begin(void);
+void	dtrace_patch_end(void);
+void	dtrace_patch_set(instr_t *addr, instr_t val);
+void	dtrace_patch_restore(instr_t *addr, instr_t expect, instr_t val);
+void	dtrace_patch_multi(instr_t *addr, instr_t trap, const void *tail, int len, instr_t val);
 void	set_page_prot(unsigned long addr, int len, long and_prot, long or_prot);
 int	on_notifier_list(uint8_t *);
 int	mem_is_writable(volatile char *addr);
@@ -68,11 +75,46 @@ int	is_probable_instruction(instr_t *, int is_entry);
 void	dtrace_instr_dump(char *label, uint8_t *insn);
 dtrace_icookie_t dtrace_interrupt_get(void);
 void	xcall_slave2(void);
+struct seq_file;
+void	mutex_stats(struct seq_file *, char *, mutex_t *);
 char * hrtime_str(hrtime_t s);
 int dtrace_xen_hypercall(int call, void *a, void *b, void *c);
+void	dtrace_ustack_init(void);
+void	dtrace_ustack_fini(void);
+int	dtrace_unwind_register(void *owner, dtrace_unwind_t *);
+void	dtrace_unwind_release(void *owner);
 int	dtrace_is_xen(void);
 int	xen_send_ipi(cpumask_t *, int);
 void	xen_xcall_init(void);
 void	xen_xcall_fini(void);
+void	*dtrace_buffer_memalloc(size_t, processorid_t);
+void	dtrace_buffer_memfree(void *, size_t);
+struct page *dtrace_buffer_mempage(void *);
+struct page *dtrace_buffer_page(dtrace_state_t *, unsigned long);
+int	dtrace_buffer_ctlmap(dtrace_state_t *, unsigned long, unsigned long);
+int	dtrace_state_pollready(dtrace_state_t *);
+void	dtrace_poll_notify(void);
+void	dtrace_poll_wakeup(void);
+int	dtrace_difjit_compile(dtrace_difo_t *);
+void	dtrace_difjit_free(dtrace_difo_t *);
+uint64_t dtrace_difjit_ldga(dtrace_difjit_t *, uint_t, uint64_t);
+uint64_t dtrace_difjit_ldgs(dtrace_difjit_t *, uint_t);
+uint64_t dtrace_difjit_rload(dtrace_difjit_t *, uint_t, uint64_t);
+uint64_t dtrace_dif_run(dtrace_difo_t *, dtrace_mstate_t *,
+    dtrace_vstate_t *, dtrace_state_t *);
+void	dtrace_difo_predecode(dtrace_difo_t *);
+void	dtrace_difo_predecode_free(dtrace_difo_t *);
+struct seq_file;
+void	dtrace_difjit_selftest(struct seq_file *);
+void	dtrace_hrtime_init(void);
+void	dtrace_hrtime_fini(void);
+void	dtrace_hrtime_start(void);
+void	dtrace_hrtime_stop(void);
+hrtime_t dtrace_hrtime_read(void);
+void	dtrace_hrtime_selftest(struct seq_file *);
+uint8_t	dtrace_load8(uintptr_t);
+uint16_t dtrace_load16(uintptr_t);
+uint32_t dtrace_load32(uintptr_t);
+uint64_t dtrace_load64(uintptr_t);
 
 # endif
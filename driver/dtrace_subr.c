@@ -16,6 +16,7 @@
 #include <sys/fasttrap.h>
 #include <sys/rwlock.h>
 #include <sys/privregs.h>
+#include <linux/vmalloc.h>
 
 # if defined(sun)
 #include <sys/x_call.h>
@@ -35,10 +36,58 @@
 typedef struct dtrace_invop_hdlr {
 	int (*dtih_func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *);
 	struct dtrace_invop_hdlr *dtih_next;
+	uint32_t dtih_mask;	/* Our bit in dtia_mask.		*/
+	int	dtih_claims;	/* Routed via dtrace_invop_tab.		*/
 } dtrace_invop_hdlr_t;
 
 dtrace_invop_hdlr_t *dtrace_invop_hdlr;
 
+/**********************************************************************/
+/*   Address  to  handler  routing. Providers claim each address they  */
+/*   patch  (dtrace_invop_claim()),  and  when a breakpoint fires we  */
+/*   only  offer  it  to the handlers which claimed it, plus any which  */
+/*   never  claim  anything.  Open  addressing,  and  entries are never  */
+/*   deleted,  so  that  the  trap  handler  can  walk  the table with  */
+/*   no  locks  whilst  we  add  to it under dtrace_lock. A miss, or a  */
+/*   full table, means we fall back to offering it to everyone.	      */
+/**********************************************************************/
+typedef struct dtrace_invop_addr {
+	uintptr_t	dtia_addr;
+	uint32_t	dtia_mask;	/* dtih_mask of each claimant.	*/
+} dtrace_invop_addr_t;
+
+#define	DTRACE_INVOP_TABSIZE	(1 << 17)
+#define	DTRACE_INVOP_ADDR2NDX(addr) \
+	((((uintptr_t)(addr) >> 4) ^ ((uintptr_t)(addr) >> 16)) & \
+	    (DTRACE_INVOP_TABSIZE - 1))
+
+static dtrace_invop_addr_t *dtrace_invop_tab;
+static int dtrace_invop_tabcnt;
+static uint32_t dtrace_invop_masks;
+
+static uint32_t
+dtrace_invop_lookup(uintptr_t addr)
+{
+	dtrace_invop_addr_t *tab = dtrace_invop_tab;
+	dtrace_invop_addr_t *ap;
+	int i, n;
+
+	if (tab == NULL)
+		return (0);
+
+	i = DTRACE_INVOP_ADDR2NDX(addr);
+	for (n = 0; n < DTRACE_INVOP_TABSIZE; n++) {
+		ap = &tab[i];
+		if (ap->dtia_addr == addr)
+			return (ap->dtia_mask);
+		if (ap->dtia_addr == 0)
+			return (0);
+		i = (i + 1) & (DTRACE_INVOP_TABSIZE - 1);
+	}
+
+	return (0);
+}
+
 /**********************************************************************/
 /*   On a breakpoint trap, see which provider or providers will take  */
 /*   the  trap.  Because of our prov provider, we can end up hitting  */
@@ -50,6 +99,7 @@ int
 dtrace_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *tinfo)
 {
 	dtrace_invop_hdlr_t *hdlr;
+	uint32_t mask;
 	int rval = 0;
 static int once = TRUE;
 
@@ -66,8 +116,12 @@ static int once = TRUE;
 		}
 	}
 
+	mask = dtrace_invop_lookup(addr);
+
 	for (hdlr = dtrace_invop_hdlr; hdlr != NULL; hdlr = hdlr->dtih_next) {
 		int	ret;
+		if (mask && hdlr->dtih_claims && (mask & hdlr->dtih_mask) == 0)
+			continue;
 		if ((ret = hdlr->dtih_func(addr, stack, eax, tinfo)) != 0)
 			rval = 1;
 	}
@@ -75,6 +129,69 @@ static int once = TRUE;
 	return rval;
 }
 
+/**********************************************************************/
+/*   Called  by  a  provider  before  it patches addr. The claim stays  */
+/*   until the handler is removed; a stale claim only costs a call.   */
+/**********************************************************************/
+void
+dtrace_invop_claim(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *),
+    uintptr_t addr)
+{
+	dtrace_invop_hdlr_t *hdlr;
+	dtrace_invop_addr_t *ap;
+	int i;
+
+	for (hdlr = dtrace_invop_hdlr; hdlr != NULL; hdlr = hdlr->dtih_next) {
+		if (hdlr->dtih_func == func)
+			break;
+	}
+	if (hdlr == NULL || hdlr->dtih_mask == 0)
+		return;
+
+	if (dtrace_invop_tab == NULL) {
+		/***********************************************/
+		/*   2MB:  too  big to ask the page allocator  */
+		/*   for in one piece.			       */
+		/***********************************************/
+		ap = vmalloc(DTRACE_INVOP_TABSIZE * sizeof (dtrace_invop_addr_t));
+		if (ap == NULL)
+			return;
+		memset(ap, 0, DTRACE_INVOP_TABSIZE * sizeof (dtrace_invop_addr_t));
+		membar_producer();
+		dtrace_invop_tab = ap;
+	}
+
+	i = DTRACE_INVOP_ADDR2NDX(addr);
+	for (;;) {
+		ap = &dtrace_invop_tab[i];
+		if (ap->dtia_addr == addr) {
+			ap->dtia_mask |= hdlr->dtih_mask;
+			break;
+		}
+		if (ap->dtia_addr == 0) {
+			/***********************************************/
+			/*   Keep  it  at  most 3/4 full, so a lookup  */
+			/*   for something we dont have stays short.   */
+			/***********************************************/
+			if (dtrace_invop_tabcnt >= DTRACE_INVOP_TABSIZE / 4 * 3)
+				return;
+			ap->dtia_mask = hdlr->dtih_mask;
+			membar_producer();
+			ap->dtia_addr = addr;
+			dtrace_invop_tabcnt++;
+			break;
+		}
+		i = (i + 1) & (DTRACE_INVOP_TABSIZE - 1);
+	}
+
+	/***********************************************/
+	/*   Publish  the  claim before we say we are  */
+	/*   routed.				       */
+	/***********************************************/
+	membar_producer();
+	hdlr->dtih_claims = TRUE;
+}
+
 void
 dtrace_invop_add(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *))
 {
@@ -82,6 +199,15 @@ dtrace_invop_add(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *))
 
 	hdlr = kmem_alloc(sizeof (dtrace_invop_hdlr_t), KM_SLEEP);
 	hdlr->dtih_func = func;
+	hdlr->dtih_claims = FALSE;
+
+	/***********************************************/
+	/*   Take  a  free  routing bit. If we run out  */
+	/*   the handler just sees every trap.	       */
+	/***********************************************/
+	hdlr->dtih_mask = ~dtrace_invop_masks & (dtrace_invop_masks + 1);
+	dtrace_invop_masks |= hdlr->dtih_mask;
+
 	hdlr->dtih_next = dtrace_invop_hdlr;
 	dtrace_invop_hdlr = hdlr;
 }
@@ -90,6 +216,7 @@ void
 dtrace_invop_remove(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *))
 {
 	dtrace_invop_hdlr_t *hdlr = dtrace_invop_hdlr, *prev = NULL;
+	dtrace_invop_addr_t *tab;
 
 	for (;;) {
 		if (hdlr == NULL)
@@ -110,6 +237,34 @@ dtrace_invop_remove(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t
 		prev->dtih_next = hdlr->dtih_next;
 	}
 
+	/***********************************************/
+	/*   Drop  our  claims, so the bit can be used  */
+	/*   by  someone  else. The last one out frees  */
+	/*   the table.				       */
+	/***********************************************/
+	if (dtrace_invop_tab) {
+		int i;
+		for (i = 0; i < DTRACE_INVOP_TABSIZE; i++)
+			dtrace_invop_tab[i].dtia_mask &= ~hdlr->dtih_mask;
+	}
+	dtrace_invop_masks &= ~hdlr->dtih_mask;
+	tab = NULL;
+	if (dtrace_invop_hdlr == NULL && dtrace_invop_tab) {
+		tab = dtrace_invop_tab;
+		dtrace_invop_tab = NULL;
+		dtrace_invop_tabcnt = 0;
+	}
+
+	/***********************************************/
+	/*   The trap handler walks the chain and the  */
+	/*   table with no locks, so wait for any CPU  */
+	/*   still in there to get out before we free  */
+	/*   what it may be looking at.                */
+	/***********************************************/
+	dtrace_sync();
+	if (tab)
+		vfree(tab);
+
 	kmem_free(hdlr, sizeof (dtrace_invop_hdlr_t));
 }
 
@@ -77,10 +77,6 @@ sprunlock(proc_t *p)
 #define SFORKING   0x00000008   /* tells called functions that we're forking */
 #define SVFORK     0x00040000   /* child of vfork that has not yet exec'd */
 
-#define VREAD           00400
-#define VWRITE          00200
-
-# define priv_proc_cred_perm(cr, p, ptr, flags) 0
 static void swap_func(void *p1, void *p2, int size)
 {
 	while (size-- > 0) {
@@ -251,7 +247,29 @@ static uint32_t fasttrap_total;
 
 #define	FASTTRAP_PID_NAME		"pid"
 
-fasttrap_hash_t			fasttrap_tpoints;
+fasttrap_hash_t * volatile	fasttrap_tpoints;
+krwlock_t			fasttrap_tpoints_rwlock;
+
+/*
+ * Grow the tracepoint hash once there are more than FASTTRAP_TPOINTS_LOAD
+ * tracepoints per bucket.
+ */
+#define	FASTTRAP_TPOINTS_LOAD		2
+#define	FASTTRAP_TPOINTS_MAX_SIZE	0x1000000
+
+static uint32_t			fasttrap_tpoints_count;
+static unsigned long long	fasttrap_tpoints_resizes;
+
+/*
+ * Lookup statistics for /proc/dtrace/fasttrap, kept per CPU so that the
+ * trap path never shares a cache line with another CPU to update them.
+ */
+typedef struct fasttrap_lookup_stat {
+	uint64_t	fls_lookups;		/* tracepoint lookups */
+	uint64_t	fls_steps;		/* chain entries visited */
+} ____cacheline_aligned fasttrap_lookup_stat_t;
+
+static fasttrap_lookup_stat_t	fasttrap_lookup_stats[NCPU];
 static fasttrap_hash_t		fasttrap_provs;
 static fasttrap_hash_t		fasttrap_procs;
 
@@ -370,15 +388,140 @@ HERE();
 	/*   online  after  we  got  loaded since the  */
 	/*   cpu_core[]  array  wont  have  the right  */
 	/*   number  of  entries and we may panic the  */
-	/*   kernel.				       */
+	/*   kernel.  So  walk  the  nr_cpus  entries  */
+	/*   cpu_core[]  has,  not  the number online  */
+	/*   now  -  a  cpu  id  can be beyond that,  */
+	/*   if a lower one has gone offline.	       */
 	/***********************************************/
-	for (i = 0; i < num_online_cpus(); i++) {
+	for (i = 0; i < nr_cpus; i++) {
 		dmutex_enter(&cpu_core[i].cpuc_pid_lock);
 		dmutex_exit(&cpu_core[i].cpuc_pid_lock);
 HERE();
 	}
 }
 
+# if linux
+static fasttrap_hash_t *
+fasttrap_tpoints_alloc(ulong_t nent)
+{
+	fasttrap_hash_t *h;
+	ulong_t i;
+
+	h = kmem_zalloc(sizeof (fasttrap_hash_t), KM_SLEEP);
+	h->fth_nent = nent;
+	h->fth_mask = nent - 1;
+	h->fth_table = kmem_zalloc(nent * sizeof (fasttrap_bucket_t), KM_SLEEP);
+	for (i = 0; i < nent; i++) {
+		dmutex_init(&h->fth_table[i].ftb_mtx);
+	}
+
+	return (h);
+}
+
+static void
+fasttrap_tpoints_free(fasttrap_hash_t *h)
+{
+	kmem_free(h->fth_table, h->fth_nent * sizeof (fasttrap_bucket_t));
+	kmem_free(h, sizeof (fasttrap_hash_t));
+}
+
+/*
+ * Called before adding a tracepoint, without fasttrap_tpoints_rwlock held.
+ * If the table is getting crowded, build a bigger one alongside it, chained
+ * through the other ftt_link[] entry, and swap it in. The trap path does
+ * not take the rwlock; it only holds its CPU's cpuc_pid_lock while it looks
+ * at the table (see fasttrap_tpoints_lookup()). So once the new table is
+ * published, cycling through those locks (as fasttrap_mod_barrier() does)
+ * guarantees nobody is still on the old one. We do that before dropping
+ * the rwlock, so the old table's links are not reused by the next resize
+ * while someone is still following them.
+ */
+static void
+fasttrap_tpoints_grow(void)
+{
+	fasttrap_hash_t *oh, *nh;
+	fasttrap_bucket_t *bucket;
+	fasttrap_tracepoint_t *tp;
+	ulong_t i, nent;
+
+	nent = fasttrap_tpoints->fth_nent;
+	if (fasttrap_tpoints_count <= nent * FASTTRAP_TPOINTS_LOAD ||
+	    nent >= FASTTRAP_TPOINTS_MAX_SIZE)
+		return;
+
+	while (nent < fasttrap_tpoints_count && nent < FASTTRAP_TPOINTS_MAX_SIZE)
+		nent <<= 1;
+
+	nh = fasttrap_tpoints_alloc(nent);
+
+	rw_enter(&fasttrap_tpoints_rwlock, RW_WRITER);
+
+	/*
+	 * Someone else may have beaten us to it.
+	 */
+	oh = fasttrap_tpoints;
+	if (oh->fth_nent >= nent) {
+		rw_exit(&fasttrap_tpoints_rwlock);
+		fasttrap_tpoints_free(nh);
+		return;
+	}
+
+	nh->fth_link = !oh->fth_link;
+	for (i = 0; i < oh->fth_nent; i++) {
+		for (tp = oh->fth_table[i].ftb_data; tp != NULL;
+		    tp = FASTTRAP_TP_NEXT(oh, tp)) {
+			bucket = &nh->fth_table[FASTTRAP_TPOINTS_HINDEX(nh,
+			    tp->ftt_pid, tp->ftt_pc)];
+			FASTTRAP_TP_NEXT(nh, tp) = bucket->ftb_data;
+			bucket->ftb_data = tp;
+		}
+	}
+
+	membar_producer();
+	fasttrap_tpoints = nh;
+	membar_producer();
+
+	for (i = 0; i < nr_cpus; i++) {
+		dmutex_enter(&cpu_core[i].cpuc_pid_lock);
+		dmutex_exit(&cpu_core[i].cpuc_pid_lock);
+	}
+
+	fasttrap_tpoints_resizes++;
+	rw_exit(&fasttrap_tpoints_rwlock);
+
+	fasttrap_tpoints_free(oh);
+}
+
+/*
+ * Find the enabled tracepoint a process has just hit. Called from the trap
+ * path with this CPU's cpuc_pid_lock held, which is what keeps the table
+ * we pick up here alive. No other locks are taken.
+ */
+fasttrap_tracepoint_t *
+fasttrap_tpoints_lookup(pid_t pid, uintptr_t pc)
+{
+	fasttrap_hash_t *h = fasttrap_tpoints;
+	fasttrap_lookup_stat_t *fls = &fasttrap_lookup_stats[cpu_get_id()];
+	fasttrap_tracepoint_t *tp;
+	uint_t n = 0;
+
+	membar_consumer();
+
+	for (tp = h->fth_table[FASTTRAP_TPOINTS_HINDEX(h, pid, pc)].ftb_data;
+	    tp != NULL; tp = FASTTRAP_TP_NEXT(h, tp)) {
+		n++;
+		if (pid == tp->ftt_pid && pc == tp->ftt_pc &&
+		    tp->ftt_proc->ftpc_acount != 0)
+			break;
+	}
+
+	fls->fls_lookups++;
+	fls->fls_steps += n;
+
+	return (tp);
+}
+# endif
+
 /*
  * This is the timeout's callback for cleaning up the providers and their
  * probes.
@@ -546,12 +689,14 @@ printk("in fasttrap_fork\n");
 	 * Iterate over every tracepoint looking for ones that belong to the
 	 * parent process, and remove each from the child process.
 	 */
-	for (i = 0; i < fasttrap_tpoints.fth_nent; i++) {
+	rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
+	for (i = 0; i < fasttrap_tpoints->fth_nent; i++) {
 		fasttrap_tracepoint_t *tp;
-		fasttrap_bucket_t *bucket = &fasttrap_tpoints.fth_table[i];
+		fasttrap_bucket_t *bucket = &fasttrap_tpoints->fth_table[i];
 
 		dmutex_enter(&bucket->ftb_mtx);
-		for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
+		for (tp = bucket->ftb_data; tp != NULL;
+		    tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp)) {
 			if (tp->ftt_pid == ppid &&
 			    tp->ftt_proc->ftpc_acount != 0) {
 				int ret = fasttrap_tracepoint_remove(cp, tp);
@@ -570,6 +715,7 @@ printk("in fasttrap_fork\n");
 		}
 		dmutex_exit(&bucket->ftb_mtx);
 	}
+	rw_exit(&fasttrap_tpoints_rwlock);
 
 	dmutex_enter(&cp->p_lock);
 	sprunlock(cp);
@@ -635,8 +781,10 @@ HERE();
 	 */
 	fasttrap_mod_barrier(probe->ftp_gen);
 
-	bucket = &fasttrap_tpoints.fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
-//printk("bucket=%p pid=%d pc=%lx\n", bucket, pid, pc);
+	/*
+	 * Make room first if we are about to overcrowd the hash.
+	 */
+	fasttrap_tpoints_grow();
 HERE();
 
 	/*
@@ -650,8 +798,11 @@ HERE();
 	 * defunct.
 	 */
 again:
+	rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
+	bucket = &fasttrap_tpoints->fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
 	dmutex_enter(&bucket->ftb_mtx);
-	for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
+	for (tp = bucket->ftb_data; tp != NULL;
+	    tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp)) {
 		/*
 		 * Note that it's safe to access the active count on the
 		 * associated proc structure because we know that at least one
@@ -703,6 +854,7 @@ HERE();
 HERE();
 
 		dmutex_exit(&bucket->ftb_mtx);
+		rw_exit(&fasttrap_tpoints_rwlock);
 HERE();
 
 		if (new_tp != NULL) {
@@ -721,11 +873,13 @@ HERE();
 	if (new_tp != NULL) {
 		int rc = 0;
 
-		new_tp->ftt_next = bucket->ftb_data;
+		FASTTRAP_TP_NEXT(fasttrap_tpoints, new_tp) = bucket->ftb_data;
 		membar_producer();
 		bucket->ftb_data = new_tp;
 		membar_producer();
+		atomic_add_32(&fasttrap_tpoints_count, 1);
 		dmutex_exit(&bucket->ftb_mtx);
+		rw_exit(&fasttrap_tpoints_rwlock);
 
 		/*
 		 * Activate the tracepoint in the ISA-specific manner.
@@ -752,6 +906,7 @@ HERE();
 
 HERE();
 	dmutex_exit(&bucket->ftb_mtx);
+	rw_exit(&fasttrap_tpoints_rwlock);
 
 	/*
 	 * Initialize the tracepoint that's been preallocated with the probe.
@@ -820,9 +975,11 @@ fasttrap_tracepoint_disable(proc_t *p, fasttrap_probe_t *probe, uint_t index)
 	 * Find the tracepoint and make sure that our id is one of the
 	 * ones registered with it.
 	 */
-	bucket = &fasttrap_tpoints.fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
+	rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
+	bucket = &fasttrap_tpoints->fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
 	dmutex_enter(&bucket->ftb_mtx);
-	for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
+	for (tp = bucket->ftb_data; tp != NULL;
+	    tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp)) {
 		if (tp->ftt_pid == pid && tp->ftt_pc == pc &&
 		    tp->ftt_proc == provider->ftp_proc)
 			break;
@@ -900,6 +1057,7 @@ fasttrap_tracepoint_disable(proc_t *p, fasttrap_probe_t *probe, uint_t index)
 		}
 
 		dmutex_exit(&bucket->ftb_mtx);
+		rw_exit(&fasttrap_tpoints_rwlock);
 
 		/*
 		 * Tag the modified probe with the generation in which it was
@@ -910,6 +1068,7 @@ fasttrap_tracepoint_disable(proc_t *p, fasttrap_probe_t *probe, uint_t index)
 	}
 
 	dmutex_exit(&bucket->ftb_mtx);
+	rw_exit(&fasttrap_tpoints_rwlock);
 
 	/*
 	 * We can't safely remove the tracepoint from the set of active
@@ -943,20 +1102,26 @@ fasttrap_tracepoint_disable(proc_t *p, fasttrap_probe_t *probe, uint_t index)
 	}
 
 	/*
-	 * Remove the probe from the hash table of active tracepoints.
+	 * Remove the probe from the hash table of active tracepoints. The
+	 * table may have been resized since we looked, so find the bucket
+	 * again.
 	 */
+	rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
+	bucket = &fasttrap_tpoints->fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
 	dmutex_enter(&bucket->ftb_mtx);
 	pp = (fasttrap_tracepoint_t **)&bucket->ftb_data;
 	ASSERT(*pp != NULL);
 	while (*pp != tp) {
-		pp = &(*pp)->ftt_next;
+		pp = &FASTTRAP_TP_NEXT(fasttrap_tpoints, *pp);
 		ASSERT(*pp != NULL);
 	}
 
-	*pp = tp->ftt_next;
+	*pp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp);
 	membar_producer();
+	atomic_add_32(&fasttrap_tpoints_count, -1);
 
 	dmutex_exit(&bucket->ftb_mtx);
+	rw_exit(&fasttrap_tpoints_rwlock);
 
 	/*
 	 * Tag the modified probe with the generation in which it was changed.
@@ -1725,20 +1890,19 @@ fasttrap_uint64_cmp(const void *ap, const void *bp)
 	return (*(const uint64_t *)ap - *(const uint64_t *)bp);
 }
 
+/*
+ * Create the probe, or offset probes, described by one spec. The caller
+ * holds the provider's creation lock. Returns ENOMEM if this would take us
+ * past fasttrap_max.
+ */
 static int
-fasttrap_add_probe(fasttrap_probe_spec_t *pdata)
+fasttrap_add_probe_locked(fasttrap_provider_t *provider,
+    fasttrap_probe_spec_t *pdata)
 {
-	fasttrap_provider_t *provider;
 	fasttrap_probe_t *pp;
 	fasttrap_tracepoint_t *tp;
 	char *name;
-	int i, aframes = 0, whack;
-
-	/*
-	 * There needs to be at least one desired trace point.
-	 */
-	if (pdata->ftps_noffs == 0)
-		return (EINVAL);
+	int i, aframes = 0;
 
 	switch (pdata->ftps_type) {
 	case DTFTP_ENTRY:
@@ -1749,35 +1913,11 @@ fasttrap_add_probe(fasttrap_probe_spec_t *pdata)
 		name = "return";
 		aframes = FASTTRAP_RETURN_AFRAMES;
 		break;
-	case DTFTP_OFFSETS:
+	default:
 		name = NULL;
 		break;
-	default:
-		return (EINVAL);
 	}
 
-	if ((provider = fasttrap_provider_lookup(pdata->ftps_pid,
-	    FASTTRAP_PID_NAME, &pid_attr)) == NULL)
-		return (ESRCH);
-
-	/*
-	 * Increment this reference count to indicate that a consumer is
-	 * actively adding a new probe associated with this provider. This
-	 * prevents the provider from being deleted -- we'll need to check
-	 * for pending deletions when we drop this reference count.
-	 */
-	provider->ftp_ccount++;
-	dmutex_exit(&provider->ftp_mtx);
-
-	/*
-	 * Grab the creation lock to ensure consistency between calls to
-	 * dtrace_probe_lookup() and dtrace_probe_create() in the face of
-	 * other threads creating probes. We must drop the provider lock
-	 * before taking this lock to avoid a three-way deadlock with the
-	 * DTrace framework.
-	 */
-	dmutex_enter(&provider->ftp_cmtx);
-
 	if (name == NULL) {
 HERE();
 		for (i = 0; i < pdata->ftps_noffs; i++) {
@@ -1794,7 +1934,7 @@ HERE();
 
 			if (fasttrap_total > fasttrap_max) {
 				atomic_add_32(&fasttrap_total, -1);
-				goto no_mem;
+				return (ENOMEM);
 			}
 
 			pp = kmem_zalloc(sizeof (fasttrap_probe_t), KM_SLEEP);
@@ -1828,7 +1968,7 @@ HERE();
 
 		if (fasttrap_total > fasttrap_max) {
 			atomic_add_32(&fasttrap_total, -pdata->ftps_noffs);
-			goto no_mem;
+			return (ENOMEM);
 		}
 
 		/*
@@ -1843,7 +1983,7 @@ HERE();
 				continue;
 
 			atomic_add_32(&fasttrap_total, -pdata->ftps_noffs);
-			goto no_mem;
+			return (ENOMEM);
 		}
 
 		ASSERT(pdata->ftps_noffs > 0);
@@ -1873,6 +2013,72 @@ HERE();
 		    pdata->ftps_mod, pdata->ftps_func, name, aframes, pp);
 	}
 
+	return (0);
+}
+
+/*
+ * Create the probes for nspecs specs, packed back to back, all for the
+ * same process. The provider is looked up, and its creation lock taken,
+ * once for the lot. *ndone is set to the number of specs processed.
+ */
+static int
+fasttrap_add_probes(pid_t pid, fasttrap_probe_spec_t *pdata, uint_t nspecs,
+    uint_t *ndone)
+{
+	fasttrap_provider_t *provider;
+	fasttrap_probe_spec_t *sp;
+	uint_t i;
+	int whack;
+
+	*ndone = 0;
+
+	for (i = 0, sp = pdata; i < nspecs; i++) {
+		/*
+		 * There needs to be at least one desired trace point.
+		 */
+		if (sp->ftps_noffs == 0 || sp->ftps_pid != pid)
+			return (EINVAL);
+
+		switch (sp->ftps_type) {
+		case DTFTP_ENTRY:
+		case DTFTP_RETURN:
+		case DTFTP_OFFSETS:
+			break;
+		default:
+			return (EINVAL);
+		}
+
+		sp = (void *)((char *)sp + FASTTRAP_PROBE_SPEC_SIZE(sp->ftps_noffs));
+	}
+
+	if ((provider = fasttrap_provider_lookup(pid,
+	    FASTTRAP_PID_NAME, &pid_attr)) == NULL)
+		return (ESRCH);
+
+	/*
+	 * Increment this reference count to indicate that a consumer is
+	 * actively adding a new probe associated with this provider. This
+	 * prevents the provider from being deleted -- we'll need to check
+	 * for pending deletions when we drop this reference count.
+	 */
+	provider->ftp_ccount++;
+	dmutex_exit(&provider->ftp_mtx);
+
+	/*
+	 * Grab the creation lock to ensure consistency between calls to
+	 * dtrace_probe_lookup() and dtrace_probe_create() in the face of
+	 * other threads creating probes. We must drop the provider lock
+	 * before taking this lock to avoid a three-way deadlock with the
+	 * DTrace framework.
+	 */
+	dmutex_enter(&provider->ftp_cmtx);
+
+	for (sp = pdata; *ndone < nspecs; (*ndone)++) {
+		if (fasttrap_add_probe_locked(provider, sp) != 0)
+			goto no_mem;
+		sp = (void *)((char *)sp + FASTTRAP_PROBE_SPEC_SIZE(sp->ftps_noffs));
+	}
+
 	dmutex_exit(&provider->ftp_cmtx);
 
 	/*
@@ -1909,6 +2115,14 @@ no_mem:
 	return (ENOMEM);
 }
 
+static int
+fasttrap_add_probe(fasttrap_probe_spec_t *pdata)
+{
+	uint_t ndone;
+
+	return (fasttrap_add_probes(pdata->ftps_pid, pdata, 1, &ndone));
+}
+
 /**********************************************************************/
 /*   Code for /proc/dtrace/fasttrap     			      */
 /**********************************************************************/
@@ -1945,7 +2159,12 @@ static int fasttrap_seq_show(struct seq_file *seq, void *v)
 	int	ent = 0;
 
 //printk("%s v=%p\n", __func__, v);
+	rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
 	if (n == 1) {
+		unsigned long used = 0, chain, maxchain = 0;
+		unsigned long long lookups = 0, steps = 0;
+		fasttrap_tracepoint_t *tp;
+
 		/***********************************************/
 		/*   Typically:				       */
 		/*   tpoints=1024 procs=256 provs=256	       */
@@ -1954,10 +2173,37 @@ static int fasttrap_seq_show(struct seq_file *seq, void *v)
 			"# TRCP: pid pc type size base index seg\n"
 			"# PROV: pid name marked retired rcount ccount mcount\n"
 			"# PROC: pid acount rcount\n",
-			fasttrap_tpoints.fth_nent,
+			fasttrap_tpoints->fth_nent,
 			fasttrap_procs.fth_nent,
 			fasttrap_provs.fth_nent,
 			fasttrap_total);
+
+		/***********************************************/
+		/*   Tracepoint  hash  occupancy,  and  how  */
+		/*   far the trap path walks looking.	       */
+		/***********************************************/
+		for (i = 0; i < fasttrap_tpoints->fth_nent; i++) {
+			chain = 0;
+			for (tp = fasttrap_tpoints->fth_table[i].ftb_data;
+			    tp != NULL; tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp))
+				chain++;
+			if (chain)
+				used++;
+			if (chain > maxchain)
+				maxchain = chain;
+		}
+		for (i = 0; i < nr_cpus; i++) {
+			lookups += fasttrap_lookup_stats[i].fls_lookups;
+			steps += fasttrap_lookup_stats[i].fls_steps;
+		}
+		seq_printf(seq, "# HASH: count=%u used=%lu maxchain=%lu resizes=%llu\n"
+			"# LOOKUP: n=%llu steps=%llu\n",
+			fasttrap_tpoints_count,
+			used,
+			maxchain,
+			fasttrap_tpoints_resizes,
+			lookups,
+			steps);
 	}
 
 	/***********************************************/
@@ -1967,10 +2213,11 @@ static int fasttrap_seq_show(struct seq_file *seq, void *v)
 	/*   ptr for each probe).		       */
 	/***********************************************/
 	target = n;
-	for (i = 0; i < fasttrap_tpoints.fth_nent; i++) {
+	for (i = 0; i < fasttrap_tpoints->fth_nent; i++) {
 		fasttrap_tracepoint_t *tp;
-		fasttrap_bucket_t *bucket = &fasttrap_tpoints.fth_table[i];
-		for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
+		fasttrap_bucket_t *bucket = &fasttrap_tpoints->fth_table[i];
+		for (tp = bucket->ftb_data; tp != NULL;
+		    tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp)) {
 			if (--target < 0) {
 				seq_printf(seq, "TRCP %d %p %02x sz:%02x b:%02x i:%02x s:%02x dest:%lx sc:%x\n",
 				//n, ent,
@@ -1983,11 +2230,14 @@ static int fasttrap_seq_show(struct seq_file *seq, void *v)
 					tp->ftt_segment,
 					tp->ftt_dest,
 					tp->ftt_scale);
-				if (++ent >= CHUNK_SIZE)
+				if (++ent >= CHUNK_SIZE) {
+					rw_exit(&fasttrap_tpoints_rwlock);
 					return 0;
 				}
+				}
 		}
 	}
+	rw_exit(&fasttrap_tpoints_rwlock);
 	for (i = 0; i < fasttrap_provs.fth_nent; i++) {
 		fasttrap_provider_t *fpp;
 		fasttrap_bucket_t *bucket = &fasttrap_provs.fth_table[i];
@@ -2357,6 +2607,125 @@ err:
 
 		return (ret);
 
+# if linux
+	} else if (cmd == FASTTRAPIOC_MAKEPROBES) {
+		fasttrap_probe_batch_t *ubatch = (void *)arg;
+		fasttrap_probe_batch_t batch;
+		fasttrap_probe_spec_t *probe;
+		char *buf, *end, *c;
+		uint_t i, ndone = 0;
+		int ret = 0;
+
+		if (copyin(ubatch, &batch, sizeof (batch)) != 0)
+			return (EFAULT);
+
+		/*
+		 * Write ftpb_ndone straight away, so that libdtrace can tell
+		 * a failed batch from a driver which does not know the ioctl.
+		 */
+		if (copyout(&ndone, &ubatch->ftpb_ndone, sizeof (ndone)) != 0)
+			return (EFAULT);
+
+		if (batch.ftpb_nspecs == 0 ||
+		    batch.ftpb_size < sizeof (fasttrap_probe_spec_t))
+			return (EINVAL);
+
+		if (batch.ftpb_size > FASTTRAP_BATCH_MAX)
+			return (ENOMEM);
+
+		/*
+		 * Every spec must be for ftpb_pid (checked below), so an
+		 * unprivileged caller can be turned away before we copy in
+		 * what may be a large batch.
+		 */
+		if (!PRIV_POLICY_CHOICE(cr, PRIV_ALL, B_FALSE)) {
+			proc_t *p;
+			pid_t pid = batch.ftpb_pid;
+
+			dmutex_enter(&pidlock);
+			/*
+			 * Report an error if the process doesn't exist
+			 * or is actively being birthed.
+			 */
+			if ((p = prfind(pid)) == NULL || p->p_stat == SIDL) {
+				dmutex_exit(&pidlock);
+				return (ESRCH);
+			}
+			dmutex_enter(&p->p_lock);
+			dmutex_exit(&pidlock);
+
+			if ((ret = priv_proc_cred_perm(cr, p, NULL,
+			    VREAD | VWRITE)) != 0) {
+				dmutex_exit(&p->p_lock);
+				return (ret);
+			}
+
+			dmutex_exit(&p->p_lock);
+		}
+
+		/*
+		 * The batch may be large enough to come from vmalloc, which
+		 * can fail even when we may sleep.
+		 */
+		if ((buf = kmem_alloc(batch.ftpb_size, KM_SLEEP)) == NULL)
+			return (ENOMEM);
+		end = buf + batch.ftpb_size;
+
+		if (copyin(ubatch + 1, buf, batch.ftpb_size) != 0) {
+			ret = EFAULT;
+			goto berr;
+		}
+
+		/*
+		 * Check every spec fits in what we were given, is for the one
+		 * process, and has sane, terminated names, before we create
+		 * anything.
+		 */
+		probe = (void *)buf;
+		for (i = 0; i < batch.ftpb_nspecs; i++) {
+			ndone = i;
+			if (end - (char *)probe < sizeof (*probe) ||
+			    probe->ftps_noffs == 0 ||
+			    probe->ftps_noffs > (end - (char *)probe) /
+			    sizeof (uint64_t) ||
+			    FASTTRAP_PROBE_SPEC_SIZE(probe->ftps_noffs) >
+			    end - (char *)probe ||
+			    probe->ftps_pid != batch.ftpb_pid) {
+				ret = EINVAL;
+				goto berr;
+			}
+
+			probe->ftps_func[DTRACE_FUNCNAMELEN - 1] = '\0';
+			probe->ftps_mod[DTRACE_MODNAMELEN - 1] = '\0';
+			for (c = &probe->ftps_func[0]; *c != '\0'; c++) {
+				if (*c < 0x20 || 0x7f <= *c) {
+					ret = EINVAL;
+					goto berr;
+				}
+			}
+			for (c = &probe->ftps_mod[0]; *c != '\0'; c++) {
+				if (*c < 0x20 || 0x7f <= *c) {
+					ret = EINVAL;
+					goto berr;
+				}
+			}
+
+			probe = (void *)((char *)probe +
+			    FASTTRAP_PROBE_SPEC_SIZE(probe->ftps_noffs));
+		}
+		ndone = 0;
+
+		ret = fasttrap_add_probes(batch.ftpb_pid, (void *)buf,
+		    batch.ftpb_nspecs, &ndone);
+berr:
+		kmem_free(buf, batch.ftpb_size);
+
+		if (copyout(&ndone, &ubatch->ftpb_ndone, sizeof (ndone)) != 0)
+			return (EFAULT);
+
+		return (ret);
+
+# endif
 	} else if (cmd == FASTTRAPIOC_GETINSTR) {
 		fasttrap_instr_query_t instr;
 		fasttrap_tracepoint_t *tp;
@@ -2391,27 +2760,30 @@ err:
 			dmutex_exit(&p->p_lock);
 		}
 
+		rw_enter(&fasttrap_tpoints_rwlock, RW_READER);
 		index = FASTTRAP_TPOINTS_INDEX(instr.ftiq_pid, instr.ftiq_pc);
 
-		dmutex_enter(&fasttrap_tpoints.fth_table[index].ftb_mtx);
-		tp = fasttrap_tpoints.fth_table[index].ftb_data;
+		dmutex_enter(&fasttrap_tpoints->fth_table[index].ftb_mtx);
+		tp = fasttrap_tpoints->fth_table[index].ftb_data;
 		while (tp != NULL) {
 			if (instr.ftiq_pid == tp->ftt_pid &&
 			    instr.ftiq_pc == tp->ftt_pc &&
 			    tp->ftt_proc->ftpc_acount != 0)
 				break;
 
-			tp = tp->ftt_next;
+			tp = FASTTRAP_TP_NEXT(fasttrap_tpoints, tp);
 		}
 
 		if (tp == NULL) {
-			dmutex_exit(&fasttrap_tpoints.fth_table[index].ftb_mtx);
+			dmutex_exit(&fasttrap_tpoints->fth_table[index].ftb_mtx);
+			rw_exit(&fasttrap_tpoints_rwlock);
 			return (ENOENT);
 		}
 
 		bcopy(&tp->ftt_instr, &instr.ftiq_instr,
 		    sizeof (instr.ftiq_instr));
-		dmutex_exit(&fasttrap_tpoints.fth_table[index].ftb_mtx);
+		dmutex_exit(&fasttrap_tpoints->fth_table[index].ftb_mtx);
+		rw_exit(&fasttrap_tpoints_rwlock);
 
 		if (copyout(&instr, (void *)arg, sizeof (instr)) != 0)
 			return (EFAULT);
@@ -2522,18 +2894,17 @@ fasttrap_attach(void)
 	if (nent == 0 || nent > 0x1000000)
 		nent = FASTTRAP_TPOINTS_DEFAULT_SIZE;
 
-	if ((nent & (nent - 1)) == 0)
-		fasttrap_tpoints.fth_nent = nent;
-	else
-		fasttrap_tpoints.fth_nent = 1 << fasttrap_highbit(nent);
+	if ((nent & (nent - 1)) != 0)
+		nent = 1 << fasttrap_highbit(nent);
 
-	ASSERT(fasttrap_tpoints.fth_nent > 0);
-	fasttrap_tpoints.fth_mask = fasttrap_tpoints.fth_nent - 1;
-	fasttrap_tpoints.fth_table = kmem_zalloc(fasttrap_tpoints.fth_nent *
-	    sizeof (fasttrap_bucket_t), KM_SLEEP);
-	for (i = 0; i < fasttrap_tpoints.fth_nent; i++) {
-		dmutex_init(&fasttrap_tpoints.fth_table[i].ftb_mtx);
-	}
+	/*
+	 * This is only the starting size: fasttrap_tpoints_grow() takes it
+	 * from here as tracepoints are added.
+	 */
+	ASSERT(nent > 0);
+	dmutex_init(&fasttrap_tpoints_rwlock.k_mutex);
+	fasttrap_tpoints = fasttrap_tpoints_alloc(nent);
+	fasttrap_tpoints_count = 0;
 
 	/*
 	 * ... and the providers hash table...
@@ -2701,9 +3072,8 @@ HERE();
 #endif
 
 HERE();
-	kmem_free(fasttrap_tpoints.fth_table,
-	    fasttrap_tpoints.fth_nent * sizeof (fasttrap_bucket_t));
-	fasttrap_tpoints.fth_nent = 0;
+	fasttrap_tpoints_free(fasttrap_tpoints);
+	fasttrap_tpoints = NULL;
 
 HERE();
 	kmem_free(fasttrap_provs.fth_table,
@@ -0,0 +1,307 @@
+/**********************************************************************/
+/*   In-kernel  emulation of common x86-64 instructions for the pid  */
+/*   provider.							      */
+/*   								      */
+/*   A  pid  probe  on  an  instruction which fasttrap_isa.c doesnt  */
+/*   emulate  costs  us  a  copy of the instruction to the process'  */
+/*   scratch  page,  a  return  to user space to execute it, and a  */
+/*   second  trap  to  get back. Function prologues are full of the  */
+/*   same  handful  of  instructions (endbr64, push, mov %rsp,%rbp,  */
+/*   sub  $n,%rsp)  and  position  independent  code  is  full  of  */
+/*   lea/mov  disp(%rip),  so  we decode those here and emulate them  */
+/*   on the trapped register set instead.			      */
+/*   								      */
+/*   We  are  deliberately  strict  about  the  encodings we accept:  */
+/*   anything  with  a  legacy  prefix (other than on a nop), or any  */
+/*   form  we  dont  recognise  exactly, is left for single stepping.  */
+/*   								      */
+/*   This  file  is  also  built in user space (-DUSERMODE) by the  */
+/*   cmd/ftemu  harness,  which checks the emulation against the CPU  */
+/*   single stepping the same instructions in libc and ld.so.	      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#if defined(USERMODE)
+#include <stdint.h>
+#include <string.h>
+#else
+#include "dtrace_linux.h"
+#endif
+
+#include "fasttrap_emu.h"
+
+# define	EMU_REX_W(rex)		(((rex) >> 3) & 1)
+# define	EMU_REX_R(rex)		(((rex) >> 2) & 1)
+# define	EMU_REX_B(rex)		((rex) & 1)
+
+# define	EMU_MODRM_MOD(modrm)	(((modrm) >> 6) & 0x3)
+# define	EMU_MODRM_REG(modrm)	(((modrm) >> 3) & 0x7)
+# define	EMU_MODRM_RM(modrm)	((modrm) & 0x7)
+
+# define	EMU_FL_CF	0x001
+# define	EMU_FL_PF	0x004
+# define	EMU_FL_AF	0x010
+# define	EMU_FL_ZF	0x040
+# define	EMU_FL_SF	0x080
+# define	EMU_FL_OF	0x800
+# define	EMU_FL_ARITH	(EMU_FL_CF | EMU_FL_PF | EMU_FL_AF | \
+				 EMU_FL_ZF | EMU_FL_SF | EMU_FL_OF)
+
+const char *dtrace_emu_names[DTRACE_EMU_NOPS] = {
+	"none", "nop", "push", "mov", "add", "sub", "lea-rip", "load-rip"
+	};
+
+/**********************************************************************/
+/*   Fetch an unaligned little endian disp32/imm32.		      */
+/**********************************************************************/
+static int64_t
+emu_imm32(const uint8_t *p)
+{
+	return (int32_t) (p[0] | (p[1] << 8) | (p[2] << 16) |
+		((uint32_t) p[3] << 24));
+}
+
+/**********************************************************************/
+/*   Decode  the instruction at instr, which the disassembler told us  */
+/*   is  len  bytes  long.  Returns  0  and fills in em if we can  */
+/*   emulate it, else -1. 64-bit processes only.		      */
+/**********************************************************************/
+int
+dtrace_emu_decode(const uint8_t *instr, int len, dtrace_emu_t *em)
+{	int	i = 0;
+	int	need;
+	uint8_t	rex = 0;
+	uint8_t	op, modrm, mod, reg, rm;
+
+	memset(em, 0, sizeof *em);
+	em->em_len = len;
+	em->em_size = 8;
+
+	/***********************************************/
+	/*   endbr64  (and endbr32)  is  the  first  */
+	/*   instruction  of  most  functions  on  a  */
+	/*   current  distro.  Without user-space IBT  */
+	/*   it  is  a  nop, and so are the padding  */
+	/*   nops (0f 1f /0) with any 66/2e prefixes.  */
+	/***********************************************/
+	if (len == 4 && instr[0] == 0xf3 && instr[1] == 0x0f &&
+	    instr[2] == 0x1e && (instr[3] == 0xfa || instr[3] == 0xfb)) {
+		em->em_op = DTRACE_EMU_NOP;
+		return 0;
+	}
+	while (i < len && (instr[i] == 0x66 || instr[i] == 0x2e))
+		i++;
+	if (i + 2 < len && instr[i] == 0x0f && instr[i + 1] == 0x1f &&
+	    EMU_MODRM_REG(instr[i + 2]) == 0) {
+		em->em_op = DTRACE_EMU_NOP;
+		return 0;
+	}
+
+	i = 0;
+	if ((instr[i] & 0xf0) == 0x40)
+		rex = instr[i++];
+	if (i >= len)
+		return -1;
+	op = instr[i++];
+
+	if (op >= 0x50 && op <= 0x57) {
+		if (len != i)
+			return -1;
+		em->em_op = DTRACE_EMU_PUSH;
+		em->em_src = (op & 7) | (EMU_REX_B(rex) << 3);
+		return 0;
+	}
+
+	switch (op) {
+	  case 0x81:
+	  case 0x83:
+	  case 0x89:
+	  case 0x8b:
+	  case 0x8d:
+	  	break;
+	  default:
+	  	return -1;
+	  }
+
+	if (i >= len)
+		return -1;
+	modrm = instr[i++];
+	mod = EMU_MODRM_MOD(modrm);
+	reg = EMU_MODRM_REG(modrm) | (EMU_REX_R(rex) << 3);
+	rm = EMU_MODRM_RM(modrm) | (EMU_REX_B(rex) << 3);
+	if (!EMU_REX_W(rex))
+		em->em_size = 4;
+
+	switch (op) {
+	  case 0x89:
+	  	/***********************************************/
+	  	/*   mov %reg, %rm			       */
+	  	/***********************************************/
+	  	if (mod != 3)
+			return -1;
+		em->em_op = DTRACE_EMU_MOV;
+		em->em_dst = rm;
+		em->em_src = reg;
+		need = i;
+		break;
+
+	  case 0x8b:
+	  case 0x8d:
+	  	/***********************************************/
+	  	/*   mov %rm, %reg or mov/lea disp(%rip), %reg */
+	  	/***********************************************/
+	  	if (op == 0x8b && mod == 3) {
+			em->em_op = DTRACE_EMU_MOV;
+			em->em_dst = reg;
+			em->em_src = rm;
+			need = i;
+			break;
+		}
+		if (mod != 0 || (rm & 7) != 5)
+			return -1;
+		if (i + 4 > len)
+			return -1;
+		em->em_op = op == 0x8b ? DTRACE_EMU_LOAD_RIP : DTRACE_EMU_LEA_RIP;
+		em->em_dst = reg;
+		em->em_imm = emu_imm32(&instr[i]);
+		need = i + 4;
+		break;
+
+	  default:
+	  	/***********************************************/
+	  	/*   add/sub $imm8/$imm32, %reg64. We only do  */
+	  	/*   the 64-bit form, to keep the flags simple. */
+	  	/***********************************************/
+	  	if (mod != 3 || !EMU_REX_W(rex))
+			return -1;
+		if (EMU_MODRM_REG(modrm) == 0)
+			em->em_op = DTRACE_EMU_ADD;
+		else if (EMU_MODRM_REG(modrm) == 5)
+			em->em_op = DTRACE_EMU_SUB;
+		else
+			return -1;
+		em->em_dst = rm;
+		if (op == 0x83) {
+			if (i + 1 > len)
+				return -1;
+			em->em_imm = (int8_t) instr[i];
+			need = i + 1;
+		} else {
+			if (i + 4 > len)
+				return -1;
+			em->em_imm = emu_imm32(&instr[i]);
+			need = i + 4;
+		}
+		break;
+	  }
+
+	/***********************************************/
+	/*   If  we  disagree  with  the disassembler  */
+	/*   about the length, trust neither of us.    */
+	/***********************************************/
+	if (need != len) {
+		em->em_op = DTRACE_EMU_NONE;
+		return -1;
+	}
+	return 0;
+}
+
+/**********************************************************************/
+/*   Arithmetic flags for r = a + b or r = a - b.		      */
+/**********************************************************************/
+static uint64_t
+emu_flags(uint64_t a, uint64_t b, uint64_t r, int sub)
+{	uint64_t fl = 0;
+	uint8_t	p = (uint8_t) r;
+
+	if (sub ? a < b : r < a)
+		fl |= EMU_FL_CF;
+	if (r == 0)
+		fl |= EMU_FL_ZF;
+	if (r >> 63)
+		fl |= EMU_FL_SF;
+	if ((a ^ b ^ r) & 0x10)
+		fl |= EMU_FL_AF;
+	if (((sub ? (a ^ b) : ~(a ^ b)) & (a ^ r)) >> 63)
+		fl |= EMU_FL_OF;
+	p ^= p >> 4;
+	p ^= p >> 2;
+	p ^= p >> 1;
+	if ((p & 1) == 0)
+		fl |= EMU_FL_PF;
+	return fl;
+}
+
+/**********************************************************************/
+/*   Execute  a  decoded  instruction  against er. On success, sets  */
+/*   er_rip  to  the  next  instruction  and  returns 0. On a user  */
+/*   memory fault, nothing is modified other than er_fault, and we  */
+/*   return -1.							      */
+/**********************************************************************/
+int
+dtrace_emu_exec(const dtrace_emu_t *em, dtrace_emu_regs_t *er,
+	const dtrace_emu_mem_t *mem)
+{	uint64_t next = er->er_rip + em->em_len;
+	uint64_t a, b, r, v;
+
+	switch (em->em_op) {
+	  case DTRACE_EMU_NOP:
+	  	break;
+
+	  case DTRACE_EMU_PUSH:
+	  	/***********************************************/
+	  	/*   "push %rsp" pushes the old value.	       */
+	  	/***********************************************/
+	  	v = er->er_gpr[em->em_src];
+		a = er->er_gpr[DTRACE_EMU_RSP] - sizeof (uint64_t);
+		if (mem->em_store(mem->em_arg, a, v, sizeof (uint64_t)) != 0) {
+			er->er_fault = a;
+			return -1;
+		}
+		er->er_gpr[DTRACE_EMU_RSP] = a;
+		break;
+
+	  case DTRACE_EMU_MOV:
+	  	v = er->er_gpr[em->em_src];
+		if (em->em_size == 4)
+			v = (uint32_t) v;
+		er->er_gpr[em->em_dst] = v;
+		break;
+
+	  case DTRACE_EMU_LEA_RIP:
+	  	v = next + em->em_imm;
+		if (em->em_size == 4)
+			v = (uint32_t) v;
+		er->er_gpr[em->em_dst] = v;
+		break;
+
+	  case DTRACE_EMU_LOAD_RIP:
+	  	a = next + em->em_imm;
+		v = 0;
+		if (mem->em_load(mem->em_arg, a, &v, em->em_size) != 0) {
+			er->er_fault = a;
+			return -1;
+		}
+		if (em->em_size == 4)
+			v = (uint32_t) v;
+		er->er_gpr[em->em_dst] = v;
+		break;
+
+	  case DTRACE_EMU_ADD:
+	  case DTRACE_EMU_SUB:
+	  	a = er->er_gpr[em->em_dst];
+		b = (uint64_t) em->em_imm;
+		r = em->em_op == DTRACE_EMU_ADD ? a + b : a - b;
+		er->er_rflags = (er->er_rflags & ~(uint64_t) EMU_FL_ARITH) |
+			emu_flags(a, b, r, em->em_op == DTRACE_EMU_SUB);
+		er->er_gpr[em->em_dst] = r;
+		break;
+
+	  default:
+	  	return -1;
+	  }
+
+	er->er_rip = next;
+	return 0;
+}
@@ -0,0 +1,62 @@
+/**********************************************************************/
+/*   Decode  and  emulate  the  common  x86-64  instructions  which  */
+/*   fasttrap_pid_probe()  would  otherwise have to single step out  */
+/*   of the scratch page. Shared with cmd/ftemu (built -DUSERMODE),  */
+/*   so the includer must already have uint8_t et al. in scope.	      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#ifndef	_FASTTRAP_EMU_H
+#define	_FASTTRAP_EMU_H
+
+/**********************************************************************/
+/*   Operations. Stored in ftt_code of a FASTTRAP_T_EMU tracepoint.   */
+/**********************************************************************/
+# define	DTRACE_EMU_NONE		0
+# define	DTRACE_EMU_NOP		1	/* endbr64, nopl/nopw */
+# define	DTRACE_EMU_PUSH		2	/* push %reg */
+# define	DTRACE_EMU_MOV		3	/* mov %reg, %reg */
+# define	DTRACE_EMU_ADD		4	/* add $imm, %reg64 */
+# define	DTRACE_EMU_SUB		5	/* sub $imm, %reg64 */
+# define	DTRACE_EMU_LEA_RIP	6	/* lea disp(%rip), %reg */
+# define	DTRACE_EMU_LOAD_RIP	7	/* mov disp(%rip), %reg */
+# define	DTRACE_EMU_NOPS		8
+
+/**********************************************************************/
+/*   Registers are numbered as in the instruction encoding.	      */
+/**********************************************************************/
+# define	DTRACE_EMU_RSP		4
+
+typedef struct dtrace_emu {
+	uint8_t		em_op;		/* DTRACE_EMU_xxx */
+	uint8_t		em_len;		/* Instruction length. */
+	uint8_t		em_size;	/* Operand size - 4 or 8. */
+	uint8_t		em_dst;		/* Destination register. */
+	uint8_t		em_src;		/* Source register. */
+	int64_t		em_imm;		/* Immediate or displacement. */
+} dtrace_emu_t;
+
+typedef struct dtrace_emu_regs {
+	uint64_t	er_gpr[16];	/* %rax .. %r15 */
+	uint64_t	er_rip;		/* In: instruction. Out: next. */
+	uint64_t	er_rflags;
+	uint64_t	er_fault;	/* Address we could not access. */
+} dtrace_emu_regs_t;
+
+/**********************************************************************/
+/*   User memory access. Return 0 on success, non-zero on a fault.    */
+/**********************************************************************/
+typedef struct dtrace_emu_mem {
+	int	(*em_load)(void *arg, uint64_t addr, uint64_t *val, int size);
+	int	(*em_store)(void *arg, uint64_t addr, uint64_t val, int size);
+	void	*em_arg;
+} dtrace_emu_mem_t;
+
+extern const char *dtrace_emu_names[DTRACE_EMU_NOPS];
+
+int	dtrace_emu_decode(const uint8_t *instr, int len, dtrace_emu_t *em);
+int	dtrace_emu_exec(const dtrace_emu_t *em, dtrace_emu_regs_t *er,
+		const dtrace_emu_mem_t *mem);
+
+#endif	/* _FASTTRAP_EMU_H */
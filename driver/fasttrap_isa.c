@@ -40,6 +40,7 @@
 #include <sys/dtrace.h>
 #include <sys/dtrace_impl.h>
 #include "dtrace_proto.h"
+#include "fasttrap_emu.h"
 #include <sys/regset.h>
 #include <sys/privregs.h>
 # define regs pt_regs
@@ -56,6 +57,8 @@
 
 #define SVFORK     0x00040000   /* child of vfork that has not yet exec'd */
 
+extern int fasttrap_emulate;
+
 # endif
 
 # if defined(sun)
@@ -600,6 +603,27 @@ HERE();
 		}
 	}
 
+#if defined(__amd64) && linux
+	/***********************************************/
+	/*   Prologues  and  PIC  loads  are  better  */
+	/*   emulated  than  stepped  -  see  the  */
+	/*   comment at the top of fasttrap_emu.c.     */
+	/***********************************************/
+	if (p_model == DATAMODEL_LP64 && tp->ftt_type == FASTTRAP_T_COMMON &&
+	    fasttrap_emulate) {
+		dtrace_emu_t em;
+
+		if (dtrace_emu_decode(instr, size, &em) == 0) {
+			tp->ftt_type = FASTTRAP_T_EMU;
+			tp->ftt_code = em.em_op;
+			tp->ftt_base = em.em_dst;
+			tp->ftt_index = em.em_src;
+			tp->ftt_scale = em.em_size;
+			tp->ftt_dest = (uintptr_t) em.em_imm;
+		}
+	}
+#endif
+
 #ifdef __amd64
 	if (p_model == DATAMODEL_LP64 && tp->ftt_type == FASTTRAP_T_COMMON) {
 		/*
@@ -709,6 +733,38 @@ fasttrap_fulword_noerr(const void *uaddr)
 }
 #endif
 
+#if defined(__amd64) && linux
+/**********************************************************************/
+/*   User memory access for dtrace_emu_exec().			      */
+/**********************************************************************/
+static int
+fasttrap_emu_load(void *arg, uint64_t addr, uint64_t *val, int size)
+{	uintptr_t v;
+	uint32_t v32;
+
+	if (size == sizeof (uint32_t)) {
+		if (fasttrap_fuword32((void *) (uintptr_t) addr, &v32) == -1)
+			return -1;
+		*val = v32;
+		return 0;
+	}
+	if (fasttrap_fulword((void *) (uintptr_t) addr, &v) == -1)
+		return -1;
+	*val = v;
+	return 0;
+}
+static int
+fasttrap_emu_store(void *arg, uint64_t addr, uint64_t val, int size)
+{
+	if (fasttrap_sulword((void *) (uintptr_t) addr, (uintptr_t) val) == -1)
+		return -1;
+	return 0;
+}
+static const dtrace_emu_mem_t fasttrap_emu_mem = {
+	fasttrap_emu_load, fasttrap_emu_store, NULL
+	};
+#endif
+
 static uint32_t
 fasttrap_fuword32_noerr(const void *uaddr)
 {
@@ -725,19 +781,12 @@ fasttrap_return_common(struct regs *rp, uintptr_t pc, pid_t pid,
     uintptr_t new_pc)
 {
 	fasttrap_tracepoint_t *tp;
-	fasttrap_bucket_t *bucket;
 	fasttrap_id_t *id;
 	kmutex_t *pid_mtx;
 
 	pid_mtx = &cpu_core[cpu_get_id()].cpuc_pid_lock;
 	dmutex_enter(pid_mtx);
-	bucket = &fasttrap_tpoints.fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
-
-	for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
-		if (pid == tp->ftt_pid && pc == tp->ftt_pc &&
-		    tp->ftt_proc->ftpc_acount != 0)
-			break;
-	}
+	tp = fasttrap_tpoints_lookup(pid, pc);
 
 	/*
 	 * Don't sweat it if we can't find the tracepoint again; unlike
@@ -1019,7 +1068,6 @@ fasttrap_pid_probe(struct regs *rp)
 {
 	proc_t *p = curproc;
 	uintptr_t pc = rp->r_pc - 1, new_pc = 0;
-	fasttrap_bucket_t *bucket;
 	kmutex_t *pid_mtx;
 	fasttrap_tracepoint_t *tp, tp_local;
 	pid_t pid;
@@ -1066,18 +1114,11 @@ HERE();
 	pid = p->p_pid;
 	pid_mtx = &cpu_core[cpu_get_id()].cpuc_pid_lock;
 	dmutex_enter(pid_mtx);
-	bucket = &fasttrap_tpoints.fth_table[FASTTRAP_TPOINTS_INDEX(pid, pc)];
-//printk("probe: bucket=%p pid=%d pc=%p\n", bucket, pid, (void *) pc);
 HERE();
 	/*
 	 * Lookup the tracepoint that the process just hit.
 	 */
-	for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
-//printk("pid:%d ftt_pipd:%d pc:%p ftt_pc:%p acount:%d\n", pid, tp->ftt_pid, pc, tp->ftt_pc, tp->ftt_proc->ftpc_acount);
-		if (pid == tp->ftt_pid && pc == tp->ftt_pc &&
-		    tp->ftt_proc->ftpc_acount != 0)
-			break;
-	}
+	tp = fasttrap_tpoints_lookup(pid, pc);
 
 	/*
 	 * If we couldn't find a matching tracepoint, either a tracepoint has
@@ -1452,6 +1493,66 @@ PRINT_CASE(FASTTRAP_T_NOP);
 		new_pc = pc + tp->ftt_size;
 		break;
 
+#if defined(__amd64) && linux
+	case FASTTRAP_T_EMU:
+	{
+		dtrace_emu_t em;
+		dtrace_emu_regs_t er;
+PRINT_CASE(FASTTRAP_T_EMU);
+		em.em_op = tp->ftt_code;
+		em.em_len = tp->ftt_size;
+		em.em_size = tp->ftt_scale;
+		em.em_dst = tp->ftt_base;
+		em.em_src = tp->ftt_index;
+		em.em_imm = (int64_t) tp->ftt_dest;
+
+		er.er_gpr[0] = rp->r_rax;
+		er.er_gpr[1] = rp->r_rcx;
+		er.er_gpr[2] = rp->r_rdx;
+		er.er_gpr[3] = rp->r_rbx;
+		er.er_gpr[4] = rp->r_rsp;
+		er.er_gpr[5] = rp->r_rbp;
+		er.er_gpr[6] = rp->r_rsi;
+		er.er_gpr[7] = rp->r_rdi;
+		er.er_gpr[8] = rp->r_r8;
+		er.er_gpr[9] = rp->r_r9;
+		er.er_gpr[10] = rp->r_r10;
+		er.er_gpr[11] = rp->r_r11;
+		er.er_gpr[12] = rp->r_r12;
+		er.er_gpr[13] = rp->r_r13;
+		er.er_gpr[14] = rp->r_r14;
+		er.er_gpr[15] = rp->r_r15;
+		er.er_rip = pc;
+		er.er_rflags = rp->r_rfl;
+
+		if (dtrace_emu_exec(&em, &er, &fasttrap_emu_mem) != 0) {
+			fasttrap_sigsegv(p, current, er.er_fault);
+			new_pc = pc;
+			break;
+		}
+
+		rp->r_rax = er.er_gpr[0];
+		rp->r_rcx = er.er_gpr[1];
+		rp->r_rdx = er.er_gpr[2];
+		rp->r_rbx = er.er_gpr[3];
+		rp->r_rsp = er.er_gpr[4];
+		rp->r_rbp = er.er_gpr[5];
+		rp->r_rsi = er.er_gpr[6];
+		rp->r_rdi = er.er_gpr[7];
+		rp->r_r8 = er.er_gpr[8];
+		rp->r_r9 = er.er_gpr[9];
+		rp->r_r10 = er.er_gpr[10];
+		rp->r_r11 = er.er_gpr[11];
+		rp->r_r12 = er.er_gpr[12];
+		rp->r_r13 = er.er_gpr[13];
+		rp->r_r14 = er.er_gpr[14];
+		rp->r_r15 = er.er_gpr[15];
+		rp->r_rfl = er.er_rflags;
+		new_pc = er.er_rip;
+		break;
+	}
+#endif
+
 	case FASTTRAP_T_JMP:
 	case FASTTRAP_T_CALL:
 PRINT_CASE(FASTTRAP_T_CALL);
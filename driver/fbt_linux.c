@@ -35,6 +35,7 @@
 #include <linux/list.h>
 #include <linux/kallsyms.h>
 #include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 #define regs pt_regs
 #include <sys/stack.h>
 #include <sys/frame.h>
@@ -95,6 +96,19 @@ MODULE_DESCRIPTION("DTRACE/Function Boundary Tracing Driver");
 #  endif
 #endif
 
+/**********************************************************************/
+/*   Jump-optimized  entry  probes (amd64). Rather than an INT3 and a  */
+/*   single  step,  the  probed instruction is replaced by a JMP to a  */
+/*   per-probe  trampoline  which  calls  dtrace_probe() and runs the  */
+/*   displaced instruction out of line. See fbt_jmp_prepare().	      */
+/**********************************************************************/
+#define	FBT_JMP			0xe9
+#define	FBT_JMP_LEN		5
+#define	FBT_TRAMP_SIZE		64
+#define	FBT_TRAMP_INSTR		33	/* Offset of displaced instruction */
+#define	FBT_TRAMP_COMMON	56	/* Offset of &fbt_jmp_common */
+#define	FBT_MAX_INSTR		16
+
 #define	FBT_ENTRY	"entry"
 #define	FBT_RETURN	"return"
 #define	FBT_ADDR2NDX(addr)	((((uintptr_t)(addr)) >> 4) & fbt_probetab_mask)
@@ -120,6 +134,18 @@ typedef struct fbt_probe {
 	unsigned int	fbtp_fired;
 //	int		fbtp_primary;
 	struct fbt_probe *fbtp_next;
+# if defined(__amd64)
+	/***********************************************/
+	/*   For  a jump-optimized probe: the out of  */
+	/*   line  trampoline,  whether  the JMP is in  */
+	/*   place,  and  a copy of the whole probed  */
+	/*   instruction,  which  the  JMP overwrites  */
+	/*   beyond the first byte.		       */
+	/***********************************************/
+	uint8_t		*fbtp_tramp;
+	char		fbtp_jmp;
+	uint8_t		fbtp_orig[FBT_MAX_INSTR];
+# endif
 # if defined(__arm__)
 	/***********************************************/
 	/*   Because  ARM doesnt handle a single-step  */
@@ -140,12 +166,14 @@ static dtrace_provider_id_t	fbt_id;
 static fbt_probe_t		**fbt_probetab;
 static int			fbt_probetab_size;
 static int			fbt_probetab_mask;
+static dtrace_kmc_t		*fbt_kmc;
 static int			fbt_verbose = 0;
 static int			num_probes;
 static int			invop_loaded;
 
 extern int dtrace_unhandled;
 extern int fbt_name_opcodes;
+extern int fbt_optimize;
 
 static void fbt_provide_function(struct modctl *mp, 
     	par_module_t *pmp,
@@ -237,6 +265,14 @@ fbt_invop(uintptr_t addr, uintptr_t *stack, uintptr_t rval, trap_instr_t *tinfo)
 //printk("fbt: opc=%p %p\n", tinfo->t_opcode, fbt->fbtp_savedval);
 			tinfo->t_inslen = fbt->fbtp_inslen;
 			tinfo->t_modrm = fbt->fbtp_modrm;
+# if defined(__amd64)
+			/***********************************************/
+			/*   We  may  be  part way through planting  */
+			/*   or removing a JMP.			       */
+			/***********************************************/
+			if (fbt->fbtp_tramp)
+				tinfo->t_instr = fbt->fbtp_orig;
+# endif
 			if (!tinfo->t_doprobe)
 				return fbt->fbtp_rval;
 			fbt->fbtp_fired++;
@@ -289,6 +325,350 @@ fbt_invop(uintptr_t addr, uintptr_t *stack, uintptr_t rval, trap_instr_t *tinfo)
 
 	return (0);
 }
+# if defined(__amd64)
+/**********************************************************************/
+/*   Registers  as  saved  by fbt_jmp_common (intr_x86-64.S), and what  */
+/*   the trampoline and the probed function's caller left above them.  */
+/**********************************************************************/
+typedef struct fbt_jmp_frame {
+	unsigned long	fr_r15, fr_r14, fr_r13, fr_r12;
+	unsigned long	fr_r11, fr_r10, fr_r9, fr_r8;
+	unsigned long	fr_rbp, fr_rdi, fr_rsi, fr_rdx;
+	unsigned long	fr_rcx, fr_rbx, fr_rax;
+	unsigned long	fr_rflags;
+	unsigned long	fr_tramp;	/* Return into the trampoline.	*/
+	fbt_probe_t	*fr_fbt;	/* Pushed by the trampoline.	*/
+	unsigned long	fr_caller;	/* Probed function's return addr. */
+	} fbt_jmp_frame_t;
+
+extern void fbt_jmp_common(void);
+void fbt_jmp_probe(fbt_jmp_frame_t *fr);
+
+typedef struct fbt_tramp_page {
+	struct fbt_tramp_page *tp_next;
+	uint8_t		*tp_base;
+	} fbt_tramp_page_t;
+
+static fbt_tramp_page_t *fbt_tramp_pages;
+static int	fbt_tramp_used;
+static void	*(*fn_module_alloc)(unsigned long);
+static void	(*fn_module_memfree)(void *);
+static void	(*fn_synchronize_rcu_tasks)(void);
+static int	(*fn_set_memory_ro)(unsigned long, int);
+static int	(*fn_set_memory_rw)(unsigned long, int);
+static int	(*fn_set_memory_x)(unsigned long, int);
+
+/**********************************************************************/
+/*   Hand  out  a  trampoline.  A  JMP  rel32  can  only  reach +/-2GB  */
+/*   from  the  patchpoint,  so  we  take  pages from the module area  */
+/*   (close  to  the  kernel  and  module  text), and carve them into  */
+/*   FBT_TRAMP_SIZE slots. Called with dtrace_lock held.	      */
+/*   								      */
+/*   Slots  are  never  recycled.  A  task  preempted  inside  a  */
+/*   trampoline  (or  about  to  return  into one from fbt_jmp_common)  */
+/*   can  sit  there  indefinitely  after the JMP is gone, and only an  */
+/*   RCU-tasks  grace period tells us it has left. fbt_exit() waits for  */
+/*   one  before  freeing  the  pages.  A probe keeps its trampoline  */
+/*   across enable/disable, so slots are only lost when a module is  */
+/*   unloaded and its probes destroyed.				      */
+/**********************************************************************/
+static uint8_t *
+fbt_tramp_alloc(void)
+{	fbt_tramp_page_t *tp;
+	uint8_t	*p;
+
+	if (fbt_tramp_pages == NULL ||
+	    fbt_tramp_used + FBT_TRAMP_SIZE > PAGE_SIZE) {
+		if (fn_module_alloc == NULL &&
+		    (fn_module_alloc = get_proc_addr("module_alloc")) == NULL)
+			return NULL;
+		if ((p = fn_module_alloc(PAGE_SIZE)) == NULL)
+			return NULL;
+		tp = kmem_alloc(sizeof *tp, KM_SLEEP);
+		tp->tp_base = p;
+		tp->tp_next = fbt_tramp_pages;
+		fbt_tramp_pages = tp;
+		fbt_tramp_used = 0;
+	}
+
+	p = fbt_tramp_pages->tp_base + fbt_tramp_used;
+	fbt_tramp_used += FBT_TRAMP_SIZE;
+	return p;
+}
+/**********************************************************************/
+/*   Give  back  the  slot  we just allocated, before anyone has had a  */
+/*   chance to jump to it.					      */
+/**********************************************************************/
+static void
+fbt_tramp_unalloc(uint8_t *p)
+{
+	if (p == fbt_tramp_pages->tp_base + fbt_tramp_used - FBT_TRAMP_SIZE)
+		fbt_tramp_used -= FBT_TRAMP_SIZE;
+}
+/**********************************************************************/
+/*   Fill  in  a  trampoline.  The page is read-only and executable  */
+/*   except  whilst we write it; other slots on it may be live, so we  */
+/*   never  take  away  execute  permission.  Without set_memory_ro()  */
+/*   and  friends,  fall  back  to  leaving  the  page writable, as we  */
+/*   always used to.						      */
+/**********************************************************************/
+static int
+fbt_tramp_write(uint8_t *t, const uint8_t *buf, int len)
+{	unsigned long pg = (unsigned long) t & PAGE_MASK;
+static int first_time = TRUE;
+
+	if (first_time) {
+		fn_set_memory_ro = get_proc_addr("set_memory_ro");
+		fn_set_memory_rw = get_proc_addr("set_memory_rw");
+		fn_set_memory_x = get_proc_addr("set_memory_x");
+		first_time = FALSE;
+	}
+
+	if (fn_set_memory_ro == NULL || fn_set_memory_rw == NULL ||
+	    fn_set_memory_x == NULL) {
+		if (!memory_set_rw(t, 0, TRUE))
+			return 0;
+		memcpy(t, buf, len);
+		return 1;
+	}
+
+	if (fn_set_memory_rw(pg, 1) != 0)
+		return 0;
+	memcpy(t, buf, len);
+	fn_set_memory_ro(pg, 1);
+	fn_set_memory_x(pg, 1);
+	return 1;
+}
+/**********************************************************************/
+/*   Module  unload.  All  the  JMPs  are  gone; wait for anything still  */
+/*   running in a trampoline to leave before we free them.	      */
+/**********************************************************************/
+static void
+fbt_tramp_fini(void)
+{	fbt_tramp_page_t *tp;
+
+	if (fbt_tramp_pages == NULL)
+		return;
+
+	fn_synchronize_rcu_tasks = get_proc_addr("synchronize_rcu_tasks");
+	if (fn_synchronize_rcu_tasks == NULL) {
+		/***********************************************/
+		/*   No  way  to know a preempted task isnt  */
+		/*   still in there. Leak them.		       */
+		/***********************************************/
+		printk(KERN_WARNING "fbt: no synchronize_rcu_tasks() - "
+			"leaking trampoline pages\n");
+		fbt_tramp_pages = NULL;
+		return;
+	}
+	fn_synchronize_rcu_tasks();
+
+	fn_module_memfree = get_proc_addr("module_memfree");
+	while ((tp = fbt_tramp_pages) != NULL) {
+		fbt_tramp_pages = tp->tp_next;
+		/***********************************************/
+		/*   Before  module_memfree()  (3.19),  module  */
+		/*   pages on x86 were plain vmalloc memory.  */
+		/***********************************************/
+		if (fn_module_memfree)
+			fn_module_memfree(tp->tp_base);
+		else
+			vfree(tp->tp_base);
+		kmem_free(tp, sizeof *tp);
+	}
+}
+/**********************************************************************/
+/*   Decide  whether  an entry probe can be jump-optimized, and if so,  */
+/*   build its trampoline:					      */
+/*   								      */
+/*   	lea	-8(%rsp),%rsp					      */
+/*   	push	%rax						      */
+/*   	movabs	$fbt,%rax					      */
+/*   	mov	%rax,8(%rsp)					      */
+/*   	pop	%rax						      */
+/*   	call	*fbt_jmp_common(%rip)				      */
+/*   	lea	8(%rsp),%rsp					      */
+/*   	<displaced instruction>					      */
+/*   	jmp	<patchpoint + inslen>				      */
+/*   								      */
+/*   None  of  which  touches the flags. We only optimize a probe when  */
+/*   the  probed  instruction  is  at  least  as  long as the JMP: no  */
+/*   other  instruction  starts  under  the JMP, so nothing can branch  */
+/*   into  the  middle  of it, and no interrupted or preempted context  */
+/*   can  be  sitting  inside it, which spares us having to stop the  */
+/*   world  to  plant  it.  This  is  the  case for the 5-byte NOP the  */
+/*   compiler  leaves at the start of every function when the kernel  */
+/*   is built for function tracing. We use the decoder's view of the  */
+/*   instruction to turn away anything that is position dependent.    */
+/**********************************************************************/
+static int
+fbt_jmp_prepare(fbt_probe_t *fbt)
+{	uint8_t	*instr = fbt->fbtp_orig;
+	uint8_t	*pp = (uint8_t *) fbt->fbtp_patchpoint;
+	int	len = fbt->fbtp_inslen;
+	uint8_t	*t;
+	long	disp, disp2;
+	uint8_t	buf[FBT_TRAMP_SIZE];
+	int	i;
+	static const uint8_t hdr[FBT_TRAMP_INSTR] = {
+		0x48, 0x8d, 0x64, 0x24, 0xf8,
+		0x50,
+		0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,
+		0x48, 0x89, 0x44, 0x24, 0x08,
+		0x58,
+		0xff, 0x15, FBT_TRAMP_COMMON - 28, 0, 0, 0,
+		0x48, 0x8d, 0x64, 0x24, 0x08,
+		};
+
+	if (fbt->fbtp_tramp)
+		return 1;
+
+	if (fbt->fbtp_type != 0 || len < FBT_JMP_LEN || len >= FBT_MAX_INSTR)
+		return 0;
+
+	/***********************************************/
+	/*   Relative  CALL/JMP/Jcc/LOOP and %RIP  */
+	/*   relative  operands  would need fixing up  */
+	/*   to run in the trampoline. Look past any  */
+	/*   prefixes (e.g. "bnd jmp", "notrack").     */
+	/***********************************************/
+	for (i = 0; i < len - 1; i++) {
+		switch (instr[i]) {
+		  case 0x26: case 0x2e: case 0x36: case 0x3e:
+		  case 0x64: case 0x65: case 0x66: case 0x67:
+		  case 0xf0: case 0xf2: case 0xf3:
+		  	continue;
+		  }
+		if ((instr[i] & 0xf0) == 0x40)
+			continue;
+		break;
+	}
+	if (instr[i] == 0xe8 || instr[i] == FBT_JMP || instr[i] == 0xeb ||
+	    (instr[i] & 0xf0) == 0x70 ||
+	    (instr[i] >= 0xe0 && instr[i] <= 0xe3) ||
+	    (instr[i] == 0x0f && i + 1 < len && (instr[i + 1] & 0xf0) == 0x80))
+		return 0;
+	if (fbt->fbtp_modrm >= 0 && (instr[fbt->fbtp_modrm] & 0xc7) == 0x05)
+		return 0;
+
+	/***********************************************/
+	/*   Someone  else  (e.g.  another provider)  */
+	/*   may have patched this since we parsed it. */
+	/***********************************************/
+	if (memcmp(pp, instr, len) != 0)
+		return 0;
+
+	/***********************************************/
+	/*   The JMP is written a byte and then a      */
+	/*   rel32 at a time, and dtrace_patch_end()   */
+	/*   only makes the patchpoint's page          */
+	/*   writable. Leave the odd one which         */
+	/*   straddles a page to the INT3.             */
+	/***********************************************/
+	if (((unsigned long) pp ^ (unsigned long) (pp + FBT_JMP_LEN - 1)) & PAGE_MASK)
+		return 0;
+
+	if ((t = fbt_tramp_alloc()) == NULL)
+		return 0;
+
+	disp = (long) t - (long) (pp + FBT_JMP_LEN);
+	disp2 = (long) (pp + len) - 
+		(long) (t + FBT_TRAMP_INSTR + len + FBT_JMP_LEN);
+	if (disp != (int32_t) disp || disp2 != (int32_t) disp2) {
+		fbt_tramp_unalloc(t);
+		return 0;
+	}
+
+	memset(buf, 0xcc, sizeof buf);
+	memcpy(buf, hdr, sizeof hdr);
+	*(fbt_probe_t **) (buf + 8) = fbt;
+	memcpy(buf + FBT_TRAMP_INSTR, instr, len);
+	buf[FBT_TRAMP_INSTR + len] = FBT_JMP;
+	*(int32_t *) (buf + FBT_TRAMP_INSTR + len + 1) = (int32_t) disp2;
+	*(void **) (buf + FBT_TRAMP_COMMON) = (void *) fbt_jmp_common;
+
+	if (!fbt_tramp_write(t, buf, sizeof buf)) {
+		fbt_tramp_unalloc(t);
+		return 0;
+	}
+
+	fbt->fbtp_tramp = t;
+	return 1;
+}
+/**********************************************************************/
+/*   Plant and remove the JMP. We go via an INT3 in the first byte    */
+/*   whilst the rest of the instruction is inconsistent; if it        */
+/*   fires, fbt_invop() hands the single step code a copy of the      */
+/*   original instruction. dtrace_patch_multi() makes sure every CPU  */
+/*   has seen each step before we take the next; within an enabling   */
+/*   it does so once for the whole batch rather than per probe.       */
+/**********************************************************************/
+static void
+fbt_jmp_arm(fbt_probe_t *fbt)
+{	uint8_t	*pp = (uint8_t *) fbt->fbtp_patchpoint;
+	int32_t	disp = (int32_t) ((long) fbt->fbtp_tramp - 
+			(long) (pp + FBT_JMP_LEN));
+
+	dtrace_patch_multi(pp, FBT_PATCHVAL, &disp, sizeof disp, FBT_JMP);
+	fbt->fbtp_jmp = TRUE;
+}
+static void
+fbt_jmp_disarm(fbt_probe_t *fbt)
+{	uint8_t	*pp = (uint8_t *) fbt->fbtp_patchpoint;
+
+	dtrace_patch_multi(pp, FBT_PATCHVAL, fbt->fbtp_orig + 1, 
+		FBT_JMP_LEN - 1, fbt->fbtp_savedval);
+	fbt->fbtp_jmp = FALSE;
+}
+/**********************************************************************/
+/*   Here  from  fbt_jmp_common  when a jump-optimized probe fires. We  */
+/*   dress  the saved registers up as a pt_regs, so that the likes of  */
+/*   stack() and errno see what they would have seen from the INT3.   */
+/**********************************************************************/
+void
+fbt_jmp_probe(fbt_jmp_frame_t *fr)
+{	fbt_probe_t *fbt = fr->fr_fbt;
+	cpu_core_t *this_cpu;
+	struct pt_regs regs;
+	struct pt_regs *oregs;
+	dtrace_icookie_t cookie;
+
+	cookie = dtrace_interrupt_disable();
+	this_cpu = cpu_get_this();
+
+	memset(&regs, 0, sizeof regs);
+	regs.r_rax = fr->fr_rax;
+	regs.r_rbx = fr->fr_rbx;
+	regs.r_rcx = fr->fr_rcx;
+	regs.r_rdx = fr->fr_rdx;
+	regs.r_rsi = fr->fr_rsi;
+	regs.r_rdi = fr->fr_rdi;
+	regs.r_rbp = fr->fr_rbp;
+	regs.r_r8 = fr->fr_r8;
+	regs.r_r9 = fr->fr_r9;
+	regs.r_r10 = fr->fr_r10;
+	regs.r_r11 = fr->fr_r11;
+	regs.r_r12 = fr->fr_r12;
+	regs.r_r13 = fr->fr_r13;
+	regs.r_r14 = fr->fr_r14;
+	regs.r_r15 = fr->fr_r15;
+	regs.r_rfl = fr->fr_rflags;
+	regs.r_pc = (unsigned long) fbt->fbtp_patchpoint;
+	regs.r_rsp = (unsigned long) &fr->fr_caller;
+
+	oregs = this_cpu->cpuc_regs;
+	this_cpu->cpuc_regs = &regs;
+
+	fbt->fbtp_fired++;
+	CPU->cpu_dtrace_caller = fr->fr_caller;
+	dtrace_probe(fbt->fbtp_id, regs.c_arg0, regs.c_arg1,
+	    regs.c_arg2, regs.c_arg3, regs.c_arg4);
+	CPU->cpu_dtrace_caller = NULL;
+
+	this_cpu->cpuc_regs = oregs;
+	dtrace_interrupt_enable(cookie);
+}
+# endif
 static int
 get_refcount(struct module *mp)
 {	int	sum = 0;
@@ -651,7 +1031,7 @@ fbt_prov_entry(pf_info_t *infp, instr_t *instr, int size, int modrm)
 	if (modrm >= 0 && (instr[modrm] & 0xc7) == 0x05) 
 		return 1;
 
-	fbt = kmem_zalloc(sizeof (fbt_probe_t), KM_SLEEP);
+	fbt = dtrace_kmc_zalloc(fbt_kmc, sizeof (fbt_probe_t), KM_SLEEP);
 	fbt->fbtp_name = infp->name;
 
 	fbt->fbtp_id = dtrace_probe_create(fbt_id, infp->modname,
@@ -669,6 +1049,9 @@ fbt_prov_entry(pf_info_t *infp, instr_t *instr, int size, int modrm)
 	/***********************************************/
 	fbt->fbtp_savedval = *instr;
 	fbt->fbtp_inslen = size;
+# if defined(__amd64)
+	memcpy(fbt->fbtp_orig, instr, size);
+# endif
 	fbt->fbtp_type = 0; /* entry */
 //if (modrm >= 0 && (instr[modrm] & 0xc7) == 0x05) printk("modrm %s %p rm=%d\n", name, instr, modrm);
 	fbt->fbtp_modrm = modrm;
@@ -705,7 +1088,7 @@ fbt_prov_return(pf_info_t *infp, instr_t *instr, int size)
 		return 0;
 	}
 
-	fbt = kmem_zalloc(sizeof (fbt_probe_t), KM_SLEEP);
+	fbt = dtrace_kmc_zalloc(fbt_kmc, sizeof (fbt_probe_t), KM_SLEEP);
 	fbt->fbtp_name = infp->name;
 
 	if (retfbt == NULL) {
@@ -822,7 +1205,11 @@ fbt_destroy(void *arg, dtrace_id_t id, void *parg)
 		}
 
 		next = fbt->fbtp_next;
-		kmem_free(fbt, sizeof (fbt_probe_t));
+		/***********************************************/
+		/*   Any  trampoline  stays  put  until  we  */
+		/*   unload - see fbt_tramp_alloc().	       */
+		/***********************************************/
+		dtrace_kmc_free(fbt_kmc, fbt, sizeof (fbt_probe_t));
 
 		fbt = next;
 	} while (fbt != NULL);
@@ -868,10 +1255,14 @@ fbt_enable(void *arg, dtrace_id_t id, void *parg)
 		fbt->fbtp_enabled = TRUE;
 		if (dtrace_here) 
 			printk("fbt_enable:patch %p p:%02x %s\n", fbt->fbtp_patchpoint, fbt->fbtp_patchval, fbt->fbtp_name);
-		if (memory_set_rw(fbt->fbtp_patchpoint, 1, TRUE)) {
-			*fbt->fbtp_patchpoint = fbt->fbtp_patchval;
-//printk("FBT: set pp=%p:%p\n", fbt->fbtp_patchpoint, *fbt->fbtp_patchpoint);
+		dtrace_invop_claim(fbt_invop, (uintptr_t) fbt->fbtp_patchpoint);
+# if defined(__amd64)
+		if (fbt_optimize && fbt_jmp_prepare(fbt)) {
+			fbt_jmp_arm(fbt);
+			continue;
 		}
+# endif
+		dtrace_patch_set(fbt->fbtp_patchpoint, fbt->fbtp_patchval);
 	}
 	return 0;
 }
@@ -904,6 +1295,13 @@ fbt_disable(void *arg, dtrace_id_t id, void *parg)
 				fbt->fbtp_ctl->name,
 				fbt->fbtp_name);
 		}
+# if defined(__amd64)
+		if (fbt->fbtp_jmp) {
+			fbt_jmp_disarm(fbt);
+			fbt->fbtp_enabled = FALSE;
+			continue;
+		}
+# endif
 		/***********************************************/
 		/*   Memory  should  be  writable,  but if we  */
 		/*   failed  in  the  fbt_enable  code,  e.g.  */
@@ -915,17 +1313,16 @@ fbt_disable(void *arg, dtrace_id_t id, void *parg)
 		/*   on  us.  Might be a temporary issue as I  */
 		/*   fiddle with other things tho.	       */
 		/***********************************************/
-		if (*fbt->fbtp_patchpoint == fbt->fbtp_patchval) {
-			*fbt->fbtp_patchpoint = fbt->fbtp_savedval;
+		dtrace_patch_restore(fbt->fbtp_patchpoint, 
+			fbt->fbtp_patchval, fbt->fbtp_savedval);
 
-			/***********************************************/
-			/*   "Logically"  mark  probe  as gone. So we  */
-			/*   can  detect overruns. But even tho it is  */
-			/*   disabled,  doesnt  mean we cannot handle  */
-			/*   it.				       */
-			/***********************************************/
-			fbt->fbtp_enabled = FALSE;
-		}
+		/***********************************************/
+		/*   "Logically"  mark  probe  as gone. So we  */
+		/*   can  detect overruns. But even tho it is  */
+		/*   disabled,  doesnt  mean we cannot handle  */
+		/*   it.				       */
+		/***********************************************/
+		fbt->fbtp_enabled = FALSE;
 	}
 }
 
@@ -948,8 +1345,15 @@ fbt_suspend(void *arg, dtrace_id_t id, void *parg)
 		return;
 # endif
 
-	for (; fbt != NULL; fbt = fbt->fbtp_next)
+	for (; fbt != NULL; fbt = fbt->fbtp_next) {
+# if defined(__amd64)
+		if (fbt->fbtp_jmp) {
+			fbt_jmp_disarm(fbt);
+			continue;
+		}
+# endif
 		*fbt->fbtp_patchpoint = fbt->fbtp_savedval;
+	}
 }
 
 /*ARGSUSED*/
@@ -971,8 +1375,15 @@ fbt_resume(void *arg, dtrace_id_t id, void *parg)
 		return;
 # endif
 
-	for (; fbt != NULL; fbt = fbt->fbtp_next)
+	for (; fbt != NULL; fbt = fbt->fbtp_next) {
+# if defined(__amd64)
+		if (fbt->fbtp_tramp) {
+			fbt_jmp_arm(fbt);
+			continue;
+		}
+# endif
 		*fbt->fbtp_patchpoint = fbt->fbtp_patchval;
+	}
 }
 
 /*ARGSUSED*/
@@ -1294,10 +1705,12 @@ static int fbt_seq_show(struct seq_file *seq, void *v)
 	char	name[KSYM_NAME_LEN];
 	char	ibuf[64];
 	char	*cp;
+	int	jmp = FALSE;
 
 //printk("%s v=%p\n", __func__, v);
 	if (n == 1) {
 		seq_printf(seq, "# count patchpoint opcode inslen modrm name\n");
+		seq_printf(seq, "# (* = overrun, j = jump-optimized)\n");
 		return 0;
 	}
 	if (n > num_probes)
@@ -1352,13 +1765,17 @@ static int fbt_seq_show(struct seq_file *seq, void *v)
 	}
 	cp = (char *) my_kallsyms_lookup((unsigned long) fbt->fbtp_patchpoint, 
 		&size, &offset, &modname, name);
+# if defined(__amd64)
+	jmp = fbt->fbtp_jmp;
+# endif
 # if defined(__arm__)
-	seq_printf(seq, "%d %04u%c %p %08x %d %2d %s:%s:%s %s\n", n-1, 
+	seq_printf(seq, "%d %04u%c%c %p %08x %d %2d %s:%s:%s %s\n", n-1, 
 # else
-	seq_printf(seq, "%d %04u%c %p %02x %d %2d %s:%s:%s %s\n", n-1, 
+	seq_printf(seq, "%d %04u%c%c %p %02x %d %2d %s:%s:%s %s\n", n-1, 
 # endif
 		fbt->fbtp_fired,
 		fbt->fbtp_overrun ? '*' : ' ',
+		jmp ? 'j' : ' ',
 		fbt->fbtp_patchpoint,
 		fbt->fbtp_savedval,
 		fbt->fbtp_inslen,
@@ -1426,6 +1843,7 @@ int fbt_init(void)
 	fbt_probetab_mask = fbt_probetab_size - 1;
 	fbt_probetab =
 	    kmem_zalloc(fbt_probetab_size * sizeof (fbt_probe_t *), KM_SLEEP);
+	fbt_kmc = dtrace_kmc_create("fbt_probe", sizeof (fbt_probe_t));
 
 /*	dtrace_invop_add(fbt_invop);*/
 	
@@ -1458,7 +1876,12 @@ void fbt_exit(void)
 	if (initted) {
 		fbt_cleanup(NULL);
 		misc_deregister(&fbt_dev);
+		dtrace_kmc_destroy(fbt_kmc);
+		fbt_kmc = NULL;
 	}
+# if defined(__amd64)
+	fbt_tramp_fini();
+# endif
 
 //	printk(KERN_WARNING "fbt driver unloaded.\n");
 }
@@ -0,0 +1,516 @@
+/**********************************************************************/
+/*   DTrace's own clock for dtrace_gethrtime() (the "timestamp" and   */
+/*   "vtimestamp" D variables).					      */
+/*   								      */
+/*   We  cannot  call  into  the  kernel  timekeeping  code  from  a  */
+/*   probe:  it  may  spin  on  a  seqcount  held  by the CPU we have  */
+/*   interrupted,  and we want to be able to trace it anyway. So we  */
+/*   keep our own clock, which never locks and never calls out.       */
+/*   								      */
+/*   If  the  CPU  has an invariant TSC (constant rate, and does not  */
+/*   stop  in  deep C-states) then we read the TSC directly. At load  */
+/*   we  work  out  a  multiplier  (from tsc_khz, or by measuring it  */
+/*   against  ktime_get()),  and  then  on each CPU, record a (TSC,  */
+/*   ktime)  anchor  pair. A reading is then the anchor ktime plus  */
+/*   the scaled TSC delta. Because every CPU is anchored to the same  */
+/*   global clock, any TSC offset between CPUs is absorbed.           */
+/*   								      */
+/*   Otherwise  (no invariant TSC, not x86, CPU hotplugged after us,  */
+/*   or  "dtrace_tsc_clock=0"),  we  fall  back to a snapshot of  */
+/*   ktime_get()  refreshed  each  jiffy by a timer, published under  */
+/*   a  sequence  count. The timer only runs while something is being  */
+/*   traced  and  some online CPU actually needs the fallback, so an  */
+/*   idle  module  with  a  good  TSC  costs  nothing.  Readers  */
+/*   interpolate  with  native_sched_clock() if we have it. A reader  */
+/*   which  keeps  on seeing the writer busy (because it is an NMI  */
+/*   on top of it) gives up rather than spin forever.		      */
+/*   								      */
+/*   Either  way,  the value returned on a CPU never goes backwards,  */
+/*   even if a probe in an NMI lands in the middle of a read.	      */
+/*   								      */
+/*   /proc/dtrace/clock  runs  a  self-test: the per-call cost, and  */
+/*   the cross-CPU skew as seen by bouncing a read off each CPU.      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#include "dtrace_linux.h"
+#include <sys/dtrace_impl.h>
+#include "dtrace_proto.h"
+#include <linux/seq_file.h>
+#include <linux/delay.h>
+#include <linux/timer.h>
+#include <linux/math64.h>
+# if defined(__i386) || defined(__amd64)
+#	include <asm/cpufeature.h>
+#	include <asm/tsc.h>
+# endif
+
+/**********************************************************************/
+/*   Which clock dtrace_gethrtime() is using.			      */
+/**********************************************************************/
+# define	HRT_NONE	0	/* Not set up - use the legacy code. */
+# define	HRT_TSC		1
+# define	HRT_SEQ		2
+int	hrtime_mode;
+
+/**********************************************************************/
+/*   ns = (tsc_delta * hrt_mult) >> HRT_SHIFT. With a shift of 24, a  */
+/*   32-bit  multiplier  covers  TSCs  from  ~4MHz  upwards, and the  */
+/*   rounding error is well under a part per million.		      */
+/**********************************************************************/
+# define	HRT_SHIFT	24
+# define	HRT_SAMPLES	16
+# define	HRT_CALLS	10000
+
+typedef struct hrt_cpu {
+	uint64_t	hc_tsc;		/* TSC at the anchor (0 == none). */
+	hrtime_t	hc_ns;		/* ktime_get() at the anchor. */
+	hrtime_t	hc_last;	/* Last value handed out here. */
+	uint64_t	hc_err;		/* Anchor read window, TSC ticks. */
+} ____cacheline_aligned_in_smp hrt_cpu_t;
+
+static hrt_cpu_t hrt_cpu[NCPU];
+static uint32_t	hrt_mult;
+
+/**********************************************************************/
+/*   Fallback clock. One writer (hrt_timer), so a bare sequence count  */
+/*   will do.							      */
+/**********************************************************************/
+static struct hrt_snap {
+	volatile unsigned hs_seq;
+	hrtime_t	hs_ns;		/* ktime_get() at the last tick. */
+	uint64_t	hs_sc;		/* native_sched_clock() ditto. */
+} hrt_snap;
+static struct timer_list hrt_timer;
+static int	hrt_users;	/* Active consumers, under dtrace_lock. */
+
+static ktime_t	(*fn_ktime_get)(void);
+static u64	(*fn_sched_clock)(void);
+static int	(*fn_check_tsc_unstable)(void);
+
+extern int dtrace_tsc_clock;
+
+unsigned long long cnt_hrtime_clamp;
+unsigned long long cnt_hrtime_retry;
+
+static inline uint64_t
+hrt_rdtsc(void)
+{
+# if defined(__i386) || defined(__amd64)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+# else
+	return 0;
+# endif
+}
+
+/**********************************************************************/
+/*   Scale  a  TSC  delta  to  ns,  in  two halves so the multiply  */
+/*   cannot overflow however long we have been loaded.		      */
+/**********************************************************************/
+static inline hrtime_t
+hrt_scale(uint64_t d)
+{
+	return (((d >> 32) * hrt_mult) << (32 - HRT_SHIFT)) +
+	    (((d & 0xffffffff) * hrt_mult) >> HRT_SHIFT);
+}
+
+static hrtime_t
+hrt_ktime(void)
+{
+	return ktime_to_ns(fn_ktime_get());
+}
+
+/**********************************************************************/
+/*   Does the TSC tick at a constant rate, through C-states, and has  */
+/*   the kernel not given up on it?				      */
+/**********************************************************************/
+static int
+hrt_tsc_invariant(void)
+{
+# if defined(__i386) || defined(__amd64)
+	if (!boot_cpu_has(X86_FEATURE_TSC) ||
+	    !boot_cpu_has(X86_FEATURE_CONSTANT_TSC))
+		return FALSE;
+#  if defined(X86_FEATURE_NONSTOP_TSC)
+	if (!boot_cpu_has(X86_FEATURE_NONSTOP_TSC))
+		return FALSE;
+#  endif
+	if (fn_check_tsc_unstable && fn_check_tsc_unstable())
+		return FALSE;
+	return TRUE;
+# else
+	return FALSE;
+# endif
+}
+
+/**********************************************************************/
+/*   Work out hrt_mult. The kernel has already calibrated the TSC for  */
+/*   us  (tsc_khz), so use that if we can, else time it over 10ms of  */
+/*   ktime_get().						      */
+/**********************************************************************/
+static int
+hrt_calibrate(void)
+{	uint64_t t0, t1, m;
+	hrtime_t n0, n1;
+
+# if defined(__i386) || defined(__amd64)
+	if (tsc_khz) {
+		m = div_u64((uint64_t) NSEC_PER_MSEC << HRT_SHIFT, tsc_khz);
+		goto done;
+	}
+# endif
+	preempt_disable();
+	t0 = hrt_rdtsc();
+	n0 = hrt_ktime();
+	mdelay(10);
+	t1 = hrt_rdtsc();
+	n1 = hrt_ktime();
+	preempt_enable();
+	if (t1 <= t0 || n1 <= n0)
+		return FALSE;
+	m = div64_u64((uint64_t) (n1 - n0) << HRT_SHIFT, t1 - t0);
+
+done:
+	if (m == 0 || m > 0xffffffffULL)
+		return FALSE;
+	hrt_mult = (uint32_t) m;
+	return TRUE;
+}
+
+/**********************************************************************/
+/*   Called  on  each CPU (via IPI) to take its anchor. Of a handful  */
+/*   of  samples,  keep  the one with the narrowest TSC window around  */
+/*   the ktime_get(), and assume the ktime was read mid-window.	      */
+/**********************************************************************/
+static void
+hrt_anchor(void *arg)
+{	hrt_cpu_t *hc = &hrt_cpu[smp_processor_id()];
+	uint64_t t0, t1, tsc = 0, best = ~0ULL;
+	hrtime_t ns, anchor = 0;
+	unsigned long flags;
+	int	i;
+
+	local_irq_save(flags);
+	for (i = 0; i < HRT_SAMPLES; i++) {
+		t0 = hrt_rdtsc();
+		ns = hrt_ktime();
+		t1 = hrt_rdtsc();
+		if (t1 - t0 < best) {
+			best = t1 - t0;
+			tsc = t0 + best / 2;
+			anchor = ns;
+		}
+	}
+	hc->hc_ns = anchor;
+	hc->hc_err = best;
+	smp_wmb();
+	hc->hc_tsc = tsc;
+	local_irq_restore(flags);
+}
+
+/**********************************************************************/
+/*   Fallback clock: refresh the snapshot.			      */
+/**********************************************************************/
+static void
+hrt_refresh(void)
+{	hrtime_t ns = hrt_ktime();
+	uint64_t sc = fn_sched_clock ? fn_sched_clock() : 0;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	hrt_snap.hs_seq++;
+	smp_wmb();
+	hrt_snap.hs_ns = ns;
+	hrt_snap.hs_sc = sc;
+	smp_wmb();
+	hrt_snap.hs_seq++;
+	local_irq_restore(flags);
+}
+
+/**********************************************************************/
+/*   Does anyone need the fallback clock kept fresh? Always when      */
+/*   there is no TSC clock, since the driver itself waits on          */
+/*   dtrace_gethrtime() (xcall timeouts, dynvar resize, provider      */
+/*   reaping) whether or not anyone is tracing. With a TSC, only      */
+/*   whilst tracing and some online CPU (e.g. one hotplugged since    */
+/*   we loaded) has no anchor.                                        */
+/**********************************************************************/
+static int
+hrt_need_tick(void)
+{	int	cpu;
+
+	if (hrtime_mode == HRT_SEQ)
+		return TRUE;
+	if (hrt_users == 0 || hrtime_mode == HRT_NONE)
+		return FALSE;
+	for_each_online_cpu(cpu) {
+		if (hrt_cpu[cpu].hc_tsc == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void
+hrt_tick(struct timer_list *t)
+# else
+static void
+hrt_tick(unsigned long arg)
+# endif
+{
+	hrt_refresh();
+	if (hrt_need_tick())
+		mod_timer(&hrt_timer, jiffies + 1);
+}
+
+/**********************************************************************/
+/*   Fallback clock: read the snapshot, and add however much          */
+/*   native_sched_clock() has moved on since. Normally that is a      */
+/*   tick or so, but the snapshot goes stale if the timer's CPU sits  */
+/*   with interrupts off, so the delta is not capped: a clock which   */
+/*   stops would hang anyone spinning on a deadline. Returns 0 if     */
+/*   the writer would not get out of the way.                         */
+/**********************************************************************/
+static hrtime_t
+hrt_read_seq(void)
+{	unsigned seq;
+	hrtime_t ns, d;
+	uint64_t sc;
+	int	i;
+
+	for (i = 0; i < HRT_SAMPLES; i++) {
+		seq = hrt_snap.hs_seq;
+		smp_rmb();
+		ns = hrt_snap.hs_ns;
+		sc = hrt_snap.hs_sc;
+		smp_rmb();
+		if ((seq & 1) == 0 && seq == hrt_snap.hs_seq)
+			break;
+		cnt_hrtime_retry++;
+	}
+	if (i >= HRT_SAMPLES)
+		return 0;
+
+	if (fn_sched_clock && sc) {
+		d = (hrtime_t) (fn_sched_clock() - sc);
+		if (d < 0)
+			d = 0;
+		ns += d;
+	}
+	return ns;
+}
+
+/**********************************************************************/
+/*   The  clock  itself. Called from probe context, so no locks, and  */
+/*   nothing which can be traced.				      */
+/**********************************************************************/
+hrtime_t
+dtrace_hrtime_read(void)
+{	hrt_cpu_t *hc = &hrt_cpu[raw_smp_processor_id()];
+	uint64_t t;
+	hrtime_t ns, last;
+
+	if (hrtime_mode == HRT_TSC && hc->hc_tsc) {
+		smp_rmb();
+		t = hrt_rdtsc();
+		ns = hc->hc_ns;
+		if (t > hc->hc_tsc)
+			ns += hrt_scale(t - hc->hc_tsc);
+	} else {
+		ns = hrt_read_seq();
+	}
+
+	/***********************************************/
+	/*   A  probe  in  an  NMI  can  come in here  */
+	/*   between  our  compare and store, and hand  */
+	/*   out  a  later  value  than  ours;  so only  */
+	/*   move hc_last forwards.		       */
+	/***********************************************/
+	for (;;) {
+		last = hc->hc_last;
+		if (ns < last) {
+			cnt_hrtime_clamp++;
+			return last;
+		}
+		if (cmpxchg64(&hc->hc_last, last, ns) == last)
+			return ns;
+	}
+}
+
+/**********************************************************************/
+/*   Called  (under  dtrace_lock) as a consumer starts and finishes  */
+/*   tracing.  The  first  one  anchors  any  CPU  which  has  come  */
+/*   online  since we loaded, refreshes the fallback snapshot so it  */
+/*   is  good  straight  away, and starts the timer if it is needed.  */
+/*   mod_timer()  is  harmless  if  the  timer  is already running,  */
+/*   and  covers  a  tick  which  has  just  decided  to stop.	      */
+/**********************************************************************/
+void
+dtrace_hrtime_start(void)
+{	int	cpu;
+
+	if (hrtime_mode == HRT_NONE || hrt_users++ != 0)
+		return;
+
+	if (hrtime_mode == HRT_TSC) {
+		for_each_online_cpu(cpu) {
+			if (hrt_cpu[cpu].hc_tsc == 0)
+				smp_call_function_single(cpu, hrt_anchor, NULL, TRUE);
+		}
+	}
+	hrt_refresh();
+	if (hrt_need_tick())
+		mod_timer(&hrt_timer, jiffies + 1);
+}
+void
+dtrace_hrtime_stop(void)
+{
+	/***********************************************/
+	/*   In TSC mode the timer sees hrt_users ==  */
+	/*   0 and stops; in seqlock mode it runs     */
+	/*   until we unload.                         */
+	/***********************************************/
+	if (hrtime_mode == HRT_NONE || hrt_users == 0)
+		return;
+	hrt_users--;
+}
+
+void
+dtrace_hrtime_init(void)
+{	int	cpu;
+
+	if (hrtime_mode != HRT_NONE)
+		return;
+
+	fn_ktime_get = (ktime_t (*)(void)) get_proc_addr("ktime_get");
+	fn_sched_clock = (u64 (*)(void)) get_proc_addr("native_sched_clock");
+	fn_check_tsc_unstable = (int (*)(void)) get_proc_addr("check_tsc_unstable");
+	if (fn_ktime_get == NULL) {
+		printk(KERN_WARNING "dtracedrv: ktime_get not found - timestamp may be unreliable\n");
+		return;
+	}
+
+	/***********************************************/
+	/*   Set up the fallback even with a TSC,     */
+	/*   since CPUs can come online after we      */
+	/*   have anchored. Without a TSC the timer   */
+	/*   runs from now on; with one, the first    */
+	/*   tick sees it is not needed and stops,    */
+	/*   and dtrace_hrtime_start() re-arms it.    */
+	/***********************************************/
+	hrt_refresh();
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+	timer_setup(&hrt_timer, hrt_tick, 0);
+# else
+	setup_timer(&hrt_timer, hrt_tick, 0);
+# endif
+	hrtime_mode = HRT_SEQ;
+	mod_timer(&hrt_timer, jiffies + 1);
+
+	if (!dtrace_tsc_clock || !hrt_tsc_invariant() || !hrt_calibrate())
+		return;
+
+	for_each_online_cpu(cpu) {
+		smp_call_function_single(cpu, hrt_anchor, NULL, TRUE);
+	}
+	smp_mb();
+	hrtime_mode = HRT_TSC;
+}
+void
+dtrace_hrtime_fini(void)
+{
+	if (hrtime_mode == HRT_NONE)
+		return;
+
+	hrtime_mode = HRT_NONE;
+	hrt_users = 0;
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	timer_delete_sync(&hrt_timer);
+# else
+	del_timer_sync(&hrt_timer);
+# endif
+}
+
+/**********************************************************************/
+/*   Self-test  for  /proc/dtrace/clock. For each other CPU, read the  */
+/*   clock  here,  then  there  (by IPI), then here again. The remote  */
+/*   read  should  land  inside  the  local  window; of the samples,  */
+/*   the  narrowest  window  gives the best estimate of the offset.   */
+/**********************************************************************/
+static void
+hrt_remote(void *arg)
+{
+	*(hrtime_t *) arg = dtrace_gethrtime();
+}
+void
+dtrace_hrtime_selftest(struct seq_file *seq)
+{	static const char *modes[] = { "legacy", "tsc", "seqlock" };
+	hrtime_t t0, t1, tr, prev, rtt, off, worst = 0;
+	uint64_t c0, c1;
+	unsigned long flags;
+	int	i, cpu, me, back = 0, outside = 0;
+
+	if (hrtime_mode != HRT_NONE)
+		hrt_refresh();
+	seq_printf(seq, "mode          %s\n", modes[hrtime_mode]);
+	seq_printf(seq, "invariant_tsc %d\n", hrt_tsc_invariant());
+	if (hrtime_mode == HRT_TSC) {
+		seq_printf(seq, "mult          %u\n", hrt_mult);
+		seq_printf(seq, "shift         %d\n", HRT_SHIFT);
+# if defined(__i386) || defined(__amd64)
+		seq_printf(seq, "tsc_khz       %u\n", tsc_khz);
+# endif
+	}
+
+	/***********************************************/
+	/*   Per-call cost, and local monotonicity.    */
+	/***********************************************/
+	local_irq_save(flags);
+	c0 = hrt_rdtsc();
+	t0 = prev = dtrace_gethrtime();
+	for (i = 0; i < HRT_CALLS; i++) {
+		t1 = dtrace_gethrtime();
+		if (t1 < prev)
+			back++;
+		prev = t1;
+	}
+	c1 = hrt_rdtsc();
+	local_irq_restore(flags);
+	seq_printf(seq, "call_ns       %lld\n", (long long) (t1 - t0) / HRT_CALLS);
+	seq_printf(seq, "call_cycles   %llu\n", (unsigned long long) (c1 - c0) / HRT_CALLS);
+	seq_printf(seq, "backwards     %d\n", back);
+
+	/***********************************************/
+	/*   Cross-CPU skew.			       */
+	/***********************************************/
+	me = get_cpu();
+	for_each_online_cpu(cpu) {
+		if (cpu == me)
+			continue;
+		rtt = -1;
+		off = 0;
+		for (i = 0; i < HRT_SAMPLES; i++) {
+			t0 = dtrace_gethrtime();
+			smp_call_function_single(cpu, hrt_remote, &tr, TRUE);
+			t1 = dtrace_gethrtime();
+			if (tr < t0 || tr > t1)
+				outside++;
+			if (rtt < 0 || t1 - t0 < rtt) {
+				rtt = t1 - t0;
+				off = tr - (t0 + t1) / 2;
+			}
+		}
+		seq_printf(seq, "cpu%-3d        offset %lld ns rtt %lld ns\n",
+			cpu, (long long) off, (long long) rtt);
+		if (off < 0)
+			off = -off;
+		if (off > worst)
+			worst = off;
+	}
+	put_cpu();
+	seq_printf(seq, "max_skew_ns   %lld\n", (long long) worst);
+	seq_printf(seq, "out_of_window %d\n", outside);
+}
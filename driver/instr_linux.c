@@ -753,9 +753,8 @@ instr_enable(void *arg, dtrace_id_t id, void *parg)
 		fbt->insp_enabled = TRUE;
 		if (dtrace_here) 
 			printk("instr_enable:patch %p p:%02x\n", fbt->insp_patchpoint, fbt->insp_patchval);
-		if (memory_set_rw(fbt->insp_patchpoint, 1, TRUE)) {
-			*fbt->insp_patchpoint = fbt->insp_patchval;
-		}
+		dtrace_invop_claim(instr_invop, (uintptr_t) fbt->insp_patchpoint);
+		dtrace_patch_set(fbt->insp_patchpoint, fbt->insp_patchval);
 	}
 	return 0;
 }
@@ -796,10 +795,8 @@ instr_disable(void *arg, dtrace_id_t id, void *parg)
 		/*   then  dont  try and unpatch something we  */
 		/*   didnt patch.			       */
 		/***********************************************/
-		if (*fbt->insp_patchpoint == fbt->insp_patchval) {
-			if (memory_set_rw(fbt->insp_patchpoint, 1, TRUE))
-				*fbt->insp_patchpoint = fbt->insp_savedval;
-		}
+		dtrace_patch_restore(fbt->insp_patchpoint, 
+			fbt->insp_patchval, fbt->insp_savedval);
 	}
 }
 
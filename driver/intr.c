@@ -416,6 +416,7 @@ dtrace_int3_handler(int type, struct pt_regs *regs)
 		/***********************************************/
 		tp = &this_cpu->cpuc_trap[0];
 		tp->ct_tinfo.t_doprobe = TRUE;
+		tp->ct_tinfo.t_instr = NULL;
 		/***********************************************/
 		/*   Save   original   location   for   debug  */
 		/*   purposes in cpu_x86.c		       */
@@ -527,6 +528,7 @@ switch_off:
 //	tp = &this_cpu->cpuc_trap[1];
 	tp = &trap_info;
 	tp->ct_tinfo.t_doprobe = FALSE;
+	tp->ct_tinfo.t_instr = NULL;
 	ret = dtrace_invop(regs->r_pc - 1, (uintptr_t *) regs, 
 		regs->r_rax, &tp->ct_tinfo);
 //preempt_enable_no_resched();
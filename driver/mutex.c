@@ -27,6 +27,14 @@
 /*   WARN_ON/BUG_ON  macros in the kernel can fire, e.g. on kmalloc,  */
 /*   when allocating memory if the irqs_disabled() function disagree  */
 /*   with the allocation flags.					      */
+/*   								      */
+/*   The  big  top-half  locks  (dtrace_lock,  cpu_lock, mod_lock and  */
+/*   friends)  are  declared  with  MUTEX_DEFINE_QUEUED, and are ticket  */
+/*   locks:  waiters  are  served  in order, and spin reading their own  */
+/*   ticket  against  the owner, rather than all hammering the line with  */
+/*   a  cmpxchg.  These  must  never  be taken from interrupt context,  */
+/*   since  an  interrupt  cannot  jump  the queue ahead of a waiter it  */
+/*   interrupted.						      */
 /*--------------------------------------------------------------------*/
 /*  $Header: Last edited: 04-Dec-2011 1.3 $ 			      */
 /**********************************************************************/
@@ -35,6 +43,7 @@
 #include <sys/dtrace_impl.h>
 #include <sys/dtrace.h>
 #include <dtrace_proto.h>
+#include <linux/seq_file.h>
 
 unsigned long cnt_mtx1;
 unsigned long cnt_mtx2;
@@ -42,6 +51,8 @@ unsigned long cnt_mtx3;
 
 static const int disable_ints;
 
+static void mutex_enter_queued(mutex_t *mp);
+
 void
 dmutex_init(mutex_t *mp)
 {
@@ -80,6 +91,7 @@ mutex_enter_common(mutex_t *mp, int dflag)
 	unsigned int  cnt;
 
 	if (!mp->m_initted) {
+		int	queued = mp->m_queued;
 		/***********************************************/
 		/*   Special  debug:  detect  a dynamic mutex  */
 		/*   being  used  (one  coming from a kmalloc  */
@@ -91,8 +103,17 @@ mutex_enter_common(mutex_t *mp, int dflag)
 			dump_stack();
 		}
 	    dmutex_init(mp);
+	    mp->m_queued = queued;
 	    }
 
+	if (mp->m_queued) {
+		mutex_enter_queued(mp);
+		mp->m_cpu = smp_processor_id();
+		mp->m_level = 1;
+		mp->m_type = dflag;
+		return;
+	}
+
 	/***********************************************/
 	/*   Check  for  recursive  mutex.  Theres  a  */
 	/*   number of scenarios.		       */
@@ -161,6 +182,11 @@ mutex_enter_common(mutex_t *mp, int dflag)
 			cnt_mtx3++;
 		}
 	}
+	mp->m_acquired++;
+	if (cnt) {
+		mp->m_contended++;
+		mp->m_spins += cnt;
+	}
 //preempt_disable();
 	mp->m_flags = flags;
 	mp->m_cpu = smp_processor_id();
@@ -168,6 +194,74 @@ mutex_enter_common(mutex_t *mp, int dflag)
 	mp->m_type = dflag;
 }
 
+/**********************************************************************/
+/*   Ticket  lock.  Take  a  ticket,  and wait til the owner gets to  */
+/*   it.  Whilst  waiting,  keep the same manners as the simple lock:  */
+/*   drain  our  xcall  mailbox  (the owner may be waiting for us to  */
+/*   ack  an  xcall),  and  let the scheduler in now and again so the  */
+/*   owner  can  run  if  we  have more dtrace processes than cpus.   */
+/*   								      */
+/*   But  we  must not sleep holding a ticket: if the lock is handed  */
+/*   to us whilst we are off the cpu, it sits idle, and every waiter  */
+/*   queued  behind  us  waits  for  us  to be scheduled again. So a  */
+/*   waiter only takes a ticket whilst fewer than all-but-one of the  */
+/*   cpus  are  already  in  the  queue,  and  until then waits (and  */
+/*   sleeps)  without  one. Once queued, it spins. Keeping a cpu out  */
+/*   of  the  queue means the owner, should it sleep, can always get  */
+/*   back onto a cpu to release the lock.			      */
+/**********************************************************************/
+static void
+mutex_enter_queued(mutex_t *mp)
+{	unsigned int ticket;
+	unsigned int maxq = num_online_cpus() > 2 ? num_online_cpus() - 1 : 1;
+	unsigned int cnt;
+
+	for (cnt = 0; ; cnt++) {
+		ticket = (unsigned int) atomic_read(&mp->m_next);
+		if (ticket - mp->m_owner < maxq &&
+		    (unsigned int) atomic_cmpxchg(&mp->m_next, ticket, ticket + 1) == ticket)
+			break;
+		cpu_relax();
+		if ((cnt % 100) == 0)
+			xcall_slave2();
+		if ((cnt % 2000) == 1999)
+			schedule();
+		if (cnt && (cnt % (500 * 1000 * 1000)) == 0) {
+			dtrace_printf("mutex_enter: taking a long time to queue for lock %p next=%u owner=%u\n", 
+				mp, ticket, mp->m_owner);
+			cnt_mtx3++;
+		}
+	}
+
+	for (; mp->m_owner != ticket; cnt++) {
+		cpu_relax();
+		if ((cnt % 100) == 0)
+			xcall_slave2();
+		if (cnt && (cnt % (500 * 1000 * 1000)) == 0) {
+			dtrace_printf("mutex_enter: taking a long time to grab queued lock %p ticket=%u owner=%u\n", 
+				mp, ticket, mp->m_owner);
+			cnt_mtx3++;
+		}
+	}
+	smp_mb();
+
+	mp->m_count = (void *) 1;
+	mp->m_acquired++;
+	if (cnt) {
+		mp->m_contended++;
+		mp->m_spins += cnt;
+	}
+	mp->m_hold_start = dtrace_gethrtime();
+}
+static void
+mutex_exit_queued(mutex_t *mp)
+{
+	mp->m_hold_ns += dtrace_gethrtime() - mp->m_hold_start;
+	mp->m_count = 0;
+	smp_mb();
+	mp->m_owner++;
+}
+
 /**********************************************************************/
 /*   Enter from interrupt context, interrupts might be disabled.      */
 /**********************************************************************/
@@ -224,6 +318,11 @@ dmutex_exit(mutex_t *mp)
 	if (--mp->m_level)
 	    return;
 
+	if (mp->m_queued) {
+		mutex_exit_queued(mp);
+		return;
+	}
+
 	/*
 	if (mp->m_cpu != smp_processor_id())
 		dtrace_printf("dmutex_exit:: cross cpu %d count=%d\n", mp->m_cpu, mp->m_count);
@@ -255,6 +354,11 @@ mutex_exit(mutex_t *mp)
 	preempt_enable_no_resched();
 	*/
 
+	if (mp->m_queued) {
+		mutex_exit_queued(mp);
+		return;
+	}
+
 	mp->m_count = 0;
 }
 
@@ -276,4 +380,16 @@ mutex_dump(mutex_t *mp)
 	dtrace_printf("mutex: %p initted=%d count=%p flags=%lx cpu=%d type=%d level=%d\n",
 	    mp, mp->m_initted, mp->m_count, mp->m_flags, mp->m_cpu, mp->m_type,
 	    mp->m_level);
+	if (mp->m_queued)
+		dtrace_printf("  next=%u owner=%u\n", 
+		    (unsigned int) atomic_read(&mp->m_next), mp->m_owner);
+}
+/**********************************************************************/
+/*   Print  the  statistics  for  a  mutex  in  /proc/dtrace/stats.  */
+/**********************************************************************/
+void
+mutex_stats(struct seq_file *seq, char *name, mutex_t *mp)
+{
+	seq_printf(seq, "mutex_%s=acquired:%llu contended:%llu spins:%llu hold_ns:%llu\n",
+	    name, mp->m_acquired, mp->m_contended, mp->m_spins, mp->m_hold_ns);
 }
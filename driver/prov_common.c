@@ -75,8 +75,17 @@ typedef struct provider {
 	dtrace_provider_id_t 	p_provider_id;
 	int			p_want_return;
 	int			(*p_callback)(dtrace_id_t, struct pt_regs *);
+	struct provider		*p_hashnext;
 	} provider_t;
 #define MAX_PROVIDER_TBL 1024
+
+/**********************************************************************/
+/*   Index  of  map[]  by  p_func_addr,  so  prcom_invop()  doesnt have  */
+/*   to scan the whole table for every breakpoint in the system.      */
+/**********************************************************************/
+#define	PRCOM_TABSIZE		256
+#define	PRCOM_ADDR2NDX(addr)	((((uintptr_t)(addr)) >> 4) & (PRCOM_TABSIZE - 1))
+static provider_t *prcom_tab[PRCOM_TABSIZE];
 static provider_t map[MAX_PROVIDER_TBL] = {
 	{
 		.p_probe = "notifier::atomic:die_chain",
@@ -873,6 +882,22 @@ prcom_init(void)
 			}
 		}
 	}
+
+	/***********************************************/
+	/*   Now  we  know  the  addresses, index them.  */
+	/*   Go  backwards so each chain is in map[]  */
+	/*   order, which is the order we fire in.     */
+	/***********************************************/
+	for (pp = &map[probe_cnt - 1]; pp >= map; pp--) {
+		int	ndx;
+
+		if (pp->p_func_addr == NULL)
+			continue;
+		ndx = PRCOM_ADDR2NDX(pp->p_func_addr);
+		pp->p_hashnext = prcom_tab[ndx];
+		membar_producer();
+		prcom_tab[ndx] = pp;
+	}
 }
 
 /**********************************************************************/
@@ -933,23 +958,29 @@ prcom_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *tinfo
 	provider_t *pp;
 	int	ret = 0;
 
+	/***********************************************/
+	/*   These  are likely rarely to fire, yet we  */
+	/*   may  get  called  for other breakpoints,  */
+	/*   so get out quickly if its not ours.       */
+	/***********************************************/
+	for (pp = prcom_tab[PRCOM_ADDR2NDX(addr)]; pp; pp = pp->p_hashnext) {
+		if (addr == (uintptr_t) pp->p_func_addr)
+			break;
+	}
+	if (pp == NULL)
+		return 0;
+
 	/***********************************************/
 	/*   Some probes are matching on the value of  */
 	/*   arg1   (shared   dispatch).   Get   arg1  */
 	/*   (stack0)  early  so we can use it in the  */
 	/*   loop below.			       */
 	/***********************************************/
-
-	/***********************************************/
-	/*   We need to hash the addresses since they  */
-	/*   are  likely  rarely to fire, yet we will  */
-	/*   get called for all FBT traffic.	       */
-	/***********************************************/
 	regs = (struct pt_regs *) stack;
 	DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
 	stack0 = regs->c_arg0;
 	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT | CPU_DTRACE_BADADDR);
-	for (pp = map; pp < &map[probe_cnt]; pp++) {
+	for (; pp != NULL; pp = pp->p_hashnext) {
 		if (addr != (uintptr_t) pp->p_func_addr)
 			continue;
 		if (!pp->p_enabled) {
@@ -1034,9 +1065,9 @@ prcom_enable(void *arg, dtrace_id_t id, void *parg)
 
 	pp->p_enabled = TRUE;
 //printk("prcom_enable %p %x\n", pp->p_func_addr, pp->p_func_addr ? *(unsigned char *) pp->p_func_addr : 0);
-	if (pp->p_func_addr &&
-	    *(unsigned char *) pp->p_func_addr != PATCHVAL) {
-		*(unsigned char *) pp->p_func_addr = PATCHVAL;
+	if (pp->p_func_addr) {
+		dtrace_invop_claim(prcom_invop, (uintptr_t) pp->p_func_addr);
+		dtrace_patch_set((instr_t *) pp->p_func_addr, PATCHVAL);
 	}
 
 	return 0;
@@ -1048,10 +1079,9 @@ prcom_disable(void *arg, dtrace_id_t id, void *parg)
 {	provider_t *pp = (provider_t *) parg;
 
 	pp->p_enabled = FALSE;
-	if (pp->p_func_addr && pp->p_patchval &&
-	    *(unsigned char *) pp->p_func_addr == PATCHVAL) {
-		*(unsigned char *) pp->p_func_addr = pp->p_patchval;
-	}
+	if (pp->p_func_addr && pp->p_patchval)
+		dtrace_patch_restore((instr_t *) pp->p_func_addr, 
+			PATCHVAL, pp->p_patchval);
 }
 
 /*ARGSUSED*/
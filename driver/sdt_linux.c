@@ -539,8 +539,8 @@ sdt_enable(void *arg, dtrace_id_t id, void *parg)
 		/*   try and unprotect it.		       */
 		/***********************************************/
 		sdp->sdp_enabled = TRUE;
-		if (memory_set_rw(sdp->sdp_patchpoint, 1, TRUE))
-			*sdp->sdp_patchpoint = sdp->sdp_patchval;
+		dtrace_invop_claim(sdt_invop, (uintptr_t) sdp->sdp_patchpoint);
+		dtrace_patch_set(sdp->sdp_patchpoint, sdp->sdp_patchval);
 		sdp = sdp->sdp_next;
 	}
 	return 0;
@@ -570,9 +570,8 @@ sdt_disable(void *arg, dtrace_id_t id, void *parg)
 		/*   memory  page,  then dont try and unpatch  */
 		/*   something we didnt patch.		       */
 		/***********************************************/
-		if (*sdp->sdp_patchpoint == sdp->sdp_patchval) {
-			*sdp->sdp_patchpoint = sdp->sdp_savedval;
-		}
+		dtrace_patch_restore(sdp->sdp_patchpoint, 
+			sdp->sdp_patchval, sdp->sdp_savedval);
 		sdp = sdp->sdp_next;
 	}
 }
@@ -110,6 +110,7 @@ char toxic_probe_tbl[] = {
 	"init_timer "
 	"int3 "
 	"iret_exc "
+	"irq_work_queue "	// Used to wake poll() from probe context
 	"kfree "
 	"kmem_cache_alloc "
 	"kmem_cache_create "
@@ -87,19 +87,40 @@ extern int ipi_vector;
 /*   use smp_call_function() and friends from interrupt context. The  */
 /*   timer interrupt will cause this to happen.			      */
 /*   								      */
-/*   The  xcalls array is our main work queue. Each cpu can invoke a  */
-/*   call to every other cpu.					      */
+/*   Each  cpu  has  a request slot per nesting level (we may xcall  */
+/*   from  an interrupt whilst an xcall is in progress). Each target  */
+/*   cpu  has  a  mailbox  -  a  bitmap  with  one  bit  per  caller  */
+/*   slot.  The  caller  fills  in  its  slot, sets its bit in every  */
+/*   target's mailbox, and sends a single IPI to the lot. Targets  */
+/*   atomically  grab  and  clear  their  mailbox, run each request,  */
+/*   and  decrement  the  request's  xr_pending.  So  the caller only  */
+/*   spins  on  one  counter, rather than polling every target, and  */
+/*   nobody takes a lock.					      */
+/*   								      */
+/*   A  request  is  posted  with  interrupts  off,  so  a  nested  */
+/*   xcall  sees  the  slot  below it either untouched or fully sent.  */
+/*   If  we  nest  deeper  than XC_LEVELS, we wait for the innermost  */
+/*   request  in  flight  to  drain,  and then borrow its slot (see  */
+/*   xcall_overflow()).						      */
 /**********************************************************************/
-# define XC_IDLE	0	/* Owned by us. */
-# define XC_WORKING     1	/* Waiting for the target cpu to finish. */
+# define XC_LEVELS	2
+# define XC_SLOT(cpu, level)	((cpu) * XC_LEVELS + (level))
+# define XC_MBOX_WORDS	((NCPU * XC_LEVELS + BITS_PER_LONG - 1) / BITS_PER_LONG)
 #if NCPU > 256
 #	warning "NCPU is large - your module may not load (x_call.c)"
 #endif
-static struct xcalls {
-	dtrace_xcall_t	xc_func;
-	void		*xc_arg;
-	volatile int	xc_state;
-	} *xcalls[NCPU];
+typedef struct xcall_req {
+	dtrace_xcall_t	xr_func;
+	void		*xr_arg;
+	atomic_t	xr_pending;	/* Targets yet to run xr_func. */
+	} ____cacheline_aligned xcall_req_t;
+
+typedef struct xcall_mbox {
+	unsigned long	xm_pending[XC_MBOX_WORDS];
+	} ____cacheline_aligned xcall_mbox_t;
+
+static xcall_req_t	*xcall_reqs;
+static xcall_mbox_t	*xcall_mbox;
 
 static int xcall_levels[NCPU];
 
@@ -108,11 +129,13 @@ unsigned long cnt_xcall1;
 unsigned long cnt_xcall2;
 unsigned long cnt_xcall3;
 unsigned long cnt_xcall4;
-unsigned long cnt_xcall5;	/* Max ack_wait/spin loop */
+unsigned long cnt_xcall5;	/* Max spin loop */
 unsigned long long cnt_xcall6;
 unsigned long long cnt_xcall7;
 unsigned long cnt_xcall8;
+unsigned long cnt_xcall_overflow;
 unsigned long cnt_ipi1;
+unsigned long long cnt_xcall_lat[XCALL_LAT_BUCKETS];
 unsigned long cnt_nmi1;
 unsigned long cnt_nmi2;
 
@@ -122,6 +145,7 @@ unsigned long cnt_nmi2;
 void orig_dtrace_xcall(processorid_t cpu, dtrace_xcall_t func, void *arg);
 void dtrace_xcall1(processorid_t cpu, dtrace_xcall_t func, void *arg);
 static void dump_xcalls(void);
+static int xcall_wait(xcall_req_t *xr, hrtime_t start);
 static void send_ipi_interrupt(cpumask_t *mask, int vector);
 void xcall_slave2(void);
 
@@ -132,8 +156,7 @@ void xcall_slave2(void);
 /**********************************************************************/
 void
 xcall_init(void)
-{	int	i;
-
+{
 	if ((x_apic = get_proc_addr("apic")) == NULL &&
 	    (x_apic = get_proc_addr("apic_ops")) == NULL) {
 		/***********************************************/
@@ -144,22 +167,20 @@ xcall_init(void)
 	if (x_apic)
 		x_apic = *(void **) x_apic;
 
-	for (i = 0; i < nr_cpus; i++) {
-		xcalls[i] = kzalloc(nr_cpus * sizeof (struct xcalls), GFP_KERNEL);
-		if (xcalls[i] == NULL) {
-			dtrace_linux_panic("Cannot allocate xcalls[%d][%d] array.\n", nr_cpus, nr_cpus);
-			return;
-		}
+	xcall_reqs = kzalloc(nr_cpus * XC_LEVELS * sizeof (xcall_req_t), GFP_KERNEL);
+	xcall_mbox = kzalloc(nr_cpus * sizeof (xcall_mbox_t), GFP_KERNEL);
+	if (xcall_reqs == NULL || xcall_mbox == NULL) {
+		dtrace_linux_panic("Cannot allocate xcall arrays for %d cpus.\n", nr_cpus);
+		return;
 	}
 
 	xen_xcall_init();
 }
 void
 xcall_fini(void)
-{	int	i;
-
-	for (i = 0; i < nr_cpus; i++)
-		kfree(xcalls[i]);
+{
+	kfree(xcall_reqs);
+	kfree(xcall_mbox);
 	xen_xcall_fini();
 }
 
@@ -251,98 +272,18 @@ orig_dtrace_xcall(processorid_t cpu, dtrace_xcall_t func, void *arg)
 
 # if XCALL_MODE == XCALL_NEW
 /**********************************************************************/
-/*   Wait  for  the other cpu to get to an appropriate point. We put  */
-/*   in  counters  to  avoid  deadlocking ourselves - these shouldnt  */
-/*   happen under normal circumstances, but they can happen, e.g. if  */
-/*   other  cpu  is  in  a big disabled-interrupt mode. We dont like  */
-/*   breaking the locking protocol, but remember the xcalls are rare  */
-/*   -  typically  as  dtrace  is  starting up or shutting down (see  */
-/*   /proc/dtrace/stats  to  see  the  numbers  relative  to  actual  */
-/*   probes).							      */
-/**********************************************************************/
-int
-ack_wait(int c, int attempts)
-{
-	unsigned long cnt = 0;
-	int	cnt1 = 0;
-	volatile struct xcalls *xc = &xcalls[smp_processor_id()][c];
-
-	/***********************************************/
-	/*   Avoid holding on to a stale cache line.   */
-	/***********************************************/
-	while (dtrace_cas32((void *) &xc->xc_state, XC_WORKING, XC_WORKING) != XC_IDLE) {
-		if (attempts-- <= 0)
-			return 0;
-
-		barrier();
-
-		/***********************************************/
-		/*   Be HT friendly.			       */
-		/***********************************************/
-//		smt_pause();
-
-		cnt_xcall6++;
-		/***********************************************/
-		/*   Keep track of the max.		       */
-		/***********************************************/
-		if (cnt > cnt_xcall5)
-			cnt_xcall5 = cnt;
-
-		/***********************************************/
-		/*   On  my  Dual Core 2.26GHz system, we are  */
-		/*   seeing counters in the range of hundreds  */
-		/*   to  maybe  2,000,000  for  more  extreme  */
-		/*   cases.  (This  is  inside  a VM). During  */
-		/*   debugging,  we  found  problems with the  */
-		/*   two  cores  not  seeing  each  other  --  */
-		/*   possibly because I wasnt doing the right  */
-		/*   things to ensure memory barriers were in  */
-		/*   place.				       */
-		/*   					       */
-		/*   We  dont  want  to  wait forever because  */
-		/*   that  will  crash/hang your machine, but  */
-		/*   we  do  need to give up if its taken far  */
-		/*   too long.				       */
-		/***********************************************/
-//		if (cnt++ == 50 * 1000 * 1000UL) {
-		if (cnt++ == 1 * 1000 * 1000UL) {
-			cnt = 0;
-			cnt_xcall4++;
-
-			if (cnt1 == 0) {
-				/***********************************************/
-				/*   Looks like we are having trouble getting  */
-				/*   the interrupt, so try for an NMI.	       */
-				/***********************************************/
-				cpumask_t mask;
-				cpus_clear(mask);
-				cpu_set(c, mask);
-//				nmi_masks[c] = 1;
-//				send_ipi_interrupt(&mask, 2); //NMI_VECTOR);
-			}
-
-			if (1) {
-//				set_console_on(1);
-				dtrace_printf("ack_wait cpu=%d xcall %staking too long! c=%d [xcall1=%lu]\n", 
-					smp_processor_id(), 
-					cnt1 ? "STILL " : "",
-					c, cnt_xcall1);
-				//dump_stack();
-//				set_console_on(0);
-			}
-
-			if (cnt1++ > 3) {
-				dump_xcalls();
-				dtrace_linux_panic("xcall taking too long");
-				break;
-			}
-		}
-	}
+/*   Record  how  long an xcall took, in power-of-2 nanosecond buckets  */
+/*   (see /proc/dtrace/stats).					      */
+/**********************************************************************/
+static void
+xcall_latency(hrtime_t t)
+{	int	b = 0;
 
-	if (xcall_debug) {
-		dtrace_printf("[%d] ack_wait finished c=%d cnt=%lu (max=%lu)\n", smp_processor_id(), c, cnt, cnt_xcall5);
+	while (t > 1 && b < XCALL_LAT_BUCKETS - 1) {
+		t >>= 1;
+		b++;
 	}
-	return 1;
+	cnt_xcall_lat[b]++;
 }
 /**********************************************************************/
 /*   Linux  version  of  the  cpu  cross call code. We need to avoid  */
@@ -376,9 +317,7 @@ dtrace_xcall1(processorid_t cpu, dtrace_xcall_t func, void *arg)
 		cnt_xcall0++; 
 	}
 	in_xcall = smp_processor_id();
-//int flags = dtrace_interrupt_disable();
 	dtrace_xcall2(cpu, func, arg);
-//dtrace_interrupt_enable(flags);
 	in_xcall = -1;
 }
 void
@@ -386,10 +325,13 @@ dtrace_xcall2(processorid_t cpu, dtrace_xcall_t func, void *arg)
 {	int	c;
 	int	cpu_id = smp_processor_id();
 	int	cpus_todo = 0;
+	int	level;
+	int	slot;
+	unsigned long flags;
+	hrtime_t start;
+	xcall_req_t *xr;
 # if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 24)
 typedef struct cpumask cpumask_t;
-//#define cpu_set(c, mask) cpumask_set_cpu(c, &(mask))
-//#define cpus_clear(mask) cpumask_clear(&mask)
 # endif
 	cpumask_t mask;
 
@@ -406,162 +348,149 @@ typedef struct cpumask cpumask_t;
 	/***********************************************/
 	cnt_xcall1++;
 	if (cpu_id == cpu) {
-		local_irq_disable();
-//dtrace_printf("[%d] sole cnt=%lu\n", smp_processor_id(), cnt_xcall1);
+		local_irq_save(flags);
 		func(arg);
-		local_irq_enable();
+		local_irq_restore(flags);
 		return;
 	}
 
+	start = dtrace_gethrtime();
+	cnt_xcall2++;
+	if ((level = xcall_levels[cpu_id]++) != 0)
+		cnt_xcall3++;
+	if (level >= XC_LEVELS) {
+		/***********************************************/
+		/*   Out  of  slots.  We cannot drop the call  */
+		/*   (the  caller  relies  on  it  having been  */
+		/*   run),  so  wait for the innermost request  */
+		/*   in  flight  to  be  acked by its targets,  */
+		/*   and  reuse  its slot. Its owner, which we  */
+		/*   interrupted, only looks at xr_pending once  */
+		/*   it  gets  control  back, by which time we  */
+		/*   have drained ours too.		       */
+		/***********************************************/
+		if (cnt_xcall_overflow++ < 10)
+			dtrace_printf("[%d] xcall nested %d deep - waiting for a slot\n",
+				cpu_id, level + 1);
+		level = XC_LEVELS - 1;
+	}
+	slot = XC_SLOT(cpu_id, level);
+	xr = &xcall_reqs[slot];
+
 	/***********************************************/
-	/*   Set  up  the  cpu  mask  to  do just the  */
-	/*   relevant cpu.			       */
+	/*   Never   post  into  a  slot  whose  last  */
+	/*   request  hasnt  drained  -  the borrowed  */
+	/*   slot  above, or one whose caller gave up  */
+	/*   on a stuck target. A late ack of the old  */
+	/*   request would be counted against the new  */
+	/*   one.  If  it wont drain, we are shutting  */
+	/*   down anyway.			       */
 	/***********************************************/
-	if (cpu != DTRACE_CPUALL) {
-//dtrace_printf("just me %d %d\n", cpu_id, cpu);
-		cpu = 1 << cpu;
+	if (atomic_read(&xr->xr_pending) != 0 && xcall_wait(xr, start) != 0) {
+		xcall_levels[cpu_id]--;
+		return;
 	}
 
-
-//dtrace_printf("xcall %d f=%p\n", cpu_id, func);
-	cnt_xcall2++;
-	if (xcall_levels[cpu_id]++)
-		cnt_xcall3++;
 	/***********************************************/
-	/*   Set  up  the  rendezvous  with the other  */
-	/*   targetted  cpus.  We use a nearly square  */
-	/*   NCPU*NCPU matrix to allow for any cpu to  */
-	/*   wait  for  any  other. We have two slots  */
-	/*   per  cpu  -  because  we  may  be  in an  */
-	/*   interrupt.				       */
-	/*   					       */
-	/*   The  interrupt  slave  will  service all  */
-	/*   queued  calls  -  sometimes  it  will be  */
-	/*   lucky and see multiple, especially if we  */
-	/*   are heavily loaded.		       */
+	/*   Work  out  who  needs  to  be called. We  */
+	/*   dont  set ourselves - we run it inline -  */
+	/*   and  for  dtrace_sync we can skip a cpu  */
+	/*   which  isnt  in  probe  context, as there  */
+	/*   is nothing to wait for.		       */
 	/***********************************************/
 	cpus_clear(mask);
 	for (c = 0; c < nr_cpus; c++) {
-		struct xcalls *xc = &xcalls[cpu_id][c];
-		unsigned int cnt;
-
-		/***********************************************/
-		/*   Dont  set  ourselves  - we dont want our  */
-		/*   cpu  to  be  taking an IPI interrupt and  */
-		/*   doing   the   work   twice.   We  inline  */
-		/*   ourselves below.			       */
-		/***********************************************/
-		if ((cpu & (1 << c)) == 0 || c == cpu_id) {
+		if (c == cpu_id || (cpu != DTRACE_CPUALL && c != cpu))
 			continue;
-		}
-
-		/***********************************************/
-		/*   Is  this  safe?  We want to avoid an IPI  */
-		/*   call  if the other cpu is idle/not doing  */
-		/*   dtrace  work.  If  thats the case and we  */
-		/*   are  calling  dtrace_sync,  then  we can  */
-		/*   avoid the xcall.			       */
-		/***********************************************/
 		if ((void *) func == (void *) dtrace_sync_func &&
 		    cpu_core[c].cpuc_probe_level == 0) {
-			cpu &= ~(1 << c);
 			cnt_xcall7++;
 			continue;
 		}
-//dtrace_printf("xcall %p\n", func);
-
-		xc->xc_func = func;
-		xc->xc_arg = arg;
-		/***********************************************/
-		/*   Spinlock  in  case  the  interrupt hasnt  */
-		/*   fired.  This  should  be  very rare, and  */
-		/*   when it happens, we would be hanging for  */
-		/*   100m  iterations  (about  1s). We reduce  */
-		/*   the   chance  of  a  hit  by  using  the  */
-		/*   NCPU*NCPU*2 array approach. These things  */
-		/*   happen  when buffers are full or user is  */
-		/*   ^C-ing dtrace.			       */
-		/***********************************************/
-		for (cnt = 0; dtrace_cas32((void *) &xc->xc_state, XC_WORKING, XC_WORKING) == XC_WORKING; cnt++) {
-			/***********************************************/
-			/*   Avoid noise for tiny windows.	       */
-			/***********************************************/
-if(0)
-			if ((cnt == 0 && xcall_debug) || !(xcall_debug && cnt == 50)) {
-				dtrace_printf("[%d] cpu%d in wrong state (state=%d)\n",
-					smp_processor_id(), c, xc->xc_state);
-			}
-//			xcall_slave2();
-			if (cnt == 100 * 1000 * 1000) {
-				dtrace_printf("[%d] cpu%d - busting lock\n",
-					smp_processor_id(), c);
-				break;
-			}
-		}
-		if ((cnt && xcall_debug) || (!xcall_debug && cnt > 50)) {
-			dtrace_printf("[%d] cpu%d in wrong state (state=%d) %u cycles\n",
-				smp_processor_id(), c, xc->xc_state, cnt);
-		}
-		/***********************************************/
-		/*   As  soon  as  we set xc_state and BEFORE  */
-		/*   the  apic  call,  the  cpu  may  see the  */
-		/*   change  since  it  may  be taking an IPI  */
-		/*   interrupt  for  someone else. We need to  */
-		/*   be  careful  with  barriers  (I  think -  */
-		/*   although    the   clflush/wmb   may   be  */
-		/*   redundant).			       */
-		/***********************************************/
-		xc->xc_state = XC_WORKING;
-//		clflush(&xc->xc_state);
-//		smp_wmb();
 		cpu_set(c, mask);
 		cpus_todo++;
 	}
 
-	smp_mb();
+	if (cpus_todo) {
+		local_irq_save(flags);
+		xr->xr_func = func;
+		xr->xr_arg = arg;
+		atomic_set(&xr->xr_pending, cpus_todo);
+		smp_wmb();
 
-	/***********************************************/
-	/*   Now tell the other cpus to do some work.  */
-	/***********************************************/
-	if (cpus_todo)
+		for (c = 0; c < nr_cpus; c++) {
+			if (cpu_isset(c, mask))
+				set_bit(slot, xcall_mbox[c].xm_pending);
+		}
+		smp_mb();
+
+		/***********************************************/
+		/*   One IPI for all of them.		       */
+		/***********************************************/
 		send_ipi_interrupt(&mask, ipi_vector);
+		local_irq_restore(flags);
+	}
 
 	/***********************************************/
 	/*   Check for ourselves.		       */
 	/***********************************************/
-	if (cpu & (1 << cpu_id)) {
+	if (cpu == DTRACE_CPUALL)
 		func(arg);
-	}
 
-	if (xcall_debug)
-		dtrace_printf("[%d] getting ready.... (%ld) mask=%x func=%p\n", smp_processor_id(), cnt_xcall1, *(int *) &mask, func);
+	if (cpus_todo)
+		xcall_wait(xr, start);
+
+	xcall_latency(dtrace_gethrtime() - start);
+	xcall_levels[cpu_id]--;
+}
+/**********************************************************************/
+/*   Wait  for  the  targets  of a request to ack it. Whilst we wait,  */
+/*   service  anyone trying to call us, else two cpus calling each  */
+/*   other  will  deadlock.  We  dont  want  to  wait forever because  */
+/*   that  will  crash/hang  your machine, but we do need to give up  */
+/*   if its taken far too long.					      */
+/*   								      */
+/*   When  we  give  up, we take back the mailbox bits of any target  */
+/*   which  hasnt  picked the request up yet, and its ack with them;  */
+/*   whoever  clears  a  bit  owns  the  decrement.  What is left of  */
+/*   xr_pending  is  targets  actually  running the request, and the  */
+/*   slot  is  not  reused  until  they  finish.  Returns 0 once the  */
+/*   request has drained, -1 if we gave up.			      */
+/**********************************************************************/
+static int
+xcall_wait(xcall_req_t *xr, hrtime_t start)
+{	unsigned long cnt;
+	int	warned = 0;
+	int	slot, c;
+
+	for (cnt = 0; atomic_read(&xr->xr_pending) > 0; cnt++) {
+		xcall_slave2();
+		cpu_relax();
+		cnt_xcall6++;
 
-	/***********************************************/
-	/*   Wait for the cpus we invoked the IPI on.  */
-	/*   Cycle  thru  the  cpus,  to avoid mutual  */
-	/*   deadlock  between one cpu trying to call  */
-	/*   us whilst we are calling them.	       */
-	/***********************************************/
-	while (cpus_todo > 0) {
-		for (c = 0; c < nr_cpus && cpus_todo > 0; c++) {
-			xcall_slave2();
-			if (c == cpu_id || (cpu & (1 << c)) == 0)
-				continue;
+		if ((cnt & 0xffff) != 0 ||
+		    dtrace_gethrtime() - start < (hrtime_t) (warned + 1) * NANOSEC)
+			continue;
 
-			/***********************************************/
-			/*   Wait  a  little  while  for  this cpu to  */
-			/*   respond before going on to the next one.  */
-			/***********************************************/
-			if (ack_wait(c, 100)) {
-				cpus_todo--;
-				cpu &= ~(1 << c);
+		cnt_xcall4++;
+		dtrace_printf("[%d] xcall %staking too long! pending=%d [xcall1=%lu]\n", 
+			smp_processor_id(), 
+			warned ? "STILL " : "",
+			atomic_read(&xr->xr_pending), cnt_xcall1);
+		if (warned++ > 3) {
+			dump_xcalls();
+			dtrace_linux_panic("xcall taking too long");
+			slot = xr - xcall_reqs;
+			for (c = 0; c < nr_cpus; c++) {
+				if (test_and_clear_bit(slot, xcall_mbox[c].xm_pending))
+					atomic_dec(&xr->xr_pending);
 			}
+			return atomic_read(&xr->xr_pending) == 0 ? 0 : -1;
 		}
-break;
 	}
-//	smp_mb();
-
-	xcall_levels[cpu_id]--;
+	if (cnt > cnt_xcall5)
+		cnt_xcall5 = cnt;
+	return 0;
 }
 #endif
 
@@ -570,17 +499,24 @@ break;
 /**********************************************************************/
 static void
 dump_xcalls(void)
-{
-/*
-	int i;
+{	int	i, j;
+
 	for (i = 0; i < nr_cpus; i++) {
-		dtrace_printf("  cpu%d:  state=%d/%s\n", i,
-			xcalls[i].xc_state,
-			xcalls[i].xc_state == XC_IDLE ? "idle" : 
-			xcalls[i].xc_state == XC_WORKING ? "work" : 
-				"??");
+		for (j = 0; j < XC_MBOX_WORDS; j++) {
+			if (xcall_mbox[i].xm_pending[j] == 0)
+				continue;
+			dtrace_printf("  cpu%d: mbox[%d]=%lx\n", i, j,
+				xcall_mbox[i].xm_pending[j]);
+		}
+	}
+	for (i = 0; i < nr_cpus * XC_LEVELS; i++) {
+		if (atomic_read(&xcall_reqs[i].xr_pending) == 0)
+			continue;
+		dtrace_printf("  cpu%d/%d: func=%p pending=%d\n", 
+			i / XC_LEVELS, i % XC_LEVELS,
+			xcall_reqs[i].xr_func, 
+			atomic_read(&xcall_reqs[i].xr_pending));
 	}
-*/
 }
 /**********************************************************************/
 /*   Send interrupt request to target cpus.			      */
@@ -714,20 +650,31 @@ xcall_slave(void)
 }
 void 
 xcall_slave2(void)
-{	int	i;
+{	xcall_mbox_t *xm = &xcall_mbox[smp_processor_id()];
+	xcall_req_t *xr;
+	unsigned long pending;
+	int	i, b;
+
+	if (xcall_mbox == NULL)
+		return;
 
 	/***********************************************/
-	/*   Check  each slot for this cpu - one from  */
-	/*   each  of  the  other  cpus  and  one for  */
-	/*   interrupt mode and non-interrupt mode in  */
-	/*   each cpu.				       */
+	/*   Grab  and  clear  our mailbox, and run a  */
+	/*   request for each bit we found. A caller  */
+	/*   setting a bit after we look will send us  */
+	/*   another IPI.			       */
 	/***********************************************/
-	for (i = 0; i < nr_cpus; i++) {
-		struct xcalls *xc = &xcalls[i][smp_processor_id()];
-		if (xc->xc_state == XC_WORKING) {
-			(*xc->xc_func)(xc->xc_arg);
-			xc->xc_state = XC_IDLE;
+	for (i = 0; i < XC_MBOX_WORDS; i++) {
+		if (xm->xm_pending[i] == 0)
+			continue;
+		pending = xchg(&xm->xm_pending[i], 0);
+		while (pending) {
+			b = __ffs(pending);
+			pending &= ~(1UL << b);
+			xr = &xcall_reqs[i * BITS_PER_LONG + b];
+			(*xr->xr_func)(xr->xr_arg);
+			smp_mb();
+			atomic_dec(&xr->xr_pending);
 		}
 	}
 }
-
@@ -802,6 +802,11 @@ dt_action_stack_args(dtrace_hdl_t *dtp, dtrace_actdesc_t *ap, dt_node_t *arg0)
 
 		ap->dtad_arg = arg0->dn_value;
 	}
+
+#if defined(linux)
+	if (dt_stackid_enabled(dtp))
+		ap->dtad_arg |= DTRACE_STACKID;
+#endif
 }
 
 static void
@@ -864,6 +869,11 @@ dt_action_ustack_args(dtrace_hdl_t *dtp, dtrace_actdesc_t *ap, dt_node_t *dnp)
 	}
 
 	ap->dtad_arg = DTRACE_USTACK_ARG(nframes, strsize);
+
+#if defined(linux)
+	if (dt_stackid_enabled(dtp))
+		ap->dtad_arg |= DTRACE_STACKID;
+#endif
 }
 
 static void
@@ -1047,6 +1057,48 @@ dt_action_test2(dtrace_hdl_t *dtp, dt_node_t *dnp, dtrace_stmtdesc_t *sdp)
 	dtrace_actdesc_t *ap = dt_stmt_action(dtp, sdp);
 	ap->dtad_kind = DTRACEACT_TEST2;
 }
+
+/*
+ * sample() and ratelimit() don't record anything:  they are filters on the
+ * whole ECB, applied in the kernel before the predicate, so their argument
+ * must be known when the enabling is made.
+ */
+static void
+dt_action_sample(dtrace_hdl_t *dtp, dt_node_t *dnp, dtrace_stmtdesc_t *sdp,
+    dtrace_actkind_t kind)
+{
+	const char *name = dnp->dn_ident->di_name;
+	dt_node_t *arg0 = dnp->dn_args;
+	dtrace_actdesc_t *ap;
+
+	/*
+	 * Each action gets a statement of its own, so look at everything the
+	 * clause has added to the ECB description so far.
+	 */
+	for (ap = sdp->dtsd_ecbdesc->dted_action; ap != NULL;
+	    ap = ap->dtad_next) {
+		if (ap->dtad_kind == kind) {
+			dnerror(dnp, D_SAMPLE_DUP, "%s( ) may only be used "
+			    "once per clause\n", name);
+		}
+	}
+
+	if (!dt_node_is_posconst(arg0)) {
+		dnerror(arg0, D_SAMPLE_ARG, "%s( ) argument #1 must be a "
+		    "non-zero positive integer constant\n", name);
+	}
+
+	if (kind == DTRACEACT_RATELIMIT &&
+	    arg0->dn_value > UINT64_MAX / NANOSEC) {
+		dnerror(arg0, D_SAMPLE_ARG, "%s( ) argument #1 must be no "
+		    "more than %llu\n", name, (u_longlong_t)(UINT64_MAX /
+		    NANOSEC));
+	}
+
+	ap = dt_stmt_action(dtp, sdp);
+	ap->dtad_kind = kind;
+	ap->dtad_arg = arg0->dn_value;
+}
 #endif
 
 static void
@@ -1148,6 +1200,12 @@ dt_compile_fun(dtrace_hdl_t *dtp, dt_node_t *dnp, dtrace_stmtdesc_t *sdp)
 	case DT_ACT_TEST2:
 		dt_action_test2(dtp, dnp->dn_expr, sdp);
 		break;
+	case DT_ACT_SAMPLE:
+		dt_action_sample(dtp, dnp->dn_expr, sdp, DTRACEACT_SAMPLE);
+		break;
+	case DT_ACT_RATELIMIT:
+		dt_action_sample(dtp, dnp->dn_expr, sdp, DTRACEACT_RATELIMIT);
+		break;
 #endif
 	default:
 		dnerror(dnp->dn_expr, D_UNKNOWN, "tracing function %s( ) is "
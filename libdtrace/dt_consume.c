@@ -28,6 +28,7 @@
  */
 
 #include <sys/bitmap.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <errno.h>
@@ -942,6 +943,24 @@ raw:
 	return (0);
 }
 
+#if defined(linux)
+/*
+ * Linux:  a stack record made with the "stackidsize" option holds only a
+ * stack ID; this is printed in place of the stack if it was dropped, or if
+ * we cannot get it from the kernel (see dt_stackid_lookup()).
+ */
+static int
+dt_print_stackid_missing(dtrace_hdl_t *dtp, FILE *fp, int indent,
+    uint32_t id)
+{
+	if (id == 0)
+		return (dt_printf(dtp, fp, "%*s<stack dropped>\n", indent, ""));
+
+	return (dt_printf(dtp, fp, "%*s<stack ID %u unavailable>\n",
+	    indent, "", id));
+}
+#endif
+
 int
 dt_print_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
     caddr_t addr, int depth, int size)
@@ -951,6 +970,10 @@ dt_print_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	int i, indent;
 	char c[PATH_MAX * 2];
 	uint64_t pc;
+#if defined(linux)
+	const void *stk;
+	uint32_t stksize;
+#endif
 
 	if (dt_printf(dtp, fp, "\n") < 0)
 		return (-1);
@@ -963,6 +986,20 @@ dt_print_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	else
 		indent = _dtrace_stkindent;
 
+#if defined(linux)
+	if (DTRACE_STACKID_ISSET((uint32_t)depth)) {
+		/* LINTED - alignment */
+		uint32_t id = *((uint32_t *)addr);
+
+		if ((stk = dt_stackid_lookup(dtp, id, &stksize)) == NULL)
+			return (dt_print_stackid_missing(dtp, fp, indent, id));
+
+		addr = (caddr_t)stk;
+		depth = DTRACE_USTACK_NFRAMES((uint32_t)depth);
+		size = stksize / depth;
+	}
+#endif
+
 	for (i = 0; i < depth; i++) {
 		switch (size) {
 		case sizeof (uint32_t):
@@ -1049,11 +1086,25 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	GElf_Sym sym;
 	int i, indent;
 	pid_t pid;
+#if defined(linux)
+	uint32_t stksize;
+#endif
 
 	if (depth == 0)
 		return (0);
 
-	pid = (pid_t)*pc++;
+#if defined(linux)
+	if (DTRACE_STACKID_ISSET(arg)) {
+		/* LINTED - alignment */
+		const void *stk = dt_stackid_lookup(dtp, *((uint32_t *)addr),
+		    &stksize);
+
+		if (stk != NULL) {
+			return (dt_print_ustack(dtp, fp, format, (caddr_t)stk,
+			    arg & ~(uint64_t)DTRACE_STACKID));
+		}
+	}
+#endif
 
 	if (dt_printf(dtp, fp, "\n") < 0)
 		return (-1);
@@ -1066,6 +1117,16 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	else
 		indent = _dtrace_stkindent;
 
+#if defined(linux)
+	if (DTRACE_STACKID_ISSET(arg)) {
+		/* LINTED - alignment */
+		return (dt_print_stackid_missing(dtp, fp, indent,
+		    *((uint32_t *)addr)));
+	}
+#endif
+
+	pid = (pid_t)*pc++;
+
 	/*
 	 * Ultimately, we need to add an entry point in the library vector for
 	 * determining <symbol, offset> from <pid, address>.  For now, if
@@ -2170,6 +2231,173 @@ nextepid:
 	return (dt_handle_cpudrop(dtp, cpu, DTRACEDROP_PRINCIPAL, drops));
 }
 
+/*
+ * Linux: map the principal buffers so that they can be consumed in place.
+ * This is only done for the "switch" and "stream" buffer policies; if the
+ * mapping cannot be made (e.g. an older driver), we quietly fall back to
+ * having the kernel copy each buffer out with DTRACEIOC_BUFSNAP.  For
+ * "stream", each CPU's control page is additionally mapped writable on its
+ * own, so that we can hand space back by advancing the tail.
+ */
+static int
+dt_bufmap_init(dtrace_hdl_t *dtp, int ncpus)
+{
+	dtrace_optval_t size, policy;
+	size_t pgsize = sysconf(_SC_PAGESIZE);
+	size_t stride;
+	void *addr;
+	int i, stream;
+
+	if (dtp->dt_bufmap != NULL)
+		return (0);
+
+	if (dtp->dt_bufmapfail)
+		return (-1);
+
+	(void) dtrace_getopt(dtp, "bufsize", &size);
+	policy = dtp->dt_options[DTRACEOPT_BUFPOLICY];
+	stream = (policy == DTRACEOPT_BUFPOLICY_STREAM);
+
+	if (size <= 0 || (policy != DTRACEOPT_UNSET &&
+	    policy != DTRACEOPT_BUFPOLICY_SWITCH && !stream)) {
+		dtp->dt_bufmapfail = 1;
+		return (-1);
+	}
+
+	stride = P2ROUNDUP((size_t)size, pgsize);
+	dtp->dt_bufmaplen = stride * 2 * ncpus;
+	addr = mmap(NULL, dtp->dt_bufmaplen, PROT_READ, MAP_SHARED,
+	    dtp->dt_fd, 0);
+
+	if (addr == MAP_FAILED) {
+		dt_dprintf("cannot map principal buffers: %s\n",
+		    strerror(errno));
+		dtp->dt_bufmapfail = 1;
+		return (-1);
+	}
+
+	dtp->dt_bufmap = addr;
+
+	if (!stream)
+		return (0);
+
+	if ((dtp->dt_bufctl = calloc(ncpus, sizeof (dtrace_bufctl_t *))) ==
+	    NULL)
+		return (0);
+
+	dtp->dt_bufctlcnt = ncpus;
+
+	for (i = 0; i < ncpus; i++) {
+		/*
+		 * CPUs without a buffer fail here; they are left to
+		 * DTRACEIOC_BUFSNAP, which will say ENOENT.
+		 */
+		addr = mmap(NULL, pgsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    dtp->dt_fd, (off_t)(i * 2 + 1) * stride);
+
+		if (addr != MAP_FAILED)
+			dtp->dt_bufctl[i] = addr;
+	}
+
+	return (0);
+}
+
+/*
+ * Linux: take whatever is new in a "stream" buffer straight from the
+ * mapping, and give the space back to the kernel by advancing the tail.
+ * The records are copied into buf, so that the caller can consume them
+ * exactly as if they had come from DTRACEIOC_BUFSNAP -- in particular,
+ * dt_consume_begin() may go over them twice.
+ */
+static dtrace_bufdesc_t *
+dt_bufstream(dtrace_hdl_t *dtp, dtrace_bufdesc_t *buf)
+{
+	volatile dtrace_bufctl_t *ctl = NULL;
+	size_t stride = dtp->dt_bufmaplen / (2 * dtp->dt_bufctlcnt);
+	caddr_t ring, dst = buf->dtbd_data;
+	uint64_t head, tail, size, offs, len;
+
+	if (buf->dtbd_cpu < dtp->dt_bufctlcnt)
+		ctl = dtp->dt_bufctl[buf->dtbd_cpu];
+
+	if (ctl == NULL) {
+		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1)
+			return (NULL);
+		return (buf);
+	}
+
+	ring = dtp->dt_bufmap + buf->dtbd_cpu * 2 * stride;
+	size = ctl->dtbc_size;
+	head = ctl->dtbc_head;
+	__sync_synchronize();
+	tail = ctl->dtbc_tail;
+
+	if (tail > head || head - tail > size)
+		tail = head - MIN(head, size);
+
+	buf->dtbd_size = head - tail;
+	buf->dtbd_oldest = 0;
+
+	while (tail < head) {
+		offs = tail % size;
+		len = MIN(head - tail, size - offs);
+		bcopy(ring + offs, dst, len);
+		dst += len;
+		tail += len;
+	}
+
+	buf->dtbd_drops = ctl->dtbc_drops - ctl->dtbc_cdrops;
+	buf->dtbd_errors = ctl->dtbc_errors - ctl->dtbc_cerrors;
+	ctl->dtbc_cdrops += buf->dtbd_drops;
+	ctl->dtbc_cerrors += buf->dtbd_errors;
+
+	__sync_synchronize();
+	ctl->dtbc_tail = tail;
+
+	return (buf);
+}
+
+/*
+ * Get the next buffer for buf->dtbd_cpu.  If the principal buffers are
+ * mapped, we just switch them and fill in *view to describe the inactive
+ * buffer in place; otherwise the buffer is copied into buf.  Returns the
+ * descriptor to consume, or NULL (with errno set) on failure.
+ */
+static dtrace_bufdesc_t *
+dt_bufsnap(dtrace_hdl_t *dtp, dtrace_bufdesc_t *buf, dtrace_bufdesc_t *view)
+{
+	dtrace_bufswap_t sw;
+
+	if (dtp->dt_bufctl != NULL)
+		return (dt_bufstream(dtp, buf));
+
+	if (dtp->dt_bufmap == NULL) {
+		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1)
+			return (NULL);
+		return (buf);
+	}
+
+	bzero(&sw, sizeof (sw));
+	sw.dtbs_cpu = buf->dtbd_cpu;
+
+	if (dt_ioctl(dtp, DTRACEIOC_BUFSWAP, &sw) == -1)
+		return (NULL);
+
+	if (sw.dtbs_offset + sw.dtbs_size > dtp->dt_bufmaplen) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	view->dtbd_cpu = sw.dtbs_cpu;
+	view->dtbd_size = sw.dtbs_size;
+	view->dtbd_drops = sw.dtbs_drops;
+	view->dtbd_errors = sw.dtbs_errors;
+	view->dtbd_oldest = 0;
+	view->dtbd_data = dtp->dt_bufmap + sw.dtbs_offset;
+
+	return (view);
+}
+
 typedef struct dt_begin {
 	dtrace_consume_probe_f *dtbgn_probefunc;
 	dtrace_consume_rec_f *dtbgn_recfunc;
@@ -2259,14 +2487,14 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 	 */
 	dt_begin_t begin;
 	processorid_t cpu = dtp->dt_beganon;
-	dtrace_bufdesc_t nbuf;
+	dtrace_bufdesc_t nbuf, view, nview, *snap, *nsnap;
 	int rval, i;
 	static int max_ncpus;
 	dtrace_optval_t size;
 
 	dtp->dt_beganon = -1;
 
-	if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
+	if ((snap = dt_bufsnap(dtp, buf, &view)) == NULL) {
 		/*
 		 * We really don't expect this to fail, but it is at least
 		 * technically possible for this to fail with ENOENT.  In this
@@ -2278,13 +2506,13 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 		return (dt_set_errno(dtp, errno));
 	}
 
-	if (!dtp->dt_stopped || buf->dtbd_cpu != dtp->dt_endedon) {
+	if (!dtp->dt_stopped || snap->dtbd_cpu != dtp->dt_endedon) {
 		/*
 		 * This is the simple case.  We're either not stopped, or if
 		 * we are, we actually processed any END probes on another
 		 * CPU.  We can simply consume this buffer and return.
 		 */
-		return (dt_consume_cpu(dtp, fp, cpu, buf, pf, rf, arg));
+		return (dt_consume_cpu(dtp, fp, cpu, snap, pf, rf, arg));
 	}
 
 	begin.dtbgn_probefunc = pf;
@@ -2301,7 +2529,7 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 	dtp->dt_errhdlr = dt_consume_begin_error;
 	dtp->dt_errarg = &begin;
 
-	rval = dt_consume_cpu(dtp, fp, cpu, buf, dt_consume_begin_probe,
+	rval = dt_consume_cpu(dtp, fp, cpu, snap, dt_consume_begin_probe,
 	    dt_consume_begin_record, &begin);
 
 	dtp->dt_errhdlr = begin.dtbgn_errhdlr;
@@ -2328,7 +2556,7 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 		if (i == cpu)
 			continue;
 
-		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, &nbuf) == -1) {
+		if ((nsnap = dt_bufsnap(dtp, &nbuf, &nview)) == NULL) {
 			/*
 			 * If we failed with ENOENT, it may be because the
 			 * CPU was unconfigured -- this is okay.  Any other
@@ -2343,7 +2571,7 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 		}
 
 		if ((rval = dt_consume_cpu(dtp, fp,
-		    i, &nbuf, pf, rf, arg)) != 0) {
+		    i, nsnap, pf, rf, arg)) != 0) {
 			free(nbuf.dtbd_data);
 			return (rval);
 		}
@@ -2365,7 +2593,7 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 	dtp->dt_errhdlr = dt_consume_begin_error;
 	dtp->dt_errarg = &begin;
 
-	rval = dt_consume_cpu(dtp, fp, cpu, buf, dt_consume_begin_probe,
+	rval = dt_consume_cpu(dtp, fp, cpu, snap, dt_consume_begin_probe,
 	    dt_consume_begin_record, &begin);
 
 	dtp->dt_errhdlr = begin.dtbgn_errhdlr;
@@ -2379,13 +2607,21 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
     dtrace_consume_probe_f *pf, dtrace_consume_rec_f *rf, void *arg)
 {
 	dtrace_bufdesc_t *buf = &dtp->dt_buf;
+	dtrace_bufdesc_t view, *snap;
 	dtrace_optval_t size;
 	static int max_ncpus;
 	int i, rval;
 	dtrace_optval_t interval = dtp->dt_options[DTRACEOPT_SWITCHRATE];
 	hrtime_t now = gethrtime();
 
-	if (dtp->dt_lastswitch != 0) {
+	if (dtp->dt_bufwake) {
+		/*
+		 * A buffer passed its watermark; switch now rather than
+		 * waiting out the rest of the switchrate interval.
+		 */
+		dtp->dt_bufwake = 0;
+		dtp->dt_lastswitch = now;
+	} else if (dtp->dt_lastswitch != 0) {
 		if (now - dtp->dt_lastswitch < interval)
 			return (0);
 
@@ -2414,6 +2650,8 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 		buf->dtbd_size = size;
 	}
 
+	(void) dt_bufmap_init(dtp, max_ncpus);
+
 	/*
 	 * If we have just begun, we want to first process the CPU that
 	 * executed the BEGIN probe (if any).
@@ -2435,7 +2673,7 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 		if (dtp->dt_stopped && (i == dtp->dt_endedon))
 			continue;
 
-		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
+		if ((snap = dt_bufsnap(dtp, buf, &view)) == NULL) {
 			/*
 			 * If we failed with ENOENT, it may be because the
 			 * CPU was unconfigured -- this is okay.  Any other
@@ -2447,7 +2685,7 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 			return (dt_set_errno(dtp, errno));
 		}
 
-		if ((rval = dt_consume_cpu(dtp, fp, i, buf, pf, rf, arg)) != 0)
+		if ((rval = dt_consume_cpu(dtp, fp, i, snap, pf, rf, arg)) != 0)
 			return (rval);
 	}
 
@@ -2456,7 +2694,7 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 
 	buf->dtbd_cpu = dtp->dt_endedon;
 
-	if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
+	if ((snap = dt_bufsnap(dtp, buf, &view)) == NULL) {
 		/*
 		 * This _really_ shouldn't fail, but it is strictly speaking
 		 * possible for this to return ENOENT if the CPU that called
@@ -2472,5 +2710,5 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 		return (dt_set_errno(dtp, errno));
 	}
 
-	return (dt_consume_cpu(dtp, fp, dtp->dt_endedon, buf, pf, rf, arg));
+	return (dt_consume_cpu(dtp, fp, dtp->dt_endedon, snap, pf, rf, arg));
 }
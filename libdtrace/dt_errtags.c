@@ -224,6 +224,8 @@ static const char *const _dt_errtags[] = {
 	"D_LLQUANT_FACTOREVEN",		/* llquantize() bad # steps/factor */
 	"D_LLQUANT_FACTORSMALL",		/* llquantize() magnitude too small */
 	"D_LLQUANT_MAGTOOBIG",		/* llquantize() high mag too large */
+	"D_SAMPLE_ARG",			/* sample()/ratelimit() bad argument */
+	"D_SAMPLE_DUP",			/* sample()/ratelimit() repeated */
 };
 
 static const int _dt_ntag = sizeof (_dt_errtags) / sizeof (_dt_errtags[0]);
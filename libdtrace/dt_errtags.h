@@ -259,7 +259,9 @@ typedef enum {
 	D_LLQUANT_FACTORNSTEPS,		/* llquantize() # steps < factor */
 	D_LLQUANT_FACTOREVEN,		/* llquantize() bad # steps/factor */
 	D_LLQUANT_FACTORSMALL,		/* llquantize() magnitude too small */
-	D_LLQUANT_MAGTOOBIG		/* llquantize() high mag too large */
+	D_LLQUANT_MAGTOOBIG,		/* llquantize() high mag too large */
+	D_SAMPLE_ARG,			/* sample()/ratelimit() bad argument */
+	D_SAMPLE_DUP			/* sample()/ratelimit() repeated */
 } dt_errtag_t;
 
 extern const char *dt_errtag(dt_errtag_t);
@@ -290,6 +290,8 @@ static const struct {
 	{ DROPTAG(DTRACEDROP_SPECUNAVAIL) },
 	{ DROPTAG(DTRACEDROP_DBLERROR) },
 	{ DROPTAG(DTRACEDROP_STKSTROVERFLOW) },
+	{ DROPTAG(DTRACEDROP_TLS) },
+	{ DROPTAG(DTRACEDROP_STACKID) },
 	{ 0, NULL }
 };
 
@@ -383,6 +385,14 @@ static const struct {
 	    offsetof(dtrace_status_t, dtst_dblerrors),
 	    "error", " in ERROR probe enabling" },
 
+	{ DTRACEDROP_TLS,
+	    offsetof(dtrace_status_t, dtst_tlsdrops),
+	    "thread-local variable drop" },
+
+	{ DTRACEDROP_STACKID,
+	    offsetof(dtrace_status_t, dtst_stackiddrops),
+	    "stack ID table drop" },
+
 	{ 0, 0, NULL }
 };
 
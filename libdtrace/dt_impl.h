@@ -243,8 +243,19 @@ struct dtrace_hdl {
 	void **dt_formats;	/* pointer to format array */
 	int dt_maxstrdata;	/* max strdata ID */
 	char **dt_strdata;	/* pointer to strdata array */
+#if defined(linux)
+	char *dt_stackids;	/* copy of the kernel's stack ID table */
+	uint64_t dt_stackidlen;	/* bytes of stack ID table copied */
+	uint64_t dt_stackidsize; /* size of dt_stackids */
+#endif
 	dt_aggregate_t dt_aggregate; /* aggregate */
 	dtrace_bufdesc_t dt_buf; /* staging buffer */
+	caddr_t dt_bufmap;	/* mmap(2) of principal buffers, if any */
+	size_t dt_bufmaplen;	/* length of dt_bufmap mapping */
+	uint_t dt_bufmapfail;	/* boolean:  buffers cannot be mapped */
+	uint_t dt_bufwake;	/* boolean:  buffer watermark was reached */
+	dtrace_bufctl_t **dt_bufctl; /* "stream" control pages, per CPU */
+	int dt_bufctlcnt;	/* number of entries in dt_bufctl */
 	struct dt_pfdict *dt_pfdict; /* dictionary of printf conversions */
 	dt_version_t dt_vmax;	/* optional ceiling on program API binding */
 	dtrace_attribute_t dt_amin; /* optional floor on program attributes */
@@ -276,6 +287,10 @@ struct dtrace_hdl {
 	int dt_fd;		/* file descriptor for dtrace pseudo-device */
 	int dt_ftfd;		/* file descriptor for fasttrap pseudo-device */
 	int dt_fterr;		/* saved errno from failed open of dt_ftfd */
+#if defined(linux)
+	struct dt_pid_batch *dt_ftbatch; /* pid probe specs waiting to go in */
+	int dt_ftnobatch;	/* fasttrap lacks FASTTRAPIOC_MAKEPROBES */
+#endif
 	int dt_cdefs_fd;	/* file descriptor for C CTF debugging cache */
 	int dt_ddefs_fd;	/* file descriptor for D CTF debugging cache */
 	int dt_stdout_fd;	/* file descriptor for saved stdout */
@@ -425,6 +440,8 @@ struct dtrace_hdl {
 # if linux
 #define	DT_ACT_TEST1		DT_ACT(30)	/* experimental action */
 #define	DT_ACT_TEST2		DT_ACT(31)	/* experimental action */
+#define	DT_ACT_SAMPLE		DT_ACT(32)	/* sample() action */
+#define	DT_ACT_RATELIMIT	DT_ACT(33)	/* ratelimit() action */
 # endif
 
 /*
@@ -619,6 +636,11 @@ extern void dt_format_destroy(dtrace_hdl_t *);
 
 extern const char *dt_strdata_lookup(dtrace_hdl_t *, int);
 extern void dt_strdata_destroy(dtrace_hdl_t *);
+#if defined(linux)
+extern int dt_stackid_enabled(dtrace_hdl_t *);
+extern const void *dt_stackid_lookup(dtrace_hdl_t *, uint32_t, uint32_t *);
+extern void dt_stackid_destroy(dtrace_hdl_t *);
+#endif
 
 extern int dt_print_quantize(dtrace_hdl_t *, FILE *,
     const void *, size_t, uint64_t);
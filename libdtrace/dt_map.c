@@ -474,3 +474,84 @@ dt_strdata_destroy(dtrace_hdl_t *dtp)
 	free(dtp->dt_strdata);
 	dtp->dt_strdata = NULL;
 }
+
+#if defined(linux)
+int
+dt_stackid_enabled(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t size = dtp->dt_options[DTRACEOPT_STACKIDSIZE];
+
+	return (size != DTRACEOPT_UNSET && size != 0);
+}
+
+/*
+ * Return the stack that a stack ID stands for, and its size.  We keep a copy
+ * of the kernel's stack table, and as it is only ever appended to, we need
+ * only ask for the part we haven't seen when we meet an ID beyond it.
+ */
+const void *
+dt_stackid_lookup(dtrace_hdl_t *dtp, uint32_t id, uint32_t *sizep)
+{
+	dtrace_stackids_t si;
+	dtrace_stackent_t *ent;
+	uint64_t offs, size;
+	int grown = 0;
+	char *buf;
+
+	if (id == 0)
+		return (NULL);
+
+	offs = DTRACE_STACKID_OFFSET(id);
+
+	while (offs >= dtp->dt_stackidlen) {
+		si.dtsi_offset = dtp->dt_stackidlen;
+		si.dtsi_size = dtp->dt_stackidsize - dtp->dt_stackidlen;
+		si.dtsi_buf = (uintptr_t)(dtp->dt_stackids + dtp->dt_stackidlen);
+
+		if (dt_ioctl(dtp, DTRACEIOC_STACKIDS, &si) == -1)
+			return (NULL);
+
+		if (si.dtsi_offset > dtp->dt_stackidlen) {
+			dtp->dt_stackidlen = si.dtsi_offset;
+			continue;
+		}
+
+		/*
+		 * We got nothing.  If we had room for the whole table, the
+		 * entry isn't complete yet (or the ID is bogus); otherwise,
+		 * make room for the whole table and try again.
+		 */
+		if (grown || si.dtsi_total <= dtp->dt_stackidsize)
+			return (NULL);
+
+		size = MAX(si.dtsi_total, dtp->dt_stackidsize * 2);
+
+		if ((buf = realloc(dtp->dt_stackids, size)) == NULL)
+			return (NULL);
+
+		dtp->dt_stackids = buf;
+		dtp->dt_stackidsize = size;
+		grown = 1;
+	}
+
+	/* LINTED - alignment */
+	ent = (dtrace_stackent_t *)(dtp->dt_stackids + offs);
+
+	if (offs + DTRACE_STACKENT_SIZE(ent->dse_size) > dtp->dt_stackidlen ||
+	    !(ent->dse_flags & DTRACE_STACKENT_READY) ||
+	    (ent->dse_flags & DTRACE_STACKENT_DEAD))
+		return (NULL);
+
+	*sizep = ent->dse_size;
+	return (ent + 1);
+}
+
+void
+dt_stackid_destroy(dtrace_hdl_t *dtp)
+{
+	free(dtp->dt_stackids);
+	dtp->dt_stackids = NULL;
+	dtp->dt_stackidlen = 0;
+	dtp->dt_stackidsize = 0;
+}
+#endif
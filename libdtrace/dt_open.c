@@ -29,6 +29,7 @@
 #include <sys/modctl.h>
 #include <sys/systeminfo.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 
 #include <libelf.h>
 #include <strings.h>
@@ -309,6 +310,10 @@ static const dt_ident_t _dtrace_globals[] = {
 { "normalize", DT_IDENT_ACTFUNC, 0, DT_ACT_NORMALIZE, DT_ATTR_STABCMN,
 	DT_VERS_1_0, &dt_idops_func, "void(...)" },
 #if linux
+{ "ratelimit", DT_IDENT_ACTFUNC, 0, DT_ACT_RATELIMIT, DT_ATTR_EVOLCMN,
+	DT_VERS_1_0, &dt_idops_func, "void(uint64_t)" },
+{ "sample", DT_IDENT_ACTFUNC, 0, DT_ACT_SAMPLE, DT_ATTR_EVOLCMN,
+	DT_VERS_1_0, &dt_idops_func, "void(uint64_t)" },
 { "test1", DT_IDENT_ACTFUNC, 0, DT_ACT_TEST1, DT_ATTR_STABCMN, DT_VERS_1_0,
 	&dt_idops_func, "uint64_t(uint64_t)" },
 { "test2", DT_IDENT_ACTFUNC, 0, DT_ACT_TEST2, DT_ATTR_STABCMN, DT_VERS_1_0,
@@ -1414,6 +1419,16 @@ dtrace_close(dtrace_hdl_t *dtp)
 	while ((pvp = dt_list_next(&dtp->dt_provlist)) != NULL)
 		dt_provider_destroy(dtp, pvp);
 
+	if (dtp->dt_bufmap != NULL)
+		(void) munmap(dtp->dt_bufmap, dtp->dt_bufmaplen);
+	if (dtp->dt_bufctl != NULL) {
+		for (i = 0; i < dtp->dt_bufctlcnt; i++) {
+			if (dtp->dt_bufctl[i] != NULL)
+				(void) munmap(dtp->dt_bufctl[i],
+				    sysconf(_SC_PAGESIZE));
+		}
+		free(dtp->dt_bufctl);
+	}
 	if (dtp->dt_fd != -1)
 		(void) close(dtp->dt_fd);
 	if (dtp->dt_ftfd != -1)
@@ -1429,6 +1444,9 @@ dtrace_close(dtrace_hdl_t *dtp)
 	dt_aggid_destroy(dtp);
 	dt_format_destroy(dtp);
 	dt_strdata_destroy(dtp);
+#if defined(linux)
+	dt_stackid_destroy(dtp);
+#endif
 	dt_buffered_destroy(dtp);
 	dt_aggregate_destroy(dtp);
 	free(dtp->dt_buf.dtbd_data);
@@ -613,6 +613,37 @@ dt_opt_size(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 	return (0);
 }
 
+#if defined(linux)
+/*
+ * The buffer watermark is a percentage of the principal buffer size, and
+ * may optionally be given with a trailing '%'.
+ */
+/*ARGSUSED*/
+static int
+dt_opt_watermark(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	char *end;
+	dtrace_optval_t val;
+
+	if (arg == NULL || arg[0] == '\0') {
+		dtp->dt_options[option] = DTRACEOPT_UNSET;
+		return (0);
+	}
+
+	errno = 0;
+	val = strtoull(arg, &end, 0);
+
+	if (*end == '%')
+		end++;
+
+	if (*end != '\0' || errno != 0 || val < 0 || val > 100)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	dtp->dt_options[option] = val;
+	return (0);
+}
+
+#endif
 static int
 dt_opt_rate(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 {
@@ -718,6 +749,9 @@ static const struct {
 	{ "ring", DTRACEOPT_BUFPOLICY_RING },
 	{ "fill", DTRACEOPT_BUFPOLICY_FILL },
 	{ "switch", DTRACEOPT_BUFPOLICY_SWITCH },
+#if defined(linux)
+	{ "stream", DTRACEOPT_BUFPOLICY_STREAM },
+#endif
 	{ NULL, 0 }
 };
 
@@ -923,15 +957,27 @@ static const dt_option_t _dtrace_rtoptions[] = {
 	{ "bufsize", dt_opt_size, DTRACEOPT_BUFSIZE },
 	{ "bufpolicy", dt_opt_bufpolicy, DTRACEOPT_BUFPOLICY },
 	{ "bufresize", dt_opt_bufresize, DTRACEOPT_BUFRESIZE },
+#if defined(linux)
+	{ "bufwatermark", dt_opt_watermark, DTRACEOPT_BUFWATERMARK },
+#endif
 	{ "cleanrate", dt_opt_rate, DTRACEOPT_CLEANRATE },
 	{ "cpu", dt_opt_runtime, DTRACEOPT_CPU },
 	{ "destructive", dt_opt_runtime, DTRACEOPT_DESTRUCTIVE },
+#if defined(linux)
+	{ "difjit", dt_opt_runtime, DTRACEOPT_DIFJIT },
+#endif
 	{ "dynvarsize", dt_opt_size, DTRACEOPT_DYNVARSIZE },
 	{ "grabanon", dt_opt_runtime, DTRACEOPT_GRABANON },
 	{ "jstackframes", dt_opt_runtime, DTRACEOPT_JSTACKFRAMES },
 	{ "jstackstrsize", dt_opt_size, DTRACEOPT_JSTACKSTRSIZE },
 	{ "nspec", dt_opt_runtime, DTRACEOPT_NSPEC },
+#if defined(linux)
+	{ "overhead", dt_opt_runtime, DTRACEOPT_OVERHEAD },
+#endif
 	{ "specsize", dt_opt_size, DTRACEOPT_SPECSIZE },
+#if defined(linux)
+	{ "stackidsize", dt_opt_size, DTRACEOPT_STACKIDSIZE },
+#endif
 	{ "statusrate", dt_opt_rate, DTRACEOPT_STATUSRATE },
 	{ "strsize", dt_opt_strsize, DTRACEOPT_STRSIZE },
 	{ "ustackframes", dt_opt_runtime, DTRACEOPT_USTACKFRAMES },
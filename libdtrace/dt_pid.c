@@ -99,6 +99,187 @@ dt_pid_error(dtrace_hdl_t *dtp, dt_pcb_t *pcb, dt_proc_t *dpr,
 	return (1);
 }
 
+#if defined(linux)
+/*
+ * Rather than one FASTTRAPIOC_MAKEPROBE ioctl per function (and so one trip
+ * through the provider lookup and locks per function), the probe specs for
+ * a whole module are queued up here and handed to the driver in a single
+ * FASTTRAPIOC_MAKEPROBES. The batch is flushed early if it gets large.
+ */
+#define	DT_PID_BATCH_MAX	(4 * 1024 * 1024)
+
+typedef struct dt_pid_batch {
+	fasttrap_probe_batch_t *dpb_hdr; /* header, then the packed specs */
+	size_t dpb_size;		/* bytes allocated at dpb_hdr */
+	size_t dpb_len;			/* bytes used, including the header */
+	char dpb_errfunc[DTRACE_FUNCNAMELEN]; /* function of failed spec */
+} dt_pid_batch_t;
+
+static int
+dt_pid_batch_flush(dtrace_hdl_t *dtp)
+{
+	dt_pid_batch_t *dpb = dtp->dt_ftbatch;
+	fasttrap_probe_batch_t *hdr = dpb->dpb_hdr;
+	fasttrap_probe_spec_t *ftp = (fasttrap_probe_spec_t *)(hdr + 1);
+	uint_t i;
+	int err;
+
+	if (hdr->ftpb_nspecs == 0)
+		return (0);
+
+	hdr->ftpb_size = dpb->dpb_len - sizeof (*hdr);
+	hdr->ftpb_ndone = UINT32_MAX;
+
+	dt_dprintf("creating %u pid probes in one batch (%lu bytes)\n",
+	    hdr->ftpb_nspecs, (ulong_t)hdr->ftpb_size);
+
+	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBES, hdr) == 0) {
+		hdr->ftpb_nspecs = 0;
+		dpb->dpb_len = sizeof (*hdr);
+		return (0);
+	}
+	err = errno;
+
+	if (hdr->ftpb_ndone != UINT32_MAX) {
+		/*
+		 * The driver got as far as spec ftpb_ndone.
+		 */
+		for (i = 0; i < hdr->ftpb_ndone && i < hdr->ftpb_nspecs; i++) {
+			ftp = (void *)((char *)ftp +
+			    FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs));
+		}
+	} else {
+		/*
+		 * An older driver which does not know the batched ioctl: put
+		 * the specs in one at a time, and stop trying to batch.
+		 */
+		dt_dprintf("FASTTRAPIOC_MAKEPROBES not supported\n");
+		dtp->dt_ftnobatch = 1;
+		for (i = 0, err = 0; i < hdr->ftpb_nspecs; i++) {
+			if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE,
+			    ftp) != 0) {
+				err = errno;
+				break;
+			}
+			ftp = (void *)((char *)ftp +
+			    FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs));
+		}
+	}
+
+	if (err != 0) {
+		(void) strncpy(dpb->dpb_errfunc, i < hdr->ftpb_nspecs ?
+		    ftp->ftps_func : "", sizeof (dpb->dpb_errfunc));
+		dpb->dpb_errfunc[sizeof (dpb->dpb_errfunc) - 1] = '\0';
+	}
+	hdr->ftpb_nspecs = 0;
+	dpb->dpb_len = sizeof (*hdr);
+
+	if (err != 0) {
+		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
+		    strerror(err));
+		return (dt_set_errno(dtp, err));
+	}
+
+	return (0);
+}
+
+static void
+dt_pid_batch_begin(dtrace_hdl_t *dtp, pid_t pid)
+{
+	dt_pid_batch_t *dpb;
+
+	if (dtp->dt_ftnobatch || dtp->dt_ftbatch != NULL)
+		return;
+
+	/*
+	 * If we can't get the memory, we just don't batch.
+	 */
+	if ((dpb = dt_zalloc(dtp, sizeof (dt_pid_batch_t))) == NULL)
+		return;
+
+	dpb->dpb_size = 64 * 1024;
+	if ((dpb->dpb_hdr = dt_zalloc(dtp, dpb->dpb_size)) == NULL) {
+		dt_free(dtp, dpb);
+		return;
+	}
+
+	dpb->dpb_hdr->ftpb_pid = pid;
+	dpb->dpb_len = sizeof (fasttrap_probe_batch_t);
+	dtp->dt_ftbatch = dpb;
+}
+
+/*
+ * Send anything left in the batch and tear it down. On failure, the name of
+ * the function whose probe could not be created is copied to errfunc.
+ */
+static int
+dt_pid_batch_end(dtrace_hdl_t *dtp, char *errfunc, size_t len)
+{
+	dt_pid_batch_t *dpb = dtp->dt_ftbatch;
+	int ret;
+
+	if (dpb == NULL)
+		return (0);
+
+	if ((ret = dt_pid_batch_flush(dtp)) != 0) {
+		(void) strncpy(errfunc, dpb->dpb_errfunc, len);
+		errfunc[len - 1] = '\0';
+	}
+
+	dtp->dt_ftbatch = NULL;
+	dt_free(dtp, dpb->dpb_hdr);
+	dt_free(dtp, dpb);
+
+	return (ret);
+}
+#endif
+
+/*
+ * Create the probe(s) described by ftp: called from the ISA-specific
+ * dt_pid_create_*_probe() functions once they have worked out the offsets.
+ * The spec is copied if it is being batched, so the caller can reuse it.
+ */
+int
+dt_pid_makeprobe(dtrace_hdl_t *dtp, fasttrap_probe_spec_t *ftp)
+{
+#if defined(linux)
+	dt_pid_batch_t *dpb = dtp->dt_ftbatch;
+	size_t sz = FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs);
+
+	if (dpb != NULL && sz <= DT_PID_BATCH_MAX) {
+		if (dpb->dpb_len + sz > DT_PID_BATCH_MAX &&
+		    dt_pid_batch_flush(dtp) != 0)
+			return (-1);
+
+		if (dpb->dpb_len + sz > dpb->dpb_size) {
+			size_t nsize = dpb->dpb_size * 2;
+			void *nhdr;
+
+			while (nsize < dpb->dpb_len + sz)
+				nsize *= 2;
+			if ((nhdr = dt_alloc(dtp, nsize)) == NULL)
+				return (-1);
+			bcopy(dpb->dpb_hdr, nhdr, dpb->dpb_len);
+			dt_free(dtp, dpb->dpb_hdr);
+			dpb->dpb_hdr = nhdr;
+			dpb->dpb_size = nsize;
+		}
+
+		bcopy(ftp, (char *)dpb->dpb_hdr + dpb->dpb_len, sz);
+		dpb->dpb_len += sz;
+		dpb->dpb_hdr->ftpb_nspecs++;
+		return (0);
+	}
+#endif
+	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
+		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
+		    strerror(errno));
+		return (dt_set_errno(dtp, errno));
+	}
+
+	return (0);
+}
+
 static int
 dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 {
@@ -243,7 +424,7 @@ dt_pid_sym_filt(void *arg, const GElf_Sym *symp, const char *func)
 }
 
 static int
-dt_pid_per_mod(void *arg, const prmap_t *pmp, const char *obj)
+dt_pid_per_mod_syms(void *arg, const prmap_t *pmp, const char *obj)
 {
 	dt_pid_probe_t *pp = arg;
 	dtrace_hdl_t *dtp = pp->dpp_dtp;
@@ -251,9 +432,6 @@ dt_pid_per_mod(void *arg, const prmap_t *pmp, const char *obj)
 	dt_proc_t *dpr = pp->dpp_dpr;
 	GElf_Sym sym;
 
-	if (obj == NULL)
-		return (0);
-
 	(void) Plmid(pp->dpp_pr, pmp->pr_vaddr, &pp->dpp_lmid);
 
 	if ((pp->dpp_obj = strrchr(obj, '/')) == NULL)
@@ -375,6 +553,41 @@ dt_pid_per_mod(void *arg, const prmap_t *pmp, const char *obj)
 	return (0);
 }
 
+static int
+dt_pid_per_mod(void *arg, const prmap_t *pmp, const char *obj)
+{
+	dt_pid_probe_t *pp = arg;
+	int ret;
+#if defined(linux)
+	char func[DTRACE_FUNCNAMELEN];
+#endif
+
+	if (obj == NULL)
+		return (0);
+
+#if defined(linux)
+	dt_pid_batch_begin(pp->dpp_dtp, Pstatus(pp->dpp_pr)->pr_pid);
+#endif
+
+	ret = dt_pid_per_mod_syms(arg, pmp, obj);
+
+#if defined(linux)
+	/*
+	 * Probes queued before any error still go in, as they would have
+	 * done without batching, but the first error is the one reported.
+	 */
+	if (dt_pid_batch_end(pp->dpp_dtp, func, sizeof (func)) != 0 &&
+	    ret == 0) {
+		ret = dt_pid_error(pp->dpp_dtp, pp->dpp_pcb, pp->dpp_dpr,
+		    NULL, D_PROC_CREATEFAIL, "failed to create probes "
+		    "for '%s': %s", func,
+		    dtrace_errmsg(pp->dpp_dtp, dtrace_errno(pp->dpp_dtp)));
+	}
+#endif
+
+	return (ret);
+}
+
 static int
 dt_pid_mod_filt(void *arg, const prmap_t *pmp, const char *obj)
 {
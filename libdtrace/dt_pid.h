@@ -57,6 +57,8 @@ extern int dt_pid_create_offset_probe(struct ps_prochandle *, dtrace_hdl_t *,
 extern int dt_pid_create_glob_offset_probes(struct ps_prochandle *,
     dtrace_hdl_t *, fasttrap_probe_spec_t *, const GElf_Sym *, const char *);
 
+extern int dt_pid_makeprobe(dtrace_hdl_t *, fasttrap_probe_spec_t *);
+
 #ifdef	__cplusplus
 }
 #endif
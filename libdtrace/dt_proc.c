@@ -84,6 +84,8 @@
 #include <signal.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <dt_proc.h>
 #include <dt_pid.h>
@@ -222,6 +224,10 @@ dt_proc_notify(dtrace_hdl_t *dtp, dt_proc_hash_t *dph, dt_proc_t *dpr,
 
 //printf("%s pid=%d\n", __func__, Pstatus(dpr->dpr_proc)->pr_pid);
 		(void) pthread_cond_broadcast(&dph->dph_cv);
+#if defined(linux)
+		if (dph->dph_pipe[1] != -1)
+			(void) write(dph->dph_pipe[1], "", 1);
+#endif
 		(void) pthread_mutex_unlock(&dph->dph_lock);
 	}
 }
@@ -290,6 +296,9 @@ dt_proc_rdevent(dtrace_hdl_t *dtp, dt_proc_t *dpr, const char *evname)
 		if (dt_pid_create_probes_module(dtp, dpr) != 0)
 			dt_proc_notify(dtp, dtp->dt_procs, dpr,
 			    dpr->dpr_errmsg);
+#if defined(linux) && defined(__amd64)
+		dt_unwind_update(dtp, dpr);
+#endif
 
 		break;
 	case RD_PREINIT:
@@ -298,6 +307,9 @@ dt_proc_rdevent(dtrace_hdl_t *dtp, dt_proc_t *dpr, const char *evname)
 		break;
 	case RD_POSTINIT:
 		Pupdate_syms(dpr->dpr_proc);
+#if defined(linux) && defined(__amd64)
+		dt_unwind_update(dtp, dpr);
+#endif
 		dt_proc_stop(dpr, DT_PROC_STOP_POSTINIT);
 		break;
 	}
@@ -1045,6 +1057,15 @@ dt_proc_grab(dtrace_hdl_t *dtp, pid_t pid, int flags, int nomonitor)
 	dt_dprintf("grabbed pid %d\n", (int)pid);
 	dpr->dpr_refs++;
 
+#if defined(linux) && defined(__amd64)
+	/*
+	 * The process is already running, so we won't see it load the
+	 * objects it has now: register an unwind table for them here.
+	 */
+	if (!nomonitor && !(flags & PGRAB_RDONLY))
+		dt_unwind_update(dtp, dpr);
+#endif
+
 	return (dpr->dpr_proc);
 }
 
@@ -1102,6 +1123,26 @@ dt_proc_hash_create(dtrace_hdl_t *dtp)
 		(void) pthread_mutex_init(&dtp->dt_procs->dph_lock, NULL);
 		(void) pthread_cond_init(&dtp->dt_procs->dph_cv, NULL);
 
+#if defined(linux)
+		/*
+		 * dtrace_sleep() may be waiting in poll() on the dtrace
+		 * device rather than on dph_cv; give it something to poll.
+		 */
+		if (pipe(dtp->dt_procs->dph_pipe) == 0) {
+			(void) fcntl(dtp->dt_procs->dph_pipe[0], F_SETFL,
+			    O_NONBLOCK);
+			(void) fcntl(dtp->dt_procs->dph_pipe[1], F_SETFL,
+			    O_NONBLOCK);
+			(void) fcntl(dtp->dt_procs->dph_pipe[0], F_SETFD,
+			    FD_CLOEXEC);
+			(void) fcntl(dtp->dt_procs->dph_pipe[1], F_SETFD,
+			    FD_CLOEXEC);
+		} else {
+			dtp->dt_procs->dph_pipe[0] = -1;
+			dtp->dt_procs->dph_pipe[1] = -1;
+		}
+#endif
+
 		dtp->dt_procs->dph_hashlen = _dtrace_pidbuckets;
 		dtp->dt_procs->dph_lrulim = _dtrace_pidlrulim;
 	}
@@ -1116,6 +1157,13 @@ dt_proc_hash_destroy(dtrace_hdl_t *dtp)
 	while ((dpr = dt_list_next(&dph->dph_lrulist)) != NULL)
 		dt_proc_destroy(dtp, dpr->dpr_proc);
 
+#if defined(linux)
+	if (dph->dph_pipe[0] != -1) {
+		(void) close(dph->dph_pipe[0]);
+		(void) close(dph->dph_pipe[1]);
+	}
+#endif
+
 	dtp->dt_procs = NULL;
 	dt_free(dtp, dph);
 }
@@ -89,6 +89,9 @@ typedef struct dt_proc_hash {
 	pthread_mutex_t dph_lock;	/* lock protecting dph_notify list */
 	pthread_cond_t dph_cv;		/* cond for waiting for dph_notify */
 	dt_proc_notify_t *dph_notify;	/* list of pending proc notifications */
+#if defined(linux)
+	int dph_pipe[2];		/* also posted to, for poll() waiters */
+#endif
 	dt_list_t dph_lrulist;		/* list of dt_proc_t's in lru order */
 	uint_t dph_lrulim;		/* limit on number of procs to hold */
 	uint_t dph_lrucnt;		/* count of cached process handles */
@@ -109,6 +112,10 @@ extern dt_proc_t *dt_proc_lookup(dtrace_hdl_t *, struct ps_prochandle *, int);
 extern void dt_proc_hash_create(dtrace_hdl_t *);
 extern void dt_proc_hash_destroy(dtrace_hdl_t *);
 
+#if defined(linux) && defined(__amd64)
+extern void dt_unwind_update(dtrace_hdl_t *, dt_proc_t *);
+#endif
+
 #ifdef	__cplusplus
 }
 #endif
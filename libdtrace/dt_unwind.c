@@ -0,0 +1,838 @@
+/**********************************************************************/
+/*   Build  an  unwind  table for a grabbed process, so that ustack()  */
+/*   can  walk  through  code  compiled  without frame pointers (the  */
+/*   default on x86-64).					      */
+/*   								      */
+/*   We  read  the  .eh_frame section of each executable mapping in  */
+/*   /proc/<pid>/maps,  run  the  call  frame  instructions of every  */
+/*   FDE,  and  reduce each row to the two things the kernel walker  */
+/*   needs:  how  to  find  the  CFA  (%rsp or %rbp plus a constant),  */
+/*   and  where the caller's %rbp was saved. Rows we cant express that  */
+/*   way  (DWARF  expressions, CFA in some other register) are left  */
+/*   out, and the kernel falls back to the frame pointer chain there.  */
+/*   								      */
+/*   The  result  is handed to the driver with DTRACEIOC_UNWIND. We  */
+/*   redo  it  whenever  the  run-time  linker  tells  us  the  list of  */
+/*   loaded objects has changed.				      */
+/*   								      */
+/*   License: CDDL						      */
+/**********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <port.h> /* For HAVE_ELF_C_READ_MMAP */
+
+#include <dt_impl.h>
+#include <dt_proc.h>
+
+#if defined(linux) && defined(__amd64)
+
+# define	DW_CFA_advance_loc		0x40
+# define	DW_CFA_offset			0x80
+# define	DW_CFA_restore			0xc0
+# define	DW_CFA_nop			0x00
+# define	DW_CFA_set_loc			0x01
+# define	DW_CFA_advance_loc1		0x02
+# define	DW_CFA_advance_loc2		0x03
+# define	DW_CFA_advance_loc4		0x04
+# define	DW_CFA_offset_extended		0x05
+# define	DW_CFA_restore_extended		0x06
+# define	DW_CFA_undefined		0x07
+# define	DW_CFA_same_value		0x08
+# define	DW_CFA_register			0x09
+# define	DW_CFA_remember_state		0x0a
+# define	DW_CFA_restore_state		0x0b
+# define	DW_CFA_def_cfa			0x0c
+# define	DW_CFA_def_cfa_register		0x0d
+# define	DW_CFA_def_cfa_offset		0x0e
+# define	DW_CFA_def_cfa_expression	0x0f
+# define	DW_CFA_expression		0x10
+# define	DW_CFA_offset_extended_sf	0x11
+# define	DW_CFA_def_cfa_sf		0x12
+# define	DW_CFA_def_cfa_offset_sf	0x13
+# define	DW_CFA_val_offset		0x14
+# define	DW_CFA_val_offset_sf		0x15
+# define	DW_CFA_val_expression		0x16
+# define	DW_CFA_GNU_args_size		0x2e
+# define	DW_CFA_GNU_negative_offset_extended 0x2f
+
+# define	DW_EH_PE_omit		0xff
+# define	DW_EH_PE_absptr		0x00
+# define	DW_EH_PE_uleb128	0x01
+# define	DW_EH_PE_udata2		0x02
+# define	DW_EH_PE_udata4		0x03
+# define	DW_EH_PE_udata8		0x04
+# define	DW_EH_PE_sleb128	0x09
+# define	DW_EH_PE_sdata2		0x0a
+# define	DW_EH_PE_sdata4		0x0b
+# define	DW_EH_PE_sdata8		0x0c
+# define	DW_EH_PE_pcrel		0x10
+# define	DW_EH_PE_indirect	0x80
+
+/**********************************************************************/
+/*   DWARF register numbers on x86-64.				      */
+/**********************************************************************/
+# define	DW_REG_RBP	6
+# define	DW_REG_RSP	7
+
+# define	UW_MAXSTATE	16
+
+/**********************************************************************/
+/*   Kinds of register rule, for uw_rule().			      */
+/**********************************************************************/
+# define	UW_OFFSET	0	/* saved at CFA + off */
+# define	UW_RESTORE	1	/* back to the CIE's rule */
+# define	UW_SAME		2	/* unchanged or undefined */
+# define	UW_OTHER	3	/* anything we cant follow */
+
+/**********************************************************************/
+/*   The  part  of  the  register  rules  we track. uc_fpoff is 0 if  */
+/*   %rbp  still holds the caller's value; uc_fpbad is set if it was  */
+/*   saved  somewhere  other than on the stack, and uc_rabad if the  */
+/*   return address isnt just below the CFA.			      */
+/**********************************************************************/
+typedef struct uw_cfa {
+	int	uc_valid;
+	int	uc_fpbad;
+	int	uc_rabad;
+	int	uc_reg;
+	int64_t	uc_off;
+	int64_t	uc_fpoff;
+} uw_cfa_t;
+
+typedef struct uw_cie {
+	uint64_t ci_code_align;
+	int64_t	ci_data_align;
+	uint64_t ci_ra;
+	int	ci_fde_enc;
+	int	ci_aug_z;
+	const uint8_t *ci_insns;
+	const uint8_t *ci_end;
+} uw_cie_t;
+
+typedef struct uw_tab {
+	dtrace_unwind_ent_t *ut_ents;
+	uint32_t ut_nents;
+	uint32_t ut_size;
+} uw_tab_t;
+
+/**********************************************************************/
+/*   The  section  being  decoded.  us_addr  is its link-time address,  */
+/*   for pc-relative pointers.					      */
+/**********************************************************************/
+typedef struct uw_sect {
+	const uint8_t *us_base;
+	const uint8_t *us_end;
+	uint64_t us_addr;
+	int	us_err;
+} uw_sect_t;
+
+static uint64_t
+uw_uleb(uw_sect_t *us, const uint8_t **pp, const uint8_t *end)
+{	const uint8_t *p = *pp;
+	uint64_t v = 0;
+	int	shift = 0;
+
+	do {
+		if (p >= end) {
+			us->us_err = 1;
+			break;
+		}
+		if (shift < 64)
+			v |= (uint64_t) (*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+
+	*pp = p;
+	return v;
+}
+
+static int64_t
+uw_sleb(uw_sect_t *us, const uint8_t **pp, const uint8_t *end)
+{	const uint8_t *p = *pp;
+	uint64_t v = 0;
+	int	shift = 0;
+	uint8_t	b = 0;
+
+	do {
+		if (p >= end) {
+			us->us_err = 1;
+			break;
+		}
+		b = *p++;
+		if (shift < 64)
+			v |= (uint64_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	if (shift < 64 && (b & 0x40))
+		v |= ~(uint64_t) 0 << shift;
+	*pp = p;
+	return (int64_t) v;
+}
+
+static uint64_t
+uw_fixed(uw_sect_t *us, const uint8_t **pp, const uint8_t *end, int size)
+{	uint64_t v = 0;
+
+	if (*pp + size > end) {
+		us->us_err = 1;
+		*pp = end;
+		return 0;
+	}
+	memcpy(&v, *pp, size);
+	*pp += size;
+	return v;
+}
+
+/**********************************************************************/
+/*   Read a pointer in one of the DW_EH_PE_xxx encodings.	      */
+/**********************************************************************/
+static uint64_t
+uw_pointer(uw_sect_t *us, const uint8_t **pp, const uint8_t *end, int enc)
+{	uint64_t pc = us->us_addr + (*pp - us->us_base);
+	uint64_t v;
+
+	if (enc == DW_EH_PE_omit)
+		return 0;
+
+	switch (enc & 0x0f) {
+	case DW_EH_PE_absptr:
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		v = uw_fixed(us, pp, end, 8);
+		break;
+	case DW_EH_PE_uleb128:
+		v = uw_uleb(us, pp, end);
+		break;
+	case DW_EH_PE_udata2:
+		v = (uint16_t) uw_fixed(us, pp, end, 2);
+		break;
+	case DW_EH_PE_sdata2:
+		v = (int16_t) uw_fixed(us, pp, end, 2);
+		break;
+	case DW_EH_PE_udata4:
+		v = (uint32_t) uw_fixed(us, pp, end, 4);
+		break;
+	case DW_EH_PE_sdata4:
+		v = (int32_t) uw_fixed(us, pp, end, 4);
+		break;
+	case DW_EH_PE_sleb128:
+		v = uw_sleb(us, pp, end);
+		break;
+	default:
+		us->us_err = 1;
+		return 0;
+	}
+
+	switch (enc & 0x70) {
+	case 0:
+		break;
+	case DW_EH_PE_pcrel:
+		v += pc;
+		break;
+	default:
+		/***********************************************/
+		/*   datarel/textrel/funcrel  arent used for  */
+		/*   FDE addresses on x86-64.		       */
+		/***********************************************/
+		us->us_err = 1;
+		break;
+	}
+	if (enc & DW_EH_PE_indirect)
+		us->us_err = 1;
+	return v;
+}
+
+/**********************************************************************/
+/*   Add  a  row  to  the  table,  merging  it  with the previous one  */
+/*   if it carries on with the same rule.			      */
+/**********************************************************************/
+static int
+uw_add(uw_tab_t *ut, uint64_t pc, uint64_t end, uw_cfa_t *cfa, uint64_t bias)
+{	dtrace_unwind_ent_t *ue;
+
+	if (!cfa->uc_valid || cfa->uc_fpbad || cfa->uc_rabad || end <= pc ||
+	    end - pc > UINT32_MAX)
+		return 0;
+	if ((cfa->uc_reg != DW_REG_RSP && cfa->uc_reg != DW_REG_RBP) ||
+	    cfa->uc_off != (int32_t) cfa->uc_off ||
+	    cfa->uc_fpoff != (int16_t) cfa->uc_fpoff)
+		return 0;
+
+	pc += bias;
+	end += bias;
+
+	if (ut->ut_nents) {
+		ue = &ut->ut_ents[ut->ut_nents - 1];
+		if (ue->dtue_pc + ue->dtue_len == pc &&
+		    end - ue->dtue_pc <= UINT32_MAX &&
+		    ue->dtue_cfaoff == cfa->uc_off &&
+		    ue->dtue_fpoff == cfa->uc_fpoff &&
+		    ue->dtue_cfareg == (cfa->uc_reg == DW_REG_RBP ?
+		    DTRACE_UNWIND_FP : DTRACE_UNWIND_SP)) {
+			ue->dtue_len = end - ue->dtue_pc;
+			return 0;
+		}
+	}
+
+	if (ut->ut_nents >= DTRACE_UNWIND_MAXENTS)
+		return -1;
+
+	if (ut->ut_nents >= ut->ut_size) {
+		uint32_t size = ut->ut_size ? ut->ut_size * 2 : 1024;
+
+		if ((ue = realloc(ut->ut_ents, size * sizeof (*ue))) == NULL)
+			return -1;
+		ut->ut_ents = ue;
+		ut->ut_size = size;
+	}
+
+	ue = &ut->ut_ents[ut->ut_nents++];
+	bzero(ue, sizeof (*ue));
+	ue->dtue_pc = pc;
+	ue->dtue_len = end - pc;
+	ue->dtue_cfaoff = cfa->uc_off;
+	ue->dtue_fpoff = cfa->uc_fpoff;
+	ue->dtue_cfareg = cfa->uc_reg == DW_REG_RBP ?
+	    DTRACE_UNWIND_FP : DTRACE_UNWIND_SP;
+	return 0;
+}
+
+/**********************************************************************/
+/*   A  new rule for reg. We only care about %rbp and the return  */
+/*   address.							      */
+/**********************************************************************/
+static void
+uw_rule(uw_cie_t *ci, uw_cfa_t *cfa, const uw_cfa_t *init, uint64_t reg,
+    int how, int64_t off)
+{
+	if (reg == DW_REG_RBP) {
+		switch (how) {
+		case UW_OFFSET:
+			cfa->uc_fpoff = off;
+			cfa->uc_fpbad = 0;
+			break;
+		case UW_RESTORE:
+			cfa->uc_fpoff = init->uc_fpoff;
+			cfa->uc_fpbad = init->uc_fpbad;
+			break;
+		case UW_SAME:
+			cfa->uc_fpoff = 0;
+			cfa->uc_fpbad = 0;
+			break;
+		default:
+			cfa->uc_fpbad = 1;
+			break;
+		}
+	} else if (reg == ci->ci_ra) {
+		if (how == UW_RESTORE)
+			cfa->uc_rabad = init->uc_rabad;
+		else
+			cfa->uc_rabad = how != UW_OFFSET || off != -8;
+	}
+}
+
+/**********************************************************************/
+/*   Run  call  frame  instructions  from  p to end. With ut NULL we  */
+/*   are  running  the  CIE's initial instructions, and just want the  */
+/*   resulting state.						      */
+/**********************************************************************/
+static int
+uw_exec(uw_sect_t *us, uw_cie_t *ci, const uint8_t *p, const uint8_t *end,
+    uw_cfa_t *cfa, const uw_cfa_t *init, uint64_t *locp, uint64_t lim,
+    uw_tab_t *ut, uint64_t bias)
+{	uw_cfa_t stack[UW_MAXSTATE];
+	int	depth = 0;
+	uint64_t loc = *locp, nloc, reg;
+	int64_t	off;
+	uint8_t	op;
+
+	while (p < end && !us->us_err) {
+		op = *p++;
+		nloc = loc;
+
+		/***********************************************/
+		/*   The  top two bits select the compact forms,  */
+		/*   with the operand in the low six.	       */
+		/***********************************************/
+		switch (op & 0xc0) {
+		case DW_CFA_advance_loc:
+			nloc = loc + (op & 0x3f) * ci->ci_code_align;
+			break;
+		case DW_CFA_offset:
+			off = uw_uleb(us, &p, end) * ci->ci_data_align;
+			uw_rule(ci, cfa, init, op & 0x3f, UW_OFFSET, off);
+			break;
+		case DW_CFA_restore:
+			uw_rule(ci, cfa, init, op & 0x3f, UW_RESTORE, 0);
+			break;
+		}
+
+		if (op & 0xc0)
+			op = DW_CFA_nop;
+
+		switch (op) {
+		case DW_CFA_nop:
+			break;
+		case DW_CFA_set_loc:
+			nloc = uw_pointer(us, &p, end, ci->ci_fde_enc);
+			break;
+		case DW_CFA_advance_loc1:
+			nloc = loc + uw_fixed(us, &p, end, 1) * ci->ci_code_align;
+			break;
+		case DW_CFA_advance_loc2:
+			nloc = loc + uw_fixed(us, &p, end, 2) * ci->ci_code_align;
+			break;
+		case DW_CFA_advance_loc4:
+			nloc = loc + uw_fixed(us, &p, end, 4) * ci->ci_code_align;
+			break;
+		case DW_CFA_offset_extended:
+			reg = uw_uleb(us, &p, end);
+			off = uw_uleb(us, &p, end) * ci->ci_data_align;
+			uw_rule(ci, cfa, init, reg, UW_OFFSET, off);
+			break;
+		case DW_CFA_offset_extended_sf:
+			reg = uw_uleb(us, &p, end);
+			off = uw_sleb(us, &p, end) * ci->ci_data_align;
+			uw_rule(ci, cfa, init, reg, UW_OFFSET, off);
+			break;
+		case DW_CFA_GNU_negative_offset_extended:
+			reg = uw_uleb(us, &p, end);
+			off = -(int64_t) uw_uleb(us, &p, end) * ci->ci_data_align;
+			uw_rule(ci, cfa, init, reg, UW_OFFSET, off);
+			break;
+		case DW_CFA_restore_extended:
+			reg = uw_uleb(us, &p, end);
+			uw_rule(ci, cfa, init, reg, UW_RESTORE, 0);
+			break;
+		case DW_CFA_undefined:
+		case DW_CFA_same_value:
+			reg = uw_uleb(us, &p, end);
+			uw_rule(ci, cfa, init, reg, UW_SAME, 0);
+			break;
+		case DW_CFA_register:
+		case DW_CFA_val_offset:
+			/***********************************************/
+			/*   Kept  in  another  register,  or  not  a  */
+			/*   memory slot. We cant follow that.	       */
+			/***********************************************/
+			reg = uw_uleb(us, &p, end);
+			(void) uw_uleb(us, &p, end);
+			uw_rule(ci, cfa, init, reg, UW_OTHER, 0);
+			break;
+		case DW_CFA_val_offset_sf:
+			reg = uw_uleb(us, &p, end);
+			(void) uw_sleb(us, &p, end);
+			uw_rule(ci, cfa, init, reg, UW_OTHER, 0);
+			break;
+		case DW_CFA_remember_state:
+			if (depth >= UW_MAXSTATE) {
+				us->us_err = 1;
+				break;
+			}
+			stack[depth++] = *cfa;
+			break;
+		case DW_CFA_restore_state:
+			if (depth == 0) {
+				us->us_err = 1;
+				break;
+			}
+			*cfa = stack[--depth];
+			break;
+		case DW_CFA_def_cfa:
+			cfa->uc_reg = uw_uleb(us, &p, end);
+			cfa->uc_off = uw_uleb(us, &p, end);
+			cfa->uc_valid = 1;
+			break;
+		case DW_CFA_def_cfa_sf:
+			cfa->uc_reg = uw_uleb(us, &p, end);
+			cfa->uc_off = uw_sleb(us, &p, end) * ci->ci_data_align;
+			cfa->uc_valid = 1;
+			break;
+		case DW_CFA_def_cfa_register:
+			cfa->uc_reg = uw_uleb(us, &p, end);
+			break;
+		case DW_CFA_def_cfa_offset:
+			cfa->uc_off = uw_uleb(us, &p, end);
+			break;
+		case DW_CFA_def_cfa_offset_sf:
+			cfa->uc_off = uw_sleb(us, &p, end) * ci->ci_data_align;
+			break;
+		case DW_CFA_def_cfa_expression:
+			p += uw_uleb(us, &p, end);
+			cfa->uc_valid = 0;
+			break;
+		case DW_CFA_expression:
+		case DW_CFA_val_expression:
+			reg = uw_uleb(us, &p, end);
+			p += uw_uleb(us, &p, end);
+			uw_rule(ci, cfa, init, reg, UW_OTHER, 0);
+			break;
+		case DW_CFA_GNU_args_size:
+			(void) uw_uleb(us, &p, end);
+			break;
+		default:
+			us->us_err = 1;
+			break;
+		}
+
+		if (p > end)
+			us->us_err = 1;
+
+		/***********************************************/
+		/*   Location  moved:  the  rule we had holds  */
+		/*   for [loc, nloc).			       */
+		/***********************************************/
+		if (nloc != loc && !us->us_err) {
+			if (nloc < loc || nloc > lim) {
+				us->us_err = 1;
+				break;
+			}
+			if (ut && uw_add(ut, loc, nloc, cfa, bias) != 0)
+				return -1;
+			loc = nloc;
+		}
+	}
+
+	*locp = loc;
+	return 0;
+}
+
+/**********************************************************************/
+/*   Decode the CIE at p.					      */
+/**********************************************************************/
+static int
+uw_cie(uw_sect_t *us, const uint8_t *p, uw_cie_t *ci)
+{	const uint8_t *end, *aug;
+	uint64_t len;
+	int	version;
+
+	bzero(ci, sizeof (*ci));
+	ci->ci_fde_enc = DW_EH_PE_absptr;
+
+	len = uw_fixed(us, &p, us->us_end, 4);
+	if (len == 0xffffffff)
+		len = uw_fixed(us, &p, us->us_end, 8);
+	if (us->us_err || len > (uint64_t) (us->us_end - p))
+		return -1;
+	end = p + len;
+
+	if (uw_fixed(us, &p, end, 4) != 0)
+		return -1;
+	version = uw_fixed(us, &p, end, 1);
+	aug = p;
+	while (p < end && *p)
+		p++;
+	if (p++ >= end)
+		return -1;
+
+	/***********************************************/
+	/*   "eh"  (an  old  g++  extension) puts a  */
+	/*   pointer before the alignment factors.     */
+	/***********************************************/
+	if (aug[0] == 'e' && aug[1] == 'h') {
+		p += 8;
+		aug += 2;
+	}
+
+	ci->ci_code_align = uw_uleb(us, &p, end);
+	ci->ci_data_align = uw_sleb(us, &p, end);
+	if (version == 1)
+		ci->ci_ra = uw_fixed(us, &p, end, 1);
+	else
+		ci->ci_ra = uw_uleb(us, &p, end);
+
+	if (*aug == 'z') {
+		const uint8_t *aend;
+
+		len = uw_uleb(us, &p, end);
+		if (len > (uint64_t) (end - p))
+			return -1;
+		aend = p + len;
+		ci->ci_aug_z = 1;
+		for (aug++; *aug && p < aend; aug++) {
+			switch (*aug) {
+			case 'R':
+				ci->ci_fde_enc = uw_fixed(us, &p, aend, 1);
+				break;
+			case 'P': {
+				int	enc = uw_fixed(us, &p, aend, 1);
+
+				/***********************************************/
+				/*   We  dont  want  the personality, but it  */
+				/*   may be indirect, which uw_pointer() wont  */
+				/*   take.				       */
+				/***********************************************/
+				(void) uw_pointer(us, &p, aend,
+				    enc & ~DW_EH_PE_indirect);
+				break;
+				}
+			case 'L':
+				(void) uw_fixed(us, &p, aend, 1);
+				break;
+			case 'S':
+			case 'B':
+				break;
+			default:
+				return -1;
+			}
+		}
+		p = aend;
+	} else if (*aug != '\0') {
+		return -1;
+	}
+
+	ci->ci_insns = p;
+	ci->ci_end = end;
+	return us->us_err ? -1 : 0;
+}
+
+/**********************************************************************/
+/*   Walk  every  FDE in the .eh_frame section, adding rows to the  */
+/*   table.							      */
+/**********************************************************************/
+static int
+uw_eh_frame(uw_sect_t *us, uint64_t bias, uw_tab_t *ut)
+{	const uint8_t *p = us->us_base, *end, *id;
+	uw_cie_t ci;
+	uw_cfa_t init, cfa;
+	uint64_t len, cie, pc, range, loc;
+
+	while (p + 4 <= us->us_end) {
+		us->us_err = 0;
+		len = uw_fixed(us, &p, us->us_end, 4);
+		if (len == 0)
+			break;
+		if (len == 0xffffffff)
+			len = uw_fixed(us, &p, us->us_end, 8);
+		if (us->us_err || len > (uint64_t) (us->us_end - p))
+			break;
+		end = p + len;
+		id = p;
+		cie = uw_fixed(us, &p, end, 4);
+
+		/***********************************************/
+		/*   CIEs  are  picked  up  by the FDEs which  */
+		/*   refer to them.			       */
+		/***********************************************/
+		if (cie == 0 || cie > (uint64_t) (id - us->us_base)) {
+			p = end;
+			continue;
+		}
+		if (uw_cie(us, id - cie, &ci) != 0) {
+			p = end;
+			continue;
+		}
+
+		pc = uw_pointer(us, &p, end, ci.ci_fde_enc);
+		range = uw_pointer(us, &p, end, ci.ci_fde_enc & 0x0f);
+		if (ci.ci_aug_z) {
+			len = uw_uleb(us, &p, end);
+			p += len;
+		}
+		if (us->us_err || p > end || pc == 0 || range == 0) {
+			p = end;
+			continue;
+		}
+
+		/***********************************************/
+		/*   On  entry  to  any  function, the CFA is  */
+		/*   %rsp+8 and %rbp is untouched. The CIE may  */
+		/*   say otherwise.			       */
+		/***********************************************/
+		bzero(&init, sizeof (init));
+		init.uc_valid = 1;
+		init.uc_reg = DW_REG_RSP;
+		init.uc_off = 8;
+		loc = pc;
+		if (uw_exec(us, &ci, ci.ci_insns, ci.ci_end, &init, &init,
+		    &loc, pc + range, NULL, 0) != 0 || us->us_err) {
+			p = end;
+			continue;
+		}
+
+		cfa = init;
+		loc = pc;
+		if (uw_exec(us, &ci, p, end, &cfa, &init, &loc, pc + range,
+		    ut, bias) != 0)
+			return -1;
+		if (!us->us_err && uw_add(ut, loc, pc + range, &cfa, bias) != 0)
+			return -1;
+
+		p = end;
+	}
+	return 0;
+}
+
+/**********************************************************************/
+/*   Add  the  rows  for one mapped object. start and offset describe  */
+/*   the  executable  mapping,  which  we  use  to work out the load  */
+/*   bias.							      */
+/**********************************************************************/
+static int
+uw_object(const char *path, uint64_t start, uint64_t offset, uw_tab_t *ut)
+{	Elf	*elf;
+	Elf_Scn	*scn = NULL;
+	Elf_Data *data;
+	GElf_Ehdr ehdr;
+	GElf_Phdr phdr;
+	GElf_Shdr shdr;
+	size_t	shstrs;
+	int	i;
+	uint64_t bias = 0, pgmask = sysconf(_SC_PAGESIZE) - 1;
+	uw_sect_t us;
+	const char *name;
+	int	fd, found = 0, ret = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+
+	/***********************************************/
+	/*   See dt_module_load() for why not ELF_C_READ. */
+	/***********************************************/
+#if defined(HAVE_ELF_C_READ_MMAP)
+	elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+#else
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+#endif
+	if (elf == NULL || gelf_getehdr(elf, &ehdr) == NULL ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr.e_machine != EM_X86_64 ||
+# if HAVE_ELF_GETSHDRSTRNDX
+	    elf_getshdrstrndx(elf, &shstrs) == -1)
+# else
+	    elf_getshstrndx(elf, &shstrs) == 0)
+# endif
+		goto done;
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (gelf_getphdr(elf, i, &phdr) == NULL ||
+		    phdr.p_type != PT_LOAD ||
+		    (phdr.p_offset & ~pgmask) > offset ||
+		    offset >= phdr.p_offset + phdr.p_filesz)
+			continue;
+		bias = start - ((phdr.p_vaddr & ~pgmask) +
+		    (offset - (phdr.p_offset & ~pgmask)));
+		found = 1;
+		break;
+	}
+	if (!found)
+		goto done;
+
+	while ((scn = elf_nextscn(elf, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) == NULL ||
+		    shdr.sh_type != SHT_PROGBITS ||
+		    (name = elf_strptr(elf, shstrs, shdr.sh_name)) == NULL ||
+		    strcmp(name, ".eh_frame") != 0)
+			continue;
+		if ((data = elf_getdata(scn, NULL)) == NULL ||
+		    data->d_buf == NULL)
+			break;
+
+		us.us_base = data->d_buf;
+		us.us_end = us.us_base + data->d_size;
+		us.us_addr = shdr.sh_addr;
+		us.us_err = 0;
+		ret = uw_eh_frame(&us, bias, ut);
+		break;
+	}
+
+done:
+	if (elf)
+		(void) elf_end(elf);
+	(void) close(fd);
+	return ret;
+}
+
+static int
+uw_compare(const void *a, const void *b)
+{	const dtrace_unwind_ent_t *ua = a, *ub = b;
+
+	if (ua->dtue_pc < ub->dtue_pc)
+		return -1;
+	return ua->dtue_pc > ub->dtue_pc;
+}
+
+/**********************************************************************/
+/*   (Re)build  and  register  the unwind table for dpr. Failure is  */
+/*   not fatal - ustack() just does what it did before.		      */
+/**********************************************************************/
+void
+dt_unwind_update(dtrace_hdl_t *dtp, dt_proc_t *dpr)
+{	dtrace_unwind_t uw;
+	uw_tab_t ut;
+	char	buf[PATH_MAX + 128];
+	char	last[PATH_MAX];
+	char	perms[8];
+	unsigned long long start, end, offset;
+	uint32_t i, n;
+	FILE	*fp;
+	char	*path;
+	int	pos;
+
+	(void) snprintf(buf, sizeof (buf), "/proc/%d/maps", (int)dpr->dpr_pid);
+	if ((fp = fopen(buf, "r")) == NULL)
+		return;
+
+	bzero(&ut, sizeof (ut));
+	last[0] = '\0';
+	(void) elf_version(EV_CURRENT);
+
+	while (fgets(buf, sizeof (buf), fp) != NULL) {
+		pos = 0;
+		if (sscanf(buf, "%llx-%llx %7s %llx %*s %*s %n",
+		    &start, &end, perms, &offset, &pos) < 4 || pos == 0)
+			continue;
+		path = buf + pos;
+		path[strcspn(path, "\n")] = '\0';
+
+		/***********************************************/
+		/*   Only  file backed text. An object which  */
+		/*   has been replaced on disk is no use to us. */
+		/***********************************************/
+		if (perms[2] != 'x' || *path != '/' ||
+		    strstr(path, " (deleted)") != NULL ||
+		    strcmp(path, last) == 0)
+			continue;
+		(void) strlcpy(last, path, sizeof (last));
+
+		if (uw_object(path, start, offset, &ut) != 0)
+			break;
+	}
+	(void) fclose(fp);
+
+	/***********************************************/
+	/*   The  kernel wants the rows sorted and not  */
+	/*   overlapping.				       */
+	/***********************************************/
+	qsort(ut.ut_ents, ut.ut_nents, sizeof (*ut.ut_ents), uw_compare);
+	for (i = n = 0; i < ut.ut_nents; i++) {
+		if (n && ut.ut_ents[i].dtue_pc <
+		    ut.ut_ents[n - 1].dtue_pc + ut.ut_ents[n - 1].dtue_len)
+			continue;
+		ut.ut_ents[n++] = ut.ut_ents[i];
+	}
+
+	uw.dtuw_pid = dpr->dpr_pid;
+	uw.dtuw_nents = n;
+	uw.dtuw_ents = (uintptr_t)ut.ut_ents;
+
+	if (dt_ioctl(dtp, DTRACEIOC_UNWIND, &uw) == -1) {
+		dt_dprintf("pid %d: failed to register unwind table: %s\n",
+		    (int)dpr->dpr_pid, strerror(errno));
+	} else {
+		dt_dprintf("pid %d: registered %u unwind entries\n",
+		    (int)dpr->dpr_pid, n);
+	}
+
+	free(ut.ut_ents);
+}
+
+#endif	/* linux && __amd64 */
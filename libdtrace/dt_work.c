@@ -32,6 +32,21 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#if defined(linux)
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Buffer policies under which the principal buffers are drained while
+ * tracing (as opposed to once, after we have stopped).
+ */
+#if defined(linux)
+#define	DT_BUFPOLICY_DRAINED(p)	((p) == DTRACEOPT_BUFPOLICY_SWITCH || \
+	(p) == DTRACEOPT_BUFPOLICY_STREAM)
+#else
+#define	DT_BUFPOLICY_DRAINED(p)	((p) == DTRACEOPT_BUFPOLICY_SWITCH)
+#endif
 
 static const struct {
 	int dtslt_option;
@@ -62,10 +77,10 @@ dtrace_sleep(dtrace_hdl_t *dtp)
 
 		/*
 		 * If the buffering policy is set to anything other than
-		 * "switch", we ignore the aggrate and switchrate -- they're
-		 * meaningless.
+		 * "switch" (or "stream"), we ignore the aggrate and
+		 * switchrate -- they're meaningless.
 		 */
-		if (policy != DTRACEOPT_BUFPOLICY_SWITCH &&
+		if (!DT_BUFPOLICY_DRAINED(policy) &&
 		    _dtrace_sleeptab[i].dtslt_option != DTRACEOPT_STATUSRATE)
 			continue;
 
@@ -85,6 +100,41 @@ dtrace_sleep(dtrace_hdl_t *dtp)
 	tv.tv_sec = (earliest - now) / NANOSEC;
 	tv.tv_nsec = (earliest - now) % NANOSEC;
 
+#if defined(linux)
+	/*
+	 * With a buffer watermark, the driver makes the dtrace device
+	 * readable as soon as a principal buffer fills past it (or drops
+	 * or errors); wait on that as well, and have dtrace_consume()
+	 * switch immediately if it fires.  Process notifications are also
+	 * posted down dph_pipe for us.
+	 */
+	if (DT_BUFPOLICY_DRAINED(policy) && dph->dph_pipe[0] != -1 &&
+	    dtp->dt_options[DTRACEOPT_BUFWATERMARK] != DTRACEOPT_UNSET &&
+	    dtp->dt_options[DTRACEOPT_BUFWATERMARK] > 0 &&
+	    dph->dph_notify == NULL) {
+		struct pollfd pfd[2];
+		hrtime_t ms;
+		char c;
+
+		(void) pthread_mutex_unlock(&dph->dph_lock);
+
+		pfd[0].fd = dtp->dt_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = dph->dph_pipe[0];
+		pfd[1].events = POLLIN;
+
+		ms = (earliest - now + (NANOSEC / MILLISEC) - 1) /
+		    (NANOSEC / MILLISEC);
+
+		if (poll(pfd, 2, (int)ms) > 0 && (pfd[0].revents & POLLIN))
+			dtp->dt_bufwake = 1;
+
+		while (read(dph->dph_pipe[0], &c, 1) == 1)
+			continue;
+
+		(void) pthread_mutex_lock(&dph->dph_lock);
+	} else
+#endif
 	/*
 	 * Wait for either 'tv' nanoseconds to pass or to receive notification
 	 * that a process is in an interesting state.  Regardless of why we
@@ -244,6 +294,202 @@ dtrace_stop(dtrace_hdl_t *dtp)
 	return (0);
 }
 
+#if defined(linux)
+typedef struct dt_dynstat_name {
+	uint_t dtdn_id;
+	const char *dtdn_name;
+} dt_dynstat_name_t;
+
+static int
+dt_dynstat_name(dt_idhash_t *dhp, dt_ident_t *idp, void *arg)
+{
+	dt_dynstat_name_t *dn = arg;
+
+	if (idp->di_id != dn->dtdn_id)
+		return (0);
+
+	dn->dtdn_name = idp->di_name;
+	return (1);
+}
+
+/*
+ * Describe the dynamic variable space:  how full it is, how the hash is
+ * behaving, and the associative arrays and thread-locals using it.  This is
+ * what one wants to see when choosing a dynvarsize.
+ */
+int
+dtrace_dynstat_print(dtrace_hdl_t *dtp, FILE *fp)
+{
+	dtrace_dynstat_t *ds;
+	dtrace_dynstat_var_t *v;
+	dt_dynstat_name_t dn;
+	size_t size = sizeof (dtrace_dynstat_t);
+	uint32_t nvars = 1, i;
+
+	for (;;) {
+		if ((ds = malloc(size)) == NULL)
+			return (dt_set_errno(dtp, EDT_NOMEM));
+
+		bzero(ds, size);
+		ds->dtdy_nvars = nvars;
+
+		if (dt_ioctl(dtp, DTRACEIOC_DYNSTAT, ds) == -1) {
+			free(ds);
+			return (dt_set_errno(dtp, errno));
+		}
+
+		if (ds->dtdy_nvars <= nvars)
+			break;
+
+		/*
+		 * More variables than we had room for; try again with space
+		 * for them all.
+		 */
+		nvars = ds->dtdy_nvars;
+		size = sizeof (dtrace_dynstat_t) +
+		    (nvars - 1) * sizeof (dtrace_dynstat_var_t);
+		free(ds);
+	}
+
+	(void) fprintf(fp, "dynamic variables: %llu bytes, %llu chunks of "
+	    "%llu bytes, %llu in use\n", (u_longlong_t)ds->dtdy_size,
+	    (u_longlong_t)ds->dtdy_nchunks, (u_longlong_t)ds->dtdy_chunksize,
+	    (u_longlong_t)ds->dtdy_inuse);
+	(void) fprintf(fp, "hash: %llu buckets, %llu in use, longest chain "
+	    "%llu, %.2f entries visited per lookup, grown %llu time%s\n",
+	    (u_longlong_t)ds->dtdy_hashsize, (u_longlong_t)ds->dtdy_buckets,
+	    (u_longlong_t)ds->dtdy_maxchain, ds->dtdy_lookups == 0 ? 0.0 :
+	    (double)ds->dtdy_steps / (double)ds->dtdy_lookups,
+	    (u_longlong_t)ds->dtdy_resizes, ds->dtdy_resizes == 1 ? "" : "s");
+	(void) fprintf(fp, "drops: %llu capacity, %llu dirty, %llu rinsing; "
+	    "%llu of %llu allocations lost a race\n",
+	    (u_longlong_t)ds->dtdy_drops, (u_longlong_t)ds->dtdy_dirty_drops,
+	    (u_longlong_t)ds->dtdy_rinsing_drops,
+	    (u_longlong_t)ds->dtdy_collisions, (u_longlong_t)ds->dtdy_allocs);
+
+	if (ds->dtdy_nvars != 0) {
+		(void) fprintf(fp, "  %-24s %-6s %10s %8s %10s\n",
+		    "VARIABLE", "SCOPE", "ENTRIES", "MAXCHAIN", "DROPS");
+	}
+
+	for (i = 0; i < ds->dtdy_nvars; i++) {
+		v = &ds->dtdy_vars[i];
+		dn.dtdn_id = v->dtdyv_id;
+		dn.dtdn_name = NULL;
+
+		(void) dt_idhash_iter(v->dtdyv_scope == DIFV_SCOPE_GLOBAL ?
+		    dtp->dt_globals : dtp->dt_tls, dt_dynstat_name, &dn);
+
+		if (dn.dtdn_name == NULL) {
+			(void) fprintf(fp, "  %-24u ", v->dtdyv_id);
+		} else if (v->dtdyv_scope == DIFV_SCOPE_GLOBAL) {
+			(void) fprintf(fp, "  %-24s ", dn.dtdn_name);
+		} else {
+			(void) fprintf(fp, "  self->%-18s ", dn.dtdn_name);
+		}
+
+		(void) fprintf(fp, "%-6s %10llu %8llu %10llu\n",
+		    v->dtdyv_scope == DIFV_SCOPE_GLOBAL ? "global" : "thread",
+		    (u_longlong_t)v->dtdyv_count,
+		    (u_longlong_t)v->dtdyv_maxchain,
+		    (u_longlong_t)v->dtdyv_drops);
+	}
+
+	free(ds);
+	return (0);
+}
+
+static int
+dt_ecbstat_cmp(const void *l, const void *r)
+{
+	const dtrace_ecbstat_t *lhs = l, *rhs = r;
+
+	if (lhs->dtes_cycles != rhs->dtes_cycles)
+		return (lhs->dtes_cycles > rhs->dtes_cycles ? -1 : 1);
+
+	return (lhs->dtes_epid < rhs->dtes_epid ? -1 : 1);
+}
+
+/*
+ * Report, for each enabled probe that has fired or had firings passed over
+ * by sample() or ratelimit(), what it has cost:  firings, cycles spent in
+ * the kernel on its behalf, bytes recorded and records dropped (these need
+ * the "overhead" option), and firings skipped.  The most expensive enabled
+ * probes come first.
+ */
+int
+dtrace_ecbstat_print(dtrace_hdl_t *dtp, FILE *fp)
+{
+	dtrace_ecbstat_t es, *stats = NULL, *new, *s;
+	dtrace_eprobedesc_t *epd;
+	dtrace_probedesc_t *pd;
+	dtrace_epid_t epid;
+	char name[DTRACE_FULLNAMELEN];
+	uint_t nstats = 0, i;
+
+	for (epid = 1; ; epid++) {
+		bzero(&es, sizeof (es));
+		es.dtes_epid = epid;
+
+		if (dt_ioctl(dtp, DTRACEIOC_ECBSTAT, &es) == -1) {
+			if (errno == ENOENT)
+				continue;
+
+			if (errno == EINVAL)
+				break;
+
+			free(stats);
+			return (dt_set_errno(dtp, errno));
+		}
+
+		if (es.dtes_fires == 0 && es.dtes_sampled == 0 &&
+		    es.dtes_limited == 0)
+			continue;
+
+		if ((new = realloc(stats,
+		    (nstats + 1) * sizeof (dtrace_ecbstat_t))) == NULL) {
+			free(stats);
+			return (dt_set_errno(dtp, EDT_NOMEM));
+		}
+
+		stats = new;
+		stats[nstats++] = es;
+	}
+
+	if (nstats == 0)
+		return (0);
+
+	qsort(stats, nstats, sizeof (dtrace_ecbstat_t), dt_ecbstat_cmp);
+
+	(void) fprintf(fp, "  %-5s %-36s %10s %12s %8s %10s %8s %10s %10s\n",
+	    "EPID", "PROBE", "FIRES", "CYCLES", "CYC/FIRE", "BYTES", "DROPS",
+	    "SAMPLED", "LIMITED");
+
+	for (i = 0; i < nstats; i++) {
+		s = &stats[i];
+
+		if (dt_epid_lookup(dtp, s->dtes_epid, &epd, &pd) == 0) {
+			(void) snprintf(name, sizeof (name), "%s:%s:%s:%s",
+			    pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func,
+			    pd->dtpd_name);
+		} else {
+			(void) strcpy(name, "?");
+		}
+
+		(void) fprintf(fp, "  %-5u %-36s %10llu %12llu %8llu %10llu "
+		    "%8llu %10llu %10llu\n", s->dtes_epid, name,
+		    (u_longlong_t)s->dtes_fires, (u_longlong_t)s->dtes_cycles,
+		    (u_longlong_t)(s->dtes_fires == 0 ? 0 :
+		    s->dtes_cycles / s->dtes_fires),
+		    (u_longlong_t)s->dtes_bytes, (u_longlong_t)s->dtes_drops,
+		    (u_longlong_t)s->dtes_sampled,
+		    (u_longlong_t)s->dtes_limited);
+	}
+
+	free(stats);
+	return (0);
+}
+#endif
 
 dtrace_workstatus_t
 dtrace_work(dtrace_hdl_t *dtp, FILE *fp,
@@ -277,7 +523,7 @@ dtrace_work(dtrace_hdl_t *dtp, FILE *fp,
 	}
 
 	if ((status == DTRACE_STATUS_NONE || status == DTRACE_STATUS_OKAY) &&
-	    policy != DTRACEOPT_BUFPOLICY_SWITCH) {
+	    !DT_BUFPOLICY_DRAINED(policy)) {
 		/*
 		 * There either isn't any status or things are fine -- and
 		 * this is a "ring" or "fill" buffer.  We don't want to consume
@@ -209,6 +209,10 @@ extern int dtrace_consume(dtrace_hdl_t *, FILE *,
 #define	DTRACE_STATUS_STOPPED	4	/* tracing already stopped */
 
 extern int dtrace_status(dtrace_hdl_t *);
+#if defined(linux)
+extern int dtrace_dynstat_print(dtrace_hdl_t *, FILE *);
+extern int dtrace_ecbstat_print(dtrace_hdl_t *, FILE *);
+#endif
 
 /*
  * DTrace Formatted Output Interfaces
@@ -297,7 +301,9 @@ typedef enum {
 	DTRACEDROP_SPECBUSY,			/* spec drop due to busy */
 	DTRACEDROP_SPECUNAVAIL,			/* spec drop due to unavail */
 	DTRACEDROP_STKSTROVERFLOW,		/* stack string tab overflow */
-	DTRACEDROP_DBLERROR			/* error in ERROR probe */
+	DTRACEDROP_DBLERROR,			/* error in ERROR probe */
+	DTRACEDROP_TLS,				/* thread-local drop */
+	DTRACEDROP_STACKID			/* stack ID table drop */
 } dtrace_dropkind_t;
 
 typedef struct dtrace_dropdata {
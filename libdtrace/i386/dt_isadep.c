@@ -48,11 +48,8 @@ dt_pid_create_entry_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	ftp->ftps_noffs = 1;
 	ftp->ftps_offs[0] = 0;
 
-	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-		    strerror(errno));
-		return (dt_set_errno(dtp, errno));
-	}
+	if (dt_pid_makeprobe(dtp, ftp) != 0)
+		return (-1);
 
 	return (1);
 }
@@ -225,11 +222,8 @@ is_ret:
 
 	free(text);
 	if (ftp->ftps_noffs > 0) {
-		if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-			dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-			    strerror(errno));
-			return (dt_set_errno(dtp, errno));
-		}
+		if (dt_pid_makeprobe(dtp, ftp) != 0)
+			return (-1);
 	}
 
 	return (ftp->ftps_noffs);
@@ -308,11 +302,8 @@ dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 		free(text);
 	}
 
-	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-		    strerror(errno));
-		return (dt_set_errno(dtp, errno));
-	}
+	if (dt_pid_makeprobe(dtp, ftp) != 0)
+		return (-1);
 
 	return (ftp->ftps_noffs);
 }
@@ -385,11 +376,8 @@ dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 
 	free(text);
 	if (ftp->ftps_noffs > 0) {
-		if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-			dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-			    strerror(errno));
-			return (dt_set_errno(dtp, errno));
-		}
+		if (dt_pid_makeprobe(dtp, ftp) != 0)
+			return (-1);
 	}
 
 	return (ftp->ftps_noffs);
@@ -273,9 +273,25 @@ typedef unsigned long long hrtime_t;
 		int		m_level;
 		int		m_initted;
 		int		m_type;
+		/***********************************************/
+		/*   Ticket lock, for the busy top-half locks  */
+		/*   (see mutex.c).			       */
+		/***********************************************/
+		int		m_queued;
+		atomic_t	m_next;
+		volatile unsigned int m_owner;
+		/***********************************************/
+		/*   Statistics.			       */
+		/***********************************************/
+		unsigned long long m_acquired;
+		unsigned long long m_contended;
+		unsigned long long m_spins;
+		unsigned long long m_hold_ns;
+		long long	m_hold_start;
 		} mutex_t;
 	#define kmutex_t mutex_t
 	#define MUTEX_DEFINE(name) mutex_t name = {.m_initted = 2 }
+	#define MUTEX_DEFINE_QUEUED(name) mutex_t name = {.m_initted = 2, .m_queued = 1 }
 	void dmutex_init(mutex_t *mp);
 	void dmutex_enter(mutex_t *mp);
 	void dmutex_exit(mutex_t *mp);
@@ -108,6 +108,8 @@ typedef struct trap_instr_t {
 	int		t_modrm;
 	instr_t		t_opcode;
 	unsigned char	t_inslen;
+	unsigned char	*t_instr;	/* Saved copy of whole instruction, */
+					/* if the text may not be intact.   */
 	} trap_instr_t;
 
 /**********************************************************************/
@@ -152,6 +154,16 @@ typedef struct cpu_core {
 	/***********************************************/
 	struct pt_regs	*cpuc_regs;
 	struct pt_regs	*cpuc_regs_old; /* Allow for interrupts */
+
+	/***********************************************/
+	/*   Last  shadow  proc  (sol_proc_t) we used  */
+	/*   on this cpu - see par_setup_thread1().    */
+	/***********************************************/
+	void		*cpuc_proc;
+	unsigned long long cpuc_par_hit;	/* See cnt_par_hit etc.	*/
+	unsigned long long cpuc_par_lookup;
+	unsigned long long cpuc_par_miss;
+	unsigned long long cpuc_par_full;
 } cpu_core_t;
 
 # define	CPUC_MODE_IDLE	0
@@ -164,6 +176,14 @@ extern cpu_t	*cpu_list;
 extern kmutex_t	cpu_lock;
 extern kmutex_t	mod_lock;
 extern cpu_t *curcpu(void);
+
+/**********************************************************************/
+/*   Solaris  cpu  setup  callbacks;  emulated  in  cyclic_linux.c on  */
+/*   top of the kernel cpu hotplug notifier.			      */
+/**********************************************************************/
+typedef int cpu_setup_func_t(cpu_setup_t, int, void *);
+void	register_cpu_setup_func(cpu_setup_func_t *, void *);
+void	unregister_cpu_setup_func(cpu_setup_func_t *, void *);
 typedef intptr_t xc_arg_t;
 typedef int (*xc_func_t)(xc_arg_t, xc_arg_t, xc_arg_t);
 
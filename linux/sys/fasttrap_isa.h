@@ -86,6 +86,9 @@ typedef struct fasttrap_machtp {
  */
 #define	FASTTRAP_T_PUSHL_EBP	0x10	/* pushl %ebp (for function entry) */
 #define	FASTTRAP_T_NOP		0x11	/* nop */
+#if linux
+#define	FASTTRAP_T_EMU		0x12	/* see driver/fasttrap_emu.c */
+#endif
 
 #define	FASTTRAP_RIP_1		0x1
 #define	FASTTRAP_RIP_2		0x2
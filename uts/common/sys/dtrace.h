@@ -403,6 +403,10 @@ typedef struct dtrace_difv {
 #define	DTRACEACT_LIBACT		5	/* library-controlled action */
 #define	DTRACEACT_TRACEMEM		6	/* tracemem() action */
 #define	DTRACEACT_TRACEMEM_DYNSIZE	7	/* dynamic tracemem() size */
+# if linux
+#define	DTRACEACT_SAMPLE		8	/* sample() ECB filter */
+#define	DTRACEACT_RATELIMIT		9	/* ratelimit() ECB filter */
+# endif
 
 #define	DTRACEACT_PROC			0x0100
 #define	DTRACEACT_USTACK		(DTRACEACT_PROC + 1)
@@ -532,7 +536,20 @@ typedef struct dtrace_difv {
 	(uint16_t)(((x) & DTRACE_LLQUANTIZE_NSTEPMASK) >> \
 	DTRACE_LLQUANTIZE_NSTEPSHIFT)
 
+#if linux
+/*
+ * Linux: with the "stackidsize" option, libdtrace sets DTRACE_STACKID in the
+ * frame count of stack(), ustack() and jstack() actions.  Such a record holds
+ * only a 32-bit stack ID; the stack itself is stored once per consumer in the
+ * kernel's stack table, and fetched with DTRACEIOC_STACKIDS.
+ */
+#define	DTRACE_STACKID			0x80000000
+#define	DTRACE_STACKID_ISSET(x)		(((x) & DTRACE_STACKID) != 0)
+#define	DTRACE_USTACK_NFRAMES(x)	\
+	(uint32_t)((x) & (UINT32_MAX & ~DTRACE_STACKID))
+#else
 #define	DTRACE_USTACK_NFRAMES(x)	(uint32_t)((x) & UINT32_MAX)
+#endif
 #define	DTRACE_USTACK_STRSIZE(x)	(uint32_t)((x) >> 32)
 #define	DTRACE_USTACK_ARG(x, y)		\
 	((((uint64_t)(y)) << 32) | ((x) & UINT32_MAX))
@@ -857,6 +874,11 @@ typedef struct dtrace_difo {
 	dtrace_diftype_t dtdo_rtype;	/* return type */
 	uint_t dtdo_refcnt;		/* owner reference count */
 	uint_t dtdo_destructive;	/* invokes destructive subroutines */
+#if defined(_KERNEL) && defined(linux)
+	void *dtdo_jit;			/* native code (difjit), or NULL */
+	size_t dtdo_jitlen;		/* size of native code */
+	struct dtrace_difpre *dtdo_pre;	/* pre-decoded text, or NULL */
+#endif
 #ifndef _KERNEL
 	dof_relodesc_t *dtdo_kreltab;	/* kernel relocations */
 	dof_relodesc_t *dtdo_ureltab;	/* user relocations */
@@ -1027,7 +1049,11 @@ typedef struct dtrace_fmtdesc {
 #define	DTRACEOPT_AGGSORTKEYPOS	26	/* agg. key position to sort on */
 #if linux
 #define DTRACEOPT_STACKSYMBOLS  27      /* clear to prevent stack symbolication */
-#define	DTRACEOPT_MAX		28	/* number of options */
+#define	DTRACEOPT_BUFWATERMARK	28	/* buffer fill % to wake poll() */
+#define	DTRACEOPT_DIFJIT	29	/* compile DIF to native code */
+#define	DTRACEOPT_OVERHEAD	30	/* account probe effect per ECB */
+#define	DTRACEOPT_STACKIDSIZE	31	/* stack ID table size */
+#define	DTRACEOPT_MAX		32	/* number of options */
 #else
 #define	DTRACEOPT_MAX		27	/* number of options */
 #endif
@@ -1037,6 +1063,9 @@ typedef struct dtrace_fmtdesc {
 #define	DTRACEOPT_BUFPOLICY_RING	0	/* ring buffer */
 #define	DTRACEOPT_BUFPOLICY_FILL	1	/* fill buffer, then stop */
 #define	DTRACEOPT_BUFPOLICY_SWITCH	2	/* switch buffers */
+#if linux
+#define	DTRACEOPT_BUFPOLICY_STREAM	3	/* single-producer stream */
+#endif
 
 #define	DTRACEOPT_BUFRESIZE_AUTO	0	/* automatic resizing */
 #define	DTRACEOPT_BUFRESIZE_MANUAL	1	/* manual resizing */
@@ -1065,6 +1094,49 @@ typedef struct dtrace_bufdesc {
 	uint64_t dtbd_oldest;			/* offset of oldest record */
 } dtrace_bufdesc_t;
 
+/*
+ * Linux: principal buffers with a "switch" policy may be mapped read-only
+ * by mmap(2) of the dtrace device, in which case the consumer uses
+ * DTRACEIOC_BUFSWAP rather than DTRACEIOC_BUFSNAP.  The mapping holds two
+ * slots per CPU -- one for each of the pair of buffers which are switched
+ * between -- each of which is the buffer size rounded up to a page.  The
+ * ioctl switches the given CPU's buffers and returns the offset within the
+ * mapping of the now inactive buffer, along with its size, drops and errors.
+ * The inactive buffer remains stable until the next switch of that CPU.
+ */
+typedef struct dtrace_bufswap {
+	uint32_t dtbs_cpu;			/* CPU to switch */
+	uint32_t dtbs_errors;			/* number of errors */
+	uint64_t dtbs_drops;			/* number of drops */
+	uint64_t dtbs_size;			/* bytes in inactive buffer */
+	uint64_t dtbs_offset;			/* mmap offset of buffer */
+} dtrace_bufswap_t;
+
+/*
+ * Linux: with the "stream" buffer policy, each CPU's principal buffer is a
+ * single-producer/single-consumer ring which is never switched.  The even
+ * slot of the CPU's pair in the mapping is the ring itself; the first page
+ * of the odd slot holds this control structure.  Head and tail are running
+ * byte counts (offset in the ring is the count modulo dtbc_size).  The
+ * kernel advances dtbc_head once records are complete; the consumer reads
+ * up to it and then advances dtbc_tail, which it does through a writable
+ * single-page mapping of the control page.  Records never straddle the end
+ * of the ring -- the remainder is filled with DTRACE_EPIDNONE instead.
+ * dtbc_drops and dtbc_errors are cumulative; dtbc_cdrops and dtbc_cerrors
+ * are for the consumer to note how many it has reported.
+ */
+typedef struct dtrace_bufctl {
+	uint64_t dtbc_head;			/* bytes produced (kernel) */
+	uint64_t dtbc_size;			/* size of the ring */
+	uint64_t dtbc_drops;			/* drops on this CPU */
+	uint64_t dtbc_errors;			/* errors on this CPU */
+	uint64_t dtbc_pad1[4];			/* own cache line */
+	uint64_t dtbc_tail;			/* bytes consumed (consumer) */
+	uint64_t dtbc_cdrops;			/* drops reported */
+	uint64_t dtbc_cerrors;			/* errors reported */
+	uint64_t dtbc_pad2[5];
+} dtrace_bufctl_t;
+
 /*
  * DTrace Status
  *
@@ -1080,6 +1152,8 @@ typedef struct dtrace_bufdesc {
  * further data will be generated until tracing is stopped (at which time any
  * enablings of the END action will be processed); if user-level sees that
  * this field is non-zero, tracing should be stopped as soon as possible.
+ * Linux: the thread-local and stack ID drop counts follow the padding, so
+ * that the members before them keep the offsets they have always had.
  */
 typedef struct dtrace_status {
 	uint64_t dtst_dyndrops;			/* dynamic drops */
@@ -1095,8 +1169,135 @@ typedef struct dtrace_status {
 	char dtst_killed;			/* non-zero if killed */
 	char dtst_exiting;			/* non-zero if exit() called */
 	char dtst_pad[6];			/* pad out to 64-bit align */
+	uint64_t dtst_tlsdrops;			/* thread-local drops */
+	uint64_t dtst_stackiddrops;		/* stack ID table drops */
 } dtrace_status_t;
 
+/*
+ * Linux: DTRACEIOC_DYNSTAT describes the dynamic variable space -- its size,
+ * how much of it is in use, how the hash is behaving and how often it has
+ * been grown -- along with, for each associative array and thread-local
+ * variable having live entries or drops, its occupancy, the longest hash
+ * chain holding one of its entries, and its allocation drops.  The caller
+ * sets dtdy_nvars to the number of dtdy_vars[] entries it has room for; the
+ * kernel fills in as many as fit and sets dtdy_nvars to the number there are.
+ * The hash is walked without stopping probes, so the figures are approximate.
+ */
+typedef struct dtrace_dynstat_var {
+	uint32_t dtdyv_id;			/* DIF variable identifier */
+	uint32_t dtdyv_scope;			/* DIFV_SCOPE_{GLOBAL,THREAD} */
+	uint64_t dtdyv_count;			/* live entries */
+	uint64_t dtdyv_maxchain;		/* longest chain holding one */
+	uint64_t dtdyv_drops;			/* allocation drops */
+} dtrace_dynstat_var_t;
+
+typedef struct dtrace_dynstat {
+	uint64_t dtdy_size;			/* dynamic variable space */
+	uint64_t dtdy_chunksize;		/* size of each chunk */
+	uint64_t dtdy_nchunks;			/* number of chunks */
+	uint64_t dtdy_inuse;			/* chunks on hash chains */
+	uint64_t dtdy_hashsize;			/* number of hash buckets */
+	uint64_t dtdy_buckets;			/* non-empty hash buckets */
+	uint64_t dtdy_maxchain;			/* longest hash chain */
+	uint64_t dtdy_lookups;			/* hash lookups */
+	uint64_t dtdy_steps;			/* chain entries visited */
+	uint64_t dtdy_allocs;			/* variables allocated */
+	uint64_t dtdy_collisions;		/* allocations which lost a race */
+	uint64_t dtdy_resizes;			/* times the hash was grown */
+	uint64_t dtdy_drops;			/* capacity drops */
+	uint64_t dtdy_dirty_drops;		/* dirty drops */
+	uint64_t dtdy_rinsing_drops;		/* rinsing drops */
+	uint32_t dtdy_nvars;			/* number of dtdy_vars[] */
+	uint32_t dtdy_pad;			/* pad out to 64-bit align */
+	dtrace_dynstat_var_t dtdy_vars[1];	/* per-variable statistics */
+} dtrace_dynstat_t;
+
+/*
+ * Linux: DTRACEIOC_ECBSTAT reports, for the enabled probe named by dtes_epid,
+ * how many firings were passed over by its sample() and ratelimit() filters
+ * and -- if the "overhead" option is set -- how often it fired, the cycles
+ * spent on it in dtrace_probe(), the bytes it recorded and the records it
+ * dropped.  Everything is summed across CPUs.  ECBs are numbered densely
+ * from 1, so a consumer can walk them all by asking for successive EPIDs
+ * until EINVAL; ENOENT means the EPID was valid but its ECB has since been
+ * destroyed.
+ */
+typedef struct dtrace_ecbstat {
+	dtrace_epid_t dtes_epid;		/* enabled probe ID */
+	uint32_t dtes_pad;			/* pad out to 64-bit align */
+	uint64_t dtes_sampled;			/* skipped by sample() */
+	uint64_t dtes_limited;			/* skipped by ratelimit() */
+	uint64_t dtes_fires;			/* firings */
+	uint64_t dtes_cycles;			/* cycles spent */
+	uint64_t dtes_bytes;			/* bytes recorded */
+	uint64_t dtes_drops;			/* records dropped */
+} dtrace_ecbstat_t;
+
+/*
+ * Linux: DTRACEIOC_STACKIDS copies out the stack table.  The table is an
+ * array of 8-byte aligned entries, each a dtrace_stackent_t followed by
+ * dse_size bytes of stack record laid out as the record would have been
+ * without DTRACE_STACKID.  Stack ID n is the entry at byte offset
+ * DTRACE_STACKID_OFFSET(n); ID 0 means the stack was dropped.  Entries are
+ * only ever appended, so a consumer keeps its own copy of the table and
+ * asks for the part past dtsi_offset, with room for dtsi_size bytes at
+ * dtsi_buf.  The kernel copies as many complete entries as fit, and returns
+ * the offset reached in dtsi_offset and the table's size in dtsi_total.
+ */
+typedef struct dtrace_stackent {
+	uint32_t dse_hash;			/* hash of the stack record */
+	uint32_t dse_size;			/* size of the stack record */
+	uint32_t dse_next;			/* next stack ID in hash chain */
+	uint32_t dse_flags;			/* DTRACE_STACKENT_* */
+} dtrace_stackent_t;
+
+#define	DTRACE_STACKENT_READY	0x1		/* entry is complete */
+#define	DTRACE_STACKENT_DEAD	0x2		/* lost a race; unused */
+
+#define	DTRACE_STACKENT_SIZE(size)	\
+	(sizeof (dtrace_stackent_t) + (((size) + 7) & ~7))
+#define	DTRACE_STACKID_OFFSET(id)	(((uint64_t)(id) - 1) * 8)
+#define	DTRACE_STACKID_FROMOFFSET(off)	((uint32_t)((off) / 8) + 1)
+
+typedef struct dtrace_stackids {
+	uint64_t dtsi_offset;			/* table offset to copy from */
+	uint64_t dtsi_size;			/* size of buffer */
+	uint64_t dtsi_buf;			/* user buffer */
+	uint64_t dtsi_total;			/* bytes of table in use */
+} dtrace_stackids_t;
+
+/*
+ * Linux: DTRACEIOC_UNWIND registers an unwind table for the process dtuw_pid,
+ * for use by ustack() and jstack() when the process has been compiled
+ * without frame pointers.  libdtrace builds the table from the .eh_frame
+ * sections of the objects mapped by a grabbed process.  Each entry gives,
+ * for dtue_len bytes of text from dtue_pc, the canonical frame address (CFA)
+ * as an offset from %rsp or %rbp, and where the caller's %rbp was saved
+ * relative to the CFA (0 if %rbp is unchanged).  The return address is
+ * always just below the CFA.  Entries must be sorted by dtue_pc and must not
+ * overlap.  A table replaces any previous one for the same process, and is
+ * discarded when the consumer closes; dtuw_nents of 0 just discards it.
+ */
+typedef struct dtrace_unwind_ent {
+	uint64_t dtue_pc;			/* first pc covered */
+	uint32_t dtue_len;			/* bytes of text covered */
+	int32_t dtue_cfaoff;			/* CFA = reg + dtue_cfaoff */
+	int16_t dtue_fpoff;			/* saved %rbp at CFA + off */
+	uint8_t dtue_cfareg;			/* DTRACE_UNWIND_* */
+	uint8_t dtue_pad[5];			/* pad to 64-bit align */
+} dtrace_unwind_ent_t;
+
+#define	DTRACE_UNWIND_SP	0		/* CFA is relative to %rsp */
+#define	DTRACE_UNWIND_FP	1		/* CFA is relative to %rbp */
+
+#define	DTRACE_UNWIND_MAXENTS	(1024 * 1024)	/* max. entries per table */
+
+typedef struct dtrace_unwind {
+	int32_t dtuw_pid;			/* process ID */
+	uint32_t dtuw_nents;			/* number of entries */
+	uint64_t dtuw_ents;			/* user array of entries */
+} dtrace_unwind_t;
+
 /*
  * DTrace Configuration
  *
@@ -1248,6 +1449,11 @@ typedef struct dtrace_providerdesc {
 #define	DTRACEIOC_FORMAT	(DTRACEIOC | 16)	/* get format str */
 #define	DTRACEIOC_DOFGET	(DTRACEIOC | 17)	/* get DOF */
 #define	DTRACEIOC_REPLICATE	(DTRACEIOC | 18)	/* replicate enab */
+#define	DTRACEIOC_BUFSWAP	(DTRACEIOC | 19)	/* switch mmap buffer */
+#define	DTRACEIOC_DYNSTAT	(DTRACEIOC | 20)	/* dyn. var. statistics */
+#define	DTRACEIOC_ECBSTAT	(DTRACEIOC | 21)	/* ECB statistics */
+#define	DTRACEIOC_STACKIDS	(DTRACEIOC | 22)	/* get stack table */
+#define	DTRACEIOC_UNWIND	(DTRACEIOC | 23)	/* set unwind table */
 
 /*
  * DTrace Helpers
@@ -2281,6 +2487,9 @@ extern int dtrace_instr_size_modrm(uchar_t *instr, int *modrm);
 extern int dtrace_instr_size_isa(uchar_t *, model_t, int *);
 extern void dtrace_invop_add(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *));
 extern void dtrace_invop_remove(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *));
+# if linux
+extern void dtrace_invop_claim(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *), uintptr_t);
+# endif
 extern void dtrace_invop_callsite(void);
 #endif
 
@@ -216,8 +216,47 @@ struct dtrace_ecb {
 	dtrace_probe_t *dte_probe;		/* pointer to probe */
 	dtrace_action_t *dte_action_last;	/* last action on ECB */
 	uint64_t dte_uarg;			/* library argument */
+# if linux
+	uint64_t dte_samplethresh;		/* sample() threshold, or 0 */
+	uint64_t dte_ratelimit;			/* ratelimit() rate, or 0 */
+	struct dtrace_ecbsample *dte_sample;	/* per-CPU filter state */
+	struct dtrace_ecbperf *dte_perf;	/* per-CPU overhead counters */
+# endif
 };
 
+# if linux
+/*
+ * Linux: per-CPU state for the sample() and ratelimit() ECB filters.  These
+ * are tested in dtrace_probe() before anything else is done for the ECB, so
+ * that a firing which is passed over costs next to nothing.  sample(N) keeps
+ * a firing if a draw from a per-CPU xorshift generator falls below
+ * dte_samplethresh (UINT64_MAX / N); ratelimit(R) is a per-CPU token bucket
+ * holding up to a second's worth of tokens, where a firing costs NANOSEC and
+ * each elapsed nanosecond earns R.  Each is padded out to a cache line.
+ */
+typedef struct dtrace_ecbsample {
+	uint64_t dtsm_rand;			/* xorshift64 state */
+	uint64_t dtsm_tokens;			/* ratelimit() tokens */
+	hrtime_t dtsm_refill;			/* time of last refill */
+	uint64_t dtsm_sampled;			/* skipped by sample() */
+	uint64_t dtsm_limited;			/* skipped by ratelimit() */
+	uint64_t dtsm_pad[3];			/* pad to cache line */
+} dtrace_ecbsample_t;
+
+/*
+ * Linux: per-CPU probe effect counters, kept for each ECB when the
+ * "overhead" option is set.  Cycles are charged from one ECB boundary in
+ * dtrace_probe() to the next, so each ECB costs a single cycle counter read.
+ */
+typedef struct dtrace_ecbperf {
+	uint64_t dtep_fires;			/* firings */
+	uint64_t dtep_cycles;			/* cycles spent */
+	uint64_t dtep_bytes;			/* bytes recorded */
+	uint64_t dtep_drops;			/* records dropped */
+	uint64_t dtep_pad[4];			/* pad to cache line */
+} dtrace_ecbperf_t;
+# endif
+
 struct dtrace_predicate {
 	dtrace_difo_t *dtp_difo;		/* DIF object */
 	dtrace_cacheid_t dtp_cacheid;		/* cache identifier */
@@ -397,6 +436,17 @@ typedef struct dtrace_aggregation {
  * scratch from the principal buffer -- lest they needlessly overwrite older,
  * valid data.  Ring buffers therefore have their own dedicated scratch buffer
  * from which scratch is allocated.
+ *
+ * Stream Buffering (Linux)
+ *
+ * A "stream" buffer is a ring buffer which the consumer drains while
+ * tracing, without switching.  The current offset, plus dtb_lapbase (the
+ * bytes written in previous trips around the ring), is published to the
+ * consumer as the head in the dtrace_bufctl_t control page; the consumer
+ * publishes the tail there in turn.  A reservation that will not fit
+ * between head and tail is dropped, and one that will not fit before the
+ * end of the ring pads the remainder with DTRACE_EPIDNONE and starts again
+ * at the top.  As with ring buffers, scratch comes from the inactive buffer.
  */
 #define	DTRACEBUF_RING		0x0001		/* bufpolicy set to "ring" */
 #define	DTRACEBUF_FILL		0x0002		/* bufpolicy set to "fill" */
@@ -407,6 +457,8 @@ typedef struct dtrace_aggregation {
 #define	DTRACEBUF_FULL		0x0040		/* "fill" buffer is full */
 #define	DTRACEBUF_CONSUMED	0x0080		/* buffer has been consumed */
 #define	DTRACEBUF_INACTIVE	0x0100		/* buffer is not yet active */
+#define	DTRACEBUF_WMARK		0x0200		/* poll() wakeup posted */
+#define	DTRACEBUF_STREAM	0x0400		/* bufpolicy set to "stream" */
 
 typedef struct dtrace_buffer {
 	uint64_t dtb_offset;			/* current offset in buffer */
@@ -425,7 +477,21 @@ typedef struct dtrace_buffer {
 #endif
 	uint64_t dtb_switched;			/* time of last switch */
 	uint64_t dtb_interval;			/* observed switch interval */
-	uint64_t dtb_pad2[6];			/* pad to avoid false sharing */
+	caddr_t dtb_mapbase;			/* first buffer, for mmap slots */
+#ifndef _LP64
+	uint32_t dtb_pad3;			/* keep dtb_pad2 aligned */
+#endif
+	uint64_t dtb_wmark;			/* poll() watermark, or 0 */
+	struct dtrace_bufctl *dtb_ctl;		/* "stream" control page */
+#ifndef _LP64
+	uint32_t dtb_pad4;			/* keep dtb_lapbase aligned */
+#endif
+	uint64_t dtb_lapbase;			/* "stream" bytes before ring */
+	caddr_t dtb_mapxamot;			/* second buffer, for mmap slots */
+#ifndef _LP64
+	uint32_t dtb_pad5;			/* keep dtb_pad2 aligned */
+#endif
+	uint64_t dtb_pad2[1];			/* pad to avoid false sharing */
 } dtrace_buffer_t;
 
 /*
@@ -760,6 +826,21 @@ typedef struct dtrace_speculation {
  * (allocation races are handled as above).  Further, this spin lock is _only_
  * held for the duration of the delete; before control is returned to the DIF
  * emulation code, the hash bucket is unlocked.
+ *
+ * Linux:  the hash may be grown while tracing.  Every chunk starts out with a
+ * bucket of its own, but a poor spread of keys can still make for long hash
+ * chains -- and allocations racing for the same chain head each send a chunk
+ * to the dirty list.  The cleaner watches both the mean number of chain
+ * entries visited per lookup and the proportion of allocations that lost
+ * such a race; when either passes its threshold, it asks for a hash twice
+ * the size.  Because this needs memory, the resize itself is done by the
+ * next DTRACEIOC_STATUS.  Resizing is not lock-free:  each CPU counts itself
+ * in (dtdsc_busy) for the duration of dtrace_dynvar(), and the resizer makes
+ * dtds_gen odd, waits for all CPUs to count themselves out, relinks the
+ * chunks on the old hash chains into the new buckets and then makes
+ * dtds_gen even again.  If the CPUs don't leave within a bounded time, the
+ * resize is abandoned and the old hash kept.  A CPU which finds dtds_gen odd
+ * spins for a bounded time and then gives up, which is accounted as a drop.
  */
 typedef struct dtrace_key {
 	uint64_t dttk_value;			/* data value or data pointer */
@@ -803,11 +884,26 @@ typedef struct dtrace_dstate_percpu {
 	uint64_t dtdsc_drops;			/* number of capacity drops */
 	uint64_t dtdsc_dirty_drops;		/* number of dirty drops */
 	uint64_t dtdsc_rinsing_drops;		/* number of rinsing drops */
+#if linux
+	uint64_t dtdsc_tlsdrops;		/* thread-local drops */
+	uint64_t dtdsc_lookups;			/* hash lookups */
+	uint64_t dtdsc_steps;			/* hash chain entries visited */
+	uint64_t dtdsc_allocs;			/* variables allocated */
+	uint64_t dtdsc_collisions;		/* inserts which lost a race */
+	volatile uint32_t dtdsc_busy;		/* in dtrace_dynvar() */
+	uint32_t dtdsc_pad32;			/* pad out to 64-bit align */
+#ifdef _LP64
+	uint64_t dtdsc_pad[3];			/* pad to avoid false sharing */
+#else
+	uint64_t dtdsc_pad[5];			/* pad to avoid false sharing */
+#endif
+#else
 #ifdef _LP64
 	uint64_t dtdsc_pad;			/* pad to avoid false sharing */
 #else
 	uint64_t dtdsc_pad[2];			/* pad to avoid false sharing */
 #endif
+#endif
 } dtrace_dstate_percpu_t;
 
 typedef enum dtrace_dstate_state {
@@ -825,6 +921,19 @@ typedef struct dtrace_dstate {
 	dtrace_dynhash_t *dtds_hash;		/* pointer to hash table */
 	dtrace_dstate_state_t dtds_state;	/* current dynamic var. state */
 	dtrace_dstate_percpu_t *dtds_percpu;	/* per-CPU dyn. var. state */
+#if linux
+	volatile uint32_t dtds_gen;		/* odd while hash is resized */
+	uint_t dtds_nglobals;			/* globals in dtds_vardrops */
+	uint_t dtds_ntlocals;			/* thread-locals after them */
+	uint64_t *dtds_vardrops;		/* per-CPU, per-variable drops */
+	dtrace_dynhash_t *dtds_hashalloc;	/* hash allocated on resize */
+	size_t dtds_resize;			/* requested new hash size */
+	uint64_t dtds_resizes;			/* number of resizes */
+	uint64_t dtds_lastlookups;		/* lookups at last check */
+	uint64_t dtds_laststeps;		/* chain steps at last check */
+	uint64_t dtds_lastallocs;		/* allocations at last check */
+	uint64_t dtds_lastcollisions;		/* collisions at last check */
+#endif
 } dtrace_dstate_t;
 
 /*
@@ -866,6 +975,35 @@ typedef struct dtrace_statvar {
 	dtrace_difv_t dtsv_var;			/* variable metadata */
 } dtrace_statvar_t;
 
+#if linux
+/*
+ * Thread-local variable slots
+ *
+ * On Linux, scalar thread-local variables are not kept in the dynamic variable
+ * space.  When the consumer goes, each is given a fixed slot in a table with
+ * one row per shadow proc (see par_tls_index()), so that self->x is an
+ * indexed load or store.  The first word of each row holds a tag derived from the
+ * shadow proc's generation: a row whose tag does not match was left behind by
+ * a previous owner of that shadow proc, and reads as empty.  As with dynamic
+ * variables, a value of zero means unset.  By-reference thread-locals, and
+ * any which do not get a slot, use the dynamic variable space as before;
+ * drops there are counted in dtdsc_tlsdrops rather than as dynamic variable
+ * drops.  A thread which could not get a shadow proc of its own keeps all of
+ * its thread-locals in the dynamic variable space for the rest of its life,
+ * even if it gets a shadow proc later; if even that cannot be arranged, its
+ * stores are dropped and counted in dtdsc_tlsdrops.
+ */
+#define	DTRACE_TLS_MAXSLOTS	16
+
+typedef struct dtrace_tls {
+	uint64_t *dtt_rows;			/* tag + slots, per shadow proc */
+	size_t dtt_size;			/* size of dtt_rows */
+	uint_t dtt_nslots;			/* slots per row */
+	uint_t dtt_nids;			/* entries in dtt_slot */
+	int8_t *dtt_slot;			/* slot for each id, or -1 */
+} dtrace_tls_t;
+#endif
+
 typedef struct dtrace_vstate {
 	dtrace_state_t *dtvs_state;		/* back pointer to state */
 	dtrace_statvar_t **dtvs_globals;	/* statically-allocated glbls */
@@ -875,6 +1013,9 @@ typedef struct dtrace_vstate {
 	dtrace_statvar_t **dtvs_locals;		/* clause-local data */
 	int dtvs_nlocals;			/* number of clause-locals */
 	dtrace_dstate_t dtvs_dynvars;		/* dynamic variable state */
+#if linux
+	dtrace_tls_t dtvs_tls;			/* thread-local slots */
+#endif
 } dtrace_vstate_t;
 
 /*
@@ -1094,6 +1235,31 @@ typedef struct dtrace_cred {
 	uint16_t		dcr_action;
 } dtrace_cred_t;
 
+#if linux
+/*
+ * DTrace Stack Table
+ *
+ * With the "stackidsize" option, stack(), ustack() and jstack() records hold
+ * a 32-bit stack ID rather than the stack itself.  The stacks live in a
+ * single append-only arena per consumer, as dtrace_stackent_t headers each
+ * followed by the stack record (see dtrace.h).  Entries are allocated by
+ * atomically advancing dst_alloc, and are published on the head of their
+ * hash chain with a compare-and-swap once complete; they are never freed
+ * until the consumer goes away, so a stack ID remains valid for as long as
+ * the consumer can see it.  dst_hash holds the stack ID at the head of each
+ * chain, or 0.
+ */
+typedef struct dtrace_stacktab {
+	uint32_t *dst_hash;			/* hash chain heads */
+	uint32_t dst_hashmask;			/* number of buckets - 1 */
+	char *dst_base;				/* base of arena */
+	uint32_t dst_size;			/* size of arena */
+	volatile uint32_t dst_alloc;		/* bytes allocated */
+} dtrace_stacktab_t;
+
+#define	DTRACE_STACKTAB_MAX	(1024 * 1024 * 1024)	/* max. arena size */
+#endif
+
 /*
  * DTrace Consumer State
  *
@@ -1139,9 +1305,54 @@ struct dtrace_state {
 	size_t dts_nretained;			/* number of retained enabs */
 #if linux
         uint64_t dts_arg_error_illval;
+	uint32_t dts_pollpend;			/* poll() wakeup pending */
+	dtrace_stacktab_t dts_stacktab;		/* stack ID table */
+	uint32_t dts_stackid_drops;		/* stack table full drops */
 #endif
 };
 
+#if linux
+/*
+ * DIF JIT
+ *
+ * With the "difjit" option, DIF objects whose instructions are all supported
+ * are translated to native code when the consumer goes (see dif_jit.c).  The
+ * generated code keeps the DIF registers in a dtrace_difjit_t on the stack
+ * of dtrace_dif_emulate(), and calls back into the framework for anything
+ * that needs access checking or can fault; it records the DIF pc of each such
+ * instruction in djt_opc so that faults are reported exactly as the
+ * interpreter would report them.
+ */
+typedef struct dtrace_difjit {
+	uint64_t djt_regs[DIF_DIR_NREGS];	/* DIF registers; must be first */
+	dtrace_mstate_t *djt_mstate;		/* machine state */
+	dtrace_vstate_t *djt_vstate;		/* variable state */
+	dtrace_state_t *djt_state;		/* consumer state */
+	volatile uint16_t *djt_flags;		/* this CPU's cpuc_dtrace_flags */
+	uint64_t djt_opc;			/* pc of last faultable insn */
+} dtrace_difjit_t;
+
+typedef uint64_t dtrace_difjit_func_t(dtrace_difjit_t *);
+
+/*
+ * Pre-decoded DIF
+ *
+ * DIF objects whose instructions the threaded interpreter handles are also
+ * kept as an array of dtrace_difpre_t, one per DIF instruction plus a final
+ * slot which returns zero.  dpi_label is the address of the handler within
+ * dtrace_dif_threaded(); fusing a sequence of instructions into a
+ * superinstruction only changes the dpi_label of its first slot.
+ */
+typedef struct dtrace_difpre {
+	const void *dpi_label;			/* handler */
+	uint64_t dpi_imm;			/* value, var, subr or target */
+	uint8_t dpi_op;				/* DIF opcode */
+	uint8_t dpi_r1;				/* DIF_INSTR_R1() */
+	uint8_t dpi_r2;				/* DIF_INSTR_R2() */
+	uint8_t dpi_rd;				/* DIF_INSTR_RD() */
+} dtrace_difpre_t;
+
+#endif
 struct dtrace_provider {
 	dtrace_pattr_t dtpv_attr;		/* provider attributes */
 	dtrace_ppriv_t dtpv_priv;		/* provider privileges */
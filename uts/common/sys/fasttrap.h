@@ -23,6 +23,9 @@ extern "C" {
 #define	FASTTRAPIOC		(('m' << 24) | ('r' << 16) | ('f' << 8))
 #define	FASTTRAPIOC_MAKEPROBE	(FASTTRAPIOC | 1)
 #define	FASTTRAPIOC_GETINSTR	(FASTTRAPIOC | 2)
+#if linux
+#define	FASTTRAPIOC_MAKEPROBES	(FASTTRAPIOC | 3)
+#endif
 
 typedef enum fasttrap_probe_type {
 	DTFTP_NONE = 0,
@@ -46,6 +49,28 @@ typedef struct fasttrap_probe_spec {
 	uint64_t		ftps_offs[1];
 } fasttrap_probe_spec_t;
 
+#define	FASTTRAP_PROBE_SPEC_SIZE(noffs)	\
+	(sizeof (fasttrap_probe_spec_t) + sizeof (uint64_t) * ((noffs) - 1))
+
+#if linux
+/*
+ * FASTTRAPIOC_MAKEPROBES takes a header followed by ftpb_nspecs probe
+ * specs, packed back to back (each FASTTRAP_PROBE_SPEC_SIZE(ftps_noffs)
+ * bytes), for a single process. The probes are created in order under one
+ * hold of the provider; on return, ftpb_ndone is the number of specs which
+ * were processed, so on failure ftpb_ndone indexes the spec at fault.
+ */
+typedef struct fasttrap_probe_batch {
+	pid_t			ftpb_pid;
+	uint32_t		ftpb_nspecs;
+	uint32_t		ftpb_ndone;
+	uint32_t		ftpb_pad;
+	uint64_t		ftpb_size;	/* bytes of specs after header */
+} fasttrap_probe_batch_t;
+
+#define	FASTTRAP_BATCH_MAX	(16 * 1024 * 1024)
+#endif
+
 typedef struct fasttrap_instr_query {
 	uint64_t		ftiq_pc;
 	pid_t			ftiq_pid;
@@ -34,6 +34,9 @@
 #include <sys/proc.h>
 #include <sys/fasttrap.h>
 #include <sys/fasttrap_isa.h>
+#if linux
+#include <sys/rwlock.h>
+#endif
 
 #ifdef	__cplusplus
 extern "C" {
@@ -135,7 +138,11 @@ struct fasttrap_tracepoint {
 	fasttrap_machtp_t ftt_mtp;		/* ISA-specific portion */
 	fasttrap_id_t *ftt_ids;			/* NULL-terminated list */
 	fasttrap_id_t *ftt_retids;		/* NULL-terminated list */
+#if linux
+	fasttrap_tracepoint_t *ftt_link[2];	/* links in global hash */
+#else
 	fasttrap_tracepoint_t *ftt_next;	/* link in global hash */
+#endif
 };
 
 typedef struct fasttrap_bucket {
@@ -155,6 +162,9 @@ typedef struct fasttrap_hash {
 	ulong_t fth_nent;			/* power-of-2 num. of entries */
 	ulong_t fth_mask;			/* fth_nent - 1 */
 	fasttrap_bucket_t *fth_table;		/* array of buckets */
+#if linux
+	int fth_link;				/* ftt_link[] used by table */
+#endif
 } fasttrap_hash_t;
 
 /*
@@ -172,10 +182,24 @@ typedef struct fasttrap_hash {
 extern void fasttrap_sigtrap(proc_t *, proc_t *, uintptr_t);
 
 extern dtrace_id_t 		fasttrap_probe_id;
-extern fasttrap_hash_t		fasttrap_tpoints;
+/*
+ * The tracepoint hash grows as tracepoints are added. A resize builds the
+ * new table by chaining the tracepoints through their other ftt_link[]
+ * entry, so that the trap path can carry on walking the old table, lock
+ * free, until the new one is published. Anything else walking or changing
+ * the chains holds fasttrap_tpoints_rwlock as a reader; the resize holds it
+ * as the writer.
+ */
+extern fasttrap_hash_t * volatile fasttrap_tpoints;
+extern krwlock_t		fasttrap_tpoints_rwlock;
 
+#define	FASTTRAP_TPOINTS_HINDEX(h, pid, pc) \
+	(((pc) / sizeof (fasttrap_instr_t) + (pid)) & (h)->fth_mask)
 #define	FASTTRAP_TPOINTS_INDEX(pid, pc) \
-	(((pc) / sizeof (fasttrap_instr_t) + (pid)) & fasttrap_tpoints.fth_mask)
+	FASTTRAP_TPOINTS_HINDEX(fasttrap_tpoints, pid, pc)
+#define	FASTTRAP_TP_NEXT(h, tp)	((tp)->ftt_link[(h)->fth_link])
+
+extern fasttrap_tracepoint_t *fasttrap_tpoints_lookup(pid_t, uintptr_t);
 
 /*
  * Must be implemented by fasttrap_isa.c